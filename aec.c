@@ -0,0 +1,544 @@
+/*
+ * Acoustic echo cancellation for the capture path
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "aec.h"
+
+/* far end power smoothing per block */
+#define AEC_POWER_DECAY 0.8f
+/* regularization: the power of a far end this quiet, per sample */
+#define AEC_POWER_FLOOR 100.0f
+/* far end peak below which there is nothing to learn from */
+#define AEC_SILENCE 64.0f
+/* blocks to keep holding the adaptation after double talk */
+#define AEC_HANGOVER 8
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *aec_alloc(size_t size)
+{
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+int aec_create(struct aec *a, unsigned int channels, unsigned int rate,
+               unsigned int block, unsigned int tail)
+{
+	unsigned int n = 2 * block;
+	size_t spectra;
+
+	memset(a, 0, sizeof(*a));
+
+	if (channels == 0 || block < 4 || (block & (block - 1)) || tail == 0)
+		return -EINVAL;
+
+	a->channels = channels;
+	a->rate = rate;
+	a->block = block;
+	a->nr_parts = (tail + block - 1) / block;
+	a->mu = 0.5f;
+	a->dt_ratio = 1.0f;
+	if (a->nr_parts > AEC_MAX_PARTS)
+		return -EINVAL;
+
+	spectra = (size_t) a->nr_parts * n * sizeof(float);
+
+	a->fft = fft_create(n);
+	a->x = aec_alloc(n * sizeof(float));
+	a->xr = aec_alloc(spectra);
+	a->xi = aec_alloc(spectra);
+	a->power = aec_alloc(n * sizeof(float));
+	a->wr = aec_alloc(channels * spectra);
+	a->wi = aec_alloc(channels * spectra);
+	a->mic = aec_alloc((size_t) channels * block * sizeof(float));
+	a->ref = aec_alloc(block * sizeof(float));
+	a->out = aec_alloc((size_t) channels * block * sizeof(short int));
+	a->tr = aec_alloc(n * sizeof(float));
+	a->ti = aec_alloc(n * sizeof(float));
+
+	if (!a->fft || !a->x || !a->xr || !a->xi || !a->power || !a->wr ||
+	    !a->wi || !a->mic || !a->ref || !a->out || !a->tr || !a->ti) {
+		aec_destroy(a);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void aec_destroy(struct aec *a)
+{
+	fft_destroy(a->fft);
+	free(a->x);
+	free(a->xr);
+	free(a->xi);
+	free(a->power);
+	free(a->wr);
+	free(a->wi);
+	free(a->mic);
+	free(a->ref);
+	free(a->out);
+	free(a->tr);
+	free(a->ti);
+	memset(a, 0, sizeof(*a));
+}
+
+/*
+ * kernels - n is a multiple of 4 and all arrays are 64 byte aligned
+ */
+
+/* y += x * w */
+static void cmac(unsigned int n, float *yr, float *yi,
+                 const float *xr, const float *xi,
+                 const float *wr, const float *wi)
+{
+	aec_v4 *vyr = (aec_v4 *) yr, *vyi = (aec_v4 *) yi;
+	const aec_v4 *vxr = (const aec_v4 *) xr, *vxi = (const aec_v4 *) xi;
+	const aec_v4 *vwr = (const aec_v4 *) wr, *vwi = (const aec_v4 *) wi;
+	unsigned int k;
+
+	for (k = 0; k < n / 4; k++) {
+		vyr[k] += vxr[k] * vwr[k] - vxi[k] * vwi[k];
+		vyi[k] += vxr[k] * vwi[k] + vxi[k] * vwr[k];
+	}
+}
+
+/* w += conj(x) * g */
+static void cmac_conj(unsigned int n, float *wr, float *wi,
+                      const float *xr, const float *xi,
+                      const float *gr, const float *gi)
+{
+	aec_v4 *vwr = (aec_v4 *) wr, *vwi = (aec_v4 *) wi;
+	const aec_v4 *vxr = (const aec_v4 *) xr, *vxi = (const aec_v4 *) xi;
+	const aec_v4 *vgr = (const aec_v4 *) gr, *vgi = (const aec_v4 *) gi;
+	unsigned int k;
+
+	for (k = 0; k < n / 4; k++) {
+		vwr[k] += vxr[k] * vgr[k] + vxi[k] * vgi[k];
+		vwi[k] += vxr[k] * vgi[k] - vxi[k] * vgr[k];
+	}
+}
+
+/* new far end block: its spectrum and power */
+static void far_end(struct aec *a)
+{
+	unsigned int n = 2 * a->block, k;
+	float *xr, *xi, peak = 0;
+
+	/* the oldest spectrum makes room */
+	a->cur = (a->cur + a->nr_parts - 1) % a->nr_parts;
+	xr = a->xr + (size_t) a->cur * n;
+	xi = a->xi + (size_t) a->cur * n;
+
+	memmove(a->x, a->x + a->block, a->block * sizeof(float));
+	memcpy(a->x + a->block, a->ref, a->block * sizeof(float));
+	for (k = 0; k < a->block; k++)
+		if (fabsf(a->ref[k]) > peak)
+			peak = fabsf(a->ref[k]);
+
+	memcpy(xr, a->x, n * sizeof(float));
+	memset(xi, 0, n * sizeof(float));
+	fft_forward(a->fft, xr, xi);
+
+	for (k = 0; k < n; k++)
+		a->power[k] = a->power[k] * AEC_POWER_DECAY +
+		              (xr[k] * xr[k] + xi[k] * xi[k]) * (1 - AEC_POWER_DECAY);
+
+	/* the tail and the block before it can still be heard */
+	memmove(a->peak + 1, a->peak, a->nr_parts * sizeof(float));
+	a->peak[0] = peak;
+}
+
+/* the far end could be loud enough and the near end is quiet */
+static int may_adapt(struct aec *a)
+{
+	unsigned int i;
+	float far = 0, near = 0;
+
+	for (i = 0; i <= a->nr_parts; i++)
+		if (a->peak[i] > far)
+			far = a->peak[i];
+
+	for (i = 0; i < a->block * a->channels; i++)
+		if (fabsf(a->mic[i]) > near)
+			near = fabsf(a->mic[i]);
+
+	if (near > far * a->dt_ratio && far > AEC_SILENCE) {
+		a->double_talk++;
+		a->hold = AEC_HANGOVER;
+	}
+
+	if (a->hold) {
+		a->hold--;
+		return 0;
+	}
+
+	return far > AEC_SILENCE;
+}
+
+/* echo estimate, subtract, adapt - for one channel */
+static void cancel(struct aec *a, unsigned int ch, int adapt)
+{
+	unsigned int n = 2 * a->block, b = a->block, p, k;
+	size_t size = (size_t) a->nr_parts * n;
+	float *wr = a->wr + ch * size, *wi = a->wi + ch * size;
+	float *mic = a->mic + ch * b;
+	short int *out = a->out + ch * b;
+	float *tr = a->tr, *ti = a->ti;
+	float scale = 1.0f / n;
+
+	/* Y = sum X[p] W[p], spectrum p is p blocks old */
+	memset(tr, 0, n * sizeof(float));
+	memset(ti, 0, n * sizeof(float));
+	for (p = 0; p < a->nr_parts; p++) {
+		size_t x = (size_t) ((a->cur + p) % a->nr_parts) * n;
+
+		cmac(n, tr, ti, a->xr + x, a->xi + x, wr + p * n, wi + p * n);
+	}
+	fft_inverse(a->fft, tr, ti);
+
+	/* overlap-save: the second half is valid */
+	for (k = 0; k < b; k++) {
+		float e = mic[k] - tr[b + k] * scale;
+		float s = e > 32767.0f ? 32767.0f : e < -32768.0f ? -32768.0f : e;
+
+		a->mic_energy += (double) mic[k] * mic[k];
+		a->out_energy += (double) s * s;
+		out[k] = (short int) lrintf(s);
+		tr[b + k] = e;
+	}
+
+	if (!adapt)
+		return;
+
+	/* E = fft(0, e), normalized per bin: 2 mu / (P (power + floor)) */
+	memset(tr, 0, b * sizeof(float));
+	memset(ti, 0, n * sizeof(float));
+	fft_forward(a->fft, tr, ti);
+	for (k = 0; k < n; k++) {
+		float g = 2 * a->mu / (a->nr_parts *
+		          (a->power[k] + n * AEC_POWER_FLOOR));
+
+		tr[k] *= g;
+		ti[k] *= g;
+	}
+
+	for (p = 0; p < a->nr_parts; p++) {
+		size_t x = (size_t) ((a->cur + p) % a->nr_parts) * n;
+
+		cmac_conj(n, wr + p * n, wi + p * n, a->xr + x, a->xi + x, tr, ti);
+	}
+}
+
+/* gradient constraint of one partition: no taps beyond a block */
+static void constrain(struct aec *a, unsigned int ch, unsigned int p)
+{
+	unsigned int n = 2 * a->block;
+	size_t off = ch * (size_t) a->nr_parts * n + p * n;
+	float *wr = a->wr + off, *wi = a->wi + off;
+	float scale = 1.0f / n;
+	unsigned int k;
+
+	memcpy(a->tr, wr, n * sizeof(float));
+	memcpy(a->ti, wi, n * sizeof(float));
+	fft_inverse(a->fft, a->tr, a->ti);
+
+	for (k = 0; k < a->block; k++) {
+		a->tr[k] *= scale;
+		a->ti[k] = 0;
+	}
+	memset(a->tr + a->block, 0, a->block * sizeof(float));
+	memset(a->ti + a->block, 0, a->block * sizeof(float));
+
+	fft_forward(a->fft, a->tr, a->ti);
+	memcpy(wr, a->tr, n * sizeof(float));
+	memcpy(wi, a->ti, n * sizeof(float));
+}
+
+static void run_block(struct aec *a)
+{
+	double start = now(), t;
+	unsigned int c;
+	int adapt;
+
+	far_end(a);
+	adapt = may_adapt(a);
+
+	for (c = 0; c < a->channels; c++) {
+		cancel(a, c, adapt);
+		if (adapt)
+			constrain(a, c, a->constrain);
+	}
+
+	if (adapt) {
+		a->constrain = (a->constrain + 1) % a->nr_parts;
+		a->adapted++;
+	}
+	a->blocks++;
+
+	t = now() - start;
+	a->time += t;
+	if (t > a->max_time)
+		a->max_time = t;
+}
+
+void aec_process(struct aec *a, short int *buf, const short int *ref,
+                 unsigned int frames)
+{
+	unsigned int i, c;
+
+	for (i = 0; i < frames; i++) {
+		for (c = 0; c < a->channels; c++) {
+			a->mic[c * a->block + a->fill] = buf[c];
+			buf[c] = a->out[c * a->block + a->fill];
+		}
+		a->ref[a->fill] = ref[i];
+		buf += a->channels;
+
+		if (++a->fill == a->block) {
+			run_block(a);
+			a->fill = 0;
+		}
+	}
+}
+
+void aec_print_stats(struct aec *a)
+{
+	double block_time = (double) a->block / a->rate;
+
+	printf("aec: %u partitions of %u frames (%.1f ms tail), %lu blocks, %lu adapted, %lu double talk\n",
+	       a->nr_parts, a->block, 1000.0 * a->nr_parts * a->block / a->rate,
+	       a->blocks, a->adapted, a->double_talk);
+	if (a->blocks == 0)
+		return;
+
+	printf("aec: erle %.1f dB, avg %.1f us, max %.1f us per block (%.2f%% of real time)\n",
+	       a->out_energy > 0 ? 10 * log10(a->mic_energy / a->out_energy) : 0.0,
+	       a->time * 1e6 / a->blocks, a->max_time * 1e6,
+	       100.0 * a->time / a->blocks / block_time);
+}
+
+/*
+ * playback reference
+ */
+
+#define AEC_REF_MAGIC 0x46455241 /* "AREF" */
+/* frames in the ring, a power of 2 - more than the playback buffer and the capture latency */
+#define AEC_REF_SIZE 65536
+/* the far end leads a bit: room for jitter before the echo path starts */
+#define AEC_REF_LEAD 16
+/* realign only when the mapping moved further than this */
+#define AEC_REF_SLIP 8
+
+struct aec_ref_header {
+	uint32_t magic;
+	uint32_t rate;
+
+	/* seqlock: reference frame 'frame' left the speaker at 'time' */
+	atomic_uint seq;
+	int valid;
+	double frame;
+	double time;
+
+	/* frames written */
+	_Alignas(64) atomic_ullong head;
+};
+
+static size_t ref_map_size(void)
+{
+	return sizeof(struct aec_ref_header) + AEC_REF_SIZE * sizeof(short int);
+}
+
+int aec_ref_create(struct aec_ref *r, const char *name, unsigned int rate)
+{
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	r->map_size = ref_map_size();
+	r->rate = rate;
+	r->writer = 1;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, r->map_size) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	r->h = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->h == MAP_FAILED) {
+		r->h = NULL;
+		return -errno;
+	}
+	r->data = (short int *) (r->h + 1);
+
+	r->h->rate = rate;
+	atomic_init(&r->h->seq, 0);
+	atomic_init(&r->h->head, 0);
+	atomic_thread_fence(memory_order_release);
+	r->h->magic = AEC_REF_MAGIC;
+
+	return 0;
+}
+
+void aec_ref_write(struct aec_ref *r, const short int *buf,
+                   unsigned int channels, unsigned int frames)
+{
+	unsigned long long head = atomic_load_explicit(&r->h->head, memory_order_relaxed);
+	unsigned int i, c;
+
+	/* the reader only looks behind the head, it is never full */
+	for (i = 0; i < frames; i++) {
+		int sum = 0;
+
+		for (c = 0; c < channels; c++)
+			sum += buf[i * channels + c];
+		r->data[(head + i) & (AEC_REF_SIZE - 1)] = sum / (int) channels;
+	}
+
+	atomic_store_explicit(&r->h->head, head + frames, memory_order_release);
+}
+
+void aec_ref_clock(struct aec_ref *r, struct pcm *pcm)
+{
+	unsigned long long head = atomic_load_explicit(&r->h->head, memory_order_relaxed);
+	double played, tstamp;
+	int valid;
+
+	/* everything written since prepare that is still queued is behind the head */
+	valid = pcm_position(pcm, &played, &tstamp) == 0;
+
+	atomic_fetch_add_explicit(&r->h->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	r->h->valid = valid;
+	if (valid) {
+		r->h->frame = head - (pcm->appl - played);
+		r->h->time = tstamp;
+	}
+	atomic_fetch_add_explicit(&r->h->seq, 1, memory_order_release);
+}
+
+int aec_ref_open(struct aec_ref *r, const char *name, unsigned int rate)
+{
+	struct aec_ref_header h;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	r->map_size = ref_map_size();
+	r->rate = rate;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != AEC_REF_MAGIC) {
+		close(fd);
+		return -EINVAL;
+	}
+	if (h.rate != rate) {
+		printf("Echo reference at %u Hz, capture at %u Hz\n", h.rate, rate);
+		close(fd);
+		return -EINVAL;
+	}
+
+	r->h = mmap(NULL, r->map_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r->h == MAP_FAILED) {
+		r->h = NULL;
+		return -errno;
+	}
+	r->data = (short int *) (r->h + 1);
+
+	return 0;
+}
+
+void aec_ref_read(struct aec_ref *r, struct pcm *pcm, short int *ref,
+                  unsigned int frames)
+{
+	double captured, tstamp, first, frame = 0, time = 0, target;
+	unsigned long long head;
+	unsigned int seq, i;
+	int valid;
+
+	/* the writer clock */
+	do {
+		while ((seq = atomic_load_explicit(&r->h->seq, memory_order_acquire)) & 1)
+			;
+		valid = r->h->valid;
+		frame = r->h->frame;
+		time = r->h->time;
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&r->h->seq, memory_order_relaxed) != seq);
+
+	/* when the first of these frames was captured */
+	if (valid && pcm_position(pcm, &captured, &tstamp) == 0) {
+		first = tstamp - (captured - (double) (pcm->appl - frames)) / r->rate;
+		target = frame + (first - time) * r->rate - AEC_REF_LEAD;
+
+		if (!r->locked || fabs(target - r->pos) > AEC_REF_SLIP) {
+			r->pos = llround(target);
+			r->locked = 1;
+			r->realigns++;
+		}
+	} else
+		r->locked = 0;
+
+	head = atomic_load_explicit(&r->h->head, memory_order_acquire);
+	for (i = 0; i < frames; i++) {
+		long long pos = r->pos + i;
+
+		/* not written yet, or overwritten already */
+		if (!r->locked || pos < 0 || pos >= (long long) head ||
+		    pos < (long long) head - AEC_REF_SIZE) {
+			ref[i] = 0;
+			r->missed++;
+		} else
+			ref[i] = r->data[pos & (AEC_REF_SIZE - 1)];
+	}
+
+	/* overwritten while copying: the writer is a ring ahead */
+	head = atomic_load_explicit(&r->h->head, memory_order_acquire);
+	if (head > AEC_REF_SIZE && (long long) (head - AEC_REF_SIZE) > r->pos)
+		memset(ref, 0, frames * sizeof(short int));
+
+	r->pos += frames;
+}
+
+void aec_ref_print_stats(struct aec_ref *r)
+{
+	printf("aec: reference realigned %lu times, %lu frames missing\n",
+	       r->realigns, r->missed);
+}
+
+void aec_ref_close(struct aec_ref *r, const char *name)
+{
+	if (r->h == NULL)
+		return;
+
+	munmap(r->h, r->map_size);
+	if (r->writer)
+		shm_unlink(name);
+	r->h = NULL;
+}
@@ -0,0 +1,136 @@
+/*
+ * Acoustic echo cancellation for the capture path
+ *
+ * Partitioned block frequency domain adaptive filter: the echo path of
+ * 'tail' frames is split in partitions of one block. Every block the
+ * far end spectrum is computed once (overlap-save, fft of two blocks),
+ * the echo estimate is the sum of the last spectra times the partition
+ * filters, and the filters follow a normalized LMS update per bin. One
+ * partition per block gets the gradient constraint, round robin. A peak
+ * detector (Geigel) holds the adaptation while the near end talks.
+ *
+ * The far end is mono, every capture channel has its own filter. The
+ * output is one block behind the input, everything is preallocated by
+ * aec_create() and aec_process() runs in the capture thread.
+ *
+ * The playback reference comes from play_wave through a shared memory
+ * ring (aec_ref): the writer stores the mono mix of what it writes and
+ * publishes which frame leaves the speaker when. The capture side maps
+ * the capture time of a period to the reference frames played at that
+ * moment, so both sides may run with different buffering.
+ */
+
+#ifndef AEC_H
+#define AEC_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "fft.h"
+#include "pcm.h"
+
+/* maximum number of partitions */
+#define AEC_MAX_PARTS 64
+
+/* 4 bins, one per lane */
+typedef float aec_v4 __attribute__((vector_size(16)));
+
+struct aec {
+	unsigned int channels;
+	unsigned int rate;
+	/* frames per block, fft size is twice that */
+	unsigned int block;
+	unsigned int nr_parts;
+	/* adaptation step, 0..1 */
+	float mu;
+	/* near end talks when its peak exceeds the far end peak times this */
+	float dt_ratio;
+
+	struct fft *fft;
+
+	/* far end: last two blocks, spectra of the last nr_parts blocks */
+	float *x;
+	float *xr;
+	float *xi;
+	unsigned int cur;
+	/* smoothed far end power per bin */
+	float *power;
+	/* far end peak per block, for the double talk detector */
+	float peak[AEC_MAX_PARTS + 1];
+	unsigned int hold;
+
+	/* filters, [channel][partition][bin] */
+	float *wr;
+	float *wi;
+	unsigned int constrain;
+
+	/* block in, block out */
+	float *mic;
+	float *ref;
+	short int *out;
+	unsigned int fill;
+
+	/* work */
+	float *tr;
+	float *ti;
+
+	/* statistics */
+	unsigned long blocks;
+	unsigned long adapted;
+	unsigned long double_talk;
+	double mic_energy;
+	double out_energy;
+	double time;
+	double max_time;
+};
+
+/* 'tail' frames of echo path - -EINVAL or -ENOMEM */
+int aec_create(struct aec *a, unsigned int channels, unsigned int rate,
+               unsigned int block, unsigned int tail);
+void aec_destroy(struct aec *a);
+
+/* 'buf' interleaved capture in, echo free out - 'ref' the mono far end */
+void aec_process(struct aec *a, short int *buf, const short int *ref,
+                 unsigned int frames);
+
+/* echo return loss enhancement, cpu time per block */
+void aec_print_stats(struct aec *a);
+
+/*
+ * Playback reference in POSIX shared memory
+ */
+
+struct aec_ref_header;
+
+struct aec_ref {
+	struct aec_ref_header *h;
+	short int *data;
+	size_t map_size;
+	unsigned int rate;
+	int writer;
+
+	/* reader: next reference frame, and how often it was moved */
+	long long pos;
+	int locked;
+	unsigned long realigns;
+	unsigned long missed;
+};
+
+/* play side: create the ring - replaces a stale one */
+int aec_ref_create(struct aec_ref *r, const char *name, unsigned int rate);
+/* the mono mix of 'frames' just written to the device */
+void aec_ref_write(struct aec_ref *r, const short int *buf,
+                   unsigned int channels, unsigned int frames);
+/* after writing: which reference frame leaves the speaker when */
+void aec_ref_clock(struct aec_ref *r, struct pcm *pcm);
+
+/* capture side: open the ring of a running writer */
+int aec_ref_open(struct aec_ref *r, const char *name, unsigned int rate);
+/* the reference for the 'frames' just read from 'pcm' - silence when unknown */
+void aec_ref_read(struct aec_ref *r, struct pcm *pcm, short int *ref,
+                  unsigned int frames);
+void aec_ref_print_stats(struct aec_ref *r);
+
+void aec_ref_close(struct aec_ref *r, const char *name);
+
+#endif
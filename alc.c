@@ -0,0 +1,719 @@
+/*
+ * Lossless codec for interleaved S16 audio
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "alc.h"
+
+/* residuals per rice parameter */
+#define ALC_PARTITION 256
+
+/* rice parameter meaning: raw values follow */
+#define ALC_ESCAPE 31
+
+/* lpc coefficient precision in bits */
+#define ALC_LPC_PRECISION 13
+
+/* channel coding */
+enum {
+	ALC_CONSTANT,
+	ALC_VERBATIM,
+	ALC_FIXED,
+	ALC_LPC,
+};
+
+/* how one channel is predicted */
+struct predictor {
+	int type;
+	unsigned int order;
+	int shift;
+	int32_t coef[ALC_MAX_ORDER];
+};
+
+/*
+ * bit io - msb first
+ */
+
+struct bit_writer {
+	unsigned char *p;
+	uint64_t acc;
+	unsigned int bits;
+};
+
+struct bit_reader {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t acc;
+	unsigned int bits;
+	/* zero bytes read past the end */
+	unsigned int pad;
+};
+
+static inline uint64_t mask(unsigned int n)
+{
+	return ((uint64_t) 1 << n) - 1;
+}
+
+/* n <= 32 */
+static inline void put_bits(struct bit_writer *w, uint32_t v, unsigned int n)
+{
+	w->acc = (w->acc << n) | (v & mask(n));
+	w->bits += n;
+	while (w->bits >= 8) {
+		w->bits -= 8;
+		*w->p++ = w->acc >> w->bits;
+	}
+}
+
+static inline void put_unary(struct bit_writer *w, uint32_t q)
+{
+	while (q >= 32) {
+		put_bits(w, 0, 32);
+		q -= 32;
+	}
+	put_bits(w, 1, q + 1);
+}
+
+static void flush_bits(struct bit_writer *w)
+{
+	if (w->bits > 0)
+		*w->p++ = w->acc << (8 - w->bits);
+	w->bits = 0;
+}
+
+static inline void refill(struct bit_reader *r)
+{
+	while (r->bits <= 48) {
+		if (r->p < r->end)
+			r->acc = (r->acc << 8) | *r->p++;
+		else {
+			/* past the end: zeros, and remember */
+			r->acc <<= 8;
+			r->pad++;
+		}
+		r->bits += 8;
+	}
+}
+
+/* n <= 32 */
+static inline uint32_t get_bits(struct bit_reader *r, unsigned int n)
+{
+	if (r->bits < n)
+		refill(r);
+	r->bits -= n;
+	return (r->acc >> r->bits) & mask(n);
+}
+
+static inline uint32_t get_unary(struct bit_reader *r)
+{
+	uint32_t q = 0;
+
+	while (1) {
+		uint64_t v;
+
+		if (r->bits == 0)
+			refill(r);
+
+		v = r->acc & mask(r->bits);
+		if (v == 0) {
+			q += r->bits;
+			r->bits = 0;
+			if (r->pad > 8)
+				return q;
+			continue;
+		}
+
+		/* leading zeros of the valid bits, then the stop bit */
+		v = r->bits - (64 - __builtin_clzll(v));
+		q += v;
+		r->bits -= v + 1;
+		return q;
+	}
+}
+
+/* more bits consumed than there were */
+static inline int overrun(const struct bit_reader *r)
+{
+	return r->pad * 8 > r->bits;
+}
+
+static inline uint32_t zigzag(int32_t v)
+{
+	return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t u)
+{
+	return (int32_t) (u >> 1) ^ -(int32_t) (u & 1);
+}
+
+/*
+ * prediction
+ */
+
+static void fixed_residual(const int32_t *x, unsigned int n,
+                           unsigned int order, int32_t *r)
+{
+	unsigned int i;
+
+	switch (order) {
+	case 0:
+		for (i = 0; i < n; i++)
+			r[i] = x[i];
+		break;
+	case 1:
+		for (i = 1; i < n; i++)
+			r[i] = x[i] - x[i - 1];
+		break;
+	case 2:
+		for (i = 2; i < n; i++)
+			r[i] = x[i] - 2 * x[i - 1] + x[i - 2];
+		break;
+	case 3:
+		for (i = 3; i < n; i++)
+			r[i] = x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+		break;
+	default:
+		for (i = 4; i < n; i++)
+			r[i] = x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+		break;
+	}
+}
+
+static void fixed_restore(int32_t *x, unsigned int n, unsigned int order)
+{
+	unsigned int i;
+
+	switch (order) {
+	case 0:
+		break;
+	case 1:
+		for (i = 1; i < n; i++)
+			x[i] += x[i - 1];
+		break;
+	case 2:
+		for (i = 2; i < n; i++)
+			x[i] += 2 * x[i - 1] - x[i - 2];
+		break;
+	case 3:
+		for (i = 3; i < n; i++)
+			x[i] += 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+		break;
+	default:
+		for (i = 4; i < n; i++)
+			x[i] += 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+		break;
+	}
+}
+
+/* 0, or -1 when a residual does not fit the rice coder */
+static int lpc_residual(const int32_t *x, unsigned int n,
+                        const struct predictor *p, int32_t *r)
+{
+	unsigned int i, j;
+
+	for (i = p->order; i < n; i++) {
+		int64_t sum = 0;
+
+		for (j = 0; j < p->order; j++)
+			sum += (int64_t) p->coef[j] * x[i - 1 - j];
+
+		sum = x[i] - (sum >> p->shift);
+		if (sum > (1 << 29) || sum < -(1 << 29))
+			return -1;
+		r[i] = sum;
+	}
+
+	return 0;
+}
+
+static void lpc_restore(int32_t *x, unsigned int n, const struct predictor *p)
+{
+	unsigned int i, j;
+
+	for (i = p->order; i < n; i++) {
+		int64_t sum = 0;
+
+		for (j = 0; j < p->order; j++)
+			sum += (int64_t) p->coef[j] * x[i - 1 - j];
+
+		x[i] += (int32_t) (sum >> p->shift);
+	}
+}
+
+/* windowed autocorrelation, levinson-durbin, quantization */
+static int lpc_design(struct alc_coder *c, const int32_t *x, unsigned int n,
+                      struct predictor *p)
+{
+	double R[ALC_MAX_ORDER + 1], a[ALC_MAX_ORDER + 1], tmp[ALC_MAX_ORDER + 1];
+	double err, cmax = 0, e = 0;
+	unsigned int order = ALC_MAX_ORDER, i, j;
+	int exponent;
+
+	if (n <= 2 * order)
+		return -1;
+
+	/* welch window */
+	for (i = 0; i < n; i++) {
+		double t = (2.0 * i - (n - 1)) / (n - 1);
+
+		c->w[i] = x[i] * (1.0 - t * t);
+	}
+
+	for (j = 0; j <= order; j++) {
+		double sum = 0;
+
+		for (i = j; i < n; i++)
+			sum += c->w[i] * c->w[i - j];
+		R[j] = sum;
+	}
+	if (R[0] <= 0)
+		return -1;
+
+	/* a[1..order]: x[i] ~ sum a[j] x[i - j] */
+	memset(a, 0, sizeof(a));
+	err = R[0] * (1.0 + 1e-9);
+	for (i = 1; i <= order; i++) {
+		double k = R[i];
+
+		for (j = 1; j < i; j++)
+			k -= a[j] * R[i - j];
+		k /= err;
+
+		memcpy(tmp, a, sizeof(a));
+		for (j = 1; j < i; j++)
+			a[j] = tmp[j] - k * tmp[i - j];
+		a[i] = k;
+
+		err *= 1.0 - k * k;
+		if (err <= 0)
+			return -1;
+	}
+
+	for (j = 1; j <= order; j++)
+		if (fabs(a[j]) > cmax)
+			cmax = fabs(a[j]);
+	if (cmax == 0)
+		return -1;
+
+	/* largest shift that keeps the biggest coefficient in precision */
+	frexp(cmax, &exponent);
+	p->shift = ALC_LPC_PRECISION - 1 - exponent;
+	if (p->shift > 15)
+		p->shift = 15;
+	if (p->shift < 0)
+		return -1;
+
+	/* quantize with error feedback */
+	for (j = 0; j < order; j++) {
+		double v = a[j + 1] * (1 << p->shift) + e;
+		long q = lround(v);
+
+		if (q > 32767)
+			q = 32767;
+		if (q < -32768)
+			q = -32768;
+		p->coef[j] = q;
+		e = v - q;
+	}
+
+	p->type = ALC_LPC;
+	p->order = order;
+
+	return 0;
+}
+
+/*
+ * residual coding
+ */
+
+/* bits for one partition with parameter k */
+static uint64_t rice_bits(const int32_t *r, unsigned int n, unsigned int k)
+{
+	uint64_t bits = (uint64_t) n * (k + 1);
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		bits += zigzag(r[i]) >> k;
+
+	return bits;
+}
+
+/* width of the escape: zigzag values in w bits */
+static unsigned int escape_width(const int32_t *r, unsigned int n)
+{
+	uint32_t all = 0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++)
+		all |= zigzag(r[i]);
+
+	return all ? 32 - __builtin_clz(all) : 0;
+}
+
+/* best parameter for one partition and its cost */
+static unsigned int rice_param(const int32_t *r, unsigned int n, uint64_t *cost)
+{
+	uint64_t sum = 0, best, bits;
+	unsigned int i, k, best_k, w;
+
+	for (i = 0; i < n; i++)
+		sum += zigzag(r[i]);
+
+	/* k ~ log2 of the mean, then look around */
+	k = 0;
+	while (k < 30 && ((uint64_t) n << (k + 1)) <= sum)
+		k++;
+
+	best_k = k;
+	best = rice_bits(r, n, k);
+	if (k > 0 && (bits = rice_bits(r, n, k - 1)) < best) {
+		best = bits;
+		best_k = k - 1;
+	}
+	if (k < 30 && (bits = rice_bits(r, n, k + 1)) < best) {
+		best = bits;
+		best_k = k + 1;
+	}
+
+	w = escape_width(r, n);
+	if (5 + (uint64_t) n * w < best) {
+		best = 5 + (uint64_t) n * w;
+		best_k = ALC_ESCAPE;
+	}
+
+	*cost = 5 + best;
+	return best_k;
+}
+
+/* total bits of the residual r[order..n) */
+static uint64_t residual_bits(const int32_t *r, unsigned int n, unsigned int order)
+{
+	uint64_t total = 0, cost;
+	unsigned int start;
+
+	for (start = 0; start < n; start += ALC_PARTITION) {
+		unsigned int end = start + ALC_PARTITION < n ? start + ALC_PARTITION : n;
+		unsigned int first = start > order ? start : order;
+
+		rice_param(r + first, end > first ? end - first : 0, &cost);
+		total += cost;
+	}
+
+	return total;
+}
+
+static void put_residual(struct bit_writer *w, const int32_t *r,
+                         unsigned int n, unsigned int order)
+{
+	uint64_t cost;
+	unsigned int start, i;
+
+	for (start = 0; start < n; start += ALC_PARTITION) {
+		unsigned int end = start + ALC_PARTITION < n ? start + ALC_PARTITION : n;
+		unsigned int first = start > order ? start : order;
+		unsigned int count = end > first ? end - first : 0;
+		unsigned int k = rice_param(r + first, count, &cost);
+
+		put_bits(w, k, 5);
+
+		if (k == ALC_ESCAPE) {
+			unsigned int width = escape_width(r + first, count);
+
+			put_bits(w, width, 5);
+			for (i = first; i < end; i++)
+				put_bits(w, zigzag(r[i]), width);
+			continue;
+		}
+
+		for (i = first; i < end; i++) {
+			uint32_t u = zigzag(r[i]);
+
+			put_unary(w, u >> k);
+			put_bits(w, u, k);
+		}
+	}
+}
+
+static void get_residual(struct bit_reader *rd, int32_t *x,
+                         unsigned int n, unsigned int order)
+{
+	unsigned int start, i;
+
+	for (start = 0; start < n; start += ALC_PARTITION) {
+		unsigned int end = start + ALC_PARTITION < n ? start + ALC_PARTITION : n;
+		unsigned int first = start > order ? start : order;
+		unsigned int k = get_bits(rd, 5);
+
+		if (k == ALC_ESCAPE) {
+			unsigned int width = get_bits(rd, 5);
+
+			for (i = first; i < end; i++)
+				x[i] = unzigzag(width ? get_bits(rd, width) : 0);
+			continue;
+		}
+
+		for (i = first; i < end; i++) {
+			uint32_t q = get_unary(rd);
+
+			x[i] = unzigzag((q << k) | get_bits(rd, k));
+		}
+	}
+}
+
+/*
+ * blocks
+ */
+
+int alc_coder_init(struct alc_coder *c, unsigned int channels,
+                   unsigned int max_frames)
+{
+	if (channels == 0 || channels > ALC_MAX_CHANNELS || max_frames == 0)
+		return -EINVAL;
+
+	c->channels = channels;
+	c->max_frames = max_frames;
+	c->x = malloc(max_frames * sizeof(*c->x));
+	c->r = malloc(max_frames * sizeof(*c->r));
+	c->w = malloc(max_frames * sizeof(*c->w));
+	if (c->x == NULL || c->r == NULL || c->w == NULL) {
+		alc_coder_free(c);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+void alc_coder_free(struct alc_coder *c)
+{
+	free(c->x);
+	free(c->r);
+	free(c->w);
+	c->x = NULL;
+	c->r = NULL;
+	c->w = NULL;
+}
+
+size_t alc_block_bound(unsigned int channels, unsigned int frames)
+{
+	/* a coded channel is never bigger than verbatim plus its type */
+	return sizeof(struct alc_block_header) +
+	       (size_t) channels * ((size_t) frames * 2 + 1) + 8;
+}
+
+/* cheapest predictor for x[0..n) */
+static uint64_t choose_predictor(struct alc_coder *c, unsigned int n,
+                                 struct predictor *best)
+{
+	const int32_t *x = c->x;
+	struct predictor p;
+	uint64_t bits, best_bits;
+	unsigned int i, order;
+
+	/* silence, or any other constant */
+	for (i = 1; i < n && x[i] == x[0]; i++)
+		;
+	if (i == n) {
+		best->type = ALC_CONSTANT;
+		return 4 + 16;
+	}
+
+	best->type = ALC_VERBATIM;
+	best_bits = 4 + (uint64_t) n * 16;
+
+	for (order = 0; order <= 4 && order < n; order++) {
+		fixed_residual(x, n, order, c->r);
+		bits = 4 + 3 + order * 16 + residual_bits(c->r, n, order);
+		if (bits < best_bits) {
+			best_bits = bits;
+			best->type = ALC_FIXED;
+			best->order = order;
+		}
+	}
+
+	if (lpc_design(c, x, n, &p) == 0 && lpc_residual(x, n, &p, c->r) == 0) {
+		bits = 4 + 4 + 4 + p.order * 32 + residual_bits(c->r, n, p.order);
+		if (bits < best_bits) {
+			best_bits = bits;
+			*best = p;
+		}
+	}
+
+	return best_bits;
+}
+
+size_t alc_encode_block(struct alc_coder *c, const short int *in,
+                        unsigned int frames, uint64_t first_frame,
+                        unsigned char *out, int raw)
+{
+	struct alc_block_header *h = (struct alc_block_header *) out;
+	unsigned char *payload = out + sizeof(*h);
+	struct bit_writer w = { payload, 0, 0 };
+	unsigned int ch, i;
+
+	h->sync = ALC_SYNC;
+	h->first_frame = first_frame;
+	h->frames = frames;
+
+	if (raw) {
+		h->frames |= ALC_BLOCK_RAW;
+		h->size = frames * c->channels * sizeof(short int);
+		memcpy(payload, in, h->size);
+		h->crc = alc_crc32(payload, h->size);
+		return sizeof(*h) + h->size;
+	}
+
+	for (ch = 0; ch < c->channels; ch++) {
+		struct predictor p;
+
+		for (i = 0; i < frames; i++)
+			c->x[i] = in[i * c->channels + ch];
+
+		choose_predictor(c, frames, &p);
+		put_bits(&w, p.type, 4);
+
+		switch (p.type) {
+		case ALC_CONSTANT:
+			put_bits(&w, (uint16_t) c->x[0], 16);
+			break;
+
+		case ALC_VERBATIM:
+			for (i = 0; i < frames; i++)
+				put_bits(&w, (uint16_t) c->x[i], 16);
+			break;
+
+		case ALC_FIXED:
+			put_bits(&w, p.order, 3);
+			for (i = 0; i < p.order; i++)
+				put_bits(&w, (uint16_t) c->x[i], 16);
+			fixed_residual(c->x, frames, p.order, c->r);
+			put_residual(&w, c->r, frames, p.order);
+			break;
+
+		case ALC_LPC:
+			put_bits(&w, p.order - 1, 4);
+			put_bits(&w, p.shift, 4);
+			for (i = 0; i < p.order; i++)
+				put_bits(&w, (uint16_t) p.coef[i], 16);
+			for (i = 0; i < p.order; i++)
+				put_bits(&w, (uint16_t) c->x[i], 16);
+			lpc_residual(c->x, frames, &p, c->r);
+			put_residual(&w, c->r, frames, p.order);
+			break;
+		}
+	}
+
+	flush_bits(&w);
+
+	h->size = w.p - payload;
+	h->crc = alc_crc32(payload, h->size);
+
+	return sizeof(*h) + h->size;
+}
+
+int alc_decode_block(struct alc_coder *c, const struct alc_block_header *h,
+                     const unsigned char *payload, short int *out)
+{
+	unsigned int frames = alc_block_frames(h);
+	struct bit_reader rd = { payload, payload + h->size, 0, 0, 0 };
+	unsigned int ch, i;
+
+	if (frames > c->max_frames)
+		return -EINVAL;
+
+	if (h->frames & ALC_BLOCK_RAW) {
+		if (h->size != frames * c->channels * sizeof(short int))
+			return -EINVAL;
+		memcpy(out, payload, h->size);
+		return 0;
+	}
+
+	for (ch = 0; ch < c->channels; ch++) {
+		struct predictor p;
+
+		p.type = get_bits(&rd, 4);
+
+		switch (p.type) {
+		case ALC_CONSTANT:
+			c->x[0] = (int16_t) get_bits(&rd, 16);
+			for (i = 1; i < frames; i++)
+				c->x[i] = c->x[0];
+			break;
+
+		case ALC_VERBATIM:
+			for (i = 0; i < frames; i++)
+				c->x[i] = (int16_t) get_bits(&rd, 16);
+			break;
+
+		case ALC_FIXED:
+			p.order = get_bits(&rd, 3);
+			if (p.order > 4 || p.order > frames)
+				return -EINVAL;
+			for (i = 0; i < p.order; i++)
+				c->x[i] = (int16_t) get_bits(&rd, 16);
+			get_residual(&rd, c->x, frames, p.order);
+			fixed_restore(c->x, frames, p.order);
+			break;
+
+		case ALC_LPC:
+			p.order = get_bits(&rd, 4) + 1;
+			p.shift = get_bits(&rd, 4);
+			if (p.order > ALC_MAX_ORDER || p.order > frames)
+				return -EINVAL;
+			for (i = 0; i < p.order; i++)
+				p.coef[i] = (int16_t) get_bits(&rd, 16);
+			for (i = 0; i < p.order; i++)
+				c->x[i] = (int16_t) get_bits(&rd, 16);
+			get_residual(&rd, c->x, frames, p.order);
+			lpc_restore(c->x, frames, &p);
+			break;
+
+		default:
+			return -EINVAL;
+		}
+
+		if (overrun(&rd))
+			return -EINVAL;
+
+		for (i = 0; i < frames; i++)
+			out[i * c->channels + ch] = c->x[i];
+	}
+
+	return 0;
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t i, v;
+	int j;
+
+	for (i = 0; i < 256; i++) {
+		v = i;
+		for (j = 0; j < 8; j++)
+			v = (v >> 1) ^ (0xedb88320 & -(v & 1));
+		crc_table[i] = v;
+	}
+}
+
+uint32_t alc_crc32(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t crc = 0xffffffff;
+	size_t i;
+
+	pthread_once(&crc_once, crc_init);
+
+	for (i = 0; i < len; i++)
+		crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
@@ -0,0 +1,106 @@
+/*
+ * Lossless codec for interleaved S16 audio
+ *
+ * A stream is an alc_header followed by independent blocks. Every block
+ * has a header with a sync word, its size, its first frame and a crc,
+ * so blocks can be coded in parallel, and a reader can find its way
+ * back after damage.
+ *
+ * Per channel a block holds a predictor - a fixed polynomial of order
+ * 0-4 or a quantized lpc of order 8, whichever codes smallest - its
+ * warm up samples, and the residual rice coded in partitions with an
+ * escape to raw values. Silent channels cost two bytes, noise never
+ * costs more than the raw samples.
+ *
+ * A finished stream ends with a seek table - first frame and file offset
+ * of every block - and an alc_footer. A stream without one (the writer
+ * died) can still be read by walking the block headers.
+ */
+
+#ifndef ALC_H
+#define ALC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ALC_MAGIC 0x31434c41 /* "ALC1" */
+#define ALC_VERSION 1
+#define ALC_SYNC 0x4b4c4241 /* "ABLK" */
+#define ALC_SEEK_MAGIC 0x4b455341 /* "ASEK" */
+
+#define ALC_MAX_CHANNELS 64
+#define ALC_MAX_ORDER 8
+
+/* frames field flag: the payload is the raw interleaved samples */
+#define ALC_BLOCK_RAW 0x80000000u
+
+struct alc_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t channels;
+	uint32_t rate;
+	/* frames per block - only the last one may be shorter */
+	uint32_t block_frames;
+};
+
+struct alc_block_header {
+	uint32_t sync;
+	/* payload bytes following this header */
+	uint32_t size;
+	uint64_t first_frame;
+	/* frame count, possibly or'ed with ALC_BLOCK_RAW */
+	uint32_t frames;
+	/* crc32 of the payload */
+	uint32_t crc;
+};
+
+struct alc_seek {
+	uint64_t first_frame;
+	uint64_t offset;
+};
+
+/* the last bytes of a finished stream */
+struct alc_footer {
+	uint64_t table_offset;
+	uint32_t nr_entries;
+	uint32_t magic;
+};
+
+/* per thread scratch memory */
+struct alc_coder {
+	unsigned int channels;
+	unsigned int max_frames;
+	int32_t *x;
+	int32_t *r;
+	double *w;
+};
+
+int alc_coder_init(struct alc_coder *c, unsigned int channels,
+                   unsigned int max_frames);
+void alc_coder_free(struct alc_coder *c);
+
+/* largest possible block, header included */
+size_t alc_block_bound(unsigned int channels, unsigned int frames);
+
+/*
+ * Code 'frames' interleaved frames into 'out' (alc_block_bound() bytes),
+ * header included. 'raw' skips the prediction: a copy, for when there
+ * is no time. Returns the number of bytes.
+ */
+size_t alc_encode_block(struct alc_coder *c, const short int *in,
+                        unsigned int frames, uint64_t first_frame,
+                        unsigned char *out, int raw);
+
+/* 0, or -EINVAL when the payload is damaged */
+int alc_decode_block(struct alc_coder *c, const struct alc_block_header *h,
+                     const unsigned char *payload, short int *out);
+
+/* frames in a block header */
+static inline unsigned int alc_block_frames(const struct alc_block_header *h)
+{
+	return h->frames & ~ALC_BLOCK_RAW;
+}
+
+uint32_t alc_crc32(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,260 @@
+/*
+ * Spectrum analyzer thread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "analyzer.h"
+
+/* lowest band edge in Hz */
+#define ANALYZER_MIN_FREQ 20.0
+
+static void *analyzer_alloc(size_t size)
+{
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+/* log spaced bands between ANALYZER_MIN_FREQ and nyquist, in fft bins */
+static void setup_bands(struct analyzer *a)
+{
+	double lo = ANALYZER_MIN_FREQ, hi = a->rate / 2.0;
+	unsigned int half = a->fft_size / 2, i;
+
+	for (i = 0; i <= a->nr_bands; i++) {
+		double f = lo * pow(hi / lo, (double) i / a->nr_bands);
+		unsigned int bin = (unsigned int) (f * a->fft_size / a->rate + 0.5);
+
+		if (bin < 1)
+			bin = 1;
+		if (i > 0 && bin <= a->band_start[i - 1])
+			bin = a->band_start[i - 1] + 1;
+		if (bin > half + 1)
+			bin = half + 1;
+		a->band_start[i] = bin;
+	}
+}
+
+float analyzer_band_freq(struct analyzer *a, unsigned int i)
+{
+	return (float) a->band_start[i] * a->rate / a->fft_size;
+}
+
+static void publish(struct analyzer *a, const float *band_db)
+{
+	atomic_fetch_add_explicit(&a->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(a->band_db, band_db, a->nr_bands * sizeof(float));
+	a->spectra++;
+	atomic_fetch_add_explicit(&a->seq, 1, memory_order_release);
+}
+
+unsigned long analyzer_read(struct analyzer *a, float *band_db)
+{
+	unsigned int seq;
+	unsigned long spectra;
+
+	do {
+		while ((seq = atomic_load_explicit(&a->seq, memory_order_acquire)) & 1)
+			;
+		memcpy(band_db, a->band_db, a->nr_bands * sizeof(float));
+		spectra = a->spectra;
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&a->seq, memory_order_relaxed) != seq);
+
+	return spectra;
+}
+
+static void report(struct analyzer *a, const float *band_db)
+{
+	unsigned int i;
+
+	printf("bands:");
+	for (i = 0; i < a->nr_bands; i++)
+		printf(" %.0f:%.1f", analyzer_band_freq(a, i), band_db[i]);
+	printf(" (dropped %lu of %lu frames)\n",
+	       atomic_load(&a->dropped), atomic_load(&a->frames));
+}
+
+static void analyze(struct analyzer *a)
+{
+	unsigned int n = a->fft_size, i, b;
+	float band_db[ANALYZER_MAX_BANDS];
+	float norm = 0;
+
+	for (i = 0; i < n; i++) {
+		a->re[i] = a->history[i] * a->window[i];
+		a->im[i] = 0;
+		norm += a->window[i];
+	}
+
+	fft_forward(a->fft, a->re, a->im);
+
+	/* one sided power, a full scale sine reads 0 dB */
+	norm = 2.0f / (norm * norm);
+
+	for (b = 0; b < a->nr_bands; b++) {
+		float energy = 0;
+
+		for (i = a->band_start[b]; i < a->band_start[b + 1]; i++)
+			energy += a->re[i] * a->re[i] + a->im[i] * a->im[i];
+
+		band_db[b] = 10.0f * log10f(energy * norm + 1e-20f);
+	}
+
+	publish(a, band_db);
+
+	/* report every 'report' seconds of audio */
+	if (a->report) {
+		unsigned long every = (unsigned long) a->report * a->rate / a->hop;
+
+		if (every == 0 || a->spectra % every == 0)
+			report(a, band_db);
+	}
+}
+
+/* mix 'frames' frames to mono and append them to the history */
+static void append(struct analyzer *a, const short int *period,
+                   unsigned int frames)
+{
+	unsigned int n = a->fft_size, c, i, skip = 0;
+	float scale = 1.0f / (32768.0f * a->channels);
+
+	/* only the last fft_size frames matter */
+	if (frames > n) {
+		skip = frames - n;
+		frames = n;
+	}
+	period += skip * a->channels;
+
+	memmove(a->history, a->history + frames, (n - frames) * sizeof(float));
+
+	for (i = 0; i < frames; i++) {
+		int sum = 0;
+
+		for (c = 0; c < a->channels; c++)
+			sum += period[i * a->channels + c];
+		a->history[n - frames + i] = sum * scale;
+	}
+
+	if (a->filled < n)
+		a->filled += frames;
+}
+
+static void *analyzer_thread(void *arg)
+{
+	struct analyzer *a = arg;
+	size_t hop_bytes = (size_t) a->hop * a->channels * sizeof(short int);
+
+	while (atomic_load(&a->running)) {
+		sem_wait(&a->wake);
+
+		while (ring_used(&a->ring) >= hop_bytes) {
+			ring_read(&a->ring, a->period, hop_bytes);
+			append(a, a->period, a->hop);
+
+			/* wait until the window is filled once */
+			if (a->filled >= a->fft_size)
+				analyze(a);
+		}
+	}
+
+	return NULL;
+}
+
+int analyzer_start(struct analyzer *a, unsigned int channels,
+                   unsigned int rate, unsigned int fft_size,
+                   unsigned int hop, unsigned int nr_bands)
+{
+	size_t frame_bytes = channels * sizeof(short int);
+	unsigned int i;
+	int err;
+
+	if (fft_size < 16 || fft_size > (1u << FFT_MAX_ORDER) ||
+	    (fft_size & (fft_size - 1)) || hop == 0 ||
+	    nr_bands == 0 || nr_bands > ANALYZER_MAX_BANDS) {
+		printf("Invalid analyzer settings\n");
+		return -EINVAL;
+	}
+
+	a->channels = channels;
+	a->rate = rate;
+	a->fft_size = fft_size;
+	a->hop = hop;
+	a->nr_bands = nr_bands;
+	a->filled = 0;
+	a->spectra = 0;
+	atomic_init(&a->seq, 0);
+	atomic_init(&a->frames, 0);
+	atomic_init(&a->dropped, 0);
+	atomic_init(&a->running, 1);
+
+	a->fft = fft_create(fft_size);
+	a->window = analyzer_alloc(fft_size * sizeof(float));
+	a->history = analyzer_alloc(fft_size * sizeof(float));
+	a->re = analyzer_alloc(fft_size * sizeof(float));
+	a->im = analyzer_alloc(fft_size * sizeof(float));
+	a->period = analyzer_alloc(hop * frame_bytes);
+	if (!a->fft || !a->window || !a->history || !a->re || !a->im || !a->period)
+		return -ENOMEM;
+
+	/* room for a few hops or windows, whatever is bigger */
+	err = ring_init(&a->ring, 4 * (hop > fft_size ? hop : fft_size) * frame_bytes);
+	if (err < 0)
+		return err;
+
+	/* hann */
+	for (i = 0; i < fft_size; i++)
+		a->window[i] = 0.5f - 0.5f * cosf(2.0f * M_PI * i / fft_size);
+
+	setup_bands(a);
+
+	if (sem_init(&a->wake, 0, 0) < 0)
+		return -errno;
+
+	err = pthread_create(&a->thread, NULL, analyzer_thread, a);
+	if (err)
+		return -err;
+
+	return 0;
+}
+
+void analyzer_stop(struct analyzer *a)
+{
+	atomic_store(&a->running, 0);
+	sem_post(&a->wake);
+	pthread_join(a->thread, NULL);
+
+	sem_destroy(&a->wake);
+	ring_free(&a->ring);
+	fft_destroy(a->fft);
+	free(a->window);
+	free(a->history);
+	free(a->re);
+	free(a->im);
+	free(a->period);
+}
+
+void analyzer_push(struct analyzer *a, const short int *buffer,
+                   unsigned int frames)
+{
+	size_t bytes = (size_t) frames * a->channels * sizeof(short int);
+
+	atomic_fetch_add_explicit(&a->frames, frames, memory_order_relaxed);
+
+	/* analysis is behind - drop, never wait */
+	if (ring_write(&a->ring, buffer, bytes) == 0) {
+		atomic_fetch_add_explicit(&a->dropped, frames, memory_order_relaxed);
+		return;
+	}
+
+	sem_post(&a->wake);
+}
@@ -0,0 +1,75 @@
+/*
+ * Spectrum analyzer thread
+ *
+ * The audio thread pushes periods with analyzer_push(), which only
+ * copies into a lock-free ring and never blocks. When the ring is full
+ * the period is dropped and counted. The analyzer thread mixes the
+ * channels to mono, computes a hann windowed fft every 'hop' frames and
+ * publishes the energy of log spaced bands.
+ */
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+#include "fft.h"
+
+/* maximum number of bands */
+#define ANALYZER_MAX_BANDS 32
+
+struct analyzer {
+	/* setup */
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int fft_size;
+	unsigned int hop;
+	unsigned int nr_bands;
+	/* print the bands every 'report' seconds, 0 = never */
+	unsigned int report;
+
+	/* audio thread -> analyzer thread */
+	struct ring ring;
+	sem_t wake;
+	atomic_int running;
+	pthread_t thread;
+
+	/* statistics */
+	atomic_ulong frames;
+	atomic_ulong dropped;
+
+	/* analyzer thread only */
+	struct fft *fft;
+	float *window;
+	float *history;
+	unsigned int filled;
+	float *re;
+	float *im;
+	short int *period;
+	unsigned int band_start[ANALYZER_MAX_BANDS + 1];
+
+	/* results - seqlock protected */
+	atomic_uint seq;
+	unsigned long spectra;
+	float band_db[ANALYZER_MAX_BANDS];
+};
+
+int analyzer_start(struct analyzer *a, unsigned int channels,
+                   unsigned int rate, unsigned int fft_size,
+                   unsigned int hop, unsigned int nr_bands);
+void analyzer_stop(struct analyzer *a);
+
+/* audio thread - never blocks */
+void analyzer_push(struct analyzer *a, const short int *buffer,
+                   unsigned int frames);
+
+/* any thread - copy of the latest bands, returns the spectrum count */
+unsigned long analyzer_read(struct analyzer *a, float *band_db);
+
+/* lower edge of band 'i' in Hz */
+float analyzer_band_freq(struct analyzer *a, unsigned int i);
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * Aligned buffer pool for period and ring memory
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+#include "bufpool.h"
+
+/* smallest block: a cache line */
+#define BUFPOOL_MIN_SHIFT 6
+#define BUFPOOL_SLAB_SHIFT 16
+#define BUFPOOL_NR_CLASSES (48 - BUFPOOL_MIN_SHIFT)
+#define BUFPOOL_HUGE_SIZE (2UL << 20)
+/* a thread keeps this much of a class before giving half back */
+#define BUFPOOL_CACHE_BYTES (2UL << BUFPOOL_SLAB_SHIFT)
+
+#define SLAB_SIZE (1UL << BUFPOOL_SLAB_SHIFT)
+
+struct block {
+	struct block *next;
+};
+
+/* the free lists and statistics of one thread */
+struct cache {
+	struct block *free[BUFPOOL_NR_CLASSES];
+	unsigned int nr_free[BUFPOOL_NR_CLASSES];
+	int registered;
+	struct cache *next;
+
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long refills;
+	long in_use;
+};
+
+static struct {
+	char *base;
+	size_t size;
+	const char *kind;
+	int locked;
+
+	/* slabs handed out, and the class of each */
+	atomic_size_t top;
+	unsigned char *slab_class;
+
+	/* slow path: shared free lists and the thread registry */
+	pthread_mutex_t lock;
+	pthread_key_t key;
+	struct block *free[BUFPOOL_NR_CLASSES];
+	unsigned int nr_free[BUFPOOL_NR_CLASSES];
+	struct cache *caches;
+
+	/* totals of the threads that ended, and the misses */
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long refills;
+	long in_use;
+	atomic_ulong fallbacks;
+} pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct cache cache;
+
+static unsigned int size_shift(size_t size)
+{
+	unsigned int shift = size > 1 ? 64 - __builtin_clzl(size - 1) : 0;
+
+	return shift < BUFPOOL_MIN_SHIFT ? BUFPOOL_MIN_SHIFT : shift;
+}
+
+static unsigned int cache_limit(unsigned int class)
+{
+	unsigned long n = BUFPOOL_CACHE_BYTES >> (class + BUFPOOL_MIN_SHIFT);
+
+	return n < 2 ? 2 : n;
+}
+
+static int in_arena(void *ptr)
+{
+	return pool.base && (char *) ptr >= pool.base &&
+	       (char *) ptr < pool.base + pool.size;
+}
+
+/* thread exit: blocks and statistics go to the pool */
+static void cache_release(void *arg)
+{
+	struct cache *c = arg, **p;
+	unsigned int i;
+
+	pthread_mutex_lock(&pool.lock);
+	for (i = 0; i < BUFPOOL_NR_CLASSES; i++) {
+		while (c->free[i]) {
+			struct block *b = c->free[i];
+
+			c->free[i] = b->next;
+			b->next = pool.free[i];
+			pool.free[i] = b;
+			pool.nr_free[i]++;
+		}
+		c->nr_free[i] = 0;
+	}
+
+	pool.allocs += c->allocs;
+	pool.frees += c->frees;
+	pool.refills += c->refills;
+	pool.in_use += c->in_use;
+
+	for (p = &pool.caches; *p; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	memset(c, 0, sizeof(*c));
+}
+
+static void cache_register(struct cache *c)
+{
+	pthread_mutex_lock(&pool.lock);
+	c->next = pool.caches;
+	pool.caches = c;
+	c->registered = 1;
+	pthread_mutex_unlock(&pool.lock);
+
+	pthread_setspecific(pool.key, c);
+}
+
+/* 'nr' slabs of the arena, NULL when it is full */
+static char *slab_get(size_t nr, unsigned int class)
+{
+	size_t top = atomic_load(&pool.top), i;
+
+	do {
+		if (top + nr > pool.size >> BUFPOOL_SLAB_SHIFT)
+			return NULL;
+	} while (!atomic_compare_exchange_weak(&pool.top, &top, top + nr));
+
+	for (i = 0; i < nr; i++)
+		pool.slab_class[top + i] = class;
+
+	return pool.base + (top << BUFPOOL_SLAB_SHIFT);
+}
+
+/* the thread list of 'class' is empty: take half a cache full */
+static int refill(struct cache *c, unsigned int class)
+{
+	size_t size = 1UL << (class + BUFPOOL_MIN_SHIFT);
+	unsigned int want = cache_limit(class) / 2;
+	char *slab;
+	size_t off;
+
+	if (!c->registered)
+		cache_register(c);
+	c->refills++;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.free[class] && c->nr_free[class] < want) {
+		struct block *b = pool.free[class];
+
+		pool.free[class] = b->next;
+		pool.nr_free[class]--;
+		b->next = c->free[class];
+		c->free[class] = b;
+		c->nr_free[class]++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (c->free[class])
+		return 0;
+
+	/* a new slab, all of it for this thread */
+	slab = slab_get(size > SLAB_SIZE ? size >> BUFPOOL_SLAB_SHIFT : 1, class);
+	if (slab == NULL)
+		return -ENOMEM;
+
+	for (off = 0; off < (size > SLAB_SIZE ? size : SLAB_SIZE); off += size) {
+		struct block *b = (struct block *) (slab + off);
+
+		b->next = c->free[class];
+		c->free[class] = b;
+		c->nr_free[class]++;
+	}
+
+	return 0;
+}
+
+/* the thread list of 'class' is too long: give half back */
+static void flush(struct cache *c, unsigned int class)
+{
+	unsigned int keep = cache_limit(class) / 2;
+
+	pthread_mutex_lock(&pool.lock);
+	while (c->nr_free[class] > keep) {
+		struct block *b = c->free[class];
+
+		c->free[class] = b->next;
+		c->nr_free[class]--;
+		b->next = pool.free[class];
+		pool.free[class] = b;
+		pool.nr_free[class]++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void *fallback_alloc(size_t size)
+{
+	size_t align = 1UL << size_shift(size);
+	void *ptr;
+
+	if (align > SLAB_SIZE)
+		align = SLAB_SIZE;
+	if (posix_memalign(&ptr, align, size))
+		return NULL;
+
+	atomic_fetch_add(&pool.fallbacks, 1);
+	return ptr;
+}
+
+void *bufpool_alloc(size_t size)
+{
+	struct cache *c = &cache;
+	unsigned int shift = size_shift(size);
+	unsigned int class = shift - BUFPOOL_MIN_SHIFT;
+	struct block *b;
+
+	if (pool.base == NULL || size == 0 || size > pool.size)
+		return fallback_alloc(size);
+
+	if (c->free[class] == NULL && refill(c, class) < 0)
+		return fallback_alloc(size);
+
+	b = c->free[class];
+	c->free[class] = b->next;
+	c->nr_free[class]--;
+
+	c->allocs++;
+	c->in_use += 1L << shift;
+
+	return b;
+}
+
+void bufpool_free(void *ptr)
+{
+	struct cache *c = &cache;
+	struct block *b = ptr;
+	unsigned int class;
+
+	if (ptr == NULL)
+		return;
+
+	if (!in_arena(ptr)) {
+		free(ptr);
+		return;
+	}
+
+	if (!c->registered)
+		cache_register(c);
+
+	class = pool.slab_class[((char *) ptr - pool.base) >> BUFPOOL_SLAB_SHIFT];
+	b->next = c->free[class];
+	c->free[class] = b;
+	c->nr_free[class]++;
+
+	c->frees++;
+	c->in_use -= 1L << (class + BUFPOOL_MIN_SHIFT);
+
+	if (c->nr_free[class] > cache_limit(class))
+		flush(c, class);
+}
+
+int bufpool_init(size_t size)
+{
+	size_t map_size;
+	char *map;
+	int err;
+
+	size = (size + BUFPOOL_HUGE_SIZE - 1) & ~(BUFPOOL_HUGE_SIZE - 1);
+	if (size == 0 || pool.base)
+		return -EINVAL;
+
+	pool.slab_class = calloc(size >> BUFPOOL_SLAB_SHIFT, 1);
+	if (pool.slab_class == NULL)
+		return -ENOMEM;
+
+	/* reserved hugepages */
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	pool.kind = "hugetlb";
+	pool.base = map;
+
+	/* else transparent ones: the 2 MB aligned part of a larger mapping */
+	if (map == MAP_FAILED) {
+		map_size = size + BUFPOOL_HUGE_SIZE;
+		map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			err = -errno;
+			free(pool.slab_class);
+			pool.slab_class = NULL;
+			pool.base = NULL;
+			return err;
+		}
+
+		pool.base = (char *) (((uintptr_t) map + BUFPOOL_HUGE_SIZE - 1) &
+		                      ~(BUFPOOL_HUGE_SIZE - 1));
+		if (pool.base != map)
+			munmap(map, pool.base - map);
+		if (pool.base + size != map + map_size)
+			munmap(pool.base + size, map + map_size - (pool.base + size));
+
+		pool.kind = madvise(pool.base, size, MADV_HUGEPAGE) ? "pages" : "thp";
+	}
+
+	pool.size = size;
+	atomic_init(&pool.top, 0);
+	atomic_init(&pool.fallbacks, 0);
+
+	/* not fatal: the memory is just not guaranteed resident */
+	pool.locked = mlock(pool.base, size) == 0;
+	if (!pool.locked)
+		printf("bufpool: could not lock %zu KB: %s\n", size >> 10, strerror(errno));
+
+	err = pthread_key_create(&pool.key, cache_release);
+	if (err) {
+		if (pool.locked)
+			munlock(pool.base, size);
+		munmap(pool.base, size);
+		free(pool.slab_class);
+		pool.base = NULL;
+		pool.slab_class = NULL;
+		return -err;
+	}
+
+	return 0;
+}
+
+void bufpool_exit(void)
+{
+	if (pool.base == NULL)
+		return;
+
+	/* the caller's list points into the arena */
+	if (cache.registered)
+		cache_release(&cache);
+	pthread_key_delete(pool.key);
+
+	if (pool.locked)
+		munlock(pool.base, pool.size);
+	munmap(pool.base, pool.size);
+	free(pool.slab_class);
+
+	pool.base = NULL;
+	pool.slab_class = NULL;
+	memset(pool.free, 0, sizeof(pool.free));
+	memset(pool.nr_free, 0, sizeof(pool.nr_free));
+}
+
+void bufpool_print_stats(void)
+{
+	unsigned long allocs, frees, refills;
+	long in_use;
+	struct cache *c;
+
+	pthread_mutex_lock(&pool.lock);
+	allocs = pool.allocs;
+	frees = pool.frees;
+	refills = pool.refills;
+	in_use = pool.in_use;
+	/* other threads' counters, read without their cooperation */
+	for (c = pool.caches; c; c = c->next) {
+		allocs += c->allocs;
+		frees += c->frees;
+		refills += c->refills;
+		in_use += c->in_use;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (pool.base)
+		printf("bufpool: %zu KB %s%s, %zu KB carved, %ld KB in use\n",
+		       pool.size >> 10, pool.kind, pool.locked ? " locked" : "",
+		       atomic_load(&pool.top) << (BUFPOOL_SLAB_SHIFT - 10), in_use >> 10);
+	printf("bufpool: %lu allocs, %lu frees, %lu refills, %lu outside the arena\n",
+	       allocs, frees, refills, atomic_load(&pool.fallbacks));
+}
@@ -0,0 +1,40 @@
+/*
+ * Aligned buffer pool for period and ring memory
+ *
+ * One arena per process: hugepages when the system has them reserved,
+ * else transparent hugepages on a 2 MB aligned mapping, locked in memory
+ * so the audio threads never fault on it. Hundreds of streams then share
+ * a handful of TLB entries instead of scattering small allocations over
+ * the heap.
+ *
+ * The arena is cut into 64 KB slabs, a slab serves one power of two size
+ * class from 64 bytes up; larger classes take contiguous slabs. A block
+ * is aligned to its size - cache line, SIMD vector, page - up to the slab
+ * size, larger blocks are slab aligned.
+ *
+ * Every thread keeps free lists of its own: allocating and freeing
+ * is a list push or pop without locks or atomics. Only an empty list
+ * (refill from the shared lists or a new slab) or a long one (give half
+ * back) takes the lock. Memory is never returned to the system before
+ * bufpool_exit().
+ *
+ * Without an arena, or when it is full, blocks come from posix_memalign()
+ * with the same alignment, so callers never care which it was.
+ */
+
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stddef.h>
+
+/* arena of 'size' bytes, rounded up to 2 MB */
+int bufpool_init(size_t size);
+/* after every block is freed */
+void bufpool_exit(void);
+
+void *bufpool_alloc(size_t size);
+void bufpool_free(void *ptr);
+
+void bufpool_print_stats(void);
+
+#endif
@@ -0,0 +1,507 @@
+/*
+ * Capture from several devices into one interleaved multichannel file
+ *
+ * Devices are linked with snd_pcm_link() so they start together. When
+ * that isn't possible, the streams are aligned on the hw timestamps of
+ * their first period. Every device has its own capture thread feeding a
+ * lock-free ring, a merge thread interleaves the rings into one file
+ * and reports the clock drift of every device.
+ *
+ * build: gcc -O2 capture_multi.c pcm.c ring.c bufpool.c -o capture_multi -lasound -lm -lpthread -lrt
+ *
+ * usage: capture_multi [-c channels] [-o file] [-H pool_mb] hw:1,0 hw:2,0 ...
+ */
+
+#include "alsa/asoundlib.h"
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "pcm.h"
+#include "ring.h"
+#include "bufpool.h"
+
+/* debugging */
+static snd_output_t *output = NULL;
+
+/* maximum number of devices */
+#define MAX_DEVICES 8
+
+
+/* S16_LE interleaved, see pcm_configure() */
+/* number of channels per device */
+unsigned int hw_channels = 8;
+/* preferred rate - this could differ from the actual rate! */
+unsigned int hw_rate = 48000;
+/* requested hw ring buffer length in us */
+unsigned int hw_buffer_time = 100000;
+/* size of hw_buffer in bytes - filled by application */
+snd_pcm_uframes_t hw_buffer_size;
+/* requested hw period time in us */
+unsigned int hw_period_time = 5000;
+/* size of hw_period in frames - filled by application */
+snd_pcm_uframes_t hw_period_size;
+
+
+struct device {
+	const char *name;
+	struct pcm *pcm;
+	snd_pcm_t *handle;
+	int linked;
+	/* what this device negotiated - the same on every device */
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+
+	/* capture thread */
+	pthread_t thread;
+	short int *period;
+	struct ring ring;
+	unsigned long long frames_read;
+
+	/* hw position and time of the first period */
+	atomic_int started;
+	unsigned long long start_pos;
+	double start_time;
+
+	/* latest hw position and time - seqlock protected */
+	atomic_uint seq;
+	unsigned long long pos;
+	double time;
+
+	/* frames lost because the merge was behind */
+	atomic_ulong dropped;
+	/* capture thread: dropped frames not yet replaced by silence */
+	unsigned long long gap;
+	short int *silence;
+	/* overruns recovered from */
+	atomic_ulong xruns;
+
+	/* merge thread: frames to skip for alignment */
+	unsigned long long skip;
+	short int *chunk;
+};
+
+struct device devices[MAX_DEVICES];
+unsigned int nr_devices = 0;
+
+/* the merge thread sleeps on this */
+sem_t merge_wake;
+
+/* set on SIGINT */
+atomic_int stop;
+
+/* arena for the period and ring memory in MB - 0 = malloc */
+unsigned int pool_size = 16;
+
+/* output file */
+int fd;
+const char* filename = "multi.raw";
+
+static double ts_to_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static void set_position(struct device *dev, unsigned long long pos, double time)
+{
+	atomic_fetch_add_explicit(&dev->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	dev->pos = pos;
+	dev->time = time;
+	atomic_fetch_add_explicit(&dev->seq, 1, memory_order_release);
+}
+
+static void get_position(struct device *dev, unsigned long long *pos, double *time)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = atomic_load_explicit(&dev->seq, memory_order_acquire)) & 1)
+			;
+		*pos = dev->pos;
+		*time = dev->time;
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&dev->seq, memory_order_relaxed) != seq);
+}
+
+/* one per device: read periods, timestamp them and hand them to the merge */
+static void *capture_thread(void *arg)
+{
+	struct device *dev = arg;
+	size_t frame_bytes = hw_channels * sizeof(short int);
+	snd_pcm_uframes_t avail;
+	snd_htimestamp_t tstamp;
+	int err;
+
+	while (!atomic_load(&stop)) {
+
+		err = snd_pcm_readi(dev->handle, dev->period, dev->period_size);
+
+		/* EAGAIN failure? -> retry */
+		if (err == -EAGAIN)
+			continue;
+
+		/* overrun, signal: restart and go on */
+		if (err < 0) {
+			if (err == -EPIPE)
+				atomic_fetch_add_explicit(&dev->xruns, 1, memory_order_relaxed);
+
+			err = snd_pcm_recover(dev->handle, err, 0);
+			if (err < 0) {
+				/* no way on - end the capture with its report */
+				printf("Read error on %s: %s\n", dev->name, snd_strerror(err));
+				atomic_store(&stop, 1);
+				sem_post(&merge_wake);
+				break;
+			}
+			continue;
+		}
+
+		dev->frames_read += err;
+
+		/* hw position = frames read + frames still in the buffer */
+		if (snd_pcm_htimestamp(dev->handle, &avail, &tstamp) == 0) {
+			unsigned long long pos = dev->frames_read + avail;
+			double time = ts_to_sec(&tstamp);
+
+			if (!atomic_load_explicit(&dev->started, memory_order_relaxed)) {
+				dev->start_pos = pos;
+				dev->start_time = time;
+				set_position(dev, pos, time);
+				atomic_store_explicit(&dev->started, 1, memory_order_release);
+			} else
+				set_position(dev, pos, time);
+		}
+
+		/* what was dropped earlier comes back as silence, in its place */
+		while (dev->gap > 0) {
+			size_t n = dev->gap < dev->period_size ? dev->gap : dev->period_size;
+
+			if (ring_write(&dev->ring, dev->silence, n * frame_bytes) == 0)
+				break;
+			dev->gap -= n;
+		}
+
+		/* merge is behind - drop, never wait */
+		if (dev->gap > 0 || ring_write(&dev->ring, dev->period, err * frame_bytes) == 0) {
+			dev->gap += err;
+			atomic_fetch_add_explicit(&dev->dropped, err, memory_order_relaxed);
+		}
+
+		sem_post(&merge_wake);
+	}
+
+	return NULL;
+}
+
+/*
+ * Align on the timestamps of the first period: the stream starts at the
+ * time of the device that started last, earlier devices skip the frames
+ * they captured before that.
+ */
+static void align_devices(void)
+{
+	double latest = 0, start[MAX_DEVICES];
+	unsigned int i;
+
+	for (i = 0; i < nr_devices; i++) {
+		struct device *dev = &devices[i];
+
+		/* time at which hw position 0 was captured */
+		start[i] = dev->start_time - dev->start_pos / (double) hw_rate;
+		if (i == 0 || start[i] > latest)
+			latest = start[i];
+	}
+
+	for (i = 0; i < nr_devices; i++) {
+		struct device *dev = &devices[i];
+
+		/* linked devices start together with the first one */
+		if (devices[0].linked)
+			dev->skip = 0;
+		else if (i > 0 && dev->linked)
+			dev->skip = devices[0].skip;
+		else
+			dev->skip = (unsigned long long) ((latest - start[i]) * hw_rate + 0.5);
+
+		printf("%s: %s, skipping %llu frames\n", dev->name,
+		       dev->linked ? "linked" : "aligned on timestamp", dev->skip);
+	}
+}
+
+/* measured rate of every device and its drift against the first one */
+static void report_drift(void)
+{
+	double rate[MAX_DEVICES];
+	unsigned long long pos;
+	double time;
+	unsigned int i;
+
+	for (i = 0; i < nr_devices; i++) {
+		struct device *dev = &devices[i];
+
+		get_position(dev, &pos, &time);
+		rate[i] = time > dev->start_time ?
+		          (pos - dev->start_pos) / (time - dev->start_time) : hw_rate;
+
+		printf("%s: %.3f Hz (%+.1f ppm vs %s), dropped %lu, %lu xruns\n",
+		       dev->name, rate[i], (rate[i] / rate[0] - 1) * 1e6,
+		       devices[0].name, atomic_load(&dev->dropped), atomic_load(&dev->xruns));
+	}
+}
+
+static void *merge_thread(void *arg)
+{
+	size_t frame_bytes = hw_channels * sizeof(short int);
+	unsigned int out_channels = hw_channels * nr_devices;
+	unsigned long long merged = 0, next_report = 10ULL * hw_rate;
+	short int *out;
+	unsigned int i, c;
+	snd_pcm_uframes_t f;
+	int aligned = 0;
+
+	out = bufpool_alloc(hw_period_size * out_channels * sizeof(short int));
+	if (out == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (!atomic_load(&stop)) {
+		sem_wait(&merge_wake);
+
+		/* wait for the first period of every device */
+		if (!aligned) {
+			for (i = 0; i < nr_devices; i++)
+				if (!atomic_load_explicit(&devices[i].started, memory_order_acquire))
+					break;
+			if (i < nr_devices)
+				continue;
+
+			align_devices();
+			aligned = 1;
+		}
+
+		while (1) {
+			/* drop the frames before the common start */
+			for (i = 0; i < nr_devices; i++) {
+				struct device *dev = &devices[i];
+
+				while (dev->skip > 0) {
+					size_t n = dev->skip < hw_period_size ? dev->skip : hw_period_size;
+
+					n = ring_read(&dev->ring, dev->chunk, n * frame_bytes) / frame_bytes;
+					if (n == 0)
+						break;
+					dev->skip -= n;
+				}
+			}
+
+			/* a full period of every device? */
+			for (i = 0; i < nr_devices; i++)
+				if (devices[i].skip > 0 ||
+				    ring_used(&devices[i].ring) < hw_period_size * frame_bytes)
+					break;
+			if (i < nr_devices)
+				break;
+
+			for (i = 0; i < nr_devices; i++)
+				ring_read(&devices[i].ring, devices[i].chunk,
+				          hw_period_size * frame_bytes);
+
+			/* interleave: all channels of device 0, then device 1, ... */
+			for (f = 0; f < hw_period_size; f++)
+				for (i = 0; i < nr_devices; i++)
+					for (c = 0; c < hw_channels; c++)
+						out[f * out_channels + i * hw_channels + c] =
+							devices[i].chunk[f * hw_channels + c];
+
+			if (write(fd, out, hw_period_size * out_channels * sizeof(short int)) < 0) {
+				printf("Write error: %s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			merged += hw_period_size;
+			if (merged >= next_report) {
+				report_drift();
+				next_report += 10ULL * hw_rate;
+			}
+		}
+	}
+
+	bufpool_free(out);
+	return NULL;
+}
+
+static void stop_capture(int sig)
+{
+	atomic_store(&stop, 1);
+	sem_post(&merge_wake);
+}
+
+int main(int argc, char *argv[])
+{
+	int err = 0;
+	struct pcm_config cfg;
+	pthread_t merge;
+	unsigned int i;
+	int opt;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "c:o:H:")) != -1) {
+		switch (opt) {
+		case 'c':
+			hw_channels = atoi(optarg);
+			break;
+		case 'o':
+			filename = optarg;
+			break;
+		case 'H':
+			pool_size = atoi(optarg);
+			break;
+		default:
+			printf("Usage: %s [-c channels] [-o file] [-H pool_mb] device...\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc || argc - optind > MAX_DEVICES) {
+		printf("Usage: %s [-c channels] [-o file] [-H pool_mb] device...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	/* period and ring memory from one locked arena */
+	if (pool_size) {
+		err = bufpool_init((size_t) pool_size << 20);
+		if (err < 0)
+			printf("Buffer pool: %s, using malloc\n", strerror(-err));
+	}
+
+	/* attach snd output to stdio - debug purposes */
+	err = snd_output_stdio_attach(&output, stdout, 0);
+	if (err < 0) {
+		printf("Output failed: %s\n", snd_strerror(err));
+		return 0;
+	}
+
+	for (i = 0; optind < argc; i++, optind++) {
+		struct device *dev = &devices[i];
+
+		dev->name = argv[optind];
+
+		/* open devicehandle - linking and hw timestamps need alsa */
+		err = pcm_open(&dev->pcm, dev->name, SND_PCM_STREAM_CAPTURE);
+		if (err < 0 || dev->pcm->handle == NULL) {
+			printf("Capture open error on %s: %s\n", dev->name,
+			       err < 0 ? snd_strerror(err) : "not an alsa device");
+			exit(EXIT_FAILURE);
+		}
+		dev->handle = dev->pcm->handle;
+
+		/* every device uses the same settings, timestamps for alignment and drift */
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.rate = hw_rate;
+		cfg.channels = hw_channels;
+		cfg.buffer_time = hw_buffer_time;
+		cfg.period_time = hw_period_time;
+		cfg.tstamp = 1;
+		err = pcm_configure(dev->pcm, &cfg);
+		if (err < 0) {
+			printf("Setting of params failed: %s\n", snd_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+		dev->buffer_size = cfg.buffer_size;
+		dev->period_size = cfg.period_size;
+
+		/* one merged stream: periods of different sizes don't interleave */
+		if (i > 0 && (dev->period_size != devices[0].period_size ||
+		              dev->buffer_size != devices[0].buffer_size)) {
+			printf("%s: period %lu, buffer %lu frames - %s has %lu, %lu\n",
+			       dev->name, dev->period_size, dev->buffer_size, devices[0].name,
+			       devices[0].period_size, devices[0].buffer_size);
+			exit(EXIT_FAILURE);
+		}
+		hw_buffer_size = dev->buffer_size;
+		hw_period_size = dev->period_size;
+
+		/* print configuration */
+		snd_pcm_dump(dev->handle, output);
+
+		/* a period for reading, one for merging, silence for drops, ring for a second */
+		dev->period = bufpool_alloc(dev->period_size * hw_channels * sizeof(short int));
+		dev->chunk = bufpool_alloc(dev->period_size * hw_channels * sizeof(short int));
+		dev->silence = bufpool_alloc(dev->period_size * hw_channels * sizeof(short int));
+		if (dev->period == NULL || dev->chunk == NULL || dev->silence == NULL ||
+		    ring_init(&dev->ring, hw_rate * hw_channels * sizeof(short int)) < 0) {
+			printf("No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(dev->silence, 0, dev->period_size * hw_channels * sizeof(short int));
+
+		/* link to the first device so they start together */
+		if (i > 0) {
+			err = snd_pcm_link(devices[0].handle, dev->handle);
+			if (err < 0)
+				printf("Unable to link %s: %s\n", dev->name, snd_strerror(err));
+			else
+				dev->linked = 1;
+		}
+	}
+	nr_devices = i;
+
+	/* the first device is the reference */
+	devices[0].linked = 1;
+	for (i = 1; i < nr_devices; i++)
+		if (!devices[i].linked)
+			devices[0].linked = 0;
+
+	printf("hw_buffer_size: %lu\n", hw_buffer_size);
+	printf("hw_period_size: %lu\n", hw_period_size);
+	printf("output: %u channels\n", hw_channels * nr_devices);
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Could not open: %s\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	sem_init(&merge_wake, 0, 0);
+	signal(SIGINT, stop_capture);
+
+	/* start capture - the first device starts all linked ones */
+	for (i = 0; i < nr_devices; i++) {
+		if (i > 0 && devices[i].linked)
+			continue;
+
+		if ((err = snd_pcm_start(devices[i].handle)) < 0) {
+			printf("Go error on %s: %s\n", devices[i].name, snd_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < nr_devices; i++)
+		pthread_create(&devices[i].thread, NULL, capture_thread, &devices[i]);
+	pthread_create(&merge, NULL, merge_thread, NULL);
+
+	pthread_join(merge, NULL);
+	for (i = 0; i < nr_devices; i++)
+		pthread_join(devices[i].thread, NULL);
+
+	report_drift();
+	bufpool_print_stats();
+	close(fd);
+
+	for (i = 0; i < nr_devices; i++) {
+		if (i > 0 && devices[i].linked)
+			snd_pcm_unlink(devices[i].handle);
+
+		/* close devicehandle */
+		pcm_close(devices[i].pcm);
+		ring_free(&devices[i].ring);
+		bufpool_free(devices[i].period);
+		bufpool_free(devices[i].chunk);
+		bufpool_free(devices[i].silence);
+	}
+
+	return 0;
+}
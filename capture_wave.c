@@ -1,19 +1,31 @@
 
+/*
+ * Capture to a raw wave file
+ *
+ * build: gcc -O2 capture_wave.c analyzer.c fft.c ring.c trace.c pcm.c alc.c encoder.c aec.c bufpool.c uring.c -o capture_wave -lasound -lm -lpthread -lrt
+ */
+
 #include "alsa/asoundlib.h"
 
+#include "analyzer.h"
+#include "trace.h"
+#include "pcm.h"
+#include "encoder.h"
+#include "aec.h"
+#include "bufpool.h"
+#include "uring.h"
+
 /* debugging */
 static snd_output_t *output = NULL;
 
-/* capture device */
+/* capture device - "sim[:options]" for the simulated device */
 static char *device = "hw:1,0";
 
+/* stop after this many frames - 0 = never */
+unsigned long long max_frames = 0;
+
 
-/* can alsa resample? */
-int hw_resample = 1;
-/* memory format */
-snd_pcm_access_t hw_access = SND_PCM_ACCESS_RW_INTERLEAVED;
-/* sample format */
-snd_pcm_format_t hw_format = SND_PCM_FORMAT_S16_LE;
+/* S16_LE interleaved, see pcm_configure() */
 /* number of channels */
 unsigned int hw_channels = 2;
 /* preferred rate - this could differ from the actual rate! */
@@ -28,142 +40,76 @@ unsigned int hw_period_time = 2000;
 snd_pcm_uframes_t hw_period_size;
 
 
-/* audio samples */
-short int*  buffer = NULL;
-unsigned int buffer_size;
+/* spectrum analyzer on the captured periods */
+int use_analyzer = 0;
+struct analyzer analyzer;
+/* analyzer fft size, hop size in frames and number of bands */
+unsigned int analyzer_fft_size = 2048;
+unsigned int analyzer_hop = 1024;
+unsigned int analyzer_bands = 10;
 
-/* file info */
-int fd;
-const char* filename = "the_guild.wav";
 
-/* set hw parameters */
-static int set_hwparams(snd_pcm_t *handle,
-                        snd_pcm_hw_params_t *params)
-{
-	int err;
-	unsigned int rrate; /* set_rate_near */
-	int dir; /* set_buffer_time_near */
+/* lossless coded output instead of raw - NULL when disabled */
+const char *encoder_file = NULL;
+struct encoder encoder;
+/* encoder worker threads and frames per coded block */
+unsigned int encoder_workers = 2;
+unsigned int encoder_block = 4096;
 
-	/* preset parameters with all possible ranges */
-	err = snd_pcm_hw_params_any(handle, params);
-	if (err < 0) {
-		printf("No configurations available: %s\n", snd_strerror(err));
-		return err;
-	}
 
-	/* enable/disable hardware resampling */
-	err = snd_pcm_hw_params_set_rate_resample(handle, params, hw_resample);
-	if (err < 0) {
-		printf("Setting resampling failed: %s\n", snd_strerror(err));
-		return err;
-	}
+/* echo reference published by play_wave -E - NULL when disabled */
+const char *aec_ref_name = NULL;
+struct aec_ref aec_ref;
+struct aec aec;
+/* echo tail in ms, frames per block */
+unsigned int aec_tail_time = 16;
+unsigned int aec_block = 128;
+/* reference for one period */
+short int *aec_ref_buffer = NULL;
 
-	/* set the read/write format interleaved/non-interleaved */
-	err = snd_pcm_hw_params_set_access(handle, params, hw_access);
-	if (err < 0) {
-		printf("Setting access failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the sample format */
-	err = snd_pcm_hw_params_set_format(handle, params, hw_format);
-	if (err < 0) {
-		printf("Setting sample format failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the count of channels */
-	err = snd_pcm_hw_params_set_channels(handle, params, hw_channels);
-	if (err < 0) {
-		printf("Setting channels failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the stream rate */
-	rrate = hw_rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
-	if (err < 0) {
-		printf("Setting rate near failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	if (rrate != hw_rate) {
-		printf("Requested rate mismatch (%i <-> %i)\n", hw_rate, rrate);
-		return -EINVAL;
-	}
-
-	/* set/get a ring buffer close to buffer_timetime */
-	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &hw_buffer_time, &dir);
-	if (err < 0) {
-		printf("Set buffer time hear failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* request the hw buffer size */
-	err = snd_pcm_hw_params_get_buffer_size(params, &hw_buffer_size);
-	if (err < 0) {
-		printf("Unable to get buffer size: %s\n", snd_strerror(err));
-		return err;
-	}
 
-	/* set/get period time close to requested time */
-	err = snd_pcm_hw_params_set_period_time_near(handle, params, &hw_period_time, &dir);
-	if (err < 0) {
-		printf("Set period_time_near failed: %s\n", snd_strerror(err));
-		return err;
-	}
+/* arena for the period and ring memory in MB - 0 = malloc */
+unsigned int pool_size = 16;
 
-	/* request period size in bytes */
-	err = snd_pcm_hw_params_get_period_size(params, &hw_period_size, &dir);
-	if (err < 0) {
-		printf("Unable to get period size: %s\n", snd_strerror(err));
-		return err;
-	}
+/* dump the hot path trace here on overrun - NULL when disabled */
+const char *trace_file = NULL;
 
-	/* write the currently selected parameters to device */
-	err = snd_pcm_hw_params(handle, params);
-	if (err < 0) {
-		printf("Unable to set hw params: %s\n", snd_strerror(err));
-		return err;
-	}
 
-	return 0;
-}
+/* audio samples */
+short int*  buffer = NULL;
+unsigned int buffer_size;
 
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *params)
+/* file info */
+int fd;
+const char* filename = "the_guild.wav";
+/* write behind through io_uring, write() when the kernel has none */
+int use_uring = 0;
+/* the write behind - NULL when writing directly */
+struct uring *uring = NULL;
+/* periods lost because every slot was still in flight */
+unsigned long dropped_periods = 0;
+
+/* open the file with its write behind, before the audio thread runs */
+static void open_uring(void)
 {
 	int err;
-	snd_pcm_uframes_t threshold = (hw_buffer_size / hw_period_size) * hw_period_size;
 
-	/* request the current swparams */
-	err = snd_pcm_sw_params_current(handle, params);
-	if (err < 0) {
-		printf("Unable to get current swparams: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set transfer threshold - when to start? */
-	err = snd_pcm_sw_params_set_start_threshold(handle, params, threshold);
-	if (err < 0) {
-		printf("Setting start threshold failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* allow the transfer when at least period_size samples can be processed */
-	err = snd_pcm_sw_params_set_avail_min(handle, params, hw_period_size);
-	if (err < 0) {
-		printf("Unable to set avail min for capture: %s\n", snd_strerror(err));
-		return err;
+	printf("Trying to open file: %s\n", filename);
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Could not open: %s\n", filename);
+		exit(EXIT_FAILURE);
 	}
 
-	/* write the parameters to the capture device */
-	err = snd_pcm_sw_params(handle, params);
+	/* batched writes off the audio thread */
+	uring = malloc(sizeof(*uring));
+	err = uring ? uring_open(uring, fd, 1, 0, URING_SLOT_SIZE, URING_NR_SLOTS)
+	            : -ENOMEM;
 	if (err < 0) {
-		printf("Unable to set sw params for capture: %s\n", snd_strerror(err));
-		return err;
+		printf("io_uring: %s, using write()\n", strerror(-err));
+		free(uring);
+		uring = NULL;
 	}
-
-	return 0;
 }
 
 static void store_buffer(short int *buffer, int count)
@@ -177,11 +123,25 @@ static void store_buffer(short int *buffer, int count)
 		}
 
 		/* TODO: store header */
-
 	}
 
 	/* store data */
 	unsigned int size_to_store = hw_channels * count * 2;
+
+	/* every slot still in flight: the disk is behind, the period is lost */
+	if (uring) {
+		int err = uring_write(uring, buffer, size_to_store);
+
+		if (err == -EAGAIN) {
+			dropped_periods++;
+		} else if (err < 0) {
+			/* sticky: every later period would fail the same way */
+			printf("Write failed: %s\n", strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+
 	unsigned int size_stored = write(fd, (unsigned char*) buffer,
 	                                 size_to_store);
 
@@ -189,14 +149,42 @@ static void store_buffer(short int *buffer, int count)
 	/* note: file isn't closed */
 }
 
-static int read_loop(snd_pcm_t *handle,
+/* overrun: record it, dump the trace and restart */
+static void recover_overrun(struct pcm *pcm)
+{
+	int err;
+
+	trace(TRACE_XRUN, 0);
+	if (trace_file) {
+		err = trace_dump(trace_file);
+		if (err < 0)
+			printf("Trace dump failed: %s\n", strerror(-err));
+		else
+			printf("Overrun, trace written to %s\n", trace_file);
+	}
+
+	err = pcm_prepare(pcm);
+	if (err < 0) {
+		printf("Prepare error: %s\n", snd_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+
+	err = pcm_start(pcm);
+	if (err < 0) {
+		printf("Go error: %s\n", snd_strerror(err));
+		exit(EXIT_FAILURE);
+	}
+}
+
+static int read_loop(struct pcm *pcm,
                      short int *buffer)
 {
 	int err;
 	short int *ptr;
 	int ptr_size;
+	unsigned long long total = 0;
 
-	while (1) {
+	while (max_frames == 0 || total < max_frames) {
 
 		/* pointer to buffer */
 		ptr = buffer;
@@ -204,33 +192,119 @@ static int read_loop(snd_pcm_t *handle,
 		/* copy of size */
 		ptr_size = hw_period_size;
 
-		/* write to module */
-		err = snd_pcm_readi(handle, ptr, ptr_size);
-
-		printf("size: %u\n", err);
+		/* read from module */
+		trace(TRACE_READI_ENTER, ptr_size);
+		err = pcm_readi(pcm, ptr, ptr_size);
+		trace(TRACE_READI_EXIT, err);
 
 		/* EAGAIN failure? -> retry */
 		if (err == -EAGAIN)
 			continue;
 
+		/* overrun -> record, restart */
+		if (err == -EPIPE) {
+			recover_overrun(pcm);
+			continue;
+		}
+
 		/* everything else -> stop */
 		if (err < 0) {
 			printf("Read error: %s\n", snd_strerror(err));
 			exit(EXIT_FAILURE);
 		}
 
-		/* store audio samples */
-		store_buffer(buffer, err);
+		/* remove the echo of our own playback */
+		if (aec_ref_name) {
+			aec_ref_read(&aec_ref, pcm, aec_ref_buffer, err);
+			aec_process(&aec, buffer, aec_ref_buffer, err);
+		}
+
+		/* store audio samples - the encoder never blocks */
+		trace(TRACE_STORE_BEGIN, err);
+		if (encoder_file)
+			encoder_push(&encoder, buffer, err);
+		else
+			store_buffer(buffer, err);
+		trace(TRACE_STORE_END, err);
+
+		/* hand over to the analyzer - never blocks */
+		if (use_analyzer)
+			analyzer_push(&analyzer, buffer, err);
 
+		total += err;
 	}
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	int err = 0;
+	struct pcm *pcm = NULL;
 	snd_pcm_t *handle = NULL;
-	snd_pcm_hw_params_t *hw_params = NULL;
-	snd_pcm_sw_params_t *sw_params = NULL;
+	struct pcm_config cfg;
+	int opt;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "af:o:b:x:D:n:z:w:B:E:L:H:U")) != -1) {
+		switch (opt) {
+		case 'a':
+			use_analyzer = 1;
+			break;
+		case 'f':
+			analyzer_fft_size = atoi(optarg);
+			break;
+		case 'o':
+			analyzer_hop = atoi(optarg);
+			break;
+		case 'b':
+			analyzer_bands = atoi(optarg);
+			break;
+		case 'x':
+			trace_file = optarg;
+			break;
+		case 'D':
+			device = optarg;
+			break;
+		case 'n':
+			max_frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'z':
+			encoder_file = optarg;
+			break;
+		case 'w':
+			encoder_workers = atoi(optarg);
+			break;
+		case 'B':
+			encoder_block = atoi(optarg);
+			break;
+		case 'E':
+			aec_ref_name = optarg;
+			break;
+		case 'L':
+			aec_tail_time = atoi(optarg);
+			break;
+		case 'H':
+			pool_size = atoi(optarg);
+			break;
+		case 'U':
+			use_uring = 1;
+			break;
+		default:
+			printf("Usage: %s [-a] [-f fft_size] [-o hop] [-b bands] [-x trace_file]\n"
+			       "       [-D device] [-n frames] [-z file] [-w workers] [-B block_frames]\n"
+			       "       [-E echo_reference] [-L tail_ms] [-H pool_mb] [-U]\n",
+			       argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* period and ring memory from one locked arena */
+	if (pool_size) {
+		err = bufpool_init((size_t) pool_size << 20);
+		if (err < 0)
+			printf("Buffer pool: %s, using malloc\n", strerror(-err));
+	}
 
 	/* attach snd output to stdio - debug purposes */
 	err = snd_output_stdio_attach(&output, stdout, 0);
@@ -239,23 +313,31 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	/* allocate memory for hw/sw parameters */
-	snd_pcm_hw_params_alloca(&hw_params);
-	snd_pcm_sw_params_alloca(&sw_params);
-
 	/* open devicehandle */
-	err = snd_pcm_open(&handle, device, SND_PCM_STREAM_CAPTURE, 0);
+	err = pcm_open(&pcm, device, SND_PCM_STREAM_CAPTURE);
 	if (err < 0) {
 		printf("Capture open error: %s\n", snd_strerror(err));
 		return 0;
 	}
-
-	/* set hw parameters */
-	err = set_hwparams(handle, hw_params);
+	handle = pcm->handle;
+
+	/* set hw and sw parameters */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.rate = hw_rate;
+	cfg.channels = hw_channels;
+	cfg.buffer_time = hw_buffer_time;
+	cfg.period_time = hw_period_time;
+	/* timestamps to line up with the echo reference */
+	cfg.tstamp = aec_ref_name != NULL;
+	err = pcm_configure(pcm, &cfg);
 	if (err < 0) {
-		printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+		printf("Setting of params failed: %s\n", snd_strerror(err));
 		exit(EXIT_FAILURE);
 	}
+	hw_buffer_time = cfg.buffer_time;
+	hw_buffer_size = cfg.buffer_size;
+	hw_period_time = cfg.period_time;
+	hw_period_size = cfg.period_size;
 
 	printf("hw_buffer_time: %u\n", hw_buffer_time);
 	printf("hw_buffer_size: %lu\n", hw_buffer_size);
@@ -263,44 +345,118 @@ int main(int argc, char *argv[])
 	printf("hw_period_time: %u\n", hw_period_time);
 	printf("hw_period_size: %lu\n", hw_period_size);
 
-	printf("phys width: %u\n",  snd_pcm_format_physical_width(hw_format));
-
-	/* set sw parameters */
-	err = set_swparams(handle, sw_params);
-	if (err < 0) {
-		printf("Setting of swparams failed: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
-	}
 
 	/* print configuration */
-	snd_pcm_dump(handle, output);
+	if (handle)
+		snd_pcm_dump(handle, output);
 
-	/* buffersize: allocate enough for 2 times a period */
-	buffer_size = (hw_period_size * hw_channels *
-	               snd_pcm_format_physical_width(hw_format)) / 8;
+	/* buffersize: one period */
+	buffer_size = hw_period_size * hw_channels * sizeof(short int);
 
 	/* allocate memory for audio samples */
-	buffer = malloc(buffer_size);
+	buffer = bufpool_alloc(buffer_size);
 	if (buffer == NULL) {
 		printf("No enough memory\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* the write behind is set up here, not on the first period */
+	if (use_uring && !encoder_file)
+		open_uring();
+
+	/* analyzer thread, reports once a second */
+	if (use_analyzer) {
+		analyzer.report = 1;
+		err = analyzer_start(&analyzer, hw_channels, hw_rate,
+		                     analyzer_fft_size, analyzer_hop, analyzer_bands);
+		if (err < 0) {
+			printf("Analyzer start failed: %s\n", snd_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* lossless coding off the audio thread */
+	if (encoder_file) {
+		err = encoder_start(&encoder, encoder_file, hw_channels, hw_rate,
+		                    encoder_block, encoder_workers);
+		if (err < 0) {
+			printf("Encoder start failed: %s\n", strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* echo canceller on the capture, reference from play_wave */
+	if (aec_ref_name) {
+		err = aec_ref_open(&aec_ref, aec_ref_name, hw_rate);
+		if (err < 0) {
+			printf("Echo reference %s: %s\n", aec_ref_name, strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+
+		err = aec_create(&aec, hw_channels, hw_rate, aec_block,
+		                 hw_rate * aec_tail_time / 1000);
+		aec_ref_buffer = bufpool_alloc(hw_period_size * sizeof(short int));
+		if (err < 0 || aec_ref_buffer == NULL) {
+			printf("Echo canceller setup failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* trace the audio thread */
+	if (trace_file) {
+		err = trace_thread_init("read_loop", 65536);
+		if (err < 0) {
+			printf("Trace setup failed: %s\n", strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* start capture */
-	if ((err = snd_pcm_start(handle)) < 0) {
+	if ((err = pcm_start(pcm)) < 0) {
 		printf("Go error: %s\n", snd_strerror(err));
 		exit(0);
 	}
 
 	/* read audio */
-	read_loop(handle, buffer);
+	err = read_loop(pcm, buffer);
 	if (err < 0)
 		printf("Transfer failed: %s\n", snd_strerror(err));
 
-	free(buffer);
+	pcm_print_stats(pcm);
+
+	if (use_analyzer)
+		analyzer_stop(&analyzer);
+
+	if (encoder_file) {
+		err = encoder_stop(&encoder);
+		if (err < 0)
+			printf("Encoder failed: %s\n", strerror(-err));
+		encoder_print_stats(&encoder);
+	}
+
+	if (aec_ref_name) {
+		aec_ref_print_stats(&aec_ref);
+		aec_print_stats(&aec);
+		aec_ref_close(&aec_ref, aec_ref_name);
+		aec_destroy(&aec);
+		bufpool_free(aec_ref_buffer);
+	}
+
+	if (uring) {
+		uring_print_stats(uring);
+		if (dropped_periods)
+			printf("Dropped %lu periods: the disk was behind\n", dropped_periods);
+		err = uring_close(uring);
+		if (err < 0)
+			printf("Write failed: %s\n", strerror(-err));
+		free(uring);
+	}
+
+	bufpool_free(buffer);
+	bufpool_print_stats();
 
 	/* close devicehandle */
-	snd_pcm_close(handle);
+	pcm_close(pcm);
 
 	return 0;
 }
@@ -0,0 +1,470 @@
+/*
+ * Decode-ahead thread for alc coded files
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "decoder.h"
+
+/* frames per ring entry */
+#define DECODER_CHUNK_FRAMES 1024
+
+/* precedes the frames of every ring entry */
+struct chunk_header {
+	uint32_t gen;
+	uint32_t frames;
+};
+
+/* chunk without frames after the last one */
+#define DECODER_END_MARKER 0xffffffffu
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int read_at(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t n = pread(fd, buf, len, offset);
+
+	if (n < 0)
+		return -errno;
+
+	return (size_t) n == len ? 0 : -EIO;
+}
+
+/* the table written by the encoder, if it is there and sane */
+static int load_seek_table(struct decoder *d, uint64_t size)
+{
+	struct alc_footer footer;
+	unsigned long i;
+	int err;
+
+	if (size < sizeof(d->header) + sizeof(footer))
+		return -ENOENT;
+
+	err = read_at(d->fd, &footer, sizeof(footer), size - sizeof(footer));
+	if (err < 0)
+		return err;
+
+	if (footer.magic != ALC_SEEK_MAGIC || footer.nr_entries == 0 ||
+	    footer.table_offset + (uint64_t) footer.nr_entries * sizeof(struct alc_seek) +
+	    sizeof(footer) != size)
+		return -ENOENT;
+
+	d->seek = malloc(footer.nr_entries * sizeof(*d->seek));
+	if (d->seek == NULL)
+		return -ENOMEM;
+
+	err = read_at(d->fd, d->seek, footer.nr_entries * sizeof(*d->seek),
+	              footer.table_offset);
+	if (err < 0)
+		goto invalid;
+
+	for (i = 0; i < footer.nr_entries; i++) {
+		if (d->seek[i].offset < sizeof(d->header) ||
+		    d->seek[i].offset >= footer.table_offset)
+			goto invalid;
+		if (i > 0 && (d->seek[i].offset <= d->seek[i - 1].offset ||
+		              d->seek[i].first_frame <= d->seek[i - 1].first_frame))
+			goto invalid;
+	}
+
+	d->nr_seek = footer.nr_entries;
+	return 0;
+
+invalid:
+	free(d->seek);
+	d->seek = NULL;
+	return -ENOENT;
+}
+
+/* no table: walk the block headers */
+static int scan_blocks(struct decoder *d, uint64_t size)
+{
+	struct alc_block_header h;
+	unsigned long max = 0;
+	uint64_t pos = sizeof(d->header);
+
+	while (pos + sizeof(h) <= size) {
+		if (read_at(d->fd, &h, sizeof(h), pos) < 0 ||
+		    h.sync != ALC_SYNC || pos + sizeof(h) + h.size > size)
+			break;
+
+		if (d->nr_seek == max) {
+			struct alc_seek *seek;
+
+			max = max ? 2 * max : 1024;
+			seek = realloc(d->seek, max * sizeof(*seek));
+			if (seek == NULL)
+				return -ENOMEM;
+			d->seek = seek;
+		}
+
+		d->seek[d->nr_seek].first_frame = h.first_frame;
+		d->seek[d->nr_seek].offset = pos;
+		d->nr_seek++;
+
+		pos += sizeof(h) + h.size;
+	}
+
+	printf("decoder: no seek table, found %lu blocks\n", d->nr_seek);
+
+	return d->nr_seek ? 0 : -EINVAL;
+}
+
+/*
+ * Blocks start at frame 0 and hold at most header.block_frames: d->pcm
+ * is that big. The crc only covers the payloads, so check the starts.
+ */
+static int check_blocks(struct decoder *d)
+{
+	unsigned long i;
+
+	if (d->seek[0].first_frame != 0)
+		return -EINVAL;
+
+	for (i = 1; i < d->nr_seek; i++)
+		if (d->seek[i].first_frame <= d->seek[i - 1].first_frame ||
+		    d->seek[i].first_frame - d->seek[i - 1].first_frame > d->header.block_frames)
+			return -EINVAL;
+
+	return 0;
+}
+
+/* frames in block 'i' */
+static unsigned int block_frames(struct decoder *d, unsigned long i)
+{
+	uint64_t end = i + 1 < d->nr_seek ? d->seek[i + 1].first_frame : d->frames;
+
+	return end - d->seek[i].first_frame;
+}
+
+/* the block holding 'frame' */
+static unsigned long find_block(struct decoder *d, uint64_t frame)
+{
+	unsigned long lo = 0, hi = d->nr_seek;
+
+	while (hi - lo > 1) {
+		unsigned long mid = lo + (hi - lo) / 2;
+
+		if (d->seek[mid].first_frame <= frame)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* read and decode block 'i' into d->pcm - silence when it is damaged */
+static void load_block(struct decoder *d, unsigned long i)
+{
+	struct alc_block_header *h = (struct alc_block_header *) d->block;
+	unsigned int frames = block_frames(d, i);
+	size_t bound = alc_block_bound(d->header.channels, d->header.block_frames);
+	double start = now();
+
+	d->blocks++;
+
+	if (read_at(d->fd, h, sizeof(*h), d->seek[i].offset) < 0 ||
+	    h->sync != ALC_SYNC || h->size > bound - sizeof(*h) ||
+	    alc_block_frames(h) > d->header.block_frames || alc_block_frames(h) != frames ||
+	    read_at(d->fd, h + 1, h->size, d->seek[i].offset + sizeof(*h)) < 0 ||
+	    alc_crc32(h + 1, h->size) != h->crc ||
+	    alc_decode_block(&d->coder, h, (unsigned char *) (h + 1), d->pcm) < 0) {
+		printf("decoder: block %lu damaged\n", i);
+		memset(d->pcm, 0, frames * d->header.channels * sizeof(short int));
+		d->bad_blocks++;
+	}
+
+	d->decoded += frames;
+	d->busy_time += now() - start;
+}
+
+static void *decoder_thread(void *arg)
+{
+	struct decoder *d = arg;
+	struct chunk_header *ch = (struct chunk_header *) d->chunk;
+	size_t frame_bytes = d->header.channels * sizeof(short int);
+	unsigned int gen = 0, pos = 0, frames = 0;
+	unsigned long block = 0;
+	int started = 0, at_end = 0;
+
+	while (atomic_load(&d->running)) {
+		uint64_t target = 0;
+		int seek = 0;
+		unsigned int n;
+		size_t bytes;
+
+		pthread_mutex_lock(&d->lock);
+		if (!started || d->request_gen != gen) {
+			gen = d->request_gen;
+			target = d->request_frame;
+			seek = 1;
+			started = 1;
+		}
+		pthread_mutex_unlock(&d->lock);
+
+		/* frame accurate: decode the block, skip up to the frame */
+		if (seek) {
+			if (target > d->frames)
+				target = d->frames;
+			block = find_block(d, target);
+			load_block(d, block);
+			frames = block_frames(d, block);
+			pos = target - d->seek[block].first_frame;
+			if (pos > frames)
+				pos = frames;
+			at_end = 0;
+		}
+
+		if (pos == frames) {
+			if (block + 1 < d->nr_seek) {
+				load_block(d, ++block);
+				frames = block_frames(d, block);
+				pos = 0;
+				continue;
+			}
+
+			/* the reader has to know the silence is not an underrun */
+			if (!at_end && ring_space(&d->ring) >= sizeof(*ch)) {
+				ch->gen = gen;
+				ch->frames = DECODER_END_MARKER;
+				ring_write(&d->ring, ch, sizeof(*ch));
+				atomic_store(&d->end_gen, gen);
+				at_end = 1;
+				continue;
+			}
+			sem_wait(&d->wake);
+			continue;
+		}
+
+		n = frames - pos < DECODER_CHUNK_FRAMES ? frames - pos : DECODER_CHUNK_FRAMES;
+		bytes = sizeof(*ch) + n * frame_bytes;
+		if (ring_space(&d->ring) < bytes) {
+			sem_wait(&d->wake);
+			continue;
+		}
+
+		ch->gen = gen;
+		ch->frames = n;
+		memcpy(ch + 1, d->pcm + pos * d->header.channels, n * frame_bytes);
+		ring_write(&d->ring, ch, bytes);
+		pos += n;
+	}
+
+	return NULL;
+}
+
+int decoder_open(struct decoder *d, const char *filename, unsigned int ahead)
+{
+	struct alc_block_header last;
+	size_t frame_bytes;
+	struct stat st;
+	int err;
+
+	memset(d, 0, sizeof(*d));
+
+	d->fd = open(filename, O_RDONLY);
+	if (d->fd < 0)
+		return -errno;
+
+	if (fstat(d->fd, &st) < 0 ||
+	    read_at(d->fd, &d->header, sizeof(d->header), 0) < 0 ||
+	    d->header.magic != ALC_MAGIC || d->header.version != ALC_VERSION ||
+	    d->header.channels == 0 || d->header.channels > ALC_MAX_CHANNELS ||
+	    d->header.block_frames == 0 || d->header.rate == 0) {
+		close(d->fd);
+		return -EINVAL;
+	}
+
+	err = load_seek_table(d, st.st_size);
+	if (err == -ENOENT)
+		err = scan_blocks(d, st.st_size);
+	if (err == 0)
+		err = check_blocks(d);
+	if (err < 0)
+		goto fail;
+
+	/* length: the end of the last block */
+	err = read_at(d->fd, &last, sizeof(last), d->seek[d->nr_seek - 1].offset);
+	if (err == 0 && (last.sync != ALC_SYNC || alc_block_frames(&last) == 0 ||
+	                 alc_block_frames(&last) > d->header.block_frames))
+		err = -EINVAL;
+	if (err < 0)
+		goto fail;
+	d->frames = d->seek[d->nr_seek - 1].first_frame + alc_block_frames(&last);
+
+	err = alc_coder_init(&d->coder, d->header.channels, d->header.block_frames);
+	if (err < 0)
+		goto fail;
+
+	frame_bytes = d->header.channels * sizeof(short int);
+	d->block = malloc(alc_block_bound(d->header.channels, d->header.block_frames));
+	d->pcm = malloc(d->header.block_frames * frame_bytes);
+	d->chunk = malloc(sizeof(struct chunk_header) + DECODER_CHUNK_FRAMES * frame_bytes);
+	if (d->block == NULL || d->pcm == NULL || d->chunk == NULL) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	if (ahead < DECODER_CHUNK_FRAMES)
+		ahead = DECODER_CHUNK_FRAMES;
+	err = ring_init(&d->ring, ahead * frame_bytes +
+	                (ahead / DECODER_CHUNK_FRAMES + 1) * sizeof(struct chunk_header));
+	if (err < 0)
+		goto fail;
+
+	atomic_init(&d->running, 1);
+	atomic_init(&d->gen, 0);
+	atomic_init(&d->end_gen, UINT_MAX);
+	d->eof_gen = UINT_MAX;
+	atomic_init(&d->underruns, 0);
+	pthread_mutex_init(&d->lock, NULL);
+
+	if (sem_init(&d->wake, 0, 0) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = pthread_create(&d->thread, NULL, decoder_thread, d);
+	if (err) {
+		err = -err;
+		goto fail;
+	}
+
+	return 0;
+
+fail:
+	close(d->fd);
+	free(d->seek);
+	free(d->block);
+	free(d->pcm);
+	free(d->chunk);
+	alc_coder_free(&d->coder);
+	return err;
+}
+
+void decoder_close(struct decoder *d)
+{
+	atomic_store(&d->running, 0);
+	sem_post(&d->wake);
+	pthread_join(d->thread, NULL);
+
+	sem_destroy(&d->wake);
+	pthread_mutex_destroy(&d->lock);
+	ring_free(&d->ring);
+	close(d->fd);
+	free(d->seek);
+	free(d->block);
+	free(d->pcm);
+	free(d->chunk);
+	alc_coder_free(&d->coder);
+}
+
+unsigned int decoder_read(struct decoder *d, short int *buffer,
+                          unsigned int frames)
+{
+	unsigned int channels = d->header.channels;
+	size_t frame_bytes = channels * sizeof(short int);
+	unsigned int gen = atomic_load_explicit(&d->gen, memory_order_acquire);
+	unsigned int done = 0;
+
+	while (done < frames) {
+		short int *ptr = buffer + done * channels;
+		unsigned int n;
+
+		if (d->chunk_left == 0) {
+			struct chunk_header h;
+
+			if (ring_used(&d->ring) < sizeof(h))
+				break;
+
+			/* chunks are written whole, the frames are there too */
+			ring_read(&d->ring, &h, sizeof(h));
+			if (h.frames == DECODER_END_MARKER) {
+				d->eof_gen = h.gen;
+				continue;
+			}
+			d->chunk_gen = h.gen;
+			d->chunk_left = h.frames;
+		}
+
+		n = d->chunk_left < frames - done ? d->chunk_left : frames - done;
+		ring_read(&d->ring, ptr, n * frame_bytes);
+		d->chunk_left -= n;
+
+		/* decoded before the last seek - the space is reused below */
+		if (d->chunk_gen != gen)
+			continue;
+
+		done += n;
+	}
+
+	if (done < frames) {
+		memset(buffer + done * channels, 0, (frames - done) * frame_bytes);
+		if (!decoder_eof(d))
+			atomic_fetch_add_explicit(&d->underruns, 1, memory_order_relaxed);
+	}
+
+	/* room for the decoder */
+	sem_post(&d->wake);
+
+	return done;
+}
+
+int decoder_eof(struct decoder *d)
+{
+	return d->eof_gen == atomic_load_explicit(&d->gen, memory_order_acquire);
+}
+
+void decoder_wait(struct decoder *d)
+{
+	size_t chunk = sizeof(struct chunk_header) +
+	               DECODER_CHUNK_FRAMES * d->header.channels * sizeof(short int);
+	struct timespec ts = { 0, 1000000 };
+
+	while (ring_space(&d->ring) >= chunk &&
+	       atomic_load(&d->end_gen) != atomic_load(&d->gen))
+		nanosleep(&ts, NULL);
+}
+
+int decoder_seek(struct decoder *d, uint64_t frame)
+{
+	if (frame > d->frames)
+		return -EINVAL;
+
+	pthread_mutex_lock(&d->lock);
+	d->request_gen++;
+	d->request_frame = frame;
+	atomic_store_explicit(&d->gen, d->request_gen, memory_order_release);
+	pthread_mutex_unlock(&d->lock);
+
+	sem_post(&d->wake);
+
+	return 0;
+}
+
+void decoder_print_stats(struct decoder *d)
+{
+	double audio = (double) d->decoded / d->header.rate;
+
+	printf("decoder: %lu blocks (%lu damaged), %.1f s decoded in %.3f s "
+	       "(%.0fx real time), %lu underruns\n",
+	       d->blocks, d->bad_blocks, audio, d->busy_time,
+	       d->busy_time > 0 ? audio / d->busy_time : 0.0,
+	       atomic_load(&d->underruns));
+}
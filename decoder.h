@@ -0,0 +1,93 @@
+/*
+ * Decode-ahead thread for alc coded files
+ *
+ * The decoder thread reads and decodes blocks into a lock-free ring of
+ * frames ahead of the audio thread, which takes them with
+ * decoder_read(). That never blocks: when the ring runs dry the rest of
+ * the period is silence and counted as an underrun.
+ *
+ * Seeking goes through the seek table at the end of the file, or a
+ * table rebuilt from the block headers when there is none, and is
+ * frame accurate: the block holding the frame is decoded and the
+ * frames before it are skipped. Frames in the ring carry the seek
+ * generation they were decoded for, so stale ones are dropped by the
+ * reader without stopping the decoder.
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "ring.h"
+#include "alc.h"
+
+struct decoder {
+	/* file */
+	int fd;
+	struct alc_header header;
+	struct alc_seek *seek;
+	unsigned long nr_seek;
+	uint64_t frames;
+
+	/* decoder thread -> audio thread */
+	struct ring ring;
+	sem_t wake;
+	atomic_int running;
+	pthread_t thread;
+
+	/* seek requests - generation and target under the lock */
+	pthread_mutex_t lock;
+	unsigned int request_gen;
+	uint64_t request_frame;
+	/* generation the reader wants, last generation decoded to the end */
+	atomic_uint gen;
+	atomic_uint end_gen;
+
+	/* audio thread only: what is left of the current chunk */
+	unsigned int chunk_gen;
+	unsigned int chunk_left;
+	/* generation whose end marker was read */
+	unsigned int eof_gen;
+
+	/* decoder thread only */
+	struct alc_coder coder;
+	unsigned char *block;
+	short int *pcm;
+	unsigned char *chunk;
+
+	/* statistics */
+	atomic_ulong underruns;
+	unsigned long blocks;
+	unsigned long bad_blocks;
+	uint64_t decoded;
+	double busy_time;
+};
+
+/* 'ahead' is the ring size in frames */
+int decoder_open(struct decoder *d, const char *filename, unsigned int ahead);
+void decoder_close(struct decoder *d);
+
+/*
+ * audio thread - never blocks. Returns the frames copied, the rest of
+ * 'frames' is silence.
+ */
+unsigned int decoder_read(struct decoder *d, short int *buffer,
+                          unsigned int frames);
+
+/* everything up to the end of the file has been read */
+int decoder_eof(struct decoder *d);
+
+/* wait until the ring is full or holds the rest of the file - before starting */
+void decoder_wait(struct decoder *d);
+
+/* any thread */
+int decoder_seek(struct decoder *d, uint64_t frame);
+
+/* decode speed against real time */
+void decoder_print_stats(struct decoder *d);
+
+#endif
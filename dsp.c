@@ -0,0 +1,440 @@
+/*
+ * Small preallocated dsp chain for the write loop
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "dsp.h"
+#include "bufpool.h"
+
+#if defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+/* gain ramp time constant in seconds */
+#define DSP_RAMP_TIME 0.005
+
+/* treat the gain as settled below this difference */
+#define DSP_RAMP_EPSILON 1e-5f
+
+static void *dsp_alloc(size_t size)
+{
+	void *ptr = NULL;
+
+	/* cache line aligned, zeroed */
+	size = (size + 63) & ~(size_t) 63;
+	ptr = bufpool_alloc(size);
+	if (ptr == NULL)
+		return NULL;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+struct dsp_chain *dsp_chain_create(unsigned int channels,
+                                   unsigned int max_frames,
+                                   unsigned int rate)
+{
+	struct dsp_chain *chain;
+
+	chain = dsp_alloc(sizeof(*chain));
+	if (chain == NULL)
+		return NULL;
+
+	chain->channels = channels;
+	chain->groups = (channels + 3) / 4;
+	chain->max_frames = max_frames;
+
+	/* unity gain, no filters */
+	chain->shared.gain = 1.0f;
+	chain->live = chain->shared;
+	chain->gain_cur = 1.0f;
+	chain->ramp_coef = 1.0f - expf(-1.0f / (DSP_RAMP_TIME * rate));
+	atomic_init(&chain->seq, 0);
+
+	chain->ramp = dsp_alloc(max_frames * sizeof(float));
+	chain->state = dsp_alloc(chain->groups * DSP_MAX_BIQUADS * 2 * sizeof(dsp_v4));
+	chain->work = dsp_alloc(chain->groups * max_frames * sizeof(dsp_v4));
+	if (!chain->ramp || !chain->state || !chain->work) {
+		dsp_chain_destroy(chain);
+		return NULL;
+	}
+
+	return chain;
+}
+
+void dsp_chain_destroy(struct dsp_chain *chain)
+{
+	if (chain == NULL)
+		return;
+
+	bufpool_free(chain->ramp);
+	bufpool_free(chain->state);
+	bufpool_free(chain->work);
+	bufpool_free(chain);
+}
+
+int dsp_chain_add_stage(struct dsp_chain *chain, struct dsp_stage *stage)
+{
+	if (chain->nr_stages >= DSP_MAX_STAGES)
+		return -1;
+
+	chain->stage[chain->nr_stages++] = stage;
+	return 0;
+}
+
+/*
+ * control side
+ *
+ * The parameters are protected by a sequence counter: odd while the
+ * control thread is writing. Only one control thread is supported.
+ */
+
+static void params_write_begin(struct dsp_chain *chain)
+{
+	atomic_fetch_add_explicit(&chain->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void params_write_end(struct dsp_chain *chain)
+{
+	atomic_fetch_add_explicit(&chain->seq, 1, memory_order_release);
+}
+
+void dsp_set_gain(struct dsp_chain *chain, float gain_db)
+{
+	params_write_begin(chain);
+	chain->shared.gain = powf(10.0f, gain_db / 20.0f);
+	params_write_end(chain);
+}
+
+void dsp_set_mute(struct dsp_chain *chain, int mute)
+{
+	params_write_begin(chain);
+	chain->shared.mute = mute;
+	params_write_end(chain);
+}
+
+int dsp_set_biquad(struct dsp_chain *chain, unsigned int index,
+                   const struct dsp_biquad *biquad)
+{
+	if (index >= DSP_MAX_BIQUADS)
+		return -1;
+
+	params_write_begin(chain);
+	chain->shared.biquad[index] = *biquad;
+	if (chain->shared.nr_biquads <= index)
+		chain->shared.nr_biquads = index + 1;
+	params_write_end(chain);
+
+	return 0;
+}
+
+void dsp_set_nr_biquads(struct dsp_chain *chain, unsigned int nr)
+{
+	if (nr > DSP_MAX_BIQUADS)
+		nr = DSP_MAX_BIQUADS;
+
+	params_write_begin(chain);
+	chain->shared.nr_biquads = nr;
+	params_write_end(chain);
+}
+
+/*
+ * audio side
+ */
+
+/* pick up new parameters and prepare the gain ramp for 'frames' */
+void dsp_update(struct dsp_chain *chain, unsigned int frames)
+{
+	unsigned int seq = atomic_load_explicit(&chain->seq, memory_order_acquire);
+	float target, gain;
+	unsigned int i;
+
+	/* new, consistent parameters? otherwise try again next period */
+	if (seq != chain->seen_seq && !(seq & 1)) {
+		struct dsp_params params;
+
+		memcpy(&params, &chain->shared, sizeof(params));
+		atomic_thread_fence(memory_order_acquire);
+
+		if (atomic_load_explicit(&chain->seq, memory_order_relaxed) == seq) {
+			unsigned int g;
+
+			/* newly enabled biquads start from silence */
+			for (g = 0; g < chain->groups; g++)
+				for (i = chain->live.nr_biquads; i < params.nr_biquads; i++) {
+					chain->state[(g * DSP_MAX_BIQUADS + i) * 2 + 0] = (dsp_v4) { 0 };
+					chain->state[(g * DSP_MAX_BIQUADS + i) * 2 + 1] = (dsp_v4) { 0 };
+				}
+
+			chain->live = params;
+			chain->seen_seq = seq;
+		}
+	}
+
+	/* de-zippered gain: one pole towards the target */
+	target = chain->live.mute ? 0.0f : chain->live.gain;
+	if (!chain->started) {
+		chain->gain_cur = target;
+		chain->started = 1;
+	}
+	gain = chain->gain_cur;
+
+	if (fabsf(target - gain) < DSP_RAMP_EPSILON) {
+		chain->gain_cur = target;
+		chain->ramp_active = 0;
+		return;
+	}
+
+	if (frames > chain->max_frames)
+		frames = chain->max_frames;
+
+	for (i = 0; i < frames; i++) {
+		gain += (target - gain) * chain->ramp_coef;
+		chain->ramp[i] = gain;
+	}
+
+	chain->gain_cur = gain;
+	chain->ramp_active = 1;
+}
+
+static void biquad_process(dsp_v4 *v, unsigned int frames,
+                           const struct dsp_biquad *b, dsp_v4 *z)
+{
+	dsp_v4 z1 = z[0], z2 = z[1];
+	unsigned int i;
+
+	/* transposed direct form II */
+	for (i = 0; i < frames; i++) {
+		dsp_v4 x = v[i];
+		dsp_v4 y = x * b->b0 + z1;
+
+		z1 = x * b->b1 - y * b->a1 + z2;
+		z2 = x * b->b2 - y * b->a2;
+		v[i] = y;
+	}
+
+	z[0] = z1;
+	z[1] = z2;
+}
+
+/* denormals in the filter state cost more than 10x - flush them to zero */
+static void denormals_off(void)
+{
+#if defined(__SSE__)
+	unsigned int csr = _mm_getcsr();
+
+	/* FTZ | DAZ */
+	if ((csr & 0x8040) != 0x8040)
+		_mm_setcsr(csr | 0x8040);
+#elif defined(__aarch64__)
+	unsigned long fpcr;
+
+	/* FZ */
+	__asm__ volatile("mrs %0, fpcr" : "=r" (fpcr));
+	if (!(fpcr & (1 << 24)))
+		__asm__ volatile("msr fpcr, %0" : : "r" (fpcr | (1 << 24)));
+#endif
+}
+
+static int chain_is_bypass(struct dsp_chain *chain)
+{
+	return !chain->ramp_active && chain->gain_cur == 1.0f &&
+	       chain->live.nr_biquads == 0 && chain->nr_stages == 0;
+}
+
+/* process channel groups [first, last) of an interleaved period in place */
+void dsp_process_groups(struct dsp_chain *chain, short int *buffer,
+                        unsigned int frames,
+                        unsigned int first, unsigned int last)
+{
+	unsigned int channels = chain->channels;
+	unsigned int g, i, j;
+
+	if (frames > chain->max_frames)
+		frames = chain->max_frames;
+
+	if (chain_is_bypass(chain))
+		return;
+
+	denormals_off();
+
+	for (g = first; g < last; g++) {
+		dsp_v4 *v = chain->work + g * chain->max_frames;
+		dsp_v4 *z = chain->state + g * DSP_MAX_BIQUADS * 2;
+		unsigned int base = g * 4;
+		unsigned int n = channels - base < 4 ? channels - base : 4;
+		short int *p;
+
+		/* deinterleave 4 channels into vectors */
+		p = buffer + base;
+		for (i = 0; i < frames; i++, p += channels) {
+			dsp_v4 x = { 0 };
+
+			for (j = 0; j < n; j++)
+				x[j] = p[j] * (1.0f / 32768.0f);
+			v[i] = x;
+		}
+
+		/* eq */
+		for (j = 0; j < chain->live.nr_biquads; j++)
+			biquad_process(v, frames, &chain->live.biquad[j], z + j * 2);
+
+		/* user stages */
+		for (j = 0; j < chain->nr_stages; j++)
+			chain->stage[j]->process(chain->stage[j], v, frames, g);
+
+		/* gain */
+		if (chain->ramp_active) {
+			for (i = 0; i < frames; i++)
+				v[i] *= chain->ramp[i];
+		} else if (chain->gain_cur != 1.0f) {
+			float gain = chain->gain_cur;
+
+			for (i = 0; i < frames; i++)
+				v[i] *= gain;
+		}
+
+		/* back to S16 with clipping */
+		p = buffer + base;
+		for (i = 0; i < frames; i++, p += channels) {
+			dsp_v4 y = v[i] * 32768.0f;
+
+			for (j = 0; j < n; j++) {
+				float s = y[j];
+
+				if (s > 32767.0f)
+					s = 32767.0f;
+				else if (s < -32768.0f)
+					s = -32768.0f;
+				p[j] = (short int) lrintf(s);
+			}
+		}
+	}
+}
+
+void dsp_process(struct dsp_chain *chain, short int *buffer,
+                 unsigned int frames)
+{
+	dsp_update(chain, frames);
+	dsp_process_groups(chain, buffer, frames, 0, chain->groups);
+}
+
+/*
+ * biquad design - see the audio eq cookbook by robert bristow-johnson
+ */
+
+static void biquad_normalize(struct dsp_biquad *b,
+                             double b0, double b1, double b2,
+                             double a0, double a1, double a2)
+{
+	b->b0 = b0 / a0;
+	b->b1 = b1 / a0;
+	b->b2 = b2 / a0;
+	b->a1 = a1 / a0;
+	b->a2 = a2 / a0;
+}
+
+void dsp_biquad_lowpass(struct dsp_biquad *b, unsigned int rate,
+                        double freq, double q)
+{
+	double w0 = 2 * M_PI * freq / rate;
+	double alpha = sin(w0) / (2 * q);
+	double c = cos(w0);
+
+	biquad_normalize(b, (1 - c) / 2, 1 - c, (1 - c) / 2,
+	                 1 + alpha, -2 * c, 1 - alpha);
+}
+
+void dsp_biquad_highpass(struct dsp_biquad *b, unsigned int rate,
+                         double freq, double q)
+{
+	double w0 = 2 * M_PI * freq / rate;
+	double alpha = sin(w0) / (2 * q);
+	double c = cos(w0);
+
+	biquad_normalize(b, (1 + c) / 2, -(1 + c), (1 + c) / 2,
+	                 1 + alpha, -2 * c, 1 - alpha);
+}
+
+void dsp_biquad_peaking(struct dsp_biquad *b, unsigned int rate,
+                        double freq, double q, double gain_db)
+{
+	double a = pow(10, gain_db / 40);
+	double w0 = 2 * M_PI * freq / rate;
+	double alpha = sin(w0) / (2 * q);
+	double c = cos(w0);
+
+	biquad_normalize(b, 1 + alpha * a, -2 * c, 1 - alpha * a,
+	                 1 + alpha / a, -2 * c, 1 - alpha / a);
+}
+
+void dsp_biquad_lowshelf(struct dsp_biquad *b, unsigned int rate,
+                         double freq, double q, double gain_db)
+{
+	double a = pow(10, gain_db / 40);
+	double w0 = 2 * M_PI * freq / rate;
+	double alpha = sin(w0) / (2 * q);
+	double c = cos(w0);
+	double sa = 2 * sqrt(a) * alpha;
+
+	biquad_normalize(b,
+	                 a * ((a + 1) - (a - 1) * c + sa),
+	                 2 * a * ((a - 1) - (a + 1) * c),
+	                 a * ((a + 1) - (a - 1) * c - sa),
+	                 (a + 1) + (a - 1) * c + sa,
+	                 -2 * ((a - 1) + (a + 1) * c),
+	                 (a + 1) + (a - 1) * c - sa);
+}
+
+void dsp_biquad_highshelf(struct dsp_biquad *b, unsigned int rate,
+                          double freq, double q, double gain_db)
+{
+	double a = pow(10, gain_db / 40);
+	double w0 = 2 * M_PI * freq / rate;
+	double alpha = sin(w0) / (2 * q);
+	double c = cos(w0);
+	double sa = 2 * sqrt(a) * alpha;
+
+	biquad_normalize(b,
+	                 a * ((a + 1) + (a - 1) * c + sa),
+	                 -2 * a * ((a - 1) + (a + 1) * c),
+	                 a * ((a + 1) + (a - 1) * c - sa),
+	                 (a + 1) - (a - 1) * c + sa,
+	                 2 * ((a - 1) - (a + 1) * c),
+	                 (a + 1) - (a - 1) * c - sa);
+}
+
+int dsp_parse_biquad(const char *spec, unsigned int rate,
+                     struct dsp_biquad *b)
+{
+	char type[8];
+	double freq, q, gain_db = 0;
+	int n;
+
+	n = sscanf(spec, "%7[a-z]:%lf:%lf:%lf", type, &freq, &q, &gain_db);
+	if (n < 3 || freq <= 0 || freq >= rate / 2.0 || q <= 0) {
+		printf("Invalid filter: %s\n", spec);
+		return -1;
+	}
+
+	if (!strcmp(type, "lp"))
+		dsp_biquad_lowpass(b, rate, freq, q);
+	else if (!strcmp(type, "hp"))
+		dsp_biquad_highpass(b, rate, freq, q);
+	else if (!strcmp(type, "peak"))
+		dsp_biquad_peaking(b, rate, freq, q, gain_db);
+	else if (!strcmp(type, "ls"))
+		dsp_biquad_lowshelf(b, rate, freq, q, gain_db);
+	else if (!strcmp(type, "hs"))
+		dsp_biquad_highshelf(b, rate, freq, q, gain_db);
+	else {
+		printf("Unknown filter type: %s\n", type);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+/*
+ * Small preallocated dsp chain for the write loop
+ *
+ * The chain works in place on interleaved S16 periods. Internally the
+ * channels are processed in groups of 4 with one vector per frame, so
+ * every kernel handles 4 channels per instruction.
+ *
+ * All memory is allocated by dsp_chain_create(), dsp_process() never
+ * allocates or locks. Parameters are changed with the dsp_set_*()
+ * functions from one control thread; the audio thread picks them up
+ * at the start of the next period.
+ */
+
+#ifndef DSP_H
+#define DSP_H
+
+#include <stdatomic.h>
+
+/* maximum number of cascaded biquads */
+#define DSP_MAX_BIQUADS 8
+
+/* maximum number of user stages */
+#define DSP_MAX_STAGES 4
+
+/* 4 channels, one per lane */
+typedef float dsp_v4 __attribute__((vector_size(16)));
+
+/* normalized biquad coefficients (a0 = 1) */
+struct dsp_biquad {
+	float b0, b1, b2;
+	float a1, a2;
+};
+
+/* parameters shared with the control thread */
+struct dsp_params {
+	/* linear gain */
+	float gain;
+	/* mute - ramped like the gain */
+	int mute;
+	/* cascaded biquads */
+	unsigned int nr_biquads;
+	struct dsp_biquad biquad[DSP_MAX_BIQUADS];
+};
+
+struct dsp_chain;
+
+/* user stage - works on 'frames' vectors of one channel group */
+struct dsp_stage {
+	void (*process)(struct dsp_stage *stage, dsp_v4 *buf,
+	                unsigned int frames, unsigned int group);
+	void *priv;
+};
+
+struct dsp_chain {
+	/* layout */
+	unsigned int channels;
+	unsigned int groups;
+	unsigned int max_frames;
+
+	/* control side - seqlock protected */
+	atomic_uint seq;
+	struct dsp_params shared;
+
+	/* audio side */
+	unsigned int seen_seq;
+	struct dsp_params live;
+
+	/* gain ramp - starts at the gain of the first period */
+	int started;
+	float gain_cur;
+	float ramp_coef;
+	int ramp_active;
+	float *ramp;
+
+	/* biquad state: [groups][DSP_MAX_BIQUADS][z1, z2] */
+	dsp_v4 *state;
+
+	/* channel groups: [groups][max_frames] */
+	dsp_v4 *work;
+
+	/* user stages, run after the biquads and before the gain */
+	unsigned int nr_stages;
+	struct dsp_stage *stage[DSP_MAX_STAGES];
+};
+
+/* setup - not realtime safe */
+struct dsp_chain *dsp_chain_create(unsigned int channels,
+                                   unsigned int max_frames,
+                                   unsigned int rate);
+void dsp_chain_destroy(struct dsp_chain *chain);
+int dsp_chain_add_stage(struct dsp_chain *chain, struct dsp_stage *stage);
+
+/* control thread */
+void dsp_set_gain(struct dsp_chain *chain, float gain_db);
+void dsp_set_mute(struct dsp_chain *chain, int mute);
+int dsp_set_biquad(struct dsp_chain *chain, unsigned int index,
+                   const struct dsp_biquad *biquad);
+void dsp_set_nr_biquads(struct dsp_chain *chain, unsigned int nr);
+
+/* audio thread */
+void dsp_update(struct dsp_chain *chain, unsigned int frames);
+void dsp_process_groups(struct dsp_chain *chain, short int *buffer,
+                        unsigned int frames,
+                        unsigned int first, unsigned int last);
+void dsp_process(struct dsp_chain *chain, short int *buffer,
+                 unsigned int frames);
+
+/* biquad design (rbj cookbook) */
+void dsp_biquad_lowpass(struct dsp_biquad *b, unsigned int rate,
+                        double freq, double q);
+void dsp_biquad_highpass(struct dsp_biquad *b, unsigned int rate,
+                         double freq, double q);
+void dsp_biquad_peaking(struct dsp_biquad *b, unsigned int rate,
+                        double freq, double q, double gain_db);
+void dsp_biquad_lowshelf(struct dsp_biquad *b, unsigned int rate,
+                         double freq, double q, double gain_db);
+void dsp_biquad_highshelf(struct dsp_biquad *b, unsigned int rate,
+                          double freq, double q, double gain_db);
+
+/* parse "type:freq:q[:gain_db]" with type lp, hp, peak, ls or hs */
+int dsp_parse_biquad(const char *spec, unsigned int rate,
+                     struct dsp_biquad *b);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+ * Measure the cost of the dsp chain in ns per frame, and how it scales
+ * over cores with the worker pool
+ *
+ * usage: dsp_bench [period_size] [max_workers]
+ *
+ * build: gcc -O2 dsp_bench.c dsp.c workers.c bufpool.c -o dsp_bench -lm -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dsp.h"
+#include "workers.h"
+
+/* stream setup */
+static unsigned int rate = 48000;
+static unsigned int period_size = 96;
+
+/* number of periods to run per configuration */
+static unsigned int nr_periods = 20000;
+
+/* scaling runs: up to this many workers besides the caller */
+static unsigned int max_workers = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench(unsigned int channels, unsigned int nr_biquads)
+{
+	struct dsp_chain *chain;
+	struct dsp_biquad b;
+	short int *buffer;
+	double start, ns_frame, budget;
+	unsigned int i;
+
+	chain = dsp_chain_create(channels, period_size, rate);
+	buffer = calloc(period_size * channels, sizeof(*buffer));
+	if (chain == NULL || buffer == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* some noise */
+	for (i = 0; i < period_size * channels; i++)
+		buffer[i] = (rand() & 0xfff) - 0x800;
+
+	for (i = 0; i < nr_biquads; i++) {
+		dsp_biquad_peaking(&b, rate, 100.0 * (i + 1), 0.7, 3.0);
+		dsp_set_biquad(chain, i, &b);
+	}
+
+	start = now();
+	for (i = 0; i < nr_periods; i++) {
+		/* keep the gain ramp busy half of the time */
+		if ((i % 100) == 0)
+			dsp_set_gain(chain, (i / 100) & 1 ? -6.0f : 0.0f);
+
+		dsp_process(chain, buffer, period_size);
+	}
+	ns_frame = (now() - start) * 1e9 / ((double) nr_periods * period_size);
+
+	/* fraction of the realtime budget of one core */
+	budget = ns_frame * rate / 1e9 * 100;
+
+	printf("channels: %3u biquads: %u  %8.2f ns/frame  %6.3f ns/sample  %6.3f%% cpu\n",
+	       channels, nr_biquads, ns_frame, ns_frame / channels, budget);
+
+	free(buffer);
+	dsp_chain_destroy(chain);
+}
+
+struct job {
+	struct dsp_chain *chain;
+	short int *buffer;
+};
+
+static void job_groups(void *ctx, unsigned int first, unsigned int last)
+{
+	struct job *job = ctx;
+
+	dsp_process_groups(job->chain, job->buffer, period_size, first, last);
+}
+
+/* the same chain split over 1 + 'nr_workers' cores - returns ns per frame */
+static double bench_parallel(unsigned int channels, unsigned int nr_biquads,
+                             unsigned int nr_workers, double base)
+{
+	struct workers w;
+	struct job job;
+	struct dsp_biquad b;
+	double start, ns_frame, budget = (double) period_size / rate;
+	unsigned int i, chunk;
+
+	job.chain = dsp_chain_create(channels, period_size, rate);
+	job.buffer = calloc(period_size * channels, sizeof(short int));
+	if (job.chain == NULL || job.buffer == NULL ||
+	    workers_start(&w, nr_workers, 1) < 0) {
+		printf("Setup failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < period_size * channels; i++)
+		job.buffer[i] = (rand() & 0xfff) - 0x800;
+	for (i = 0; i < nr_biquads; i++) {
+		dsp_biquad_peaking(&b, rate, 100.0 * (i + 1), 0.7, 3.0);
+		dsp_set_biquad(job.chain, i, &b);
+	}
+
+	/* one claim per thread, stragglers are picked up dynamically */
+	chunk = (job.chain->groups + nr_workers) / (nr_workers + 1);
+
+	start = now();
+	for (i = 0; i < nr_periods; i++) {
+		workers_sync(&w);
+		dsp_update(job.chain, period_size);
+		workers_run(&w, job.chain->groups, chunk, job_groups, &job, budget);
+	}
+	ns_frame = (now() - start) * 1e9 / ((double) nr_periods * period_size);
+
+	printf("channels: %3u biquads: %u workers: %2u  %8.2f ns/frame  %6.3f%% of a period  x%.2f  late: %lu\n",
+	       channels, nr_biquads, w.nr_workers, ns_frame, ns_frame * rate / 1e9 * 100,
+	       base > 0 ? base / ns_frame : 1.0, w.late);
+
+	workers_stop(&w);
+	free(job.buffer);
+	dsp_chain_destroy(job.chain);
+
+	return ns_frame;
+}
+
+int main(int argc, char *argv[])
+{
+	static const unsigned int channels[] = { 1, 2, 8, 16, 32, 64 };
+	static const unsigned int biquads[] = { 0, 1, 4, 8 };
+	unsigned int c, b;
+
+	if (argc > 1)
+		period_size = atoi(argv[1]);
+	if (argc > 2)
+		max_workers = atoi(argv[2]);
+
+	printf("rate: %u period: %u frames\n", rate, period_size);
+
+	for (c = 0; c < sizeof(channels) / sizeof(channels[0]); c++)
+		for (b = 0; b < sizeof(biquads) / sizeof(biquads[0]); b++)
+			bench(channels[c], biquads[b]);
+
+	/* 1 to N cores */
+	if (max_workers) {
+		static const unsigned int wide[] = { 64, 128, 256 };
+		unsigned int n;
+
+		for (c = 0; c < sizeof(wide) / sizeof(wide[0]); c++) {
+			double base = 0;
+
+			for (n = 0; n <= max_workers; n++) {
+				double ns = bench_parallel(wide[c], 8, n, base);
+
+				if (n == 0)
+					base = ns;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * Lossless encoder stage for the capture thread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "encoder.h"
+
+/* seconds of audio the ring holds - the latency bound */
+#define ENCODER_RING_TIME 2
+/* gaps not yet filled - more drop the period as well */
+#define ENCODER_MAX_GAPS 64
+
+enum {
+	SLOT_FREE,
+	SLOT_QUEUED,
+	SLOT_CODING,
+	SLOT_DONE,
+};
+
+struct encoder_slot {
+	int state;
+	unsigned int frames;
+	unsigned long long first_frame;
+	double cut_time;
+	short int *in;
+	unsigned char *out;
+	size_t size;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = write(fd, p, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* seek table and footer - only when every block made it to the file */
+static int write_seek_table(struct encoder *e)
+{
+	struct alc_footer footer;
+	int err;
+
+	if (e->write_error || e->nr_seek != e->blocks)
+		return e->write_error;
+
+	err = write_all(e->fd, e->seek, e->nr_seek * sizeof(*e->seek));
+	if (err < 0)
+		return err;
+
+	memset(&footer, 0, sizeof(footer));
+	footer.table_offset = e->file_pos;
+	footer.nr_entries = e->nr_seek;
+	footer.magic = ALC_SEEK_MAGIC;
+
+	return write_all(e->fd, &footer, sizeof(footer));
+}
+
+static void *worker_thread(void *arg)
+{
+	struct encoder *e = arg;
+	struct alc_coder coder;
+	unsigned int i;
+
+	if (alc_coder_init(&coder, e->channels, e->block_frames) < 0)
+		return NULL;
+
+	pthread_mutex_lock(&e->lock);
+
+	while (1) {
+		struct encoder_slot *slot = NULL;
+
+		/* oldest queued block first */
+		for (i = 0; i < e->nr_slots; i++) {
+			struct encoder_slot *s = &e->slots[i];
+
+			if (s->state == SLOT_QUEUED &&
+			    (slot == NULL || s->first_frame < slot->first_frame))
+				slot = s;
+		}
+
+		if (slot == NULL) {
+			if (e->quit)
+				break;
+			pthread_cond_wait(&e->work, &e->lock);
+			continue;
+		}
+
+		slot->state = SLOT_CODING;
+		pthread_mutex_unlock(&e->lock);
+
+		slot->size = alc_encode_block(&coder, slot->in, slot->frames,
+		                              slot->first_frame, slot->out, 0);
+
+		pthread_mutex_lock(&e->lock);
+		slot->state = SLOT_DONE;
+		sem_post(&e->wake);
+	}
+
+	pthread_mutex_unlock(&e->lock);
+	alc_coder_free(&coder);
+
+	return NULL;
+}
+
+static int slot_state(struct encoder *e, struct encoder_slot *slot)
+{
+	int state;
+
+	pthread_mutex_lock(&e->lock);
+	state = slot->state;
+	pthread_mutex_unlock(&e->lock);
+
+	return state;
+}
+
+/* write finished blocks in order */
+static void write_done(struct encoder *e)
+{
+	while (e->write_seq < e->next_seq) {
+		struct encoder_slot *slot = &e->slots[e->write_seq % e->nr_slots];
+		double latency;
+		int err;
+
+		if (slot_state(e, slot) != SLOT_DONE)
+			break;
+
+		/* where the block goes */
+		if (e->nr_seek == e->max_seek) {
+			unsigned long max = e->max_seek ? 2 * e->max_seek : 1024;
+			struct alc_seek *seek = realloc(e->seek, max * sizeof(*seek));
+
+			if (seek != NULL) {
+				e->seek = seek;
+				e->max_seek = max;
+			}
+		}
+		if (e->nr_seek < e->max_seek) {
+			e->seek[e->nr_seek].first_frame = slot->first_frame;
+			e->seek[e->nr_seek].offset = e->file_pos;
+			e->nr_seek++;
+		}
+
+		err = write_all(e->fd, slot->out, slot->size);
+		if (err < 0 && !e->write_error) {
+			printf("Encoder write failed: %s\n", strerror(-err));
+			e->write_error = err;
+		}
+
+		e->bytes_out += slot->size;
+		e->file_pos += slot->size;
+		latency = now() - slot->cut_time;
+		if (latency > e->max_latency)
+			e->max_latency = latency;
+
+		pthread_mutex_lock(&e->lock);
+		slot->state = SLOT_FREE;
+		pthread_mutex_unlock(&e->lock);
+
+		e->write_seq++;
+	}
+}
+
+/* behind: the oldest queued block is stored raw here, no worker is waited for */
+static int take_queued(struct encoder *e)
+{
+	struct encoder_slot *slot = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&e->lock);
+	for (i = 0; i < e->nr_slots; i++) {
+		struct encoder_slot *s = &e->slots[i];
+
+		if (s->state == SLOT_QUEUED &&
+		    (slot == NULL || s->first_frame < slot->first_frame))
+			slot = s;
+	}
+	if (slot)
+		slot->state = SLOT_CODING;
+	pthread_mutex_unlock(&e->lock);
+
+	if (slot == NULL)
+		return 0;
+
+	slot->size = alc_encode_block(&e->coder, slot->in, slot->frames,
+	                              slot->first_frame, slot->out, 1);
+	e->raw_blocks++;
+
+	pthread_mutex_lock(&e->lock);
+	slot->state = SLOT_DONE;
+	pthread_mutex_unlock(&e->lock);
+
+	return 1;
+}
+
+static void *encoder_thread(void *arg)
+{
+	struct encoder *e = arg;
+	size_t frame_bytes = e->channels * sizeof(short int);
+
+	while (1) {
+		struct encoder_slot *slot;
+		int running = atomic_load(&e->running);
+		unsigned long long want = e->block_frames;
+		size_t used;
+
+		write_done(e);
+
+		if (e->nr_workers && ring_used(&e->ring) > e->ring.size / 2 && take_queued(e))
+			continue;
+
+		/* the samples first: a gap is handed over before what follows it */
+		used = ring_used(&e->ring);
+		if (!e->have_gap && ring_read(&e->gaps, &e->next_gap, sizeof(e->next_gap)))
+			e->have_gap = 1;
+
+		/* blocks end where a gap starts */
+		if (e->have_gap && e->next_gap.at - e->frames_read < want)
+			want = e->next_gap.at - e->frames_read;
+
+		/* a whole block, or the rest when stopping */
+		if (want && used < want * frame_bytes && (running || used < frame_bytes)) {
+			if (!running && e->write_seq == e->next_seq)
+				break;
+			sem_wait(&e->wake);
+			continue;
+		}
+
+		/* every slot in flight - wait for the oldest one */
+		slot = &e->slots[e->next_seq % e->nr_slots];
+		if (slot_state(e, slot) != SLOT_FREE) {
+			sem_wait(&e->wake);
+			continue;
+		}
+
+		slot->first_frame = e->frames_cut;
+		slot->cut_time = now();
+
+		/* dropped periods: silence, so the frames after them keep their time */
+		if (want == 0) {
+			slot->frames = e->next_gap.frames < e->block_frames ?
+			               e->next_gap.frames : e->block_frames;
+			memset(slot->in, 0, slot->frames * frame_bytes);
+			slot->size = alc_encode_block(&e->coder, slot->in, slot->frames,
+			                              slot->first_frame, slot->out, 0);
+			e->next_gap.frames -= slot->frames;
+			e->have_gap = e->next_gap.frames > 0;
+			e->frames_cut += slot->frames;
+			e->silence_blocks++;
+			e->blocks++;
+			e->next_seq++;
+
+			pthread_mutex_lock(&e->lock);
+			slot->state = SLOT_DONE;
+			pthread_mutex_unlock(&e->lock);
+			continue;
+		}
+
+		slot->frames = (used < want * frame_bytes ? used / frame_bytes : want);
+		ring_read(&e->ring, slot->in, slot->frames * frame_bytes);
+		e->frames_cut += slot->frames;
+		e->frames_read += slot->frames;
+		e->bytes_in += slot->frames * frame_bytes;
+		e->blocks++;
+		e->next_seq++;
+
+		/* behind: a copy is all there is time for */
+		if (e->nr_workers == 0 || ring_used(&e->ring) > e->ring.size / 2) {
+			slot->size = alc_encode_block(&e->coder, slot->in, slot->frames,
+			                              slot->first_frame, slot->out, 1);
+			e->raw_blocks++;
+
+			pthread_mutex_lock(&e->lock);
+			slot->state = SLOT_DONE;
+			pthread_mutex_unlock(&e->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&e->lock);
+		slot->state = SLOT_QUEUED;
+		pthread_cond_signal(&e->work);
+		pthread_mutex_unlock(&e->lock);
+	}
+
+	return NULL;
+}
+
+int encoder_start(struct encoder *e, const char *filename,
+                  unsigned int channels, unsigned int rate,
+                  unsigned int block_frames, unsigned int nr_workers)
+{
+	struct alc_header header;
+	size_t frame_bytes = channels * sizeof(short int);
+	unsigned int i;
+	int err;
+
+	memset(e, 0, sizeof(*e));
+
+	if (channels == 0 || channels > ALC_MAX_CHANNELS || block_frames == 0 ||
+	    nr_workers > ENCODER_MAX_WORKERS) {
+		printf("Invalid encoder settings\n");
+		return -EINVAL;
+	}
+
+	e->channels = channels;
+	e->rate = rate;
+	e->block_frames = block_frames;
+	e->nr_workers = nr_workers;
+	atomic_init(&e->frames, 0);
+	atomic_init(&e->dropped, 0);
+	atomic_init(&e->running, 1);
+
+	err = alc_coder_init(&e->coder, channels, block_frames);
+	if (err < 0)
+		return err;
+
+	/* enough slots to keep every worker busy while the oldest is written */
+	e->nr_slots = 2 * nr_workers + 2;
+	e->slots = calloc(e->nr_slots, sizeof(*e->slots));
+	if (e->slots == NULL)
+		return -ENOMEM;
+	for (i = 0; i < e->nr_slots; i++) {
+		e->slots[i].in = malloc(block_frames * frame_bytes);
+		e->slots[i].out = malloc(alc_block_bound(channels, block_frames));
+		if (e->slots[i].in == NULL || e->slots[i].out == NULL)
+			return -ENOMEM;
+	}
+
+	/* the latency bound, and never less than a few blocks */
+	err = ring_init(&e->ring, (size_t) ENCODER_RING_TIME * rate * frame_bytes >
+	                4 * block_frames * frame_bytes ?
+	                (size_t) ENCODER_RING_TIME * rate * frame_bytes :
+	                4 * block_frames * frame_bytes);
+	if (err < 0)
+		return err;
+	err = ring_init(&e->gaps, ENCODER_MAX_GAPS * sizeof(struct encoder_gap));
+	if (err < 0)
+		return err;
+
+	e->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (e->fd < 0)
+		return -errno;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = ALC_MAGIC;
+	header.version = ALC_VERSION;
+	header.channels = channels;
+	header.rate = rate;
+	header.block_frames = block_frames;
+	err = write_all(e->fd, &header, sizeof(header));
+	if (err < 0)
+		return err;
+	e->file_pos = sizeof(header);
+
+	if (sem_init(&e->wake, 0, 0) < 0)
+		return -errno;
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_cond_init(&e->work, NULL);
+
+	for (i = 0; i < nr_workers; i++) {
+		err = pthread_create(&e->workers[i], NULL, worker_thread, e);
+		if (err)
+			return -err;
+	}
+
+	err = pthread_create(&e->thread, NULL, encoder_thread, e);
+	if (err)
+		return -err;
+
+	return 0;
+}
+
+int encoder_stop(struct encoder *e)
+{
+	struct encoder_gap gap = { e->pushed, e->gap };
+	unsigned int i;
+	int err;
+
+	/* periods dropped last: silence up to the end of the capture */
+	while (e->gap && ring_write(&e->gaps, &gap, sizeof(gap)) == 0) {
+		sem_post(&e->wake);
+		usleep(1000);
+	}
+
+	/* the encoder thread drains the ring and the workers first */
+	atomic_store(&e->running, 0);
+	sem_post(&e->wake);
+	pthread_join(e->thread, NULL);
+
+	pthread_mutex_lock(&e->lock);
+	e->quit = 1;
+	pthread_cond_broadcast(&e->work);
+	pthread_mutex_unlock(&e->lock);
+	for (i = 0; i < e->nr_workers; i++)
+		pthread_join(e->workers[i], NULL);
+
+	err = write_seek_table(e);
+	if (close(e->fd) < 0 && err == 0)
+		err = -errno;
+
+	sem_destroy(&e->wake);
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->work);
+	ring_free(&e->ring);
+	ring_free(&e->gaps);
+	alc_coder_free(&e->coder);
+	for (i = 0; i < e->nr_slots; i++) {
+		free(e->slots[i].in);
+		free(e->slots[i].out);
+	}
+	free(e->slots);
+	free(e->seek);
+
+	return err;
+}
+
+void encoder_push(struct encoder *e, const short int *buffer,
+                  unsigned int frames)
+{
+	size_t bytes = (size_t) frames * e->channels * sizeof(short int);
+	struct encoder_gap gap = { e->pushed, e->gap };
+
+	atomic_fetch_add_explicit(&e->frames, frames, memory_order_relaxed);
+
+	/* the encoder thread is stuck (disk?) - drop, never wait */
+	if (ring_space(&e->ring) < bytes ||
+	    (e->gap && ring_write(&e->gaps, &gap, sizeof(gap)) == 0)) {
+		atomic_fetch_add_explicit(&e->dropped, frames, memory_order_relaxed);
+		e->gap += frames;
+		return;
+	}
+
+	/* only the consumer frees space, the room checked is still there */
+	ring_write(&e->ring, buffer, bytes);
+	e->pushed += frames;
+	e->gap = 0;
+
+	sem_post(&e->wake);
+}
+
+void encoder_print_stats(struct encoder *e)
+{
+	printf("encoder: %lu blocks (%lu raw, %lu silence), %llu -> %llu bytes (%.1f%%), "
+	       "max latency %.1f ms, %lu of %lu frames dropped\n",
+	       e->blocks, e->raw_blocks, e->silence_blocks, e->bytes_in, e->bytes_out,
+	       e->bytes_in ? 100.0 * e->bytes_out / e->bytes_in : 0.0,
+	       e->max_latency * 1000.0,
+	       atomic_load(&e->dropped), atomic_load(&e->frames));
+}
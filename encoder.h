@@ -0,0 +1,109 @@
+/*
+ * Lossless encoder stage for the capture thread
+ *
+ * The audio thread hands over periods with encoder_push(), which only
+ * copies into a lock-free ring and never blocks, like analyzer_push().
+ * The encoder thread cuts the ring into blocks, hands them to a pool of
+ * worker threads that code them in parallel, and writes the coded
+ * blocks to the file in order.
+ *
+ * Latency is bounded by the ring: once it is more than half full the
+ * encoder thread stores blocks raw itself, which is a copy, until the
+ * workers have caught up - queued blocks too, oldest first. Only the
+ * blocks a worker is coding already are waited for, one per worker.
+ * Falling behind costs disk space, not samples.
+ *
+ * A period the ring has no room for is dropped. Where it was is handed
+ * over next to the samples, the encoder thread fills the gap with
+ * silence blocks so the file keeps the timing of the capture.
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "ring.h"
+#include "alc.h"
+
+/* maximum number of worker threads */
+#define ENCODER_MAX_WORKERS 16
+
+struct encoder_slot;
+
+/* 'frames' dropped before frame 'at' of the ring */
+struct encoder_gap {
+	unsigned long long at;
+	unsigned long long frames;
+};
+
+struct encoder {
+	/* setup */
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int block_frames;
+	unsigned int nr_workers;
+	int fd;
+
+	/* audio thread -> encoder thread */
+	struct ring ring;
+	struct ring gaps;
+	sem_t wake;
+	atomic_int running;
+	pthread_t thread;
+
+	/* audio thread only: frames in the ring so far, dropped since */
+	unsigned long long pushed;
+	unsigned long long gap;
+
+	/* statistics */
+	atomic_ulong frames;
+	atomic_ulong dropped;
+
+	/* encoder thread <-> workers: blocks in flight */
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	int quit;
+	struct encoder_slot *slots;
+	unsigned int nr_slots;
+	pthread_t workers[ENCODER_MAX_WORKERS];
+
+	/* encoder thread only */
+	struct alc_coder coder;
+	unsigned long long next_seq;
+	unsigned long long write_seq;
+	unsigned long long frames_cut;
+	unsigned long long frames_read;
+	struct encoder_gap next_gap;
+	int have_gap;
+	unsigned long blocks;
+	unsigned long raw_blocks;
+	unsigned long silence_blocks;
+	unsigned long long bytes_in;
+	unsigned long long bytes_out;
+	double max_latency;
+	int write_error;
+
+	/* seek table, written when stopping */
+	struct alc_seek *seek;
+	unsigned long nr_seek;
+	unsigned long max_seek;
+	unsigned long long file_pos;
+};
+
+int encoder_start(struct encoder *e, const char *filename,
+                  unsigned int channels, unsigned int rate,
+                  unsigned int block_frames, unsigned int nr_workers);
+
+/* codes what is left, writes it and the seek table and closes the file */
+int encoder_stop(struct encoder *e);
+
+/* audio thread - never blocks */
+void encoder_push(struct encoder *e, const short int *buffer,
+                  unsigned int frames);
+
+void encoder_print_stats(struct encoder *e);
+
+#endif
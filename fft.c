@@ -0,0 +1,307 @@
+/*
+ * In-tree complex fft
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "fft.h"
+
+typedef float fft_v4 __attribute__((vector_size(16)));
+typedef int fft_i4 __attribute__((vector_size(16)));
+
+#if defined(__clang__)
+#define SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shufflevector(a, b, i0, i1, i2, i3)
+#else
+#define SHUFFLE(a, b, i0, i1, i2, i3) __builtin_shuffle(a, b, (fft_i4) { i0, i1, i2, i3 })
+#endif
+
+static inline fft_v4 load4(const float *p)
+{
+	fft_v4 v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline void store4(float *p, fft_v4 v)
+{
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline fft_v4 splat(float x)
+{
+	return (fft_v4) { x, x, x, x };
+}
+
+/* rows r0..r3 -> columns, stored as 16 consecutive values */
+static inline void store4x4(float *p, fft_v4 r0, fft_v4 r1, fft_v4 r2, fft_v4 r3)
+{
+	fft_v4 t0 = SHUFFLE(r0, r1, 0, 4, 1, 5);
+	fft_v4 t1 = SHUFFLE(r2, r3, 0, 4, 1, 5);
+	fft_v4 t2 = SHUFFLE(r0, r1, 2, 6, 3, 7);
+	fft_v4 t3 = SHUFFLE(r2, r3, 2, 6, 3, 7);
+
+	store4(p + 0, SHUFFLE(t0, t1, 0, 1, 4, 5));
+	store4(p + 4, SHUFFLE(t0, t1, 2, 3, 6, 7));
+	store4(p + 8, SHUFFLE(t2, t3, 0, 1, 4, 5));
+	store4(p + 12, SHUFFLE(t2, t3, 2, 3, 6, 7));
+}
+
+static void *fft_alloc(size_t size)
+{
+	void *ptr = NULL;
+
+	if (posix_memalign(&ptr, 64, size))
+		return NULL;
+	return ptr;
+}
+
+struct fft *fft_create(unsigned int n)
+{
+	struct fft *f;
+	unsigned int len, stage, p;
+
+	if (n < 4 || (n & (n - 1)) || n > (1u << FFT_MAX_ORDER))
+		return NULL;
+
+	f = calloc(1, sizeof(*f));
+	if (f == NULL)
+		return NULL;
+
+	f->n = n;
+	f->re = fft_alloc(n * sizeof(float));
+	f->im = fft_alloc(n * sizeof(float));
+	if (!f->re || !f->im)
+		goto fail;
+
+	/* twiddles for every radix-4 stage */
+	for (len = n, stage = 0; len >= 4; len /= 4, stage++) {
+		unsigned int n1 = len / 4;
+		float *tw = fft_alloc(6 * n1 * sizeof(float));
+
+		if (tw == NULL)
+			goto fail;
+		f->twiddle[stage] = tw;
+
+		for (p = 0; p < n1; p++) {
+			double theta = 2 * M_PI * p / len;
+
+			tw[0 * n1 + p] = cos(theta);
+			tw[1 * n1 + p] = -sin(theta);
+			tw[2 * n1 + p] = cos(2 * theta);
+			tw[3 * n1 + p] = -sin(2 * theta);
+			tw[4 * n1 + p] = cos(3 * theta);
+			tw[5 * n1 + p] = -sin(3 * theta);
+		}
+	}
+	f->nr_stages = stage;
+
+	return f;
+
+fail:
+	fft_destroy(f);
+	return NULL;
+}
+
+void fft_destroy(struct fft *f)
+{
+	unsigned int i;
+
+	if (f == NULL)
+		return;
+
+	for (i = 0; i < f->nr_stages; i++)
+		free(f->twiddle[i]);
+	free(f->re);
+	free(f->im);
+	free(f);
+}
+
+/* radix-4 stage, generic version for small sizes */
+static void radix4_scalar(unsigned int n, unsigned int s,
+                          const float *xr, const float *xi,
+                          float *yr, float *yi, const float *tw)
+{
+	unsigned int n1 = n / 4, p, q;
+
+	for (p = 0; p < n1; p++) {
+		float w1r = tw[0 * n1 + p], w1i = tw[1 * n1 + p];
+		float w2r = tw[2 * n1 + p], w2i = tw[3 * n1 + p];
+		float w3r = tw[4 * n1 + p], w3i = tw[5 * n1 + p];
+
+		for (q = 0; q < s; q++) {
+			unsigned int i = q + s * p, o = q + s * 4 * p;
+			float ar = xr[i], ai = xi[i];
+			float br = xr[i + s * n1], bi = xi[i + s * n1];
+			float cr = xr[i + s * 2 * n1], ci = xi[i + s * 2 * n1];
+			float dr = xr[i + s * 3 * n1], di = xi[i + s * 3 * n1];
+			float apcr = ar + cr, apci = ai + ci;
+			float amcr = ar - cr, amci = ai - ci;
+			float bpdr = br + dr, bpdi = bi + di;
+			float bmdr = br - dr, bmdi = bi - di;
+			float t1r = amcr + bmdi, t1i = amci - bmdr;
+			float t2r = apcr - bpdr, t2i = apci - bpdi;
+			float t3r = amcr - bmdi, t3i = amci + bmdr;
+
+			yr[o] = apcr + bpdr;
+			yi[o] = apci + bpdi;
+			yr[o + s] = t1r * w1r - t1i * w1i;
+			yi[o + s] = t1r * w1i + t1i * w1r;
+			yr[o + 2 * s] = t2r * w2r - t2i * w2i;
+			yi[o + 2 * s] = t2r * w2i + t2i * w2r;
+			yr[o + 3 * s] = t3r * w3r - t3i * w3i;
+			yi[o + 3 * s] = t3r * w3i + t3i * w3r;
+		}
+	}
+}
+
+/* one radix-4 butterfly on 4 lanes */
+#define BUTTERFLY4(ar, ai, br, bi, cr, ci, dr, di,                         \
+                   w1r, w1i, w2r, w2i, w3r, w3i,                           \
+                   o0r, o0i, o1r, o1i, o2r, o2i, o3r, o3i)                 \
+	do {                                                               \
+		fft_v4 apcr = ar + cr, apci = ai + ci;                     \
+		fft_v4 amcr = ar - cr, amci = ai - ci;                     \
+		fft_v4 bpdr = br + dr, bpdi = bi + di;                     \
+		fft_v4 bmdr = br - dr, bmdi = bi - di;                     \
+		fft_v4 t1r = amcr + bmdi, t1i = amci - bmdr;               \
+		fft_v4 t2r = apcr - bpdr, t2i = apci - bpdi;               \
+		fft_v4 t3r = amcr - bmdi, t3i = amci + bmdr;               \
+		o0r = apcr + bpdr;                                         \
+		o0i = apci + bpdi;                                         \
+		o1r = t1r * w1r - t1i * w1i;                               \
+		o1i = t1r * w1i + t1i * w1r;                               \
+		o2r = t2r * w2r - t2i * w2i;                               \
+		o2i = t2r * w2i + t2i * w2r;                               \
+		o3r = t3r * w3r - t3i * w3i;                               \
+		o3i = t3r * w3i + t3i * w3r;                               \
+	} while (0)
+
+/* radix-4 stage, stride >= 4: vectors along q, twiddles broadcast */
+static void radix4_strided(unsigned int n, unsigned int s,
+                           const float *xr, const float *xi,
+                           float *yr, float *yi, const float *tw)
+{
+	unsigned int n1 = n / 4, p, q;
+
+	for (p = 0; p < n1; p++) {
+		fft_v4 w1r = splat(tw[0 * n1 + p]), w1i = splat(tw[1 * n1 + p]);
+		fft_v4 w2r = splat(tw[2 * n1 + p]), w2i = splat(tw[3 * n1 + p]);
+		fft_v4 w3r = splat(tw[4 * n1 + p]), w3i = splat(tw[5 * n1 + p]);
+
+		for (q = 0; q < s; q += 4) {
+			unsigned int i = q + s * p, o = q + s * 4 * p;
+			fft_v4 o0r, o0i, o1r, o1i, o2r, o2i, o3r, o3i;
+
+			BUTTERFLY4(load4(xr + i), load4(xi + i),
+			           load4(xr + i + s * n1), load4(xi + i + s * n1),
+			           load4(xr + i + s * 2 * n1), load4(xi + i + s * 2 * n1),
+			           load4(xr + i + s * 3 * n1), load4(xi + i + s * 3 * n1),
+			           w1r, w1i, w2r, w2i, w3r, w3i,
+			           o0r, o0i, o1r, o1i, o2r, o2i, o3r, o3i);
+
+			store4(yr + o, o0r);
+			store4(yi + o, o0i);
+			store4(yr + o + s, o1r);
+			store4(yi + o + s, o1i);
+			store4(yr + o + 2 * s, o2r);
+			store4(yi + o + 2 * s, o2i);
+			store4(yr + o + 3 * s, o3r);
+			store4(yi + o + 3 * s, o3i);
+		}
+	}
+}
+
+/* first radix-4 stage, stride 1: vectors along p, transposed stores */
+static void radix4_first(unsigned int n,
+                         const float *xr, const float *xi,
+                         float *yr, float *yi, const float *tw)
+{
+	unsigned int n1 = n / 4, p;
+
+	for (p = 0; p < n1; p += 4) {
+		fft_v4 o0r, o0i, o1r, o1i, o2r, o2i, o3r, o3i;
+
+		BUTTERFLY4(load4(xr + p), load4(xi + p),
+		           load4(xr + p + n1), load4(xi + p + n1),
+		           load4(xr + p + 2 * n1), load4(xi + p + 2 * n1),
+		           load4(xr + p + 3 * n1), load4(xi + p + 3 * n1),
+		           load4(tw + 0 * n1 + p), load4(tw + 1 * n1 + p),
+		           load4(tw + 2 * n1 + p), load4(tw + 3 * n1 + p),
+		           load4(tw + 4 * n1 + p), load4(tw + 5 * n1 + p),
+		           o0r, o0i, o1r, o1i, o2r, o2i, o3r, o3i);
+
+		store4x4(yr + 4 * p, o0r, o1r, o2r, o3r);
+		store4x4(yi + 4 * p, o0i, o1i, o2i, o3i);
+	}
+}
+
+/* last radix-2 stage, in place */
+static void radix2(unsigned int s, float *xr, float *xi)
+{
+	unsigned int q;
+
+	if (s >= 4) {
+		for (q = 0; q < s; q += 4) {
+			fft_v4 ar = load4(xr + q), ai = load4(xi + q);
+			fft_v4 br = load4(xr + q + s), bi = load4(xi + q + s);
+
+			store4(xr + q, ar + br);
+			store4(xi + q, ai + bi);
+			store4(xr + q + s, ar - br);
+			store4(xi + q + s, ai - bi);
+		}
+		return;
+	}
+
+	for (q = 0; q < s; q++) {
+		float ar = xr[q], ai = xi[q];
+		float br = xr[q + s], bi = xi[q + s];
+
+		xr[q] = ar + br;
+		xi[q] = ai + bi;
+		xr[q + s] = ar - br;
+		xi[q + s] = ai - bi;
+	}
+}
+
+void fft_forward(struct fft *f, float *re, float *im)
+{
+	float *xr = re, *xi = im, *yr = f->re, *yi = f->im, *t;
+	unsigned int n = f->n, s = 1, stage = 0;
+
+	while (n >= 4) {
+		const float *tw = f->twiddle[stage++];
+
+		if (s >= 4)
+			radix4_strided(n, s, xr, xi, yr, yi, tw);
+		else if (s == 1 && (n / 4) % 4 == 0)
+			radix4_first(n, xr, xi, yr, yi, tw);
+		else
+			radix4_scalar(n, s, xr, xi, yr, yi, tw);
+
+		/* output of this stage is input of the next */
+		t = xr; xr = yr; yr = t;
+		t = xi; xi = yi; yi = t;
+
+		n /= 4;
+		s *= 4;
+	}
+
+	if (n == 2)
+		radix2(s, xr, xi);
+
+	/* odd number of radix-4 stages: result is in the scratch buffers */
+	if (xr != re) {
+		memcpy(re, xr, f->n * sizeof(float));
+		memcpy(im, xi, f->n * sizeof(float));
+	}
+}
+
+/* swapping real and imaginary turns the forward into the inverse */
+void fft_inverse(struct fft *f, float *re, float *im)
+{
+	fft_forward(f, im, re);
+}
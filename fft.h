@@ -0,0 +1,36 @@
+/*
+ * In-tree complex fft
+ *
+ * Stockham autosort radix-4 stages with a final radix-2 stage when
+ * needed, on split real/imaginary arrays. Every butterfly loop works on
+ * 4 values at a time, so no bit reversal pass is needed and the kernels
+ * map directly to SSE/NEON.
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+/* maximum log2 of the fft size */
+#define FFT_MAX_ORDER 16
+
+struct fft {
+	unsigned int n;
+
+	/* radix-4 stages: twiddles w1, w2, w3 (re, im) per stage */
+	unsigned int nr_stages;
+	float *twiddle[FFT_MAX_ORDER / 2];
+
+	/* ping-pong buffers */
+	float *re;
+	float *im;
+};
+
+/* n must be a power of 2, at least 4 */
+struct fft *fft_create(unsigned int n);
+void fft_destroy(struct fft *f);
+
+/* in place, not normalized */
+void fft_forward(struct fft *f, float *re, float *im);
+void fft_inverse(struct fft *f, float *re, float *im);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+ * Compare file i/o of many streams: a read() or write() per period
+ * against read ahead and write behind through io_uring
+ *
+ * Every stream moves one period of 48 kHz stereo every 2 ms, all of
+ * them from one thread, for the given time. The syscalls are the ones
+ * the streams make, the cpu time is the whole process - the io_uring
+ * workers included.
+ *
+ * usage: io_bench [streams] [seconds]
+ *
+ * build: gcc -O2 io_bench.c uring.c bufpool.c -o io_bench -lpthread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "uring.h"
+#include "bufpool.h"
+
+/* stream setup */
+static unsigned int rate = 48000;
+static unsigned int period_size = 96;
+static unsigned int channels = 2;
+
+static unsigned int nr_streams = 128;
+static unsigned int seconds = 3;
+
+static const char *read_file = "io_bench.tmp";
+
+struct stream {
+	int fd;
+	struct uring u;
+};
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* the file all readers read, long enough for the run */
+static void make_read_file(size_t size)
+{
+	char block[65536];
+	size_t done;
+	int fd;
+
+	fd = open(read_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Could not open: %s\n", read_file);
+		exit(EXIT_FAILURE);
+	}
+
+	memset(block, 0x55, sizeof(block));
+	for (done = 0; done < size; done += sizeof(block))
+		if (write(fd, block, sizeof(block)) != sizeof(block)) {
+			printf("Could not write: %s\n", read_file);
+			exit(EXIT_FAILURE);
+		}
+
+	close(fd);
+}
+
+static void bench(int write_mode, int use_uring)
+{
+	size_t period_bytes = period_size * channels * sizeof(short int);
+	unsigned long nr_ticks = (unsigned long) seconds * rate / period_size;
+	unsigned long syscalls = 0, stalls = 0, tick;
+	struct timespec next;
+	struct stream *s;
+	double cpu;
+	char *buf;
+	unsigned int i;
+	int err;
+
+	s = calloc(nr_streams, sizeof(*s));
+	buf = bufpool_alloc(period_bytes);
+	if (s == NULL || buf == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(buf, 0x55, period_bytes);
+
+	for (i = 0; i < nr_streams; i++) {
+		if (write_mode) {
+			char name[64];
+
+			/* unlinked right away, gone at close */
+			snprintf(name, sizeof(name), "io_bench.%u.tmp", i);
+			s[i].fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+			unlink(name);
+		} else
+			s[i].fd = open(read_file, O_RDONLY);
+
+		if (s[i].fd < 0) {
+			printf("Could not open stream %u: %s\n", i, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (use_uring) {
+			err = uring_open(&s[i].u, s[i].fd, write_mode, 0,
+			                 URING_SLOT_SIZE, URING_NR_SLOTS);
+			if (err < 0) {
+				printf("io_uring: %s\n", strerror(-err));
+				exit(EXIT_FAILURE);
+			}
+			/* the priming reads are setup, not steady state */
+			s[i].u.enters = 0;
+		}
+	}
+
+	cpu = cpu_time();
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	for (tick = 0; tick < nr_ticks; tick++) {
+		next.tv_nsec += period_size * 1000000000ULL / rate;
+		if (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		for (i = 0; i < nr_streams; i++) {
+			if (use_uring && write_mode)
+				uring_write(&s[i].u, buf, period_bytes);
+			else if (use_uring)
+				uring_read(&s[i].u, buf, period_bytes);
+			else if (write_mode)
+				syscalls += write(s[i].fd, buf, period_bytes) >= 0;
+			else
+				syscalls += read(s[i].fd, buf, period_bytes) >= 0;
+		}
+	}
+
+	cpu = cpu_time() - cpu;
+
+	for (i = 0; i < nr_streams; i++) {
+		if (use_uring) {
+			syscalls += s[i].u.enters;
+			stalls += s[i].u.stalls;
+			uring_close(&s[i].u);
+		}
+		close(s[i].fd);
+	}
+
+	printf("%-5s %-9s %9.0f syscalls/s  cpu %5.1f%%  %lu stalls\n",
+	       write_mode ? "write" : "read", use_uring ? "io_uring" : "plain",
+	       syscalls / (double) seconds, 100.0 * cpu / seconds, stalls);
+
+	bufpool_free(buf);
+	free(s);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc > 1)
+		nr_streams = atoi(argv[1]);
+	if (argc > 2)
+		seconds = atoi(argv[2]);
+
+	printf("streams: %u, %u frames of %u ch at %u Hz, %u s\n",
+	       nr_streams, period_size, channels, rate, seconds);
+
+	/* with slack for the read ahead */
+	make_read_file((size_t) (seconds + 2) * rate * channels * sizeof(short int));
+
+	bench(0, 0);
+	bench(0, 1);
+	bench(1, 0);
+	bench(1, 1);
+
+	unlink(read_file);
+
+	return 0;
+}
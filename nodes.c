@@ -0,0 +1,847 @@
+/*
+ * Standard pipeline nodes
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nodes.h"
+#include "pcm.h"
+#include "dsp.h"
+#include "route.h"
+#include "wav.h"
+
+/* what every node keeps from its spec */
+struct node_args {
+	const char *arg;
+	struct pl_config cfg;
+};
+
+static unsigned int period_frames(const struct pl_config *cfg, unsigned int rate)
+{
+	return (unsigned long long) rate * cfg->period_time / 1000000;
+}
+
+/*
+ * gen: sine on every channel
+ */
+
+struct gen {
+	struct node_args args;
+	double step;
+	double phase;
+};
+
+static int gen_setup(struct pl_node *n, const struct pl_format *in,
+                     struct pl_format *out)
+{
+	struct gen *g = n->priv;
+	const struct pl_config *cfg = &g->args.cfg;
+	double freq;
+	unsigned int channels = cfg->channels;
+
+	if (sscanf(g->args.arg, "%lf,%u", &freq, &channels) < 1 ||
+	    freq <= 0 || freq >= cfg->rate / 2.0 || channels == 0)
+		return -EINVAL;
+
+	g->step = 2 * M_PI * freq / cfg->rate;
+	out->rate = cfg->rate;
+	out->channels = channels;
+	out->period = period_frames(cfg, cfg->rate);
+
+	return 0;
+}
+
+static int gen_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct gen *g = n->priv;
+	struct pl_buffer *b = pl_buffer_get(n->pipe, n->out.channels);
+	short int *p;
+	unsigned int i, c;
+
+	if (b == NULL)
+		return -ENOBUFS;
+
+	p = b->data;
+	for (i = 0; i < n->out.period; i++) {
+		short int v = (short int) (sin(g->phase) * 16384);
+
+		for (c = 0; c < b->channels; c++)
+			*p++ = v;
+
+		g->phase += g->step;
+		if (g->phase >= 2 * M_PI)
+			g->phase -= 2 * M_PI;
+	}
+
+	b->frames = n->out.period;
+	*buf = b;
+	return 0;
+}
+
+static const struct pl_node_ops gen_ops = {
+	.name = "gen",
+	.kind = PL_SOURCE,
+	.setup = gen_setup,
+	.process = gen_process,
+};
+
+/*
+ * file: wave file source and sink
+ */
+
+struct file {
+	struct node_args args;
+	int fd;
+	uint64_t frames;
+};
+
+static int file_src_setup(struct pl_node *n, const struct pl_format *in,
+                          struct pl_format *out)
+{
+	struct file *f = n->priv;
+	struct wav_info info;
+	struct stat st;
+	void *map;
+	int err;
+
+	f->fd = open(f->args.arg, O_RDONLY);
+	if (f->fd < 0)
+		return -errno;
+
+	if (fstat(f->fd, &st) < 0)
+		return -errno;
+
+	/* only the pages with chunk headers are read */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, f->fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+	err = wav_parse(map, st.st_size, &info);
+	munmap(map, st.st_size);
+	if (err < 0) {
+		printf("%s: %s\n", f->args.arg, info.error);
+		return err;
+	}
+
+	if (info.format != WAV_FORMAT_PCM || info.bits != 16) {
+		printf("%s: only 16 bit pcm files are supported\n", f->args.arg);
+		return -EINVAL;
+	}
+
+	f->frames = info.frames;
+	lseek(f->fd, info.data_offset, SEEK_SET);
+
+	out->rate = info.rate;
+	out->channels = info.channels;
+	out->period = period_frames(&f->args.cfg, info.rate);
+
+	return 0;
+}
+
+static int file_src_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct file *f = n->priv;
+	struct pl_buffer *b;
+	size_t frame_bytes = n->out.channels * sizeof(short int);
+	unsigned int frames = f->frames < n->out.period ? f->frames : n->out.period;
+	ssize_t len;
+
+	/* the end */
+	if (frames == 0)
+		return 0;
+
+	b = pl_buffer_get(n->pipe, n->out.channels);
+	if (b == NULL)
+		return -ENOBUFS;
+
+	len = read(f->fd, b->data, frames * frame_bytes);
+	if (len < 0) {
+		pl_buffer_put(b);
+		return -errno;
+	}
+
+	b->frames = len / frame_bytes;
+	f->frames = len == (ssize_t) (frames * frame_bytes) ? f->frames - frames : 0;
+	*buf = b;
+	return 0;
+}
+
+static void file_destroy(struct pl_node *n)
+{
+	struct file *f = n->priv;
+
+	if (f->fd >= 0)
+		close(f->fd);
+}
+
+static const struct pl_node_ops file_src_ops = {
+	.name = "file",
+	.kind = PL_SOURCE,
+	.setup = file_src_setup,
+	.process = file_src_process,
+	.destroy = file_destroy,
+};
+
+static int file_sink_setup(struct pl_node *n, const struct pl_format *in,
+                           struct pl_format *out)
+{
+	struct file *f = n->priv;
+	unsigned char h[WAV_HEADER_SIZE];
+
+	f->fd = open(f->args.arg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f->fd < 0)
+		return -errno;
+
+	/* the sizes are filled in at the end */
+	wav_header(h, in->rate, in->channels, 0);
+	if (write(f->fd, h, sizeof(h)) != sizeof(h))
+		return -EIO;
+
+	return 0;
+}
+
+static int file_sink_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct file *f = n->priv;
+	size_t len = (size_t) (*buf)->frames * (*buf)->channels * sizeof(short int);
+
+	if (write(f->fd, (*buf)->data, len) != (ssize_t) len)
+		return errno ? -errno : -EIO;
+
+	f->frames += (*buf)->frames;
+	return 0;
+}
+
+static void file_sink_destroy(struct pl_node *n)
+{
+	struct file *f = n->priv;
+	unsigned char h[WAV_HEADER_SIZE];
+
+	if (f->fd < 0)
+		return;
+
+	wav_header(h, n->in.rate, n->in.channels, f->frames);
+	if (pwrite(f->fd, h, sizeof(h), 0) != sizeof(h))
+		printf("%s: header write failed\n", f->args.arg);
+	close(f->fd);
+}
+
+static const struct pl_node_ops file_sink_ops = {
+	.name = "file",
+	.kind = PL_SINK,
+	.setup = file_sink_setup,
+	.process = file_sink_process,
+	.destroy = file_sink_destroy,
+};
+
+/*
+ * capture and play: pcm devices
+ */
+
+struct device {
+	struct node_args args;
+	struct pcm *pcm;
+	struct pcm_config pc;
+	unsigned long xruns;
+};
+
+static int device_open(struct device *d, const char *name,
+                       snd_pcm_stream_t stream, unsigned int rate,
+                       unsigned int channels)
+{
+	int err;
+
+	err = pcm_open(&d->pcm, name, stream);
+	if (err < 0)
+		return err;
+
+	memset(&d->pc, 0, sizeof(d->pc));
+	d->pc.rate = rate;
+	d->pc.channels = channels;
+	d->pc.buffer_time = d->args.cfg.buffer_time;
+	d->pc.period_time = d->args.cfg.period_time;
+
+	return pcm_configure(d->pcm, &d->pc);
+}
+
+static int capture_setup(struct pl_node *n, const struct pl_format *in,
+                         struct pl_format *out)
+{
+	struct device *d = n->priv;
+	unsigned int channels = d->args.cfg.channels;
+	char name[64];
+	char *at;
+	int err;
+
+	/* "hw:1,0@4" - commas belong to the device name */
+	snprintf(name, sizeof(name), "%s", d->args.arg);
+	at = strrchr(name, '@');
+	if (at) {
+		channels = atoi(at + 1);
+		*at = '\0';
+	}
+
+	err = device_open(d, name, SND_PCM_STREAM_CAPTURE, d->args.cfg.rate, channels);
+	if (err < 0)
+		return err;
+
+	out->rate = d->pc.rate;
+	out->channels = d->pc.channels;
+	out->period = d->pc.period_size;
+
+	return pcm_start(d->pcm);
+}
+
+static int capture_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct device *d = n->priv;
+	struct pl_buffer *b = pl_buffer_get(n->pipe, n->out.channels);
+	snd_pcm_sframes_t err;
+
+	if (b == NULL)
+		return -ENOBUFS;
+
+	while (b->frames < n->out.period) {
+		err = pcm_readi(d->pcm, b->data + b->frames * b->channels,
+		                n->out.period - b->frames);
+		if (err == -EAGAIN)
+			continue;
+
+		/* overrun -> restart */
+		if (err == -EPIPE) {
+			d->xruns++;
+			err = pcm_prepare(d->pcm);
+			if (err == 0)
+				err = pcm_start(d->pcm);
+		}
+		if (err < 0) {
+			pl_buffer_put(b);
+			return err;
+		}
+
+		b->frames += err;
+	}
+
+	*buf = b;
+	return 0;
+}
+
+static void device_print_stats(struct pl_node *n)
+{
+	struct device *d = n->priv;
+
+	printf("  %-10s %9lu xruns\n", "", d->xruns);
+	pcm_print_stats(d->pcm);
+}
+
+static void device_destroy(struct pl_node *n)
+{
+	struct device *d = n->priv;
+
+	if (d->pcm)
+		pcm_close(d->pcm);
+}
+
+static const struct pl_node_ops capture_ops = {
+	.name = "capture",
+	.kind = PL_SOURCE,
+	.setup = capture_setup,
+	.process = capture_process,
+	.print_stats = device_print_stats,
+	.destroy = device_destroy,
+};
+
+static int play_setup(struct pl_node *n, const struct pl_format *in,
+                      struct pl_format *out)
+{
+	struct device *d = n->priv;
+
+	return device_open(d, d->args.arg, SND_PCM_STREAM_PLAYBACK,
+	                   in->rate, in->channels);
+}
+
+static int play_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct device *d = n->priv;
+	short int *ptr = (*buf)->data;
+	unsigned int left = (*buf)->frames;
+	snd_pcm_sframes_t err;
+
+	while (left > 0) {
+		err = pcm_writei(d->pcm, ptr, left);
+		if (err == -EAGAIN)
+			continue;
+
+		/* underrun -> restart */
+		if (err == -EPIPE) {
+			d->xruns++;
+			err = pcm_prepare(d->pcm);
+			if (err < 0)
+				return err;
+			continue;
+		}
+		if (err < 0)
+			return err;
+
+		ptr += err * (*buf)->channels;
+		left -= err;
+	}
+
+	return 0;
+}
+
+static const struct pl_node_ops play_ops = {
+	.name = "play",
+	.kind = PL_SINK,
+	.setup = play_setup,
+	.process = play_process,
+	.print_stats = device_print_stats,
+	.destroy = device_destroy,
+};
+
+/*
+ * gain and eq: a dsp chain each
+ */
+
+struct proc {
+	struct node_args args;
+	struct dsp_chain *dsp;
+};
+
+static int proc_setup(struct pl_node *n, const struct pl_format *in,
+                      struct pl_format *out)
+{
+	struct proc *p = n->priv;
+	struct dsp_biquad b;
+
+	p->dsp = dsp_chain_create(in->channels, in->period, in->rate);
+	if (p->dsp == NULL)
+		return -ENOMEM;
+
+	if (!strcmp(n->ops->name, "gain")) {
+		dsp_set_gain(p->dsp, atof(p->args.arg));
+		return 0;
+	}
+
+	if (dsp_parse_biquad(p->args.arg, in->rate, &b) < 0)
+		return -EINVAL;
+	dsp_set_biquad(p->dsp, 0, &b);
+
+	return 0;
+}
+
+/* in place - a copy only when a buffer is shared */
+static int proc_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct proc *p = n->priv;
+	int err;
+
+	err = pl_buffer_writable(buf);
+	if (err < 0)
+		return err;
+
+	dsp_process(p->dsp, (*buf)->data, (*buf)->frames);
+	return 0;
+}
+
+static void proc_destroy(struct pl_node *n)
+{
+	struct proc *p = n->priv;
+
+	dsp_chain_destroy(p->dsp);
+}
+
+static const struct pl_node_ops gain_ops = {
+	.name = "gain",
+	.kind = PL_PROCESS,
+	.setup = proc_setup,
+	.process = proc_process,
+	.destroy = proc_destroy,
+};
+
+static const struct pl_node_ops eq_ops = {
+	.name = "eq",
+	.kind = PL_PROCESS,
+	.setup = proc_setup,
+	.process = proc_process,
+	.destroy = proc_destroy,
+};
+
+/*
+ * route: the one node that changes the format
+ */
+
+struct router {
+	struct node_args args;
+	struct route route;
+};
+
+static int route_setup(struct pl_node *n, const struct pl_format *in,
+                       struct pl_format *out)
+{
+	struct router *r = n->priv;
+	unsigned int s, d, channels = 0;
+
+	/* "<channels>": straight through, or a spec "src:dst[:gain_db],..." */
+	if (!strchr(r->args.arg, ':')) {
+		channels = atoi(r->args.arg);
+		if (channels == 0 || channels > ROUTE_MAX_CHANNELS)
+			return -EINVAL;
+
+		route_init(&r->route, in->channels, channels);
+		for (s = 0; s < in->channels && s < channels; s++)
+			route_set(&r->route, s, s, 0);
+	} else {
+		route_init(&r->route, in->channels, ROUTE_MAX_CHANNELS);
+		if (route_parse(&r->route, r->args.arg) < 0)
+			return -EINVAL;
+
+		/* the highest device channel used */
+		for (s = 0; s < in->channels; s++)
+			for (d = 0; d < ROUTE_MAX_CHANNELS; d++)
+				if (r->route.gain[s][d] != 0.0f && d + 1 > channels)
+					channels = d + 1;
+
+		route_init(&r->route, in->channels, channels);
+		route_parse(&r->route, r->args.arg);
+	}
+
+	route_finalize(&r->route);
+	out->channels = channels;
+
+	return 0;
+}
+
+static int route_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct router *r = n->priv;
+	struct pl_buffer *b;
+
+	if (r->route.type == ROUTE_IDENTITY)
+		return 0;
+
+	b = pl_buffer_get(n->pipe, n->out.channels);
+	if (b == NULL)
+		return -ENOBUFS;
+
+	route_apply(&r->route, (*buf)->data, b->data, (*buf)->frames);
+	b->frames = (*buf)->frames;
+
+	pl_buffer_put(*buf);
+	*buf = b;
+	return 0;
+}
+
+static const struct pl_node_ops route_ops = {
+	.name = "route",
+	.kind = PL_PROCESS,
+	.setup = route_setup,
+	.process = route_process,
+};
+
+/*
+ * shm: ring in POSIX shared memory between processes
+ */
+
+#define SHM_MAGIC 0x4d485341 /* "ASHM" */
+
+struct shm_header {
+	uint32_t magic;
+	uint32_t rate;
+	uint32_t channels;
+	/* the sink is gone */
+	atomic_uint eof;
+	/* data bytes, a power of 2 */
+	uint64_t size;
+
+	/* producer and consumer positions on their own cache lines */
+	_Alignas(64) atomic_ullong head;
+	_Alignas(64) atomic_ullong tail;
+};
+
+struct shm {
+	struct node_args args;
+	struct shm_header *h;
+	unsigned char *data;
+	size_t map_size;
+	unsigned long dropped;
+};
+
+static void shm_copy(struct shm *s, unsigned long long pos, void *buf,
+                     size_t len, int to_ring)
+{
+	size_t off = pos & (s->h->size - 1);
+	size_t first = s->h->size - off < len ? s->h->size - off : len;
+
+	if (to_ring) {
+		memcpy(s->data + off, buf, first);
+		memcpy(s->data, (unsigned char *) buf + first, len - first);
+	} else {
+		memcpy(buf, s->data + off, first);
+		memcpy((unsigned char *) buf + first, s->data, len - first);
+	}
+}
+
+static int shm_sink_setup(struct pl_node *n, const struct pl_format *in,
+                          struct pl_format *out)
+{
+	struct shm *s = n->priv;
+	size_t size = 64;
+	int fd;
+
+	/* a second of audio */
+	while (size < (size_t) in->rate * in->channels * sizeof(short int))
+		size <<= 1;
+	s->map_size = sizeof(struct shm_header) + size;
+
+	/* a stale ring from before would confuse the reader */
+	shm_unlink(s->args.arg);
+	fd = shm_open(s->args.arg, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, s->map_size) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	s->h = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s->h == MAP_FAILED) {
+		s->h = NULL;
+		return -errno;
+	}
+	s->data = (unsigned char *) (s->h + 1);
+
+	s->h->rate = in->rate;
+	s->h->channels = in->channels;
+	s->h->size = size;
+	atomic_init(&s->h->eof, 0);
+	atomic_init(&s->h->head, 0);
+	atomic_init(&s->h->tail, 0);
+	atomic_thread_fence(memory_order_release);
+	s->h->magic = SHM_MAGIC;
+
+	return 0;
+}
+
+/* never blocks: a full ring drops the period */
+static int shm_sink_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct shm *s = n->priv;
+	size_t len = (size_t) (*buf)->frames * (*buf)->channels * sizeof(short int);
+	unsigned long long head = atomic_load_explicit(&s->h->head, memory_order_relaxed);
+	unsigned long long tail = atomic_load_explicit(&s->h->tail, memory_order_acquire);
+
+	if (s->h->size - (head - tail) < len) {
+		s->dropped += (*buf)->frames;
+		return 0;
+	}
+
+	shm_copy(s, head, (*buf)->data, len, 1);
+	atomic_store_explicit(&s->h->head, head + len, memory_order_release);
+
+	return 0;
+}
+
+static void shm_print_stats(struct pl_node *n)
+{
+	struct shm *s = n->priv;
+
+	printf("  %-10s %9lu frames dropped\n", "", s->dropped);
+}
+
+static void shm_destroy(struct pl_node *n)
+{
+	struct shm *s = n->priv;
+
+	if (s->h == NULL)
+		return;
+
+	/* sink: tell the reader, source: the ring is done */
+	if (n->ops->kind == PL_SINK)
+		atomic_store_explicit(&s->h->eof, 1, memory_order_release);
+	else
+		shm_unlink(s->args.arg);
+
+	munmap(s->h, s->map_size);
+}
+
+static const struct pl_node_ops shm_sink_ops = {
+	.name = "shm",
+	.kind = PL_SINK,
+	.setup = shm_sink_setup,
+	.process = shm_sink_process,
+	.print_stats = shm_print_stats,
+	.destroy = shm_destroy,
+};
+
+static int shm_src_setup(struct pl_node *n, const struct pl_format *in,
+                         struct pl_format *out)
+{
+	struct shm *s = n->priv;
+	struct shm_header h;
+	int fd;
+
+	fd = shm_open(s->args.arg, O_RDWR, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != SHM_MAGIC ||
+	    h.size == 0 || (h.size & (h.size - 1))) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	s->map_size = sizeof(struct shm_header) + h.size;
+	s->h = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s->h == MAP_FAILED) {
+		s->h = NULL;
+		return -errno;
+	}
+	s->data = (unsigned char *) (s->h + 1);
+
+	out->rate = s->h->rate;
+	out->channels = s->h->channels;
+	out->period = period_frames(&s->args.cfg, s->h->rate);
+
+	return 0;
+}
+
+/* polls a quarter period at a time until there is a period, or the end */
+static int shm_src_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	struct shm *s = n->priv;
+	size_t frame_bytes = n->out.channels * sizeof(short int);
+	size_t len = n->out.period * frame_bytes;
+	struct timespec ts = { 0, s->args.cfg.period_time * 250L };
+	unsigned long long head, tail;
+	struct pl_buffer *b;
+
+	while (1) {
+		int eof = atomic_load_explicit(&s->h->eof, memory_order_acquire);
+
+		tail = atomic_load_explicit(&s->h->tail, memory_order_relaxed);
+		head = atomic_load_explicit(&s->h->head, memory_order_acquire);
+		if (head - tail >= len)
+			break;
+
+		/* what is left, after the sink is gone */
+		if (eof) {
+			len = (head - tail) / frame_bytes * frame_bytes;
+			if (len == 0)
+				return 0;
+			break;
+		}
+
+		if (atomic_load_explicit(&n->pipe->stop, memory_order_relaxed))
+			return 0;
+		nanosleep(&ts, NULL);
+	}
+
+	b = pl_buffer_get(n->pipe, n->out.channels);
+	if (b == NULL)
+		return -ENOBUFS;
+
+	shm_copy(s, tail, b->data, len, 0);
+	atomic_store_explicit(&s->h->tail, tail + len, memory_order_release);
+
+	b->frames = len / frame_bytes;
+	*buf = b;
+	return 0;
+}
+
+static const struct pl_node_ops shm_src_ops = {
+	.name = "shm",
+	.kind = PL_SOURCE,
+	.setup = shm_src_setup,
+	.process = shm_src_process,
+	.destroy = shm_destroy,
+};
+
+/*
+ * null: discards everything, for timing the rest
+ */
+
+static int null_setup(struct pl_node *n, const struct pl_format *in,
+                      struct pl_format *out)
+{
+	return 0;
+}
+
+static int null_process(struct pl_node *n, struct pl_buffer **buf)
+{
+	return 0;
+}
+
+static const struct pl_node_ops null_ops = {
+	.name = "null",
+	.kind = PL_SINK,
+	.setup = null_setup,
+	.process = null_process,
+};
+
+/*
+ * spec parsing
+ */
+
+static const struct {
+	const struct pl_node_ops *ops;
+	size_t priv_size;
+} node_types[] = {
+	{ &gen_ops, sizeof(struct gen) },
+	{ &file_src_ops, sizeof(struct file) },
+	{ &capture_ops, sizeof(struct device) },
+	{ &shm_src_ops, sizeof(struct shm) },
+	{ &gain_ops, sizeof(struct proc) },
+	{ &eq_ops, sizeof(struct proc) },
+	{ &route_ops, sizeof(struct router) },
+	{ &play_ops, sizeof(struct device) },
+	{ &file_sink_ops, sizeof(struct file) },
+	{ &shm_sink_ops, sizeof(struct shm) },
+	{ &null_ops, sizeof(struct node_args) },
+};
+
+struct pl_node *pl_node_parse(const char *spec, enum pl_kind kind,
+                              const struct pl_config *cfg)
+{
+	const char *colon = strchr(spec, ':');
+	size_t len = colon ? (size_t) (colon - spec) : strlen(spec);
+	unsigned int i;
+
+	for (i = 0; i < sizeof(node_types) / sizeof(node_types[0]); i++) {
+		const struct pl_node_ops *ops = node_types[i].ops;
+		struct node_args *args;
+		struct pl_node *n;
+
+		/* processing nodes fit wherever a source or sink was asked */
+		if (strlen(ops->name) != len || strncmp(ops->name, spec, len) ||
+		    (ops->kind != kind && ops->kind != PL_PROCESS))
+			continue;
+
+		n = pl_node_alloc(ops, node_types[i].priv_size);
+		if (n == NULL)
+			return NULL;
+
+		/* every private struct starts with the args */
+		args = n->priv;
+		args->arg = colon ? colon + 1 : "";
+		args->cfg = *cfg;
+
+		/* no file open until setup */
+		if (ops == &file_src_ops || ops == &file_sink_ops)
+			((struct file *) n->priv)->fd = -1;
+		return n;
+	}
+
+	printf("Unknown node: %s\n", spec);
+	return NULL;
+}
@@ -0,0 +1,40 @@
+/*
+ * Standard pipeline nodes
+ *
+ *   sources     gen:<freq>[,<channels>]     sine on every channel
+ *               file:<name>                 16 bit pcm wave file
+ *               capture:<device>[@<ch>]     capture pcm ("sim[:...]" works)
+ *               shm:<name>                  shared memory ring from a shm sink
+ *   processing  gain:<db>
+ *               eq:<type:freq:q[:gain_db]>  biquad, see dsp_parse_biquad()
+ *               route:<channels>|<spec>     channel routing - a new format:
+ *                                           i -> i, or "src:dst[:gain_db],..."
+ *   sinks       play:<device>               playback pcm
+ *               file:<name>                 16 bit pcm wave file
+ *               shm:<name>                  shared memory ring, never blocks
+ *               null
+ *
+ * The shared memory ring is single producer / single consumer across
+ * processes: the sink drops periods when the ring is full, the source
+ * polls when it is empty.
+ */
+
+#ifndef NODES_H
+#define NODES_H
+
+#include "pipeline.h"
+
+/* what the specs leave out */
+struct pl_config {
+	unsigned int rate;
+	unsigned int channels;
+	/* pcm buffer and period time in us, the period also paces sources */
+	unsigned int buffer_time;
+	unsigned int period_time;
+};
+
+/* "type:args" of 'kind' - NULL with a message when invalid */
+struct pl_node *pl_node_parse(const char *spec, enum pl_kind kind,
+                              const struct pl_config *cfg);
+
+#endif
@@ -0,0 +1,848 @@
+/*
+ * Thin pcm layer: alsa or a simulated device
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "pcm.h"
+
+/* frequency of the tone a simulated capture device delivers */
+#define SIM_TONE 1000.0
+
+struct pcm_sim {
+	struct pcm_sim_config cfg;
+
+	/* setup */
+	snd_pcm_stream_t stream;
+	unsigned int rate;
+	unsigned int channels;
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+	snd_pcm_uframes_t start_threshold;
+	snd_pcm_uframes_t avail_min;
+
+	/* device */
+	snd_pcm_state_t state;
+	double origin;
+	double now;
+	double start_time;
+	unsigned long long hw;
+	unsigned long long appl;
+	double phase;
+
+	/* statistics */
+	unsigned long wakeups;
+	unsigned long stalls;
+	unsigned long xruns;
+	unsigned long long transferred;
+	snd_pcm_sframes_t min_delay;
+	snd_pcm_sframes_t max_avail;
+	/* first frame played that is not silence - -1 while there is none */
+	long long first_sound;
+	double first_sound_time;
+};
+
+static double monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void sec_to_ts(double t, struct timespec *ts)
+{
+	ts->tv_sec = (time_t) t;
+	ts->tv_nsec = (long) ((t - ts->tv_sec) * 1e9);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * simulated device
+ */
+
+static double sim_time(struct pcm_sim *sim)
+{
+	return sim->cfg.realtime ? monotonic() : sim->now;
+}
+
+static void sim_sleep_until(struct pcm_sim *sim, double t)
+{
+	struct timespec ts;
+
+	if (!sim->cfg.realtime) {
+		if (t > sim->now)
+			sim->now = t;
+		return;
+	}
+
+	sec_to_ts(t, &ts);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* device frames per second of system time */
+static double sim_rate(struct pcm_sim *sim)
+{
+	return sim->rate * (1.0 + sim->cfg.skew_ppm * 1e-6);
+}
+
+/* system time of period interrupt 'k' */
+static double sim_interrupt_time(struct pcm_sim *sim, unsigned long long k)
+{
+	return sim->start_time + (double) k * sim->period_size / sim_rate(sim);
+}
+
+/* move the hw pointer to the last period interrupt, detect xruns */
+static void sim_update(struct pcm_sim *sim)
+{
+	unsigned long long k, hw;
+	double t;
+
+	if (sim->state != SND_PCM_STATE_RUNNING)
+		return;
+
+	t = sim_time(sim);
+	k = (unsigned long long) ((t - sim->start_time) * sim_rate(sim) /
+	                          sim->period_size);
+	/* rounding: sim_wait() sleeps until exactly this time */
+	if (sim_interrupt_time(sim, k + 1) <= t)
+		k++;
+	hw = k * sim->period_size;
+
+	if (sim->stream == SND_PCM_STREAM_PLAYBACK) {
+		/* played everything we had */
+		if (hw >= sim->appl) {
+			sim->hw = sim->appl;
+			sim->state = SND_PCM_STATE_XRUN;
+			sim->xruns++;
+			return;
+		}
+	} else {
+		/* buffer full */
+		if (hw - sim->appl >= sim->buffer_size) {
+			sim->hw = sim->appl + sim->buffer_size;
+			sim->state = SND_PCM_STATE_XRUN;
+			sim->xruns++;
+			return;
+		}
+	}
+
+	sim->hw = hw;
+}
+
+static snd_pcm_sframes_t sim_avail(struct pcm_sim *sim)
+{
+	if (sim->stream == SND_PCM_STREAM_PLAYBACK)
+		return sim->buffer_size - (sim->appl - sim->hw);
+
+	return sim->hw - sim->appl;
+}
+
+static void sim_start(struct pcm_sim *sim)
+{
+	sim->state = SND_PCM_STATE_RUNNING;
+	sim->start_time = sim_time(sim);
+	sim->hw = 0;
+
+	/* when the first sound will come out */
+	if (sim->first_sound >= 0 && sim->first_sound_time == 0)
+		sim->first_sound_time = sim->start_time + sim->first_sound / sim_rate(sim);
+}
+
+/* wake up at the application: maybe late because of a stall */
+static void sim_wakeup(struct pcm_sim *sim, double t)
+{
+	sim->wakeups++;
+
+	if (sim->cfg.stall_prob > 0 &&
+	    rand_r(&sim->cfg.seed) < sim->cfg.stall_prob * ((double) RAND_MAX + 1)) {
+		sim->stalls++;
+		t += sim->cfg.stall_time;
+	}
+
+	sim_sleep_until(sim, t);
+}
+
+/* block until 'need' frames can be transferred, or an xrun */
+static void sim_wait(struct pcm_sim *sim, snd_pcm_uframes_t need)
+{
+	while (1) {
+		unsigned long long target, k;
+
+		sim_update(sim);
+		if (sim->state != SND_PCM_STATE_RUNNING ||
+		    sim_avail(sim) >= (snd_pcm_sframes_t) need)
+			return;
+
+		/* first period interrupt with enough frames */
+		if (sim->stream == SND_PCM_STREAM_PLAYBACK)
+			target = sim->appl + need - sim->buffer_size;
+		else
+			target = sim->appl + need;
+		k = (target + sim->period_size - 1) / sim->period_size;
+
+		sim_wakeup(sim, sim_interrupt_time(sim, k));
+	}
+}
+
+static void sim_generate(struct pcm_sim *sim, short int *buffer,
+                         snd_pcm_uframes_t frames)
+{
+	double step = 2 * M_PI * SIM_TONE / sim->rate;
+	snd_pcm_uframes_t i;
+	unsigned int c;
+
+	for (i = 0; i < frames; i++) {
+		short int v = (short int) (sin(sim->phase) * 16384);
+
+		for (c = 0; c < sim->channels; c++)
+			*buffer++ = v;
+
+		sim->phase += step;
+		if (sim->phase >= 2 * M_PI)
+			sim->phase -= 2 * M_PI;
+	}
+}
+
+/* remember the first frame that is not silence, to check scheduling */
+static void sim_find_sound(struct pcm_sim *sim, const short int *buffer,
+                           snd_pcm_uframes_t frames)
+{
+	snd_pcm_uframes_t i;
+
+	for (i = 0; i < frames * sim->channels; i++)
+		if (buffer[i]) {
+			sim->first_sound = sim->appl + i / sim->channels;
+			if (sim->state == SND_PCM_STATE_RUNNING)
+				sim->first_sound_time = sim->start_time +
+				                        sim->first_sound / sim_rate(sim);
+			return;
+		}
+}
+
+static snd_pcm_sframes_t sim_transfer(struct pcm_sim *sim, void *buffer,
+                                      snd_pcm_uframes_t size)
+{
+	snd_pcm_sframes_t total = 0, avail;
+
+	sim_update(sim);
+	if (sim->state == SND_PCM_STATE_XRUN)
+		return -EPIPE;
+	if (sim->state != SND_PCM_STATE_PREPARED &&
+	    sim->state != SND_PCM_STATE_RUNNING)
+		return -EBADFD;
+
+	while (size > 0) {
+		snd_pcm_uframes_t n;
+
+		avail = sim_avail(sim);
+
+		/* fill level statistics */
+		if (sim->state == SND_PCM_STATE_RUNNING) {
+			if (sim->stream == SND_PCM_STREAM_PLAYBACK &&
+			    (sim->min_delay < 0 ||
+			     (snd_pcm_sframes_t) sim->buffer_size - avail < sim->min_delay))
+				sim->min_delay = sim->buffer_size - avail;
+			if (avail > sim->max_avail)
+				sim->max_avail = avail;
+		}
+
+		/* not started capture has nothing to give */
+		if (sim->stream == SND_PCM_STREAM_CAPTURE &&
+		    sim->state == SND_PCM_STATE_PREPARED)
+			return total ? total : -EBADFD;
+
+		/* block like alsa: wait for avail_min unless all fits */
+		if ((snd_pcm_uframes_t) avail < size &&
+		    (snd_pcm_uframes_t) avail < sim->avail_min) {
+			if (sim->state != SND_PCM_STATE_RUNNING)
+				return total ? total : -EAGAIN;
+
+			sim_wait(sim, sim->avail_min < size ? sim->avail_min : size);
+			if (sim->state == SND_PCM_STATE_XRUN)
+				return total ? total : -EPIPE;
+			continue;
+		}
+
+		n = (snd_pcm_uframes_t) avail < size ? (snd_pcm_uframes_t) avail : size;
+
+		if (sim->stream == SND_PCM_STREAM_CAPTURE)
+			sim_generate(sim, (short int *) buffer + total * sim->channels, n);
+		else if (sim->first_sound < 0)
+			sim_find_sound(sim, (short int *) buffer + total * sim->channels, n);
+
+		sim->appl += n;
+		sim->transferred += n;
+		total += n;
+		size -= n;
+
+		/* start threshold */
+		if (sim->stream == SND_PCM_STREAM_PLAYBACK &&
+		    sim->state == SND_PCM_STATE_PREPARED &&
+		    sim->appl >= sim->start_threshold)
+			sim_start(sim);
+	}
+
+	return total;
+}
+
+static int sim_parse(struct pcm_sim_config *cfg, const char *name)
+{
+	const char *p = name + 3;
+	char key[16];
+	double value;
+	int len;
+
+	/* defaults */
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->stall_time = 0.005;
+	cfg->seed = 1;
+
+	if (*p == ':')
+		p++;
+
+	while (*p) {
+		if (!strncmp(p, "rt", 2) && (p[2] == ',' || p[2] == '\0')) {
+			cfg->realtime = 1;
+			len = 2;
+		} else if (sscanf(p, "%15[a-z_]=%lf%n", key, &value, &len) == 2) {
+			if (!strcmp(key, "skew"))
+				cfg->skew_ppm = value;
+			else if (!strcmp(key, "stall"))
+				cfg->stall_prob = value;
+			else if (!strcmp(key, "stall_ms"))
+				cfg->stall_time = value / 1000.0;
+			else if (!strcmp(key, "seed"))
+				cfg->seed = (unsigned int) value;
+			else if (!strcmp(key, "rate"))
+				cfg->rate = (unsigned int) value;
+			else {
+				printf("Unknown sim option: %s\n", key);
+				return -EINVAL;
+			}
+		} else {
+			printf("Invalid sim option: %s\n", p);
+			return -EINVAL;
+		}
+
+		p += len;
+		if (*p == ',')
+			p++;
+	}
+
+	return 0;
+}
+
+/*
+ * public interface
+ */
+
+int pcm_open(struct pcm **pcm, const char *name, snd_pcm_stream_t stream)
+{
+	struct pcm *p;
+	int err;
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return -ENOMEM;
+	p->stream = stream;
+
+	if (strncmp(name, "sim", 3) || (name[3] != '\0' && name[3] != ':')) {
+		err = snd_pcm_open(&p->handle, name, stream, 0);
+		if (err < 0) {
+			free(p);
+			return err;
+		}
+		*pcm = p;
+		return 0;
+	}
+
+	p->sim = calloc(1, sizeof(*p->sim));
+	if (p->sim == NULL) {
+		free(p);
+		return -ENOMEM;
+	}
+
+	err = sim_parse(&p->sim->cfg, name);
+	if (err < 0) {
+		free(p->sim);
+		free(p);
+		return err;
+	}
+
+	p->sim->state = SND_PCM_STATE_OPEN;
+	p->sim->min_delay = -1;
+	p->sim->first_sound = -1;
+
+	*pcm = p;
+	return 0;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+	int err = 0;
+
+	if (pcm->handle)
+		err = snd_pcm_close(pcm->handle);
+	free(pcm->sim);
+	free(pcm);
+
+	return err;
+}
+
+static int set_hwparams(snd_pcm_t *handle, struct pcm_config *cfg)
+{
+	snd_pcm_hw_params_t *params;
+	unsigned int rate = cfg->rate;
+	int err, dir;
+
+	snd_pcm_hw_params_alloca(&params);
+
+	/* preset parameters with all possible ranges */
+	err = snd_pcm_hw_params_any(handle, params);
+	if (err < 0) {
+		printf("No configurations available: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	/* native rate: whatever rate near the request the hardware runs */
+	err = snd_pcm_hw_params_set_rate_resample(handle, params, !cfg->native_rate);
+	if (err < 0) {
+		printf("Setting resampling failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+	if (err < 0) {
+		printf("Setting access failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	/* timer mode: we don't want to be woken up on every period */
+	if (cfg->timer) {
+		if (snd_pcm_hw_params_can_disable_period_wakeup(params)) {
+			err = snd_pcm_hw_params_set_period_wakeup(handle, params, 0);
+			if (err < 0) {
+				printf("Disabling period wakeups failed: %s\n", snd_strerror(err));
+				return err;
+			}
+		} else
+			printf("Device can't disable period wakeups\n");
+	}
+
+	err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE);
+	if (err < 0) {
+		printf("Setting sample format failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_set_channels(handle, params, cfg->channels);
+	if (err < 0) {
+		printf("Setting channels failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0);
+	if (err < 0) {
+		printf("Setting rate near failed: %s\n", snd_strerror(err));
+		return err;
+	}
+	if (rate != cfg->rate && !cfg->native_rate) {
+		printf("Requested rate mismatch (%i <-> %i)\n", cfg->rate, rate);
+		return -EINVAL;
+	}
+	cfg->rate = rate;
+
+	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &cfg->buffer_time, &dir);
+	if (err < 0) {
+		printf("Set buffer time near failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_get_buffer_size(params, &cfg->buffer_size);
+	if (err < 0) {
+		printf("Unable to get buffer size: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_set_period_time_near(handle, params, &cfg->period_time, &dir);
+	if (err < 0) {
+		printf("Set period_time_near failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params_get_period_size(params, &cfg->period_size, &dir);
+	if (err < 0) {
+		printf("Unable to get period size: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_hw_params(handle, params);
+	if (err < 0) {
+		printf("Unable to set hw params: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	return 0;
+}
+
+static int set_swparams(snd_pcm_t *handle, struct pcm_config *cfg)
+{
+	snd_pcm_sw_params_t *params;
+	int err;
+
+	snd_pcm_sw_params_alloca(&params);
+
+	err = snd_pcm_sw_params_current(handle, params);
+	if (err < 0) {
+		printf("Unable to get current swparams: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_sw_params_set_start_threshold(handle, params, cfg->start_threshold);
+	if (err < 0) {
+		printf("Setting start threshold failed: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	err = snd_pcm_sw_params_set_avail_min(handle, params, cfg->avail_min);
+	if (err < 0) {
+		printf("Unable to set avail min: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	if (cfg->tstamp) {
+		err = snd_pcm_sw_params_set_tstamp_mode(handle, params, SND_PCM_TSTAMP_ENABLE);
+		if (err < 0) {
+			printf("Unable to set tstamp mode: %s\n", snd_strerror(err));
+			return err;
+		}
+
+		err = snd_pcm_sw_params_set_tstamp_type(handle, params, SND_PCM_TSTAMP_TYPE_MONOTONIC);
+		if (err < 0) {
+			printf("Unable to set tstamp type: %s\n", snd_strerror(err));
+			return err;
+		}
+	}
+
+	err = snd_pcm_sw_params(handle, params);
+	if (err < 0) {
+		printf("Unable to set sw params: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	return 0;
+}
+
+int pcm_configure(struct pcm *pcm, struct pcm_config *cfg)
+{
+	int err;
+
+	if (pcm->sim) {
+		if (cfg->native_rate && pcm->sim->cfg.rate)
+			cfg->rate = pcm->sim->cfg.rate;
+		cfg->buffer_size = (snd_pcm_uframes_t) cfg->rate * cfg->buffer_time / 1000000;
+		cfg->period_size = (snd_pcm_uframes_t) cfg->rate * cfg->period_time / 1000000;
+	} else {
+		err = set_hwparams(pcm->handle, cfg);
+		if (err < 0)
+			return err;
+	}
+
+	if (cfg->period_size == 0)
+		return -EINVAL;
+	if (cfg->start_threshold == 0)
+		cfg->start_threshold = (cfg->buffer_size / cfg->period_size) * cfg->period_size;
+	if (cfg->avail_min == 0)
+		cfg->avail_min = cfg->timer ? cfg->buffer_size : cfg->period_size;
+
+	if (pcm->sim)
+		return pcm_sim_configure(pcm, cfg->rate, cfg->channels, cfg->buffer_size,
+		                         cfg->period_size, cfg->start_threshold,
+		                         cfg->avail_min);
+
+	return set_swparams(pcm->handle, cfg);
+}
+
+int pcm_sim_configure(struct pcm *pcm, unsigned int rate,
+                      unsigned int channels,
+                      snd_pcm_uframes_t buffer_size,
+                      snd_pcm_uframes_t period_size,
+                      snd_pcm_uframes_t start_threshold,
+                      snd_pcm_uframes_t avail_min)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	if (sim == NULL || period_size == 0 || buffer_size < period_size)
+		return -EINVAL;
+
+	sim->stream = pcm->stream;
+	sim->rate = rate;
+	sim->channels = channels;
+	sim->buffer_size = buffer_size;
+	sim->period_size = period_size;
+	sim->start_threshold = start_threshold;
+	sim->avail_min = avail_min;
+	sim->state = SND_PCM_STATE_PREPARED;
+	sim->origin = sim_time(sim);
+
+	return 0;
+}
+
+snd_pcm_sframes_t pcm_writei(struct pcm *pcm, const void *buffer,
+                             snd_pcm_uframes_t size)
+{
+	snd_pcm_sframes_t n;
+
+	if (pcm->sim)
+		n = sim_transfer(pcm->sim, (void *) buffer, size);
+	else
+		n = snd_pcm_writei(pcm->handle, buffer, size);
+
+	if (n > 0)
+		pcm->appl += n;
+	return n;
+}
+
+snd_pcm_sframes_t pcm_readi(struct pcm *pcm, void *buffer,
+                            snd_pcm_uframes_t size)
+{
+	snd_pcm_sframes_t n;
+
+	if (pcm->sim)
+		n = sim_transfer(pcm->sim, buffer, size);
+	else
+		n = snd_pcm_readi(pcm->handle, buffer, size);
+
+	if (n > 0)
+		pcm->appl += n;
+	return n;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+	if (pcm->sim == NULL)
+		return snd_pcm_start(pcm->handle);
+
+	if (pcm->sim->state != SND_PCM_STATE_PREPARED)
+		return -EBADFD;
+
+	sim_start(pcm->sim);
+	return 0;
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	if (sim == NULL)
+		return snd_pcm_wait(pcm->handle, timeout);
+
+	sim_wait(sim, sim->avail_min ? sim->avail_min : 1);
+	return 1;
+}
+
+int pcm_drain(struct pcm *pcm)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	if (sim == NULL)
+		return snd_pcm_drain(pcm->handle);
+
+	/* a stream shorter than the start threshold starts now */
+	if (sim->stream == SND_PCM_STREAM_PLAYBACK && sim->appl > 0) {
+		if (sim->state == SND_PCM_STATE_PREPARED)
+			sim_start(sim);
+		if (sim->state == SND_PCM_STATE_RUNNING) {
+			sim_sleep_until(sim, sim->start_time + sim->appl / sim_rate(sim));
+			sim->hw = sim->appl;
+		}
+	}
+
+	sim->state = SND_PCM_STATE_SETUP;
+	return 0;
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	pcm->appl = 0;
+	if (sim == NULL)
+		return snd_pcm_prepare(pcm->handle);
+
+	sim->state = SND_PCM_STATE_PREPARED;
+	sim->hw = 0;
+	sim->appl = 0;
+
+	return 0;
+}
+
+snd_pcm_state_t pcm_state(struct pcm *pcm)
+{
+	if (pcm->sim == NULL)
+		return snd_pcm_state(pcm->handle);
+
+	sim_update(pcm->sim);
+	return pcm->sim->state;
+}
+
+int pcm_avail_delay(struct pcm *pcm, snd_pcm_sframes_t *avail,
+                    snd_pcm_sframes_t *delay)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	if (sim == NULL)
+		return snd_pcm_avail_delay(pcm->handle, avail, delay);
+
+	sim_update(sim);
+	*avail = sim_avail(sim);
+	if (sim->stream == SND_PCM_STREAM_PLAYBACK)
+		*delay = sim->appl - sim->hw;
+	else
+		*delay = sim->hw - sim->appl;
+
+	return 0;
+}
+
+int pcm_status(struct pcm *pcm, snd_pcm_state_t *state,
+               snd_pcm_uframes_t *avail, snd_pcm_sframes_t *delay,
+               struct timespec *tstamp)
+{
+	snd_pcm_status_t *status;
+	snd_pcm_sframes_t a;
+	int err;
+
+	if (pcm->sim) {
+		*state = pcm_state(pcm);
+		pcm_avail_delay(pcm, &a, delay);
+		*avail = a;
+		sec_to_ts(sim_time(pcm->sim), tstamp);
+		return 0;
+	}
+
+	snd_pcm_status_alloca(&status);
+
+	err = snd_pcm_status(pcm->handle, status);
+	if (err < 0)
+		return err;
+
+	*state = snd_pcm_status_get_state(status);
+	*avail = snd_pcm_status_get_avail(status);
+	*delay = snd_pcm_status_get_delay(status);
+	snd_pcm_status_get_htstamp(status, tstamp);
+
+	/* no timestamps from this device - now is close enough */
+	if (tstamp->tv_sec == 0 && tstamp->tv_nsec == 0)
+		clock_gettime(CLOCK_MONOTONIC, tstamp);
+
+	return 0;
+}
+
+int pcm_position(struct pcm *pcm, double *played, double *tstamp)
+{
+	struct pcm_sim *sim = pcm->sim;
+	snd_pcm_uframes_t avail, buffer_size, period_size;
+	snd_pcm_sframes_t a, delay;
+	struct timespec ts;
+	int err;
+
+	if (sim) {
+		sim_update(sim);
+		if (sim->state != SND_PCM_STATE_RUNNING)
+			return -EBADFD;
+
+		/* the hw pointer moved at the last period interrupt */
+		*played = sim->hw;
+		*tstamp = sim_interrupt_time(sim, sim->hw / sim->period_size);
+		return 0;
+	}
+
+	if (snd_pcm_state(pcm->handle) != SND_PCM_STATE_RUNNING)
+		return -EBADFD;
+
+	err = snd_pcm_get_params(pcm->handle, &buffer_size, &period_size);
+	if (err < 0)
+		return err;
+
+	/* the hw pointer and when it was there */
+	err = snd_pcm_htimestamp(pcm->handle, &avail, &ts);
+	if (err < 0)
+		return err;
+	*tstamp = ts.tv_sec + ts.tv_nsec / 1e9;
+
+	/* no timestamps from this device - now is close enough */
+	if (ts.tv_sec == 0 && ts.tv_nsec == 0)
+		*tstamp = monotonic();
+
+	err = snd_pcm_avail_delay(pcm->handle, &a, &delay);
+
+	/* capture: read plus available, plus what fifo and codec still hold */
+	if (pcm->stream == SND_PCM_STREAM_CAPTURE) {
+		*played = (double) pcm->appl + avail;
+		if (err == 0 && delay > a)
+			*played += delay - a;
+		return 0;
+	}
+
+	/* playback: fifo and codec, what delay adds to the queued frames */
+	*played = (double) pcm->appl - (buffer_size - avail);
+	if (err == 0 && delay > (snd_pcm_sframes_t) buffer_size - a)
+		*played -= delay - ((snd_pcm_sframes_t) buffer_size - a);
+
+	return 0;
+}
+
+double pcm_now(struct pcm *pcm)
+{
+	if (pcm->sim)
+		return sim_time(pcm->sim);
+
+	return monotonic();
+}
+
+void pcm_sleep_until(struct pcm *pcm, double t)
+{
+	struct timespec ts;
+
+	if (pcm->sim) {
+		sim_wakeup(pcm->sim, t);
+		return;
+	}
+
+	sec_to_ts(t, &ts);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+void pcm_print_stats(struct pcm *pcm)
+{
+	struct pcm_sim *sim = pcm->sim;
+
+	if (sim == NULL)
+		return;
+
+	printf("sim: %.3f s, %llu frames, %lu wakeups, %lu stalls, %lu xruns\n",
+	       sim_time(sim) - sim->origin, sim->transferred,
+	       sim->wakeups, sim->stalls, sim->xruns);
+
+	if (sim->stream == SND_PCM_STREAM_PLAYBACK)
+		printf("sim: lowest fill level %ld frames (%.2f ms)\n",
+		       sim->min_delay, sim->min_delay * 1000.0 / sim->rate);
+	else
+		printf("sim: highest fill level %ld frames (%.2f ms)\n",
+		       sim->max_avail, sim->max_avail * 1000.0 / sim->rate);
+
+	if (sim->first_sound_time > 0)
+		printf("sim: first sound at frame %lld, %.6f s\n",
+		       sim->first_sound, sim->first_sound_time);
+}
@@ -0,0 +1,121 @@
+/*
+ * Thin pcm layer: alsa or a simulated device
+ *
+ * "sim[:option,...]" opens a simulated device, everything else goes to
+ * snd_pcm_open() - so "null" or a "file" plugin definition work too.
+ *
+ * The simulated device models a ring buffer whose hw pointer moves at
+ * period interrupts, a device clock with configurable skew against the
+ * system clock, and scheduling stalls injected at wakeups. By default
+ * it runs in virtual time: blocking calls advance the clock instead of
+ * sleeping, so the loops run as fast as the cpu allows.
+ *
+ * sim options:
+ *   skew=<ppm>      device clock skew
+ *   stall=<p>       probability of a stall per wakeup
+ *   stall_ms=<ms>   length of a stall
+ *   seed=<n>        random seed for the stalls
+ *   rate=<hz>       the only native rate, see pcm_config.native_rate
+ *   rt              pace with the real clock instead of virtual time
+ */
+
+#ifndef PCM_H
+#define PCM_H
+
+#include "alsa/asoundlib.h"
+
+struct pcm_sim_config {
+	double skew_ppm;
+	double stall_prob;
+	double stall_time;
+	unsigned int seed;
+	/* native rate - 0 = any */
+	unsigned int rate;
+	int realtime;
+};
+
+struct pcm_sim;
+
+struct pcm {
+	/* one of both */
+	snd_pcm_t *handle;
+	struct pcm_sim *sim;
+	snd_pcm_stream_t stream;
+	/* frames transferred since the last prepare */
+	unsigned long long appl;
+};
+
+/*
+ * S16_LE interleaved with the common hw and sw params. Times are in us,
+ * zero thresholds mean the defaults: start when the periods that fit the
+ * buffer are filled, wake up per period.
+ */
+struct pcm_config {
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int buffer_time;
+	unsigned int period_time;
+	snd_pcm_uframes_t start_threshold;
+	snd_pcm_uframes_t avail_min;
+	/* monotonic timestamps for pcm_status() and pcm_position() */
+	int tstamp;
+	/* timer scheduling: no period wakeups, avail_min defaults to the buffer */
+	int timer;
+	/* no alsa resampling: the rate becomes the native rate nearest to it */
+	int native_rate;
+
+	/* filled in by pcm_configure() */
+	snd_pcm_uframes_t buffer_size;
+	snd_pcm_uframes_t period_size;
+};
+
+int pcm_open(struct pcm **pcm, const char *name, snd_pcm_stream_t stream);
+int pcm_close(struct pcm *pcm);
+
+/* hw and sw params, or the sizes alsa would most likely pick when simulated */
+int pcm_configure(struct pcm *pcm, struct pcm_config *cfg);
+
+/* the simulated device has no hw/sw params */
+int pcm_sim_configure(struct pcm *pcm, unsigned int rate,
+                      unsigned int channels,
+                      snd_pcm_uframes_t buffer_size,
+                      snd_pcm_uframes_t period_size,
+                      snd_pcm_uframes_t start_threshold,
+                      snd_pcm_uframes_t avail_min);
+
+snd_pcm_sframes_t pcm_writei(struct pcm *pcm, const void *buffer,
+                             snd_pcm_uframes_t size);
+snd_pcm_sframes_t pcm_readi(struct pcm *pcm, void *buffer,
+                            snd_pcm_uframes_t size);
+int pcm_start(struct pcm *pcm);
+/* until avail_min frames can be transferred - snd_pcm_wait() */
+int pcm_wait(struct pcm *pcm, int timeout);
+/* playback: returns when everything written is played */
+int pcm_drain(struct pcm *pcm);
+int pcm_prepare(struct pcm *pcm);
+snd_pcm_state_t pcm_state(struct pcm *pcm);
+int pcm_avail_delay(struct pcm *pcm, snd_pcm_sframes_t *avail,
+                    snd_pcm_sframes_t *delay);
+
+/* state, avail, delay and the CLOCK_MONOTONIC (or virtual) time of both */
+int pcm_status(struct pcm *pcm, snd_pcm_state_t *state,
+               snd_pcm_uframes_t *avail, snd_pcm_sframes_t *delay,
+               struct timespec *tstamp);
+
+/*
+ * playback: frames played since the last prepare and the CLOCK_MONOTONIC
+ * (or virtual) time of that hw pointer update - snd_pcm_htimestamp()
+ * less the delay behind the hw pointer. Needs tstamp mode enabled with
+ * the monotonic tstamp type. -EBADFD when not running.
+ * capture: frames captured since the last prepare, the same way.
+ */
+int pcm_position(struct pcm *pcm, double *played, double *tstamp);
+
+/* CLOCK_MONOTONIC, or virtual time for the simulated device */
+double pcm_now(struct pcm *pcm);
+void pcm_sleep_until(struct pcm *pcm, double t);
+
+/* wakeups, stalls, xruns, fill level and first sound of the simulated device */
+void pcm_print_stats(struct pcm *pcm);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+ * Run a pipeline: a source, processing nodes and sinks
+ *
+ *   pipe gen:440 gain:-6 play:hw:1,0
+ *   pipe capture:sim eq:hp:80:0.7 file:out.wav shm:/mon
+ *   pipe "shm:/mon ! route:0:0,0:1 ! play:default"
+ *
+ * The nodes are separate arguments or '!' separated in one, see nodes.h.
+ * The first is the source, nodes after the first sink are sinks too.
+ *
+ * build: gcc -O2 pipe.c pipeline.c nodes.c pcm.c dsp.c route.c wav.c bufpool.c -o pipe -lasound -lm -lpthread -lrt
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "nodes.h"
+#include "bufpool.h"
+
+/* stop after this many frames - 0 = never */
+unsigned long long max_frames = 0;
+
+/* arena for the period and ring memory in MB - 0 = malloc */
+unsigned int pool_size = 16;
+
+/* defaults for the nodes */
+struct pl_config config = {
+	.rate = 44100,
+	.channels = 2,
+	.buffer_time = 20000,
+	.period_time = 2000,
+};
+
+static struct pipeline pipeline;
+
+static void stop(int sig)
+{
+	pipeline_stop(&pipeline);
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-r rate] [-c channels] [-b buffer_us] [-p period_us] [-n frames]\n"
+	       "          [-H pool_mb] source [processing...] sink [sink...]\n", name);
+	exit(EXIT_FAILURE);
+}
+
+/* one node spec, what kind follows from the position */
+static void add(char *spec, int *kind)
+{
+	struct pl_node *n;
+
+	n = pl_node_parse(spec, *kind, &config);
+	if (n == NULL)
+		exit(EXIT_FAILURE);
+
+	if (pipeline_add(&pipeline, n) < 0) {
+		free(n);
+		exit(EXIT_FAILURE);
+	}
+
+	/* after the source: processing until the first sink */
+	if (n->ops->kind == PL_SOURCE)
+		*kind = PL_SINK;
+}
+
+int main(int argc, char *argv[])
+{
+	int err, opt, i;
+	int kind = PL_SOURCE;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "r:c:b:p:n:H:")) != -1) {
+		switch (opt) {
+		case 'r':
+			config.rate = atoi(optarg);
+			break;
+		case 'c':
+			config.channels = atoi(optarg);
+			break;
+		case 'b':
+			config.buffer_time = atoi(optarg);
+			break;
+		case 'p':
+			config.period_time = atoi(optarg);
+			break;
+		case 'n':
+			max_frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'H':
+			pool_size = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind >= argc)
+		usage(argv[0]);
+
+	/* period and ring memory from one locked arena */
+	if (pool_size) {
+		err = bufpool_init((size_t) pool_size << 20);
+		if (err < 0)
+			printf("Buffer pool: %s, using malloc\n", strerror(-err));
+	}
+
+	pipeline_init(&pipeline);
+
+	for (i = optind; i < argc; i++) {
+		char *spec, *save = NULL;
+
+		for (spec = strtok_r(argv[i], "!", &save); spec;
+		     spec = strtok_r(NULL, "!", &save)) {
+			/* trim the spaces around '!' */
+			while (*spec == ' ')
+				spec++;
+			while (*spec && spec[strlen(spec) - 1] == ' ')
+				spec[strlen(spec) - 1] = '\0';
+			if (*spec)
+				add(spec, &kind);
+		}
+	}
+
+	err = pipeline_start(&pipeline);
+	if (err < 0) {
+		pipeline_destroy(&pipeline);
+		exit(EXIT_FAILURE);
+	}
+
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+
+	err = pipeline_run(&pipeline, max_frames);
+	if (err < 0)
+		printf("Pipeline error: %s\n", strerror(-err));
+
+	pipeline_print_stats(&pipeline);
+	pipeline_destroy(&pipeline);
+	bufpool_print_stats();
+
+	return err < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
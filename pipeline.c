@@ -0,0 +1,272 @@
+/*
+ * Pipeline engine: source -> processing -> sinks, a period at a time
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "pipeline.h"
+#include "bufpool.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct pl_node *pl_node_alloc(const struct pl_node_ops *ops, size_t priv_size)
+{
+	/* private data cache line aligned, it may hold vectors */
+	size_t offset = (sizeof(struct pl_node) + 63) & ~(size_t) 63;
+	struct pl_node *n;
+
+	if (posix_memalign((void **) &n, 64, offset + priv_size))
+		return NULL;
+	memset(n, 0, offset + priv_size);
+
+	n->ops = ops;
+	n->priv = (unsigned char *) n + offset;
+	return n;
+}
+
+void pipeline_init(struct pipeline *p)
+{
+	memset(p, 0, sizeof(*p));
+	atomic_init(&p->stop, 0);
+}
+
+int pipeline_add(struct pipeline *p, struct pl_node *n)
+{
+	enum pl_kind last = p->nr_nodes ? p->nodes[p->nr_nodes - 1]->ops->kind : PL_SOURCE;
+
+	if (p->nr_nodes == PL_MAX_NODES)
+		return -ENOSPC;
+
+	/* one source first, sinks last */
+	if ((p->nr_nodes == 0) != (n->ops->kind == PL_SOURCE) ||
+	    (last == PL_SINK && n->ops->kind != PL_SINK)) {
+		printf("%s: not allowed here\n", n->ops->name);
+		return -EINVAL;
+	}
+
+	n->pipe = p;
+	p->nodes[p->nr_nodes++] = n;
+	return 0;
+}
+
+int pipeline_start(struct pipeline *p)
+{
+	struct pl_format fmt, out;
+	unsigned int i, channels = 0, period = 0;
+	int err;
+
+	if (p->nr_nodes < 2 || p->nodes[p->nr_nodes - 1]->ops->kind != PL_SINK) {
+		printf("A pipeline needs a source and a sink\n");
+		return -EINVAL;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+
+	for (i = 0; i < p->nr_nodes; i++) {
+		struct pl_node *n = p->nodes[i];
+
+		out = fmt;
+		err = n->ops->setup(n, &fmt, &out);
+		if (err < 0) {
+			printf("%s: setup failed: %s\n", n->ops->name, strerror(-err));
+			return err;
+		}
+
+		if (out.channels == 0 || out.rate == 0 || out.period == 0) {
+			printf("%s: no format\n", n->ops->name);
+			return -EINVAL;
+		}
+
+		n->in = fmt;
+		n->out = out;
+		if (out.channels > channels)
+			channels = out.channels;
+		if (out.period > period)
+			period = out.period;
+
+		/* sinks all see the last processing node */
+		if (n->ops->kind != PL_SINK)
+			fmt = out;
+	}
+
+	/* the pool is sized for the widest format */
+	for (i = 0; i < PL_POOL_SIZE; i++) {
+		struct pl_buffer *b = &p->buffers[i];
+
+		b->data = bufpool_alloc((size_t) period * channels * sizeof(short int));
+		if (b->data == NULL)
+			return -ENOMEM;
+		b->pipe = p;
+		b->next = p->free;
+		p->free = b;
+	}
+
+	return 0;
+}
+
+/* one node, timed */
+static int call(struct pl_node *n, struct pl_buffer **buf)
+{
+	double start = now(), t;
+	int err;
+
+	err = n->ops->process(n, buf);
+
+	t = now() - start;
+	n->calls++;
+	n->time += t;
+	if (t > n->max_time)
+		n->max_time = t;
+	if (*buf)
+		n->frames += (*buf)->frames;
+
+	return err;
+}
+
+int pipeline_run(struct pipeline *p, unsigned long long max_frames)
+{
+	unsigned int i;
+	int err = 0;
+
+	while (!atomic_load_explicit(&p->stop, memory_order_relaxed) &&
+	       (max_frames == 0 || p->frames < max_frames)) {
+		struct pl_buffer *buf = NULL;
+
+		err = call(p->nodes[0], &buf);
+		if (err < 0 || buf == NULL || buf->frames == 0) {
+			if (buf)
+				pl_buffer_put(buf);
+			break;
+		}
+
+		/* exactly max_frames */
+		if (max_frames && buf->frames > max_frames - p->frames)
+			buf->frames = max_frames - p->frames;
+
+		for (i = 1; i < p->nr_nodes && err == 0; i++) {
+			struct pl_buffer *b = buf;
+
+			/* sinks only look, the buffer stays for the next one */
+			if (p->nodes[i]->ops->kind == PL_SINK)
+				err = call(p->nodes[i], &b);
+			else
+				err = call(p->nodes[i], &buf);
+		}
+
+		p->frames += buf->frames;
+		pl_buffer_put(buf);
+
+		/* a failed node stops the pipeline, like a failed source */
+		if (err < 0)
+			break;
+	}
+
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+void pipeline_stop(struct pipeline *p)
+{
+	atomic_store(&p->stop, 1);
+}
+
+void pipeline_print_stats(struct pipeline *p)
+{
+	unsigned int i;
+
+	printf("pipeline: %llu frames, %lu copies\n", p->frames, p->copies);
+
+	for (i = 0; i < p->nr_nodes; i++) {
+		struct pl_node *n = p->nodes[i];
+		double audio = (double) n->frames / n->out.rate;
+
+		printf("  %-10s %9lu calls, avg %8.1f us, max %8.1f us, %6.2f%% of real time\n",
+		       n->ops->name, n->calls,
+		       n->calls ? n->time * 1e6 / n->calls : 0.0,
+		       n->max_time * 1e6,
+		       audio > 0 ? 100.0 * n->time / audio : 0.0);
+
+		if (n->ops->print_stats)
+			n->ops->print_stats(n);
+	}
+}
+
+void pipeline_destroy(struct pipeline *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->nr_nodes; i++) {
+		if (p->nodes[i]->ops->destroy)
+			p->nodes[i]->ops->destroy(p->nodes[i]);
+		free(p->nodes[i]);
+	}
+
+	for (i = 0; i < PL_POOL_SIZE; i++)
+		bufpool_free(p->buffers[i].data);
+}
+
+/*
+ * buffers
+ */
+
+struct pl_buffer *pl_buffer_get(struct pipeline *p, unsigned int channels)
+{
+	struct pl_buffer *b = p->free;
+
+	if (b == NULL)
+		return NULL;
+
+	p->free = b->next;
+	b->refs = 1;
+	b->channels = channels;
+	b->frames = 0;
+	return b;
+}
+
+struct pl_buffer *pl_buffer_ref(struct pl_buffer *b)
+{
+	b->refs++;
+	return b;
+}
+
+void pl_buffer_put(struct pl_buffer *b)
+{
+	if (--b->refs)
+		return;
+
+	b->next = b->pipe->free;
+	b->pipe->free = b;
+}
+
+int pl_buffer_writable(struct pl_buffer **b)
+{
+	struct pl_buffer *copy;
+
+	if ((*b)->refs == 1)
+		return 0;
+
+	copy = pl_buffer_get((*b)->pipe, (*b)->channels);
+	if (copy == NULL)
+		return -ENOBUFS;
+
+	memcpy(copy->data, (*b)->data,
+	       (size_t) (*b)->frames * (*b)->channels * sizeof(short int));
+	copy->frames = (*b)->frames;
+	(*b)->pipe->copies++;
+
+	pl_buffer_put(*b);
+	*b = copy;
+	return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Pipeline engine: source -> processing -> sinks, a period at a time
+ *
+ * One source node delivers periods of interleaved S16 samples, the
+ * processing nodes work on them in order and every sink gets the
+ * result. Buffers come from a pool allocated at start and pass between
+ * the nodes by reference: a processing node writes in place when it
+ * holds the only reference and takes a new buffer only when it changes
+ * the format (or the buffer is shared), and all sinks share one buffer.
+ * The hot path never allocates.
+ *
+ * The pipeline runs in the calling thread, paced by whichever node
+ * blocks: a capture source or a playback sink. Every node keeps its own
+ * timing - calls, frames, total and worst time per call.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdatomic.h>
+
+#define PL_MAX_NODES 16
+/* buffers in the pool: the current one, a format change, a copy */
+#define PL_POOL_SIZE 4
+
+enum pl_kind {
+	PL_SOURCE,
+	PL_PROCESS,
+	PL_SINK,
+};
+
+struct pl_format {
+	unsigned int rate;
+	unsigned int channels;
+	/* frames per period - the most a buffer holds */
+	unsigned int period;
+};
+
+struct pipeline;
+
+struct pl_buffer {
+	struct pipeline *pipe;
+	/* only touched by the pipeline thread */
+	unsigned int refs;
+	unsigned int channels;
+	unsigned int frames;
+	short int *data;
+	struct pl_buffer *next;
+};
+
+struct pl_node;
+
+struct pl_node_ops {
+	const char *name;
+	enum pl_kind kind;
+
+	/*
+	 * 'in' is the format of the node before (empty for a source):
+	 * open devices and files, fill in 'out'. Sinks and nodes that do
+	 * not change the format get 'out' preset to 'in'.
+	 */
+	int (*setup)(struct pl_node *n, const struct pl_format *in,
+	             struct pl_format *out);
+
+	/*
+	 * source: *buf is NULL, deliver a buffer - 0 frames is the end.
+	 * processing: work on *buf, replace it when the format changes.
+	 * sink: consume *buf, take a reference to keep it.
+	 * Returns 0 or -errno, which stops the pipeline.
+	 */
+	int (*process)(struct pl_node *n, struct pl_buffer **buf);
+
+	/* statistics of its own, after the node timing */
+	void (*print_stats)(struct pl_node *n);
+	void (*destroy)(struct pl_node *n);
+};
+
+struct pl_node {
+	const struct pl_node_ops *ops;
+	struct pipeline *pipe;
+	void *priv;
+	struct pl_format in;
+	struct pl_format out;
+
+	/* timing */
+	unsigned long calls;
+	unsigned long long frames;
+	double time;
+	double max_time;
+};
+
+struct pipeline {
+	struct pl_node *nodes[PL_MAX_NODES];
+	unsigned int nr_nodes;
+
+	/* pool */
+	struct pl_buffer buffers[PL_POOL_SIZE];
+	struct pl_buffer *free;
+	unsigned long copies;
+
+	atomic_int stop;
+	unsigned long long frames;
+};
+
+/* node constructors (nodes.c) return nodes allocated with this */
+struct pl_node *pl_node_alloc(const struct pl_node_ops *ops, size_t priv_size);
+
+void pipeline_init(struct pipeline *p);
+
+/* in order: the source, processing nodes, sinks - the pipeline owns it */
+int pipeline_add(struct pipeline *p, struct pl_node *n);
+
+/* set up every node and the pool */
+int pipeline_start(struct pipeline *p);
+
+/* until the source ends, 'max_frames' (0 = no limit) or pipeline_stop() */
+int pipeline_run(struct pipeline *p, unsigned long long max_frames);
+
+/* any thread, signal handlers too */
+void pipeline_stop(struct pipeline *p);
+
+void pipeline_print_stats(struct pipeline *p);
+void pipeline_destroy(struct pipeline *p);
+
+/* a buffer with room for a period of 'channels', one reference - NULL when the pool is empty */
+struct pl_buffer *pl_buffer_get(struct pipeline *p, unsigned int channels);
+struct pl_buffer *pl_buffer_ref(struct pl_buffer *b);
+void pl_buffer_put(struct pl_buffer *b);
+
+/* make *b safe to write: copied when someone else holds a reference */
+int pl_buffer_writable(struct pl_buffer **b);
+
+#endif
@@ -1,10 +1,16 @@
 /*
  * Play back simple wave file
+ *
+ * build: gcc -O2 play.c pcm.c dsp.c route.c bufpool.c -o play -lasound -lm -lrt
  */
 
 #include "alsa/asoundlib.h"
 #include <math.h>
 
+#include "pcm.h"
+#include "dsp.h"
+#include "route.h"
+
 /* debugging */
 static snd_output_t *output = NULL;
 
@@ -12,11 +18,7 @@ static snd_output_t *output = NULL;
 static char *device = "hw:1,0";
 
 
-/* can alsa resample? */
-int hw_resample = 1;
-/* memory format */
-snd_pcm_access_t hw_access = SND_PCM_ACCESS_RW_INTERLEAVED;
-/* sample format */
+/* S16_LE interleaved, see pcm_configure() */
 snd_pcm_format_t hw_format = SND_PCM_FORMAT_S16_LE;
 /* number of channels */
 unsigned int hw_channels = 2;
@@ -39,140 +41,18 @@ unsigned int buffer_size;
 /* requested frequency */
 static double freq = 440;
 
+/* processing between generator and device - NULL when disabled */
+struct dsp_chain *dsp = NULL;
 
+/* routing of the mono sine to the device channels - NULL when disabled */
+struct route *route = NULL;
+/* mono samples, only used when routing */
+short int *src_buffer = NULL;
 
-/* set hw parameters */
-static int set_hwparams(snd_pcm_t *handle,
-                        snd_pcm_hw_params_t *params)
-{
-	int err;
-	unsigned int rrate; /* set_rate_near */
-	int dir; /* set_buffer_time_near */
-
-	/* preset parameters with all possible ranges */
-	err = snd_pcm_hw_params_any(handle, params);
-	if (err < 0) {
-		printf("No configurations available: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* enable/disable hardware resampling */
-	err = snd_pcm_hw_params_set_rate_resample(handle, params, hw_resample);
-	if (err < 0) {
-		printf("Setting resampling failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the read/write format interleaved/non-interleaved */
-	err = snd_pcm_hw_params_set_access(handle, params, hw_access);
-	if (err < 0) {
-		printf("Setting access failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the sample format */
-	err = snd_pcm_hw_params_set_format(handle, params, hw_format);
-	if (err < 0) {
-		printf("Setting sample format failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the count of channels */
-	err = snd_pcm_hw_params_set_channels(handle, params, hw_channels);
-	if (err < 0) {
-		printf("Setting channels failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set the stream rate */
-	rrate = hw_rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
-	if (err < 0) {
-		printf("Setting rate near failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	if (rrate != hw_rate) {
-		printf("Requested rate mismatch (%i <-> %i)\n", hw_rate, rrate);
-		return -EINVAL;
-	}
-
-	/* set/get a ring buffer close to buffer_timetime */
-	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &hw_buffer_time, &dir);
-	if (err < 0) {
-		printf("Set buffer time hear failed: %s\n", snd_strerror(err));
-		return err;
-	}
 
-	/* request the hw buffer size */
-	err = snd_pcm_hw_params_get_buffer_size(params, &hw_buffer_size);
-	if (err < 0) {
-		printf("Unable to get buffer size: %s\n", snd_strerror(err));
-		return err;
-	}
 
-	/* set/get period time close to requested time */
-	err = snd_pcm_hw_params_set_period_time_near(handle, params, &hw_period_time, &dir);
-	if (err < 0) {
-		printf("Set period_time_near failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* request period size in bytes */
-	err = snd_pcm_hw_params_get_period_size(params, &hw_period_size, &dir);
-	if (err < 0) {
-		printf("Unable to get period size: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* write the currently selected parameters to device */
-	err = snd_pcm_hw_params(handle, params);
-	if (err < 0) {
-		printf("Unable to set hw params: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	return 0;
-}
-
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *params)
-{
-	int err;
-	snd_pcm_uframes_t threshold = (hw_buffer_size / hw_period_size) * hw_period_size;
-
-	/* request the current swparams */
-	err = snd_pcm_sw_params_current(handle, params);
-	if (err < 0) {
-		printf("Unable to get current swparams: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* set transfer threshold - when to start? */
-	err = snd_pcm_sw_params_set_start_threshold(handle, params, threshold);
-	if (err < 0) {
-		printf("Setting start threshold failed: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* allow the transfer when at least period_size samples can be processed */
-	err = snd_pcm_sw_params_set_avail_min(handle, params, hw_period_size);
-	if (err < 0) {
-		printf("Unable to set avail min for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	/* write the parameters to the playback device */
-	err = snd_pcm_sw_params(handle, params);
-	if (err < 0) {
-		printf("Unable to set sw params for playback: %s\n", snd_strerror(err));
-		return err;
-	}
-
-	return 0;
-}
-
-static void generate_sine(short int *buffer,
-                          int count, double *_phase)
+static void generate_sine(short int *buffer, int count,
+                          unsigned int channels, double *_phase)
 {
 	static double max_phase = 2. * M_PI;
 	double phase = *_phase;
@@ -183,15 +63,15 @@ static void generate_sine(short int *buffer,
 
 	unsigned int i = 0, j = 0;
 
-	/* total area to fill = period * hw_channels */
-	count *= hw_channels;
+	/* total area to fill = period * channels */
+	count *= channels;
 	while (i < count) {
 
 		/* sample value */
 		int res = sin(phase) * maxval;
 
 		/* all channels contain the same data */
-		for (j = 0; j < hw_channels; j++)
+		for (j = 0; j < channels; j++)
 			buffer[i++] = (signed short) res; /* left */
 
 		/* move phase & reset if necessary */
@@ -204,7 +84,7 @@ static void generate_sine(short int *buffer,
 	*_phase = phase;
 }
 
-static int write_loop(snd_pcm_t *handle,
+static int write_loop(struct pcm *pcm,
                       short int *buffer)
 {
 	double phase = 0;
@@ -214,11 +94,18 @@ static int write_loop(snd_pcm_t *handle,
 
 	while (1) {
 
-		/* generate sine */
-		generate_sine(buffer, hw_period_size, &phase);
+		/* generate sine - once and route it, or in every channel */
+		if (route) {
+			generate_sine(src_buffer, hw_period_size, 1, &phase);
+			ptr = route_apply(route, src_buffer, buffer, hw_period_size);
+		} else {
+			generate_sine(buffer, hw_period_size, hw_channels, &phase);
+			ptr = buffer;
+		}
 
-		/* pointer to buffer */
-		ptr = buffer;
+		/* process */
+		if (dsp)
+			dsp_process(dsp, ptr, hw_period_size);
 
 		/* copy of size */
 		ptr_size = hw_period_size;
@@ -227,7 +114,7 @@ static int write_loop(snd_pcm_t *handle,
 		while (ptr_size > 0) {
 
 			/* write to module */
-			err = snd_pcm_writei(handle, ptr, ptr_size);
+			err = pcm_writei(pcm, ptr, ptr_size);
 
 			/* EAGAIN failure? -> retry */
 			if (err == -EAGAIN)
@@ -249,9 +136,46 @@ static int write_loop(snd_pcm_t *handle,
 int main(int argc, char *argv[])
 {
 	int err = 0;
+	struct pcm *pcm = NULL;
 	snd_pcm_t *handle = NULL;
-	snd_pcm_hw_params_t *hw_params = NULL;
-	snd_pcm_sw_params_t *sw_params = NULL;
+	struct pcm_config cfg;
+	const char *filter[DSP_MAX_BIQUADS];
+	unsigned int nr_filters = 0, i;
+	float gain = 0;
+	int use_dsp = 0;
+	const char *route_spec = NULL;
+	int use_route = 0;
+	int opt;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "g:e:c:r:")) != -1) {
+		switch (opt) {
+		case 'g':
+			gain = atof(optarg);
+			use_dsp = 1;
+			break;
+		case 'e':
+			if (nr_filters >= DSP_MAX_BIQUADS) {
+				printf("Too many filters\n");
+				exit(EXIT_FAILURE);
+			}
+			filter[nr_filters++] = optarg;
+			use_dsp = 1;
+			break;
+		case 'c':
+			hw_channels = atoi(optarg);
+			use_route = 1;
+			break;
+		case 'r':
+			route_spec = optarg;
+			use_route = 1;
+			break;
+		default:
+			printf("Usage: %s [-g gain_db] [-e type:freq:q[:gain_db]] [-c channels] [-r 0:dst[:gain_db],...]\n",
+			       argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
 
 	/* attach snd output to stdio - debug purposes */
 	err = snd_output_stdio_attach(&output, stdout, 0);
@@ -260,43 +184,43 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	/* allocate memory for hw/sw parameters */
-	snd_pcm_hw_params_alloca(&hw_params);
-	snd_pcm_sw_params_alloca(&sw_params);
-
 	/* open devicehandle */
-	err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+	err = pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK);
 	if (err < 0) {
 		printf("Playback open error: %s\n", snd_strerror(err));
 		return 0;
 	}
-
-	/* set hw parameters */
-	err = set_hwparams(handle, hw_params);
+	handle = pcm->handle;
+
+	/* set hw and sw parameters */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.rate = hw_rate;
+	cfg.channels = hw_channels;
+	cfg.buffer_time = hw_buffer_time;
+	cfg.period_time = hw_period_time;
+	err = pcm_configure(pcm, &cfg);
 	if (err < 0) {
-		printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+		printf("Setting of params failed: %s\n", snd_strerror(err));
 		exit(EXIT_FAILURE);
 	}
+	hw_buffer_time = cfg.buffer_time;
+	hw_buffer_size = cfg.buffer_size;
+	hw_period_time = cfg.period_time;
+	hw_period_size = cfg.period_size;
 
 	printf("hw_buffer_time: %u\n", hw_buffer_time);
-	printf("hw_buffer_size: %u\n", hw_buffer_size);
+	printf("hw_buffer_size: %lu\n", hw_buffer_size);
 
 	printf("hw_period_time: %u\n", hw_period_time);
-	printf("hw_period_size: %u\n", hw_period_size);
+	printf("hw_period_size: %lu\n", hw_period_size);
 
 	printf("phys width: %u\n",  snd_pcm_format_physical_width(hw_format));
 
-	/* set sw parameters */
-	err = set_swparams(handle, sw_params);
-	if (err < 0) {
-		printf("Setting of swparams failed: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
-	}
-
 	/* print configuration */
-	snd_pcm_dump(handle, output);
+	if (handle)
+		snd_pcm_dump(handle, output);
 
-	/* buffersize: allocate enough for 2 times a period */
+	/* buffersize: one period */
 	buffer_size = (hw_period_size * hw_channels *
 	               snd_pcm_format_physical_width(hw_format)) / 8;
 
@@ -307,15 +231,64 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* route the mono sine by spec or by channel map */
+	if (use_route) {
+		static const unsigned int mono[] = { SND_CHMAP_MONO };
+		snd_pcm_chmap_t *map;
+
+		route = malloc(sizeof(*route));
+		src_buffer = malloc(hw_period_size * sizeof(*src_buffer));
+		if (route == NULL || src_buffer == NULL) {
+			printf("No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (route_init(route, 1, hw_channels) < 0)
+			exit(EXIT_FAILURE);
+
+		if (route_spec) {
+			if (route_parse(route, route_spec) < 0)
+				exit(EXIT_FAILURE);
+		} else if (handle && (map = snd_pcm_get_chmap(handle)) != NULL) {
+			route_from_chmap(route, mono, map);
+			free(map);
+		} else
+			route_set(route, 0, 0, 0);
+
+		route_finalize(route);
+		route_print(route);
+	}
+
+	/* processing chain */
+	if (use_dsp) {
+		struct dsp_biquad b;
+
+		dsp = dsp_chain_create(hw_channels, hw_period_size, hw_rate);
+		if (dsp == NULL) {
+			printf("No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		dsp_set_gain(dsp, gain);
+		for (i = 0; i < nr_filters; i++) {
+			if (dsp_parse_biquad(filter[i], hw_rate, &b) < 0)
+				exit(EXIT_FAILURE);
+			dsp_set_biquad(dsp, i, &b);
+		}
+	}
+
 	/* write audio */
-	write_loop(handle, buffer);
+	write_loop(pcm, buffer);
 	if (err < 0)
 		printf("Transfer failed: %s\n", snd_strerror(err));
 
 	free(buffer);
+	free(src_buffer);
+	free(route);
+	dsp_chain_destroy(dsp);
 
 	/* close devicehandle */
-	snd_pcm_close(handle);
+	pcm_close(pcm);
 
 	return 0;
 }
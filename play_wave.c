@@ -1,22 +1,40 @@
 /*
  * Play back simple wave file
+ *
+ * build: gcc -O2 play_wave.c dsp.c route.c trace.c pcm.c wav.c wavindex.c ring.c alc.c decoder.c playout.c aec.c fft.c workers.c rcache.c bufpool.c uring.c -o play_wave -lasound -lm -lpthread -lrt
  */
 
 #include "alsa/asoundlib.h"
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dsp.h"
+#include "route.h"
+#include "trace.h"
+#include "pcm.h"
+#include "wav.h"
+#include "wavindex.h"
+#include "decoder.h"
+#include "playout.h"
+#include "aec.h"
+#include "workers.h"
+#include "rcache.h"
+#include "bufpool.h"
+#include "uring.h"
 
 /* debugging */
 static snd_output_t *output = NULL;
 
-/* playback device */
+/* playback device - "sim[:options]" for the simulated device */
 static char *device = "hw:1,0";
 
+/* stop after this many frames - 0 = never */
+unsigned long long max_frames = 0;
+
 
-/* can alsa resample? */
-int hw_resample = 1;
-/* memory format */
-snd_pcm_access_t hw_access = SND_PCM_ACCESS_RW_INTERLEAVED;
-/* sample format */
-snd_pcm_format_t hw_format = SND_PCM_FORMAT_S16_LE;
+/* S16_LE interleaved, see pcm_configure() */
 /* number of channels */
 unsigned int hw_channels = 2;
 /* preferred rate - this could differ from the actual rate! */
@@ -30,184 +48,416 @@ unsigned int hw_period_time = 2000;
 /* size of hw_period in frames - filled by application */
 snd_pcm_uframes_t hw_period_size;
 
+/* timer based scheduling: large buffer without period wakeups */
+int timer_sched = 0;
+/* requested hw ring buffer length in us in timer mode */
+unsigned int timer_buffer_time = 200000;
+/* initial safety margin in us in timer mode - adapted at runtime */
+unsigned int timer_margin_time = 4000;
+
+
+/* processing between file and device - NULL when disabled */
+struct dsp_chain *dsp = NULL;
+/* requested gain in dB */
+float dsp_gain = 0;
+/* requested filters */
+const char *dsp_filter[DSP_MAX_BIQUADS];
+unsigned int dsp_nr_filters = 0;
+/* accept dsp commands on stdin */
+int dsp_control = 0;
+/* split the dsp over this many pinned workers besides the audio thread - 0 = none */
+unsigned int dsp_workers = 0;
+/* cpu of the first worker */
+int dsp_first_cpu = 1;
+struct workers workers;
+
+
+/* number of channels in the file */
+unsigned int file_channels = 2;
+/* routing from file to device channels - NULL when not needed */
+struct route *route = NULL;
+/* explicit routing "src:dst[:gain_db],..." - by channel map otherwise */
+const char *route_spec = NULL;
+
+
+/* dump the hot path trace here on underrun - NULL when disabled */
+const char *trace_file = NULL;
+
 
 /* audio samples */
 short int*  buffer = NULL;
 unsigned int buffer_size;
+/* file samples, only used when routing */
+short int *src_buffer = NULL;
 
 /* file info */
 int fd;
 const char* filename = "the_guild.wav";
+/* start of the samples */
+off_t file_offset = 44;
+/* index written by wav_scan - saves parsing the header, NULL when unused */
+const char *index_filename = NULL;
+/* read ahead through io_uring, read() when the kernel has none */
+int use_uring = 0;
+/* the read ahead - NULL when reading directly */
+struct uring *uring = NULL;
+/* rate of the file - the device runs another one with the render cache */
+unsigned int file_rate;
+/* first frame to play */
+unsigned long long start_frame = 0;
+/* bytes of the data chunk still to play - chunks after it are no samples */
+unsigned long long file_left;
+/* no more samples in the file */
+int file_done = 0;
+
+/* decode-ahead for alc files - NULL for wave files */
+struct decoder *decoder = NULL;
+/* decoded frames kept ahead of the audio thread */
+unsigned int decoder_ahead_time = 2000000;
+
+
+/* start time: CLOCK_MONOTONIC seconds, "+seconds" from now - NULL = asap */
+const char *start_spec = NULL;
+/* start_spec is CLOCK_REALTIME */
+int start_realtime = 0;
+/* start_spec in CLOCK_MONOTONIC (or virtual) seconds */
+double start_time;
+/* scheduled start and position model - NULL when not scheduled */
+struct playout *playout = NULL;
+
+
+/* arena for the period and ring memory in MB - 0 = malloc */
+unsigned int pool_size = 16;
+
+/* device native renders instead of converting every play - NULL when disabled */
+const char *cache_dir = NULL;
+/* size limit of the cache in MB */
+unsigned int cache_size = 256;
+struct rcache rcache;
+/* upcoming playlist items, rendered in the background */
+char **playlist = NULL;
+unsigned int playlist_len = 0;
+
+
+/* publish what is played as echo reference for capture_wave -E - NULL when disabled */
+const char *aec_ref_name = NULL;
+struct aec_ref aec_ref;
 
 /* file was generated with:
    gst-launch-1.0 audiotestsrc wave=0 num-buffers=4096 ! audio/x-raw,format=S16LE,channels=2 ! wavenc ! filesink location=the_guild.wav */
 
-/* set hw parameters */
-static int set_hwparams(snd_pcm_t *handle,
-                        snd_pcm_hw_params_t *params)
+/* the format of the file from the index - -ENOENT when missing or stale */
+static int lookup_index(const struct stat *st, struct wav_info *info)
 {
+	const struct wav_index_entry *e;
+	struct wav_index idx;
+	char *path;
 	int err;
-	unsigned int rrate; /* set_rate_near */
-	int dir; /* set_buffer_time_near */
 
-	/* preset parameters with all possible ranges */
-	err = snd_pcm_hw_params_any(handle, params);
+	err = wav_index_open(&idx, index_filename);
 	if (err < 0) {
-		printf("No configurations available: %s\n", snd_strerror(err));
+		printf("Could not load index %s: %s\n", index_filename, strerror(-err));
 		return err;
 	}
 
-	/* enable/disable hardware resampling */
-	err = snd_pcm_hw_params_set_rate_resample(handle, params, hw_resample);
-	if (err < 0) {
-		printf("Setting resampling failed: %s\n", snd_strerror(err));
-		return err;
-	}
+	/* the index has real paths */
+	path = realpath(filename, NULL);
+	e = path ? wav_index_find(&idx, path) : NULL;
+	free(path);
 
-	/* set the read/write format interleaved/non-interleaved */
-	err = snd_pcm_hw_params_set_access(handle, params, hw_access);
-	if (err < 0) {
-		printf("Setting access failed: %s\n", snd_strerror(err));
-		return err;
+	if (e == NULL || !(e->flags & WAV_INDEX_VALID) ||
+	    e->file_size != (uint64_t) st->st_size ||
+	    e->mtime_ns != (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec) {
+		printf("%s not in index or stale\n", filename);
+		wav_index_close(&idx);
+		return -ENOENT;
 	}
 
-	/* set the sample format */
-	err = snd_pcm_hw_params_set_format(handle, params, hw_format);
-	if (err < 0) {
-		printf("Setting sample format failed: %s\n", snd_strerror(err));
-		return err;
-	}
+	memset(info, 0, sizeof(*info));
+	info->format = e->format;
+	info->channels = e->channels;
+	info->rate = e->rate;
+	info->bits = e->bits;
+	info->data_offset = e->data_offset;
+	info->frames = e->frames;
 
-	/* set the count of channels */
-	err = snd_pcm_hw_params_set_channels(handle, params, hw_channels);
-	if (err < 0) {
-		printf("Setting channels failed: %s\n", snd_strerror(err));
-		return err;
+	wav_index_close(&idx);
+	return 0;
+}
+
+/* alc file: the decoder thread reads it */
+static void open_alc_file(unsigned int rate)
+{
+	int err;
+
+	decoder = malloc(sizeof(*decoder));
+	if (decoder == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
 	}
 
-	/* set the stream rate */
-	rrate = hw_rate;
-	err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
+	err = decoder_open(decoder, filename,
+	                   (unsigned long long) rate * decoder_ahead_time / 1000000);
 	if (err < 0) {
-		printf("Setting rate near failed: %s\n", snd_strerror(err));
-		return err;
+		printf("Not a valid alc file: %s\n", strerror(-err));
+		exit(EXIT_FAILURE);
 	}
 
-	if (rrate != hw_rate) {
-		printf("Requested rate mismatch (%i <-> %i)\n", hw_rate, rrate);
-		return -EINVAL;
+	printf("file: %u channels, %u Hz, %llu frames, %lu blocks\n",
+	       decoder->header.channels, decoder->header.rate,
+	       (unsigned long long) decoder->frames, decoder->nr_seek);
+
+	file_channels = decoder->header.channels;
+	hw_rate = decoder->header.rate;
+
+	if (start_frame && decoder_seek(decoder, start_frame) < 0) {
+		printf("Start beyond the end of the file\n");
+		exit(EXIT_FAILURE);
 	}
 
-	/* set/get a ring buffer close to buffer_timetime */
-	err = snd_pcm_hw_params_set_buffer_time_near(handle, params, &hw_buffer_time, &dir);
-	if (err < 0) {
-		printf("Set buffer time hear failed: %s\n", snd_strerror(err));
-		return err;
+	/* no silence at the start */
+	decoder_wait(decoder);
+}
+
+/*
+ * open the file and take its format - from the index or the header;
+ * 'file_fd' is the file already open, or -1
+ */
+static void open_file(int file_fd)
+{
+	struct wav_info info;
+	struct stat st;
+	struct alc_header alc;
+	void *map;
+
+	printf("Trying to open file: %s\n", filename);
+	fd = file_fd >= 0 ? file_fd : open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		printf("Could not open: %s\n", filename);
+		exit(EXIT_FAILURE);
 	}
 
-	/* request the hw buffer size */
-	err = snd_pcm_hw_params_get_buffer_size(params, &hw_buffer_size);
-	if (err < 0) {
-		printf("Unable to get buffer size: %s\n", snd_strerror(err));
-		return err;
+	if (pread(fd, &alc, sizeof(alc), 0) == sizeof(alc) && alc.magic == ALC_MAGIC) {
+		close(fd);
+		open_alc_file(alc.rate);
+		return;
 	}
 
-	/* set/get period time close to requested time */
-	err = snd_pcm_hw_params_set_period_time_near(handle, params, &hw_period_time, &dir);
-	if (err < 0) {
-		printf("Set period_time_near failed: %s\n", snd_strerror(err));
-		return err;
+	if (index_filename == NULL || lookup_index(&st, &info) < 0) {
+		/* only the pages with chunk headers are read */
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED || wav_parse(map, st.st_size, &info) < 0) {
+			printf("Not a valid wave file: %s\n",
+			       map == MAP_FAILED ? strerror(errno) : info.error);
+			exit(EXIT_FAILURE);
+		}
+		munmap(map, st.st_size);
 	}
 
-	/* request period size in bytes */
-	err = snd_pcm_hw_params_get_period_size(params, &hw_period_size, &dir);
-	if (err < 0) {
-		printf("Unable to get period size: %s\n", snd_strerror(err));
-		return err;
+	if (info.format != WAV_FORMAT_PCM || info.bits != 16) {
+		printf("Only 16 bit pcm files are supported\n");
+		exit(EXIT_FAILURE);
 	}
 
-	/* write the currently selected parameters to device */
-	err = snd_pcm_hw_params(handle, params);
-	if (err < 0) {
-		printf("Unable to set hw params: %s\n", snd_strerror(err));
-		return err;
+	printf("file: %u channels, %u Hz, %llu frames\n",
+	       info.channels, info.rate, (unsigned long long) info.frames);
+
+	file_channels = info.channels;
+	hw_rate = info.rate;
+	file_rate = info.rate;
+	file_offset = info.data_offset;
+
+	if (start_frame > info.frames) {
+		printf("Start beyond the end of the file\n");
+		exit(EXIT_FAILURE);
 	}
 
-	return 0;
+	/* skip header */
+	lseek(fd, file_offset + start_frame * file_channels * 2, SEEK_SET);
+	file_left = (info.frames - start_frame) * file_channels * 2;
 }
 
-static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *params)
+static void fill_buffer(short int *buffer, int count)
 {
-	int err;
-	snd_pcm_uframes_t threshold = (hw_buffer_size / hw_period_size) * hw_period_size;
+	unsigned int size = file_channels * count * 2;
+	unsigned int size_to_read = size < file_left ? size : file_left;
+	ssize_t size_read;
 
-	/* request the current swparams */
-	err = snd_pcm_sw_params_current(handle, params);
-	if (err < 0) {
-		printf("Unable to get current swparams: %s\n", snd_strerror(err));
-		return err;
+	/* decoded ahead - a short read is an underrun or the end */
+	if (decoder) {
+		decoder_read(decoder, buffer, count);
+		if (decoder_eof(decoder))
+			file_done = 1;
+		return;
 	}
 
-	/* set transfer threshold - when to start? */
-	err = snd_pcm_sw_params_set_start_threshold(handle, params, threshold);
-	if (err < 0) {
-		printf("Setting start threshold failed: %s\n", snd_strerror(err));
-		return err;
+	/* read data - read ahead, or now */
+	if (uring) {
+		size_read = uring_read(uring, buffer, size_to_read);
+		/* not in from disk yet: silence, the file goes on next period */
+		if (size_read == -EAGAIN) {
+			memset(buffer, 0, size);
+			return;
+		}
+	} else
+		size_read = read(fd, (unsigned char*) buffer, size_to_read);
+
+	if (size_read > 0)
+		file_left -= size_read;
+
+	/* end of the data: play out the rest as silence */
+	if (size_read < (ssize_t) size) {
+		if (size_read < 0)
+			size_read = 0;
+		memset((unsigned char *) buffer + size_read, 0, size - size_read);
+		file_done = 1;
 	}
+}
 
-	/* allow the transfer when at least period_size samples can be processed */
-	err = snd_pcm_sw_params_set_avail_min(handle, params, hw_period_size);
-	if (err < 0) {
-		printf("Unable to set avail min for playback: %s\n", snd_strerror(err));
-		return err;
+/* channel groups of the period in flight, for the workers */
+struct dsp_job {
+	short int *samples;
+	unsigned int frames;
+};
+
+static void dsp_job_groups(void *ctx, unsigned int first, unsigned int last)
+{
+	struct dsp_job *job = ctx;
+
+	dsp_process_groups(dsp, job->samples, job->frames, first, last);
+}
+
+/* fork-join over the channel groups, due before the device needs the period */
+static void dsp_process_parallel(short int *samples, unsigned int count)
+{
+	/* a late job outlives the call */
+	static struct dsp_job job;
+	unsigned int chunk = (dsp->groups + dsp_workers) / (dsp_workers + 1);
+
+	job.samples = samples;
+	job.frames = count;
+	dsp_update(dsp, count);
+	if (workers_run(&workers, dsp->groups, chunk, dsp_job_groups, &job,
+	                (double) count / hw_rate) < 0)
+		trace(TRACE_LATE, count);
+}
+
+/* read, route and process 'count' frames - returns the device samples */
+static short int *get_samples(short int *buffer, int count)
+{
+	short int *samples = buffer;
+
+	trace(TRACE_FILL_BEGIN, count);
+
+	/* a late period may still be processed in the buffer refilled here */
+	if (dsp && dsp_workers)
+		workers_sync(&workers);
+
+	if (route) {
+		fill_buffer(src_buffer, count);
+		samples = route_apply(route, src_buffer, buffer, count);
+	} else
+		fill_buffer(buffer, count);
+
+	if (dsp && dsp_workers)
+		dsp_process_parallel(samples, count);
+	else if (dsp)
+		dsp_process(dsp, samples, count);
+
+	trace(TRACE_FILL_END, count);
+
+	return samples;
+}
+
+/* underrun: record it, dump the trace and restart */
+static void recover_underrun(struct pcm *pcm)
+{
+	int err;
+
+	trace(TRACE_XRUN, 0);
+	if (playout) {
+		playout_xrun(playout);
+		printf("Underrun, playout position lost\n");
+	}
+	if (trace_file) {
+		err = trace_dump(trace_file);
+		if (err < 0)
+			printf("Trace dump failed: %s\n", strerror(-err));
+		else
+			printf("Underrun, trace written to %s\n", trace_file);
 	}
 
-	/* write the parameters to the playback device */
-	err = snd_pcm_sw_params(handle, params);
+	err = pcm_prepare(pcm);
 	if (err < 0) {
-		printf("Unable to set sw params for playback: %s\n", snd_strerror(err));
-		return err;
+		printf("Prepare error: %s\n", snd_strerror(err));
+		exit(EXIT_FAILURE);
 	}
-
-	return 0;
 }
 
-static void fill_buffer(short int *buffer, int count)
+/*
+ * Scheduled start: silence until the start time, then drop the frames
+ * that should have played already.
+ */
+static void start_scheduled(struct pcm *pcm, short int *buffer)
 {
-	if (!fd) {
-		printf("Trying to open file: %s\n", filename);
-		fd = open(filename, O_RDONLY);
-		if (!fd) {
-			printf("Could not open: %s\n", filename);
-			exit(EXIT_FAILURE);
-		}
+	snd_pcm_uframes_t period = timer_sched ? hw_buffer_size / 4 : hw_period_size;
+	unsigned long long n;
+	long long skip;
+	double t;
 
-		/* skip header */
-		lseek(fd, 44, SEEK_SET);
+	memset(buffer, 0, period * hw_channels * sizeof(short int));
+	skip = playout_start_at(playout, start_time, buffer, period,
+	                        hw_buffer_size - period);
+	if (skip < 0) {
+		printf("Scheduled start failed: %s\n", snd_strerror(skip));
+		exit(EXIT_FAILURE);
 	}
 
-	/* read data */
-	unsigned int size_to_read = hw_channels * count * 2;
-	unsigned int size_read = read(fd, (unsigned char*) buffer, size_to_read);
+	if (playout_frame_time(playout, 0, &t) == 0)
+		printf("Scheduled start at %.6f, late %lld frames\n", t, skip);
+
+	/* the silence is part of the echo reference too */
+	if (aec_ref_name)
+		for (n = pcm->appl; n > 0; n -= n < period ? n : period)
+			aec_ref_write(&aec_ref, buffer, hw_channels, n < period ? n : period);
+
+	while (skip > 0) {
+		n = (unsigned long long) skip < period ? (unsigned long long) skip : period;
 
-	/* note: no checks for end of file */
-	/* note: file isn't closed */
+		get_samples(buffer, n);
+		skip -= n;
+	}
 }
 
-static int write_loop(snd_pcm_t *handle,
+static int write_loop(struct pcm *pcm,
                       short int *buffer)
 {
 	int err;
 	short int *ptr;
 	int ptr_size;
+	unsigned long long total = 0;
+
+	if (playout)
+		start_scheduled(pcm, buffer);
 
-	while (1) {
+	while ((max_frames == 0 || total < max_frames) && !file_done) {
 
 		/* get audio samples */
-		fill_buffer(buffer, hw_period_size);
+		ptr = get_samples(buffer, hw_period_size);
+
+		/* fill level, only worth the syscall when tracing */
+		if (trace_local) {
+			snd_pcm_sframes_t avail, delay;
+
+			if (pcm_avail_delay(pcm, &avail, &delay) == 0) {
+				trace(TRACE_AVAIL, avail);
+				trace(TRACE_DELAY, delay);
+			}
+		}
 
-		/* pointer to buffer */
-		ptr = buffer;
+		/* where the content is */
+		if (playout)
+			playout_update(playout);
 
 		/* copy of size */
 		ptr_size = hw_period_size;
@@ -216,11 +466,185 @@ static int write_loop(snd_pcm_t *handle,
 		while (ptr_size > 0) {
 
 			/* write to module */
-			err = snd_pcm_writei(handle, ptr, ptr_size);
+			trace(TRACE_WRITEI_ENTER, ptr_size);
+			err = pcm_writei(pcm, ptr, ptr_size);
+			trace(TRACE_WRITEI_EXIT, err);
+
+			/* EAGAIN failure? -> wait for room, retry */
+			if (err == -EAGAIN) {
+				pcm_wait(pcm, 1000);
+				continue;
+			}
+
+			/* underrun -> restart */
+			if (err == -EPIPE) {
+				recover_underrun(pcm);
+				continue;
+			}
+
+			/* everything else -> stop */
+			if (err < 0) {
+				printf("Write error: %s\n", snd_strerror(err));
+				exit(EXIT_FAILURE);
+			}
+
+			if (aec_ref_name)
+				aec_ref_write(&aec_ref, ptr, hw_channels, err);
+
+			/* move buffer pointer */
+			ptr += err * hw_channels;
+			ptr_size -= err;
+			total += err;
+		}
+
+		/* when the reference reaches the speaker */
+		if (aec_ref_name)
+			aec_ref_clock(&aec_ref, pcm);
+	}
+
+	return 0;
+}
+
+static double ts_to_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+/*
+ * Timer scheduled playback.
+ *
+ * Instead of waking up on every period interrupt, we estimate when the fill
+ * level will reach the safety margin and sleep until then. On wakeup, as
+ * much as possible is refilled in one transfer.
+ *
+ * The clock model tracks the ratio between the device clock and
+ * CLOCK_MONOTONIC from the hw pointer progress between two status
+ * timestamps. The margin grows after a near miss and slowly decays again
+ * while the stream is healthy.
+ */
+static int write_loop_timer(struct pcm *pcm,
+                            short int *buffer)
+{
+	snd_pcm_state_t state;
+	struct timespec tstamp;
+	int err;
+	short int *ptr;
+	snd_pcm_sframes_t ptr_size;
+
+	/* current and minimal margin in frames */
+	snd_pcm_sframes_t margin = (snd_pcm_sframes_t) hw_rate * timer_margin_time / 1000000;
+	snd_pcm_sframes_t margin_min = margin / 2;
+	snd_pcm_sframes_t margin_max = hw_buffer_size / 2;
+
+	/* clock model: device frames per second of CLOCK_MONOTONIC */
+	double rate = hw_rate;
+	double last_time = 0;
+	unsigned long long last_pos = 0;
+
+	/* frames written since start, and in total */
+	unsigned long long written = 0, total = 0;
+
+	/* statistics */
+	unsigned long wakeups = 0, near_misses = 0, xruns = 0;
+	double report_time = 0;
+
+	if (margin_min < 1)
+		margin_min = 1;
+	if (margin > margin_max)
+		margin = margin_max;
+
+	if (playout) {
+		start_scheduled(pcm, buffer);
+		written = pcm->appl;
+	}
+
+	while ((max_frames == 0 || total < max_frames) && !file_done) {
+		snd_pcm_uframes_t avail;
+		snd_pcm_sframes_t delay;
+		double now;
+
+		/* timestamped fill level */
+		err = pcm_status(pcm, &state, &avail, &delay, &tstamp);
+		if (err < 0) {
+			printf("Status error: %s\n", snd_strerror(err));
+			exit(EXIT_FAILURE);
+		}
+
+		/* underrun -> restart and be more careful */
+		if (state == SND_PCM_STATE_XRUN) {
+			xruns++;
+			margin = margin * 2 > margin_max ? margin_max : margin * 2;
+			printf("Underrun, margin now %ld frames\n", margin);
+
+			recover_underrun(pcm);
+
+			written = 0;
+			last_time = 0;
+			continue;
+		}
+
+		trace(TRACE_AVAIL, avail);
+		trace(TRACE_DELAY, delay);
+		now = ts_to_sec(&tstamp);
+
+		if (playout)
+			playout_update(playout);
+
+		if (state == SND_PCM_STATE_RUNNING) {
+			/* hw position = everything written minus what is queued */
+			unsigned long long pos = written - delay;
+
+			wakeups++;
+
+			/* did we come close to running dry? */
+			if (delay < margin / 2) {
+				near_misses++;
+				margin += margin / 2;
+				if (margin > margin_max)
+					margin = margin_max;
+			} else if (margin > margin_min) {
+				/* all fine, slowly give back some of the margin */
+				margin -= (margin >> 6) ? (margin >> 6) : 1;
+			}
+
+			/* update clock model, ignore very short intervals */
+			if (last_time > 0 && now - last_time > 0.001) {
+				double measured = (pos - last_pos) / (now - last_time);
+
+				/* reject nonsense, then low pass */
+				if (measured > hw_rate * 0.9 && measured < hw_rate * 1.1)
+					rate += (measured - rate) * 0.05;
+			}
+			last_time = now;
+			last_pos = pos;
+
+			if (now - report_time >= 10.0) {
+				if (report_time > 0)
+					printf("wakeups: %lu near misses: %lu xruns: %lu margin: %ld rate: %.2f\n",
+					       wakeups, near_misses, xruns, margin, rate);
+				report_time = now;
+			}
+		}
+
+		/* refill as much as possible in one transfer */
+		ptr = get_samples(buffer, avail);
+		ptr_size = avail;
+		while (ptr_size > 0) {
+
+			/* write to module */
+			trace(TRACE_WRITEI_ENTER, ptr_size);
+			err = pcm_writei(pcm, ptr, ptr_size);
+			trace(TRACE_WRITEI_EXIT, err);
 
-			/* EAGAIN failure? -> retry */
-			if (err == -EAGAIN)
+			/* EAGAIN failure? -> wait for room, retry */
+			if (err == -EAGAIN) {
+				pcm_wait(pcm, 1000);
 				continue;
+			}
+
+			/* underrun is handled at the top of the loop */
+			if (err == -EPIPE)
+				break;
 
 			/* everything else -> stop */
 			if (err < 0) {
@@ -228,19 +652,405 @@ static int write_loop(snd_pcm_t *handle,
 				exit(EXIT_FAILURE);
 			}
 
+			if (aec_ref_name)
+				aec_ref_write(&aec_ref, ptr, hw_channels, err);
+
 			/* move buffer pointer */
 			ptr += err * hw_channels;
 			ptr_size -= err;
+			written += err;
+			total += err;
+		}
+
+		/* when the reference reaches the speaker */
+		if (aec_ref_name)
+			aec_ref_clock(&aec_ref, pcm);
+
+		/* not started yet? nothing to wait for */
+		if (pcm_state(pcm) != SND_PCM_STATE_RUNNING)
+			continue;
+
+		/* sleep until the queued data drops to the margin */
+		delay += avail - ptr_size;
+		if (delay > margin)
+			pcm_sleep_until(pcm, now + (delay - margin) / rate);
+		trace(TRACE_WAKEUP, 0);
+	}
+
+	return 0;
+}
+
+/*
+ * Control thread: change the dsp parameters while playing.
+ *
+ *   gain <dB>
+ *   mute | unmute
+ *   eq <index> <type:freq:q[:gain_db]>
+ *   eq off
+ *   seek <frame>            (alc files)
+ *   pos                     (scheduled start)
+ */
+static void *control_thread(void *arg)
+{
+	char line[128], spec[64];
+	float value;
+	unsigned int index;
+	struct dsp_biquad b;
+	unsigned long long frame;
+	struct timespec ts;
+	double pos;
+
+	while (fgets(line, sizeof(line), stdin)) {
+		if (sscanf(line, "gain %f", &value) == 1)
+			dsp_set_gain(dsp, value);
+		else if (!strncmp(line, "mute", 4))
+			dsp_set_mute(dsp, 1);
+		else if (!strncmp(line, "unmute", 6))
+			dsp_set_mute(dsp, 0);
+		else if (!strncmp(line, "eq off", 6))
+			dsp_set_nr_biquads(dsp, 0);
+		else if (sscanf(line, "eq %u %63s", &index, spec) == 2) {
+			if (dsp_parse_biquad(spec, hw_rate, &b) == 0 &&
+			    dsp_set_biquad(dsp, index, &b) < 0)
+				printf("Invalid filter index: %u\n", index);
+		} else if (sscanf(line, "seek %llu", &frame) == 1) {
+			if (decoder == NULL)
+				printf("Seeking needs an alc file\n");
+			else if (decoder_seek(decoder, frame) < 0)
+				printf("Beyond the end: %llu\n", frame);
+		} else if (!strncmp(line, "pos", 3)) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			if (playout == NULL ||
+			    playout_position(playout, ts.tv_sec + ts.tv_nsec / 1e9, &pos) < 0)
+				printf("Position unknown\n");
+			else
+				printf("pos %.3f at %ld.%09ld\n", pos, (long) ts.tv_sec, ts.tv_nsec);
+		} else
+			printf("Unknown command: %s", line);
+	}
+
+	return NULL;
+}
+
+/* create the dsp chain from the command line settings */
+static void setup_dsp(void)
+{
+	struct dsp_biquad b;
+	unsigned int i;
+
+	/* max transfer is a period, or the whole ring in timer mode */
+	dsp = dsp_chain_create(hw_channels,
+	                       timer_sched ? hw_buffer_size : hw_period_size,
+	                       hw_rate);
+	if (dsp == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	dsp_set_gain(dsp, dsp_gain);
+
+	if (dsp_workers) {
+		int err = workers_start(&workers, dsp_workers, dsp_first_cpu);
+
+		if (err < 0) {
+			printf("Workers start failed: %s\n", strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < dsp_nr_filters; i++) {
+		if (dsp_parse_biquad(dsp_filter[i], hw_rate, &b) < 0)
+			exit(EXIT_FAILURE);
+		dsp_set_biquad(dsp, i, &b);
+	}
+
+	if (dsp_control) {
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, control_thread, NULL)) {
+			printf("Unable to start control thread\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(thread);
+	}
+}
+
+/* highest device channel used by the routing spec + 1 */
+static unsigned int route_spec_channels(void)
+{
+	struct route r;
+	unsigned int s, d, channels = 0;
+
+	route_init(&r, file_channels, ROUTE_MAX_CHANNELS);
+	if (route_parse(&r, route_spec) < 0)
+		exit(EXIT_FAILURE);
+
+	for (s = 0; s < file_channels; s++)
+		for (d = 0; d < ROUTE_MAX_CHANNELS; d++)
+			if (r.gain[s][d] != 0.0f && d + 1 > channels)
+				channels = d + 1;
+
+	return channels;
+}
+
+/*
+ * Render cache: the file converted once to the device rate and channels,
+ * then played without routing or resampling.
+ */
+static void use_render_cache(void)
+{
+	struct rcache_target target = { hw_rate, hw_channels, route };
+	char path[4096];
+	int err, render_fd, rendered = 0;
+
+	err = rcache_open(&rcache, cache_dir, (unsigned long long) cache_size << 20);
+	if (err < 0) {
+		printf("Render cache %s: %s\n", cache_dir, strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+
+	/* alc files are decoded while playing, matching files need nothing */
+	if (!decoder && (hw_rate != file_rate || route)) {
+		render_fd = rcache_get(&rcache, filename, &target, path, sizeof(path));
+		if (render_fd < 0) {
+			printf("Render of %s failed: %s\n", filename, strerror(-render_fd));
+			exit(EXIT_FAILURE);
+		}
+
+		/* the render instead, same position in time */
+		start_frame = start_frame * hw_rate / file_rate;
+		close(fd);
+		filename = strdup(path);
+		index_filename = NULL;
+		open_file(render_fd);
+		rendered = 1;
+	}
+
+	/* the next items while this one plays - takes its own copy of the route */
+	err = rcache_prerender(&rcache, playlist, playlist_len, &target);
+	if (err < 0)
+		printf("Pre-render failed: %s\n", strerror(-err));
+
+	/* the render is routed already */
+	if (rendered) {
+		free(route);
+		bufpool_free(src_buffer);
+		route = NULL;
+		src_buffer = NULL;
+	}
+}
+
+/* pick the smallest channel map of the device that fits 'channels' */
+static void choose_channels(snd_pcm_t *handle, unsigned int channels)
+{
+	snd_pcm_chmap_query_t **maps, **p;
+	unsigned int best = 0;
+	char name[256];
+
+	maps = handle ? snd_pcm_query_chmaps(handle) : NULL;
+	if (maps == NULL) {
+		/* no channel maps - just ask for what we need */
+		hw_channels = channels;
+		return;
+	}
+
+	for (p = maps; *p; p++) {
+		unsigned int n = (*p)->map.channels;
+
+		if (n >= channels && (best == 0 || n < best))
+			best = n;
+	}
+
+	for (p = maps; *p; p++)
+		if ((*p)->map.channels == best) {
+			snd_pcm_chmap_print(&(*p)->map, sizeof(name), name);
+			printf("Using channel map: %s\n", name);
+			break;
 		}
+
+	snd_pcm_free_chmaps(maps);
+
+	if (best == 0) {
+		printf("Device has no channel map with %u channels\n", channels);
+		exit(EXIT_FAILURE);
+	}
+
+	hw_channels = best;
+}
+
+/* route the file channels to the device channels */
+static void setup_route(snd_pcm_t *handle)
+{
+	/* wave files without a channel mask: mono, or front left/right first */
+	unsigned int pos[ROUTE_MAX_CHANNELS];
+	snd_pcm_chmap_t *map;
+	unsigned int i;
+
+	route = malloc(sizeof(*route));
+	if (route == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (route_init(route, file_channels, hw_channels) < 0)
+		exit(EXIT_FAILURE);
+
+	if (route_spec) {
+		if (route_parse(route, route_spec) < 0)
+			exit(EXIT_FAILURE);
+	} else if (handle && (map = snd_pcm_get_chmap(handle)) != NULL) {
+		for (i = 0; i < file_channels; i++)
+			pos[i] = file_channels == 1 ? SND_CHMAP_MONO :
+			         i == 0 ? SND_CHMAP_FL : i == 1 ? SND_CHMAP_FR : SND_CHMAP_UNKNOWN;
+		route_from_chmap(route, pos, map);
+		free(map);
+	} else {
+		/* no channel map - by index */
+		for (i = 0; i < file_channels && i < hw_channels; i++)
+			route_set(route, i, i, 0);
+	}
+
+	route_finalize(route);
+	route_print(route);
+
+	/* nothing to do */
+	if (route->type == ROUTE_IDENTITY) {
+		free(route);
+		route = NULL;
+		return;
+	}
+
+	src_buffer = bufpool_alloc((timer_sched ? hw_buffer_size : hw_period_size) *
+	                    file_channels * sizeof(*src_buffer));
+	if (src_buffer == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
 	}
 }
 
 int main(int argc, char *argv[])
 {
 	int err = 0;
+	struct pcm *pcm = NULL;
 	snd_pcm_t *handle = NULL;
-	snd_pcm_hw_params_t *hw_params = NULL;
-	snd_pcm_sw_params_t *sw_params = NULL;
+	struct pcm_config cfg;
+	int opt;
+	int use_dsp = 0;
+	int use_route = 0;
+	int channels_set = 0;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "tm:g:e:kj:J:c:r:x:D:n:f:i:S:T:R:E:C:M:H:U")) != -1) {
+		switch (opt) {
+		case 't':
+			timer_sched = 1;
+			break;
+		case 'm':
+			timer_margin_time = atoi(optarg);
+			break;
+		case 'g':
+			dsp_gain = atof(optarg);
+			use_dsp = 1;
+			break;
+		case 'e':
+			if (dsp_nr_filters >= DSP_MAX_BIQUADS) {
+				printf("Too many filters\n");
+				exit(EXIT_FAILURE);
+			}
+			dsp_filter[dsp_nr_filters++] = optarg;
+			use_dsp = 1;
+			break;
+		case 'k':
+			dsp_control = 1;
+			use_dsp = 1;
+			break;
+		case 'j':
+			dsp_workers = atoi(optarg);
+			break;
+		case 'J':
+			dsp_first_cpu = atoi(optarg);
+			break;
+		case 'c':
+			hw_channels = atoi(optarg);
+			channels_set = 1;
+			use_route = 1;
+			break;
+		case 'r':
+			route_spec = optarg;
+			use_route = 1;
+			break;
+		case 'x':
+			trace_file = optarg;
+			break;
+		case 'D':
+			device = optarg;
+			break;
+		case 'n':
+			max_frames = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			filename = optarg;
+			break;
+		case 'i':
+			index_filename = optarg;
+			break;
+		case 'S':
+			start_frame = strtoull(optarg, NULL, 0);
+			break;
+		case 'T':
+			start_spec = optarg;
+			break;
+		case 'R':
+			start_spec = optarg;
+			start_realtime = 1;
+			break;
+		case 'E':
+			aec_ref_name = optarg;
+			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case 'M':
+			cache_size = atoi(optarg);
+			break;
+		case 'H':
+			pool_size = atoi(optarg);
+			break;
+		case 'U':
+			use_uring = 1;
+			break;
+		default:
+			printf("Usage: %s [-t] [-m margin_us] [-g gain_db] [-e type:freq:q[:gain_db]] [-k]\n"
+			       "       [-j dsp_workers] [-J first_cpu]\n"
+			       "       [-c channels] [-r src:dst[:gain_db],...] [-x trace_file]\n"
+			       "       [-D device] [-n frames] [-f file] [-i index] [-S start_frame]\n"
+			       "       [-T [+]monotonic_time] [-R realtime] [-E echo_reference]\n"
+			       "       [-C cache_dir] [-M cache_mb] [-H pool_mb] [-U]\n"
+			       "       [upcoming files...]\n",
+			       argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* period and ring memory from one locked arena */
+	if (pool_size) {
+		err = bufpool_init((size_t) pool_size << 20);
+		if (err < 0)
+			printf("Buffer pool: %s, using malloc\n", strerror(-err));
+	}
+
+	/* the rest of the playlist, rendered ahead */
+	playlist = argv + optind;
+	playlist_len = argc - optind;
+
+	/* the file decides the rate and channels */
+	open_file(-1);
+	if (!channels_set)
+		hw_channels = file_channels;
+
+	/* timer mode uses a large ring buffer */
+	if (timer_sched)
+		hw_buffer_time = timer_buffer_time;
 
 	/* attach snd output to stdio - debug purposes */
 	err = snd_output_stdio_attach(&output, stdout, 0);
@@ -249,23 +1059,56 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
-	/* allocate memory for hw/sw parameters */
-	snd_pcm_hw_params_alloca(&hw_params);
-	snd_pcm_sw_params_alloca(&sw_params);
-
 	/* open devicehandle */
-	err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+	err = pcm_open(&pcm, device, SND_PCM_STREAM_PLAYBACK);
 	if (err < 0) {
 		printf("Playback open error: %s\n", snd_strerror(err));
 		return 0;
 	}
+	handle = pcm->handle;
+
+	/* when to start - relative times against the device clock */
+	if (start_spec) {
+		start_time = atof(start_spec);
+		if (start_realtime)
+			start_time = playout_realtime_to_monotonic(start_time);
+		else if (start_spec[0] == '+')
+			start_time += pcm_now(pcm);
+
+		playout = malloc(sizeof(*playout));
+		if (playout == NULL) {
+			printf("No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* routing without a channel count: ask the device */
+	if (route_spec && !channels_set)
+		choose_channels(handle, route_spec_channels());
 
-	/* set hw parameters */
-	err = set_hwparams(handle, hw_params);
+	/* set hw and sw parameters */
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.rate = hw_rate;
+	cfg.channels = hw_channels;
+	cfg.buffer_time = hw_buffer_time;
+	cfg.period_time = hw_period_time;
+	/* timestamps for the clock model and the playout position */
+	cfg.tstamp = timer_sched || playout || aec_ref_name;
+	cfg.timer = timer_sched;
+	/* renders replace the alsa resampler - decoded files have none */
+	cfg.native_rate = cache_dir && !decoder;
+	err = pcm_configure(pcm, &cfg);
 	if (err < 0) {
-		printf("Setting of hwparams failed: %s\n", snd_strerror(err));
+		printf("Setting of params failed: %s\n", snd_strerror(err));
 		exit(EXIT_FAILURE);
 	}
+	hw_buffer_time = cfg.buffer_time;
+	hw_buffer_size = cfg.buffer_size;
+	hw_period_time = cfg.period_time;
+	hw_period_size = cfg.period_size;
+	hw_rate = cfg.rate;
+	if (playout)
+		playout_init(playout, pcm, hw_rate);
 
 	printf("hw_buffer_time: %u\n", hw_buffer_time);
 	printf("hw_buffer_size: %lu\n", hw_buffer_size);
@@ -273,38 +1116,112 @@ int main(int argc, char *argv[])
 	printf("hw_period_time: %u\n", hw_period_time);
 	printf("hw_period_size: %lu\n", hw_period_size);
 
-	printf("phys width: %u\n",  snd_pcm_format_physical_width(hw_format));
-
-	/* set sw parameters */
-	err = set_swparams(handle, sw_params);
-	if (err < 0) {
-		printf("Setting of swparams failed: %s\n", snd_strerror(err));
-		exit(EXIT_FAILURE);
-	}
 
 	/* print configuration */
-	snd_pcm_dump(handle, output);
+	if (handle)
+		snd_pcm_dump(handle, output);
 
-	/* buffersize: allocate enough for 2 times a period */
-	buffer_size = (hw_period_size * hw_channels *
-	               snd_pcm_format_physical_width(hw_format)) / 8;
+	/* buffersize: one period, or the whole ring in timer mode */
+	buffer_size = (timer_sched ? hw_buffer_size : hw_period_size) * hw_channels *
+	              sizeof(short int);
 
 	/* allocate memory for audio samples */
-	buffer = malloc(buffer_size);
+	buffer = bufpool_alloc(buffer_size);
 	if (buffer == NULL) {
 		printf("No enough memory\n");
 		exit(EXIT_FAILURE);
 	}
 
+	/* channel routing */
+	if (use_route)
+		setup_route(handle);
+
+	/* convert once to what the device runs */
+	if (cache_dir)
+		use_render_cache();
+
+	/* file reads off the audio thread - the render cache may have changed the file */
+	if (use_uring && !decoder) {
+		uring = malloc(sizeof(*uring));
+		if (uring == NULL) {
+			printf("No enough memory\n");
+			exit(EXIT_FAILURE);
+		}
+
+		err = uring_open(uring, fd, 0, lseek(fd, 0, SEEK_CUR),
+		                 URING_SLOT_SIZE, URING_NR_SLOTS);
+		if (err < 0) {
+			printf("io_uring: %s, using read()\n", strerror(-err));
+			free(uring);
+			uring = NULL;
+		}
+	}
+
+	/* processing chain */
+	if (use_dsp)
+		setup_dsp();
+
+	/* echo reference for a capture on the same room */
+	if (aec_ref_name) {
+		err = aec_ref_create(&aec_ref, aec_ref_name, hw_rate);
+		if (err < 0) {
+			printf("Echo reference %s: %s\n", aec_ref_name, strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* trace the audio thread */
+	if (trace_file) {
+		err = trace_thread_init("write_loop", 65536);
+		if (err < 0) {
+			printf("Trace setup failed: %s\n", strerror(-err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	/* write audio */
-	write_loop(handle, buffer);
+	if (timer_sched)
+		err = write_loop_timer(pcm, buffer);
+	else
+		err = write_loop(pcm, buffer);
 	if (err < 0)
 		printf("Transfer failed: %s\n", snd_strerror(err));
+	else
+		/* the last buffer, decoded or read, plays out before the close */
+		pcm_drain(pcm);
+
+	pcm_print_stats(pcm);
+	free(playout);
+	if (uring) {
+		uring_print_stats(uring);
+		uring_close(uring);
+		free(uring);
+	}
+	if (aec_ref_name)
+		aec_ref_close(&aec_ref, aec_ref_name);
+	if (decoder) {
+		decoder_print_stats(decoder);
+		decoder_close(decoder);
+		free(decoder);
+	}
+
+	bufpool_free(buffer);
+	bufpool_free(src_buffer);
+	free(route);
+	if (dsp && dsp_workers) {
+		workers_print_stats(&workers);
+		workers_stop(&workers);
+	}
+	dsp_chain_destroy(dsp);
+	if (cache_dir) {
+		rcache_print_stats(&rcache);
+		rcache_close(&rcache);
+	}
 
-	free(buffer);
+	bufpool_print_stats();
 
 	/* close devicehandle */
-	snd_pcm_close(handle);
+	pcm_close(pcm);
 
 	return 0;
 }
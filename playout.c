@@ -0,0 +1,221 @@
+/*
+ * Scheduled playback: start at a given time, and where are we now
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "playout.h"
+
+/* seconds between device rate measurements */
+#define PLAYOUT_RATE_INTERVAL 1.0
+
+static double ts_to_sec(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static void model_write_begin(struct playout *p)
+{
+	atomic_fetch_add_explicit(&p->seq, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+}
+
+static void model_write_end(struct playout *p)
+{
+	atomic_fetch_add_explicit(&p->seq, 1, memory_order_release);
+}
+
+/* a consistent copy of the model */
+static void model_read(struct playout *p, struct playout *copy)
+{
+	unsigned int seq;
+
+	do {
+		while ((seq = atomic_load_explicit(&p->seq, memory_order_acquire)) & 1)
+			;
+		copy->anchor_pos = p->anchor_pos;
+		copy->anchor_time = p->anchor_time;
+		copy->clock_rate = p->clock_rate;
+		copy->content_start = p->content_start;
+		copy->valid = p->valid;
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&p->seq, memory_order_relaxed) != seq);
+}
+
+/* new anchor from the hw pointer, rate from anchors a second apart */
+static int measure(struct playout *p)
+{
+	double played, tstamp, rate = p->clock_rate;
+	int err;
+
+	err = pcm_position(p->pcm, &played, &tstamp);
+	if (err < 0)
+		return err;
+
+	if (p->rate_time == 0 || played < p->rate_pos) {
+		p->rate_pos = played;
+		p->rate_time = tstamp;
+	} else if (tstamp - p->rate_time >= PLAYOUT_RATE_INTERVAL) {
+		double measured = (played - p->rate_pos) / (tstamp - p->rate_time);
+
+		/* reject nonsense, then low pass */
+		if (measured > p->rate * 0.9 && measured < p->rate * 1.1)
+			rate += (measured - rate) * 0.25;
+		p->rate_pos = played;
+		p->rate_time = tstamp;
+	}
+
+	model_write_begin(p);
+	p->anchor_pos = played;
+	p->anchor_time = tstamp;
+	p->clock_rate = rate;
+	model_write_end(p);
+
+	return 0;
+}
+
+void playout_init(struct playout *p, struct pcm *pcm, unsigned int rate)
+{
+	memset(p, 0, sizeof(*p));
+	p->pcm = pcm;
+	p->rate = rate;
+	p->clock_rate = rate;
+	atomic_init(&p->seq, 0);
+}
+
+double playout_realtime_to_monotonic(double t)
+{
+	struct timespec m0, r, m1;
+	double window, best = 1e9, offset = 0;
+	int i;
+
+	/* the realtime read with the least time around it */
+	for (i = 0; i < 5; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &m0);
+		clock_gettime(CLOCK_REALTIME, &r);
+		clock_gettime(CLOCK_MONOTONIC, &m1);
+
+		window = ts_to_sec(&m1) - ts_to_sec(&m0);
+		if (window < best) {
+			best = window;
+			offset = ts_to_sec(&r) - (ts_to_sec(&m0) + ts_to_sec(&m1)) / 2;
+		}
+	}
+
+	return t - offset;
+}
+
+static int write_silence(struct pcm *pcm, const short int *silence,
+                         snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t err;
+
+	while (frames > 0) {
+		err = pcm_writei(pcm, silence, frames);
+		if (err == -EAGAIN) {
+			pcm_wait(pcm, 1000);
+			continue;
+		}
+		if (err < 0)
+			return err;
+		frames -= err;
+	}
+
+	return 0;
+}
+
+long long playout_start_at(struct playout *p, double t, const short int *silence,
+                           snd_pcm_uframes_t period, snd_pcm_uframes_t queue)
+{
+	int err;
+
+	while (1) {
+		/* running: where will the hw pointer be at 't'? */
+		if (measure(p) == 0) {
+			double target = p->anchor_pos + (t - p->anchor_time) * p->clock_rate;
+			double queued = p->pcm->appl - p->anchor_pos;
+			double offset = target - p->pcm->appl;
+
+			if (offset < period) {
+				long long pad = llround(offset), trim = 0;
+
+				if (pad < 0) {
+					trim = -pad;
+					pad = 0;
+				}
+
+				err = write_silence(p->pcm, silence, pad);
+				if (err < 0)
+					return err;
+
+				model_write_begin(p);
+				p->content_start = (double) p->pcm->appl - trim;
+				p->valid = 1;
+				model_write_end(p);
+
+				return trim;
+			}
+
+			/* keep the rest for later: sleep until there is room. The
+			   hw pointer may move a period at a time, so at least until
+			   just after the next move */
+			if (queued + period > queue) {
+				double wait = queued + period - queue;
+
+				if (wait < period)
+					wait = period;
+				pcm_sleep_until(p->pcm, p->anchor_time + (wait + 1) / p->clock_rate);
+				continue;
+			}
+		}
+
+		/* not started yet: the start threshold will */
+		err = write_silence(p->pcm, silence, period);
+		if (err == -EPIPE)
+			err = pcm_prepare(p->pcm);
+		if (err < 0)
+			return err;
+	}
+}
+
+void playout_update(struct playout *p)
+{
+	measure(p);
+}
+
+void playout_xrun(struct playout *p)
+{
+	model_write_begin(p);
+	p->valid = 0;
+	model_write_end(p);
+
+	p->rate_time = 0;
+}
+
+int playout_position(struct playout *p, double t, double *frame)
+{
+	struct playout m;
+
+	model_read(p, &m);
+	if (!m.valid)
+		return -ENODATA;
+
+	*frame = m.anchor_pos + (t - m.anchor_time) * m.clock_rate - m.content_start;
+	return 0;
+}
+
+int playout_frame_time(struct playout *p, double frame, double *t)
+{
+	struct playout m;
+
+	model_read(p, &m);
+	if (!m.valid)
+		return -ENODATA;
+
+	*t = m.anchor_time + (frame + m.content_start - m.anchor_pos) / m.clock_rate;
+	return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Scheduled playback: start at a given time, and where are we now
+ *
+ * playout_start_at() runs in the audio thread before the first frame of
+ * the content. It keeps the device running on silence until the target
+ * time is less than a period away, then writes exactly the silence that
+ * puts the next frame at the target. When the target has already passed
+ * the start of the content is trimmed instead, so it is still in place.
+ *
+ * The position model maps CLOCK_MONOTONIC to content frames: the last
+ * hw pointer measurement from pcm_position() plus the time since, at the
+ * device rate measured against the system clock. The audio thread
+ * updates it, any thread can read it - seqlock protected.
+ */
+
+#ifndef PLAYOUT_H
+#define PLAYOUT_H
+
+#include <stdatomic.h>
+
+#include "pcm.h"
+
+struct playout {
+	struct pcm *pcm;
+	unsigned int rate;
+
+	/* position model - seqlock protected */
+	atomic_uint seq;
+	/* stream frame at the DAC at anchor_time */
+	double anchor_pos;
+	double anchor_time;
+	/* device frames per second of system time */
+	double clock_rate;
+	/* stream frame that is content frame 0 - the model is only valid
+	   after a start and before an xrun */
+	double content_start;
+	int valid;
+
+	/* audio thread only: rate measurement */
+	double rate_pos;
+	double rate_time;
+};
+
+void playout_init(struct playout *p, struct pcm *pcm, unsigned int rate);
+
+/* CLOCK_REALTIME seconds to CLOCK_MONOTONIC, for PTP disciplined clocks */
+double playout_realtime_to_monotonic(double t);
+
+/*
+ * Audio thread: write silence until the next frame written plays at 't'.
+ * 'silence' holds a period of zeroes, at most 'queue' frames are kept
+ * in the device buffer. Returns the number of content frames to skip
+ * because 't' has passed, or -errno.
+ */
+long long playout_start_at(struct playout *p, double t, const short int *silence,
+                           snd_pcm_uframes_t period, snd_pcm_uframes_t queue);
+
+/* audio thread: new hw pointer measurement, once per period or wakeup */
+void playout_update(struct playout *p);
+
+/* audio thread: the stream restarted, content and device are apart now */
+void playout_xrun(struct playout *p);
+
+/*
+ * any thread: the content frame at the DAC at time 't' - interpolated,
+ * fractional. -ENODATA before the start or after an xrun.
+ */
+int playout_position(struct playout *p, double t, double *frame);
+
+/* any thread: when content frame 'frame' plays - to trigger events */
+int playout_frame_time(struct playout *p, double frame, double *t);
+
+#endif
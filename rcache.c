@@ -0,0 +1,618 @@
+/*
+ * On-disk cache of device native renders
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "rcache.h"
+#include "wav.h"
+
+/* output frames per block */
+#define RCACHE_BLOCK 4096
+/* filter phases, interpolated in between */
+#define RCACHE_PHASES 256
+/* taps at a ratio of 1 - more when downsampling */
+#define RCACHE_TAPS 32
+#define RCACHE_MAX_TAPS 256
+
+/* remembered content hash of a source */
+struct path_entry {
+	uint64_t size;
+	int64_t mtime_ns;
+	uint64_t hash;
+};
+
+/*
+ * hashing: FNV-1a 8 bytes at a time with a final mix - not
+ * cryptographic, the size and format are part of the key as well
+ */
+
+static uint64_t hash64(const void *data, size_t len, uint64_t h)
+{
+	const unsigned char *p = data;
+	uint64_t w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 0x100000001b3ull;
+	}
+	for (; len; p++, len--)
+		h = (h ^ *p) * 0x100000001b3ull;
+
+	return h;
+}
+
+static uint64_t hash64_final(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdull;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ull;
+	h ^= h >> 33;
+	return h;
+}
+
+#define HASH_INIT 0xcbf29ce484222325ull
+
+int rcache_open(struct rcache *c, const char *dir, unsigned long long max_size)
+{
+	char path[4096];
+
+	memset(c, 0, sizeof(*c));
+	atomic_init(&c->stop, 0);
+	atomic_init(&c->hits, 0);
+	atomic_init(&c->renders, 0);
+	atomic_init(&c->evictions, 0);
+
+	snprintf(path, sizeof(path), "%s/paths", dir);
+	if ((mkdir(dir, 0755) < 0 && errno != EEXIST) ||
+	    (mkdir(path, 0755) < 0 && errno != EEXIST))
+		return -errno;
+
+	c->dir = strdup(dir);
+	if (c->dir == NULL)
+		return -ENOMEM;
+	c->max_size = max_size;
+
+	return 0;
+}
+
+void rcache_close(struct rcache *c)
+{
+	if (c->thread_running) {
+		atomic_store(&c->stop, 1);
+		pthread_join(c->thread, NULL);
+		c->thread_running = 0;
+	}
+
+	free(c->route);
+	free(c->dir);
+	c->route = NULL;
+	c->dir = NULL;
+}
+
+/* content hash of the samples, from the path memo when the file did not change */
+static uint64_t content_hash(struct rcache *c, const char *src, const struct stat *st,
+                             const void *map, const struct wav_info *info)
+{
+	struct path_entry e, old;
+	char *real = realpath(src, NULL);
+	char memo[4096];
+	int fd;
+
+	e.size = st->st_size;
+	e.mtime_ns = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+
+	snprintf(memo, sizeof(memo), "%s/paths/%016llx", c->dir, (unsigned long long)
+	         hash64_final(hash64(real ? real : src, strlen(real ? real : src), HASH_INIT)));
+	free(real);
+
+	fd = open(memo, O_RDONLY);
+	if (fd >= 0) {
+		int ok = read(fd, &old, sizeof(old)) == sizeof(old) &&
+		         old.size == e.size && old.mtime_ns == e.mtime_ns;
+
+		close(fd);
+		if (ok)
+			return old.hash;
+	}
+
+	e.hash = hash64_final(hash64((const unsigned char *) map + info->data_offset,
+	                             info->frames * info->block_align, HASH_INIT));
+
+	/* best effort, the next play hashes again */
+	fd = open(memo, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		if (write(fd, &e, sizeof(e)) != sizeof(e))
+			unlink(memo);
+		close(fd);
+	}
+
+	return e.hash;
+}
+
+/* the target route, or i -> i when there is none that fits */
+static void make_route(struct route *r, const struct rcache_target *t,
+                       unsigned int src_channels)
+{
+	unsigned int i;
+
+	if (t->route && t->route->src_channels == src_channels &&
+	    t->route->dst_channels == t->channels) {
+		memcpy(r, t->route, sizeof(*r));
+		return;
+	}
+
+	route_init(r, src_channels, t->channels);
+	for (i = 0; i < src_channels && i < t->channels; i++)
+		route_set(r, i, i, 0);
+	route_finalize(r);
+}
+
+static uint64_t route_hash(const struct route *r)
+{
+	uint64_t h = hash64(&r->src_channels, sizeof(r->src_channels), HASH_INIT);
+	unsigned int s;
+
+	h = hash64(&r->dst_channels, sizeof(r->dst_channels), h);
+	for (s = 0; s < r->src_channels; s++)
+		h = hash64(r->gain[s], r->dst_channels * sizeof(float), h);
+
+	return hash64_final(h);
+}
+
+/*
+ * resampler: windowed sinc, 'taps' per phase, linear between phases
+ */
+
+struct resampler {
+	unsigned int in_rate;
+	unsigned int out_rate;
+	unsigned int taps;
+	/* [RCACHE_PHASES + 1][taps] */
+	float *table;
+};
+
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	int k;
+
+	for (k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+
+	return sum;
+}
+
+static int resampler_init(struct resampler *rs, unsigned int in_rate,
+                          unsigned int out_rate)
+{
+	/* below the lower nyquist, with a transition band */
+	double ratio = out_rate < in_rate ? (double) out_rate / in_rate : 1.0;
+	double fc = 0.91 * ratio, beta = 8.0;
+	unsigned int p, k, taps;
+
+	taps = (unsigned int) ceil(RCACHE_TAPS / ratio / 2) * 2;
+	if (taps > RCACHE_MAX_TAPS)
+		taps = RCACHE_MAX_TAPS;
+
+	rs->in_rate = in_rate;
+	rs->out_rate = out_rate;
+	rs->taps = taps;
+	rs->table = malloc((RCACHE_PHASES + 1) * taps * sizeof(float));
+	if (rs->table == NULL)
+		return -ENOMEM;
+
+	for (p = 0; p <= RCACHE_PHASES; p++) {
+		float *h = rs->table + p * taps;
+		double frac = (double) p / RCACHE_PHASES, sum = 0;
+
+		/* tap k is input sample ipos + k - taps / 2 + 1 */
+		for (k = 0; k < taps; k++) {
+			double d = frac - ((int) k - (int) taps / 2 + 1);
+			double x = d / (taps / 2.0);
+			double w = fabs(x) < 1 ? bessel_i0(beta * sqrt(1 - x * x)) / bessel_i0(beta) : 0;
+			double s = d == 0 ? 1 : sin(M_PI * fc * d) / (M_PI * fc * d);
+
+			h[k] = fc * s * w;
+			sum += h[k];
+		}
+
+		/* unity gain at dc for every phase */
+		for (k = 0; k < taps; k++)
+			h[k] /= sum;
+	}
+
+	return 0;
+}
+
+/* input frame and phase position (in 1/RCACHE_PHASES) of output frame j */
+static void resampler_pos(const struct resampler *rs, uint64_t j,
+                          int64_t *ipos, double *phase)
+{
+	uint64_t num = j * rs->in_rate;
+
+	*ipos = num / rs->out_rate;
+	*phase = (double) (num % rs->out_rate) / rs->out_rate * RCACHE_PHASES;
+}
+
+/* the routed input from 'first' on, zero outside the file */
+static void load_input(const short int *src, uint64_t frames, const struct route *r,
+                       int64_t first, unsigned int count, short int *in, short int *out)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		int64_t f = first + i;
+
+		if (f < 0 || (uint64_t) f >= frames)
+			memset(in + i * r->src_channels, 0, r->src_channels * sizeof(short int));
+		else
+			memcpy(in + i * r->src_channels, src + f * r->src_channels,
+			       r->src_channels * sizeof(short int));
+	}
+
+	if (route_apply(r, in, out, count) != out)
+		memcpy(out, in, (size_t) count * r->src_channels * sizeof(short int));
+}
+
+static void resample_block(const struct resampler *rs, const short int *in,
+                           int64_t in_first, unsigned int channels,
+                           uint64_t j0, unsigned int count, short int *out)
+{
+	unsigned int i, k, c;
+	float acc[channels];
+
+	for (i = 0; i < count; i++) {
+		int64_t ipos;
+		double phase;
+		unsigned int p;
+		float a;
+		const float *h0, *h1;
+		const short int *x;
+
+		resampler_pos(rs, j0 + i, &ipos, &phase);
+		p = (unsigned int) phase;
+		a = phase - p;
+		h0 = rs->table + p * rs->taps;
+		h1 = h0 + rs->taps;
+		x = in + (ipos - rs->taps / 2 + 1 - in_first) * channels;
+
+		for (c = 0; c < channels; c++)
+			acc[c] = 0;
+		for (k = 0; k < rs->taps; k++, x += channels) {
+			float h = h0[k] + (h1[k] - h0[k]) * a;
+
+			for (c = 0; c < channels; c++)
+				acc[c] += h * x[c];
+		}
+
+		for (c = 0; c < channels; c++) {
+			float s = acc[c];
+
+			out[i * channels + c] = s > 32767.0f ? 32767 : s < -32768.0f ? -32768 : lrintf(s);
+		}
+	}
+}
+
+/* render the whole source into the open file 'fd' - returns the frames */
+static int64_t render(struct rcache *c, const short int *src, const struct wav_info *info,
+                      const struct rcache_target *t, const struct route *r, int fd)
+{
+	struct resampler rs = { 0 };
+	uint64_t out_frames, j;
+	unsigned int in_max;
+	short int *in = NULL, *routed = NULL, *out = NULL;
+	int64_t err = 0;
+
+	if (info->rate == t->rate) {
+		out_frames = info->frames;
+		in_max = RCACHE_BLOCK;
+	} else {
+		err = resampler_init(&rs, info->rate, t->rate);
+		if (err < 0)
+			return err;
+		out_frames = (info->frames * t->rate + info->rate - 1) / info->rate;
+		in_max = (uint64_t) RCACHE_BLOCK * info->rate / t->rate + rs.taps + 2;
+	}
+
+	in = malloc((size_t) in_max * r->src_channels * sizeof(short int));
+	routed = malloc((size_t) in_max * t->channels * sizeof(short int));
+	out = malloc((size_t) RCACHE_BLOCK * t->channels * sizeof(short int));
+	if (!in || !routed || !out) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (j = 0; j < out_frames; j += RCACHE_BLOCK) {
+		unsigned int count = out_frames - j < RCACHE_BLOCK ? out_frames - j : RCACHE_BLOCK;
+		size_t len = (size_t) count * t->channels * sizeof(short int);
+		const short int *block = routed;
+
+		/* the pre-render gives up early */
+		if (atomic_load_explicit(&c->stop, memory_order_relaxed)) {
+			err = -EINTR;
+			goto out;
+		}
+
+		if (rs.table) {
+			int64_t first, last;
+			double phase;
+
+			resampler_pos(&rs, j, &first, &phase);
+			resampler_pos(&rs, j + count - 1, &last, &phase);
+			first -= rs.taps / 2 - 1;
+			last += rs.taps / 2 + 1;
+
+			load_input(src, info->frames, r, first, last - first + 1, in, routed);
+			resample_block(&rs, routed, first, t->channels, j, count, out);
+			block = out;
+		} else
+			load_input(src, info->frames, r, j, count, in, routed);
+
+		if (write(fd, block, len) != (ssize_t) len) {
+			err = -EIO;
+			goto out;
+		}
+	}
+	err = out_frames;
+
+out:
+	free(rs.table);
+	free(in);
+	free(routed);
+	free(out);
+	return err;
+}
+
+/* oldest first */
+struct cache_file {
+	char name[256];
+	off_t size;
+	struct timespec mtime;
+};
+
+static int by_mtime(const void *a, const void *b)
+{
+	const struct cache_file *fa = a, *fb = b;
+
+	if (fa->mtime.tv_sec != fb->mtime.tv_sec)
+		return fa->mtime.tv_sec < fb->mtime.tv_sec ? -1 : 1;
+	if (fa->mtime.tv_nsec != fb->mtime.tv_nsec)
+		return fa->mtime.tv_nsec < fb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* least recently used renders go until the cache fits - never 'keep' */
+static void evict(struct rcache *c, const char *keep)
+{
+	struct cache_file *files = NULL, *f;
+	unsigned int nr = 0, max = 0, i;
+	unsigned long long total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(c->dir);
+	if (dir == NULL)
+		return;
+
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+
+		if (len < 5 || len >= sizeof(f->name) || strcmp(de->d_name + len - 4, ".wav") ||
+		    fstatat(dirfd(dir), de->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			f = realloc(files, max * sizeof(*files));
+			if (f == NULL)
+				break;
+			files = f;
+		}
+
+		f = &files[nr++];
+		strcpy(f->name, de->d_name);
+		f->size = st.st_size;
+		f->mtime = st.st_mtim;
+		total += st.st_size;
+	}
+
+	if (total > c->max_size) {
+		qsort(files, nr, sizeof(*files), by_mtime);
+
+		for (i = 0; i < nr && total > c->max_size; i++) {
+			if (!strcmp(files[i].name, keep))
+				continue;
+			if (unlinkat(dirfd(dir), files[i].name, 0) == 0) {
+				total -= files[i].size;
+				atomic_fetch_add(&c->evictions, 1);
+			}
+		}
+	}
+
+	closedir(dir);
+	free(files);
+}
+
+int rcache_get(struct rcache *c, const char *src,
+               const struct rcache_target *target, char *path, size_t size)
+{
+	struct wav_info info;
+	struct route *r;
+	struct stat st;
+	char name[128], tmp[4096];
+	unsigned char header[WAV_HEADER_SIZE];
+	void *map = MAP_FAILED;
+	int64_t frames;
+	int fd, out = -1, err;
+
+	fd = open(src, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		err = -errno;
+		goto fail;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		err = -errno;
+		goto fail;
+	}
+
+	err = wav_parse(map, st.st_size, &info);
+	if (err < 0 || info.format != WAV_FORMAT_PCM || info.bits != 16 || info.truncated) {
+		printf("%s: not a complete 16 bit pcm wave file\n", src);
+		err = -EINVAL;
+		goto fail;
+	}
+
+	r = malloc(sizeof(*r));
+	if (r == NULL) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	make_route(r, target, info.channels);
+
+	/* content, source format and target */
+	snprintf(name, sizeof(name), "%016llx-%u-%u-%u-%u-%08llx.wav",
+	         (unsigned long long) content_hash(c, src, &st, map, &info),
+	         info.rate, info.channels, target->rate, target->channels,
+	         (unsigned long long) (route_hash(r) & 0xffffffff));
+	snprintf(path, size, "%s/%s", c->dir, name);
+
+	/* hit: it is used now - open, an eviction can not take it from us any more */
+	out = open(path, O_RDONLY);
+	if (out >= 0) {
+		futimens(out, NULL);
+		atomic_fetch_add(&c->hits, 1);
+		err = out;
+		out = -1;
+		goto done;
+	}
+	if (errno != ENOENT) {
+		err = -errno;
+		goto done;
+	}
+
+	/* miss: render next to it and move it in place when complete */
+	snprintf(tmp, sizeof(tmp), "%s.%d.%ld.tmp", path, getpid(), (long) syscall(SYS_gettid));
+	out = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (out < 0) {
+		err = -errno;
+		goto done;
+	}
+
+	wav_header(header, target->rate, target->channels, 0);
+	if (write(out, header, sizeof(header)) != sizeof(header)) {
+		err = -EIO;
+		goto done;
+	}
+
+	frames = render(c, (const short int *) ((const unsigned char *) map + info.data_offset),
+	                &info, target, r, out);
+	if (frames < 0) {
+		err = frames;
+		goto done;
+	}
+
+	wav_header(header, target->rate, target->channels, frames);
+	if (pwrite(out, header, sizeof(header), 0) != sizeof(header) || fsync(out) < 0 ||
+	    rename(tmp, path) < 0) {
+		err = errno ? -errno : -EIO;
+		goto done;
+	}
+
+	atomic_fetch_add(&c->renders, 1);
+	evict(c, name);
+
+	/* the descriptor is the render now, whatever happens to the name */
+	lseek(out, 0, SEEK_SET);
+	err = out;
+	out = -1;
+
+done:
+	if (out >= 0) {
+		close(out);
+		if (err < 0)
+			unlink(tmp);
+	}
+	free(r);
+fail:
+	if (map != MAP_FAILED)
+		munmap(map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	return err;
+}
+
+static void *prerender_thread(void *arg)
+{
+	struct rcache *c = arg;
+	char path[4096];
+	unsigned int i;
+	int err;
+
+	/* only idle time */
+	setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+	for (i = 0; i < c->nr_files && !atomic_load(&c->stop); i++) {
+		err = rcache_get(c, c->files[i], &c->target, path, sizeof(path));
+		if (err >= 0)
+			close(err);
+		else if (err != -EINTR)
+			printf("Pre-render of %s failed: %s\n", c->files[i], strerror(-err));
+	}
+
+	return NULL;
+}
+
+int rcache_prerender(struct rcache *c, char **files, unsigned int nr_files,
+                     const struct rcache_target *target)
+{
+	int err;
+
+	if (c->thread_running || nr_files == 0)
+		return c->thread_running ? -EBUSY : 0;
+
+	c->files = files;
+	c->nr_files = nr_files;
+	c->target = *target;
+
+	/* the caller may free its route while we still render */
+	if (target->route) {
+		c->route = malloc(sizeof(*c->route));
+		if (c->route == NULL)
+			return -ENOMEM;
+		memcpy(c->route, target->route, sizeof(*c->route));
+		c->target.route = c->route;
+	}
+
+	err = pthread_create(&c->thread, NULL, prerender_thread, c);
+	if (err)
+		return -err;
+	c->thread_running = 1;
+
+	return 0;
+}
+
+void rcache_print_stats(struct rcache *c)
+{
+	printf("render cache: %lu hits, %lu renders, %lu evicted\n",
+	       atomic_load(&c->hits), atomic_load(&c->renders),
+	       atomic_load(&c->evictions));
+}
@@ -0,0 +1,78 @@
+/*
+ * On-disk cache of device native renders
+ *
+ * A render is the source converted once to what the device runs: 16 bit
+ * pcm at the device rate, routed to the device channels. It is stored
+ * as a plain wave file named after the source content and the target:
+ *
+ *   <dir>/<content hash>-<rate>-<channels>-<route hash>.wav
+ *
+ * so the player opens it like any other file and plays it without
+ * conversion. The content hash of a source is remembered per path,
+ * size and mtime in <dir>/paths/, a source that did not change is not
+ * read again.
+ *
+ * The mtime of a render is its last use: renders are touched on every
+ * hit, and after every new render the least recently used ones are
+ * removed until the cache fits its size. Renders appear atomically
+ * (write to a temporary, rename), so several players may share a cache.
+ * A render is handed out open: another player evicting it meanwhile
+ * only removes the name, an open that finds no file is a miss.
+ *
+ * A background thread renders the upcoming items of a playlist, at the
+ * lowest priority, so they are ready when their turn comes.
+ */
+
+#ifndef RCACHE_H
+#define RCACHE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "route.h"
+
+struct rcache_target {
+	unsigned int rate;
+	unsigned int channels;
+	/* source to device channels - NULL, or other source channels, i -> i */
+	const struct route *route;
+};
+
+struct rcache {
+	char *dir;
+	unsigned long long max_size;
+
+	/* pre-render thread, with its own copy of the target */
+	pthread_t thread;
+	int thread_running;
+	atomic_int stop;
+	char **files;
+	unsigned int nr_files;
+	struct rcache_target target;
+	struct route *route;
+
+	/* statistics */
+	atomic_ulong hits;
+	atomic_ulong renders;
+	atomic_ulong evictions;
+};
+
+/* the directory is created when missing */
+int rcache_open(struct rcache *c, const char *dir, unsigned long long max_size);
+void rcache_close(struct rcache *c);
+
+/*
+ * The render of 16 bit pcm wave file 'src' for 'target' in 'path',
+ * rendered now when missing - returns it open for reading.
+ */
+int rcache_get(struct rcache *c, const char *src,
+               const struct rcache_target *target, char *path, size_t size);
+
+/* render 'files' in the background - rcache_close() stops it */
+int rcache_prerender(struct rcache *c, char **files, unsigned int nr_files,
+                     const struct rcache_target *target);
+
+void rcache_print_stats(struct rcache *c);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Lock-free single producer / single consumer byte ring
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ring.h"
+#include "bufpool.h"
+
+int ring_init(struct ring *r, size_t size)
+{
+	size_t n = 64;
+
+	while (n < size)
+		n <<= 1;
+
+	r->data = bufpool_alloc(n);
+	if (r->data == NULL)
+		return -ENOMEM;
+
+	r->size = n;
+	r->mask = n - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+
+	return 0;
+}
+
+void ring_free(struct ring *r)
+{
+	bufpool_free(r->data);
+	r->data = NULL;
+}
+
+size_t ring_used(struct ring *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) -
+	       atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+size_t ring_space(struct ring *r)
+{
+	return r->size - ring_used(r);
+}
+
+size_t ring_write(struct ring *r, const void *buf, size_t len)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	size_t pos = head & r->mask;
+	size_t first;
+
+	if (r->size - (head - tail) < len)
+		return 0;
+
+	/* copy with wrap around */
+	first = r->size - pos < len ? r->size - pos : len;
+	memcpy(r->data + pos, buf, first);
+	memcpy(r->data, (const unsigned char *) buf + first, len - first);
+
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+	return len;
+}
+
+size_t ring_read(struct ring *r, void *buf, size_t len)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	size_t pos = tail & r->mask;
+	size_t first;
+
+	if (head - tail < len)
+		len = head - tail;
+
+	first = r->size - pos < len ? r->size - pos : len;
+	memcpy(buf, r->data + pos, first);
+	memcpy((unsigned char *) buf + first, r->data, len - first);
+
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+	return len;
+}
@@ -0,0 +1,38 @@
+/*
+ * Lock-free single producer / single consumer byte ring
+ *
+ * Writes are all or nothing and never block, so the audio thread can
+ * hand over a period and simply count it as dropped when the consumer
+ * is behind.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+
+struct ring {
+	unsigned char *data;
+	size_t size;
+	size_t mask;
+
+	/* producer and consumer positions on their own cache lines */
+	_Alignas(64) atomic_size_t head;
+	_Alignas(64) atomic_size_t tail;
+};
+
+/* size is rounded up to a power of 2 */
+int ring_init(struct ring *r, size_t size);
+void ring_free(struct ring *r);
+
+size_t ring_used(struct ring *r);
+size_t ring_space(struct ring *r);
+
+/* producer: returns len, or 0 when there is not enough space */
+size_t ring_write(struct ring *r, const void *buf, size_t len);
+
+/* consumer: returns the number of bytes read, at most len */
+size_t ring_read(struct ring *r, void *buf, size_t len);
+
+#endif
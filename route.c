@@ -0,0 +1,265 @@
+/*
+ * Channel routing from source channels to device channels
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "route.h"
+
+int route_init(struct route *r, unsigned int src_channels,
+               unsigned int dst_channels)
+{
+	if (src_channels == 0 || src_channels > ROUTE_MAX_CHANNELS ||
+	    dst_channels == 0 || dst_channels > ROUTE_MAX_CHANNELS) {
+		printf("Unsupported channel count (%u -> %u)\n",
+		       src_channels, dst_channels);
+		return -EINVAL;
+	}
+
+	memset(r, 0, sizeof(*r));
+	r->src_channels = src_channels;
+	r->dst_channels = dst_channels;
+	r->groups = (dst_channels + 3) / 4;
+
+	return 0;
+}
+
+int route_set(struct route *r, unsigned int src, unsigned int dst,
+              float gain_db)
+{
+	if (src >= r->src_channels || dst >= r->dst_channels) {
+		printf("Invalid route %u -> %u\n", src, dst);
+		return -EINVAL;
+	}
+
+	r->gain[src][dst] = gain_db == 0 ? 1.0f : powf(10.0f, gain_db / 20.0f);
+	return 0;
+}
+
+/* "src:dst[:gain_db],..." */
+int route_parse(struct route *r, const char *spec)
+{
+	const char *p = spec;
+
+	while (*p) {
+		unsigned int src, dst;
+		float gain_db = 0;
+		int n, len = 0;
+
+		n = sscanf(p, "%u:%u%n:%f%n", &src, &dst, &len, &gain_db, &len);
+		if (n < 2) {
+			printf("Invalid route: %s\n", p);
+			return -EINVAL;
+		}
+
+		if (route_set(r, src, dst, gain_db) < 0)
+			return -EINVAL;
+
+		p += len;
+		if (*p == ',')
+			p++;
+		else if (*p) {
+			printf("Invalid route: %s\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* device channel at position 'pos' - only one the matrix has */
+static int find_pos(const struct route *r, const snd_pcm_chmap_t *map,
+                    unsigned int pos)
+{
+	unsigned int i;
+
+	for (i = 0; i < map->channels; i++)
+		if (map->pos[i] == pos)
+			return i < r->dst_channels && i < ROUTE_MAX_CHANNELS ? (int) i : -1;
+
+	return -1;
+}
+
+/*
+ * Route by channel position: 'src_pos' has one position per source
+ * channel, each goes to the device channel with the same position. Mono goes to front left/right, or
+ * front center. When nothing matches, route by index.
+ */
+int route_from_chmap(struct route *r, const unsigned int *src_pos,
+                     const snd_pcm_chmap_t *map)
+{
+	unsigned int s, matched = 0;
+	int d, fl, fr;
+
+	for (s = 0; s < r->src_channels; s++) {
+		/* no position, nowhere to go */
+		if (src_pos[s] == SND_CHMAP_UNKNOWN)
+			continue;
+
+		d = find_pos(r, map, src_pos[s]);
+		if (d >= 0) {
+			r->gain[s][d] = 1.0f;
+			matched++;
+			continue;
+		}
+
+		if (src_pos[s] != SND_CHMAP_MONO)
+			continue;
+
+		fl = find_pos(r, map, SND_CHMAP_FL);
+		fr = find_pos(r, map, SND_CHMAP_FR);
+		if (fl >= 0 && fr >= 0) {
+			/* -3dB on both sides */
+			r->gain[s][fl] = M_SQRT1_2;
+			r->gain[s][fr] = M_SQRT1_2;
+			matched++;
+		} else if ((d = find_pos(r, map, SND_CHMAP_FC)) >= 0) {
+			r->gain[s][d] = 1.0f;
+			matched++;
+		}
+	}
+
+	if (matched)
+		return matched;
+
+	for (s = 0; s < r->src_channels && s < r->dst_channels; s++)
+		r->gain[s][s] = 1.0f;
+
+	return 0;
+}
+
+/* pick the cheapest way to apply the matrix */
+void route_finalize(struct route *r)
+{
+	unsigned int s, d, g;
+	int identity = r->src_channels == r->dst_channels;
+	int copy = 1;
+
+	for (d = 0; d < r->dst_channels; d++) {
+		unsigned int taps = 0;
+
+		r->map[d] = -1;
+		for (s = 0; s < r->src_channels; s++) {
+			if (r->gain[s][d] == 0.0f)
+				continue;
+
+			taps++;
+			r->map[d] = s;
+			if (r->gain[s][d] != 1.0f)
+				copy = 0;
+		}
+
+		if (taps > 1)
+			copy = 0;
+		if (r->map[d] != (int) d || taps != 1)
+			identity = 0;
+	}
+
+	if (identity)
+		r->type = ROUTE_IDENTITY;
+	else if (copy)
+		r->type = ROUTE_COPY;
+	else
+		r->type = ROUTE_MATRIX;
+
+	/* columns and non zero taps per group of 4 device channels */
+	for (g = 0; g < r->groups; g++) {
+		r->nr_taps[g] = 0;
+
+		for (s = 0; s < r->src_channels; s++) {
+			route_v4 col = { 0 };
+			int used = 0;
+
+			for (d = 0; d < 4 && g * 4 + d < r->dst_channels; d++) {
+				col[d] = r->gain[s][g * 4 + d];
+				if (col[d] != 0.0f)
+					used = 1;
+			}
+
+			r->column[s][g] = col;
+			if (used)
+				r->tap[g][r->nr_taps[g]++] = s;
+		}
+	}
+}
+
+void route_print(const struct route *r)
+{
+	static const char *type[] = { "identity", "copy", "matrix" };
+	unsigned int s, d;
+
+	printf("route: %u -> %u channels (%s)\n",
+	       r->src_channels, r->dst_channels, type[r->type]);
+
+	for (s = 0; s < r->src_channels; s++)
+		for (d = 0; d < r->dst_channels; d++)
+			if (r->gain[s][d] != 0.0f)
+				printf("  %u -> %u: %.2f dB\n", s, d,
+				       20 * log10f(r->gain[s][d]));
+}
+
+static void apply_copy(const struct route *r, const short int *src,
+                       short int *dst, unsigned int frames)
+{
+	unsigned int ns = r->src_channels, nd = r->dst_channels;
+	unsigned int i, d;
+
+	for (i = 0; i < frames; i++, src += ns, dst += nd)
+		for (d = 0; d < nd; d++)
+			dst[d] = r->map[d] >= 0 ? src[r->map[d]] : 0;
+}
+
+static void apply_matrix(const struct route *r, const short int *src,
+                         short int *dst, unsigned int frames)
+{
+	unsigned int ns = r->src_channels, nd = r->dst_channels;
+	float x[ROUTE_MAX_CHANNELS];
+	unsigned int i, s, g, t, d;
+
+	for (i = 0; i < frames; i++, src += ns, dst += nd) {
+
+		for (s = 0; s < ns; s++)
+			x[s] = src[s];
+
+		for (g = 0; g < r->groups; g++) {
+			route_v4 acc = { 0 };
+			unsigned int n = nd - g * 4 < 4 ? nd - g * 4 : 4;
+
+			/* only the source channels feeding this group */
+			for (t = 0; t < r->nr_taps[g]; t++) {
+				s = r->tap[g][t];
+				acc += x[s] * r->column[s][g];
+			}
+
+			for (d = 0; d < n; d++) {
+				float v = acc[d];
+
+				if (v > 32767.0f)
+					v = 32767.0f;
+				else if (v < -32768.0f)
+					v = -32768.0f;
+				dst[g * 4 + d] = (short int) lrintf(v);
+			}
+		}
+	}
+}
+
+short int *route_apply(const struct route *r, short int *src,
+                       short int *dst, unsigned int frames)
+{
+	switch (r->type) {
+	case ROUTE_IDENTITY:
+		return src;
+	case ROUTE_COPY:
+		apply_copy(r, src, dst, frames);
+		break;
+	case ROUTE_MATRIX:
+		apply_matrix(r, src, dst, frames);
+		break;
+	}
+
+	return dst;
+}
@@ -0,0 +1,65 @@
+/*
+ * Channel routing from source channels to device channels
+ *
+ * The routing is a gain matrix [src][dst]. route_finalize() looks at
+ * the matrix and picks the cheapest way to apply it:
+ *
+ *   identity - same layout, the source buffer is used as is
+ *   copy     - every device channel takes at most one source channel
+ *              at unity gain, a plain gather
+ *   matrix   - mixing, per group of 4 device channels only the non
+ *              zero source columns are accumulated
+ */
+
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "alsa/asoundlib.h"
+
+/* maximum number of source and device channels */
+#define ROUTE_MAX_CHANNELS 64
+
+enum route_type {
+	ROUTE_IDENTITY,
+	ROUTE_COPY,
+	ROUTE_MATRIX,
+};
+
+/* 4 device channels, one per lane */
+typedef float route_v4 __attribute__((vector_size(16)));
+
+struct route {
+	unsigned int src_channels;
+	unsigned int dst_channels;
+	unsigned int groups;
+	enum route_type type;
+
+	/* gains, [src][dst] */
+	float gain[ROUTE_MAX_CHANNELS][ROUTE_MAX_CHANNELS];
+
+	/* copy: source channel for every device channel, -1 = silence */
+	int map[ROUTE_MAX_CHANNELS];
+
+	/* matrix: columns per group, [src][group] */
+	route_v4 column[ROUTE_MAX_CHANNELS][ROUTE_MAX_CHANNELS / 4];
+	/* matrix: non zero source channels per group */
+	unsigned int nr_taps[ROUTE_MAX_CHANNELS / 4];
+	unsigned char tap[ROUTE_MAX_CHANNELS / 4][ROUTE_MAX_CHANNELS];
+};
+
+/* setup */
+int route_init(struct route *r, unsigned int src_channels,
+               unsigned int dst_channels);
+int route_set(struct route *r, unsigned int src, unsigned int dst,
+              float gain_db);
+int route_parse(struct route *r, const char *spec);
+int route_from_chmap(struct route *r, const unsigned int *src_pos,
+                     const snd_pcm_chmap_t *map);
+void route_finalize(struct route *r);
+void route_print(const struct route *r);
+
+/* audio thread - returns the buffer holding the device channels */
+short int *route_apply(const struct route *r, short int *src,
+                       short int *dst, unsigned int frames);
+
+#endif
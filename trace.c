@@ -0,0 +1,141 @@
+/*
+ * Hot path tracing
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+__thread struct trace_ring *trace_local = NULL;
+
+/* registered rings - the lock is only taken at setup and dump time */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_ring *trace_rings[TRACE_MAX_THREADS];
+static unsigned int trace_nr_rings = 0;
+
+/* clock calibration start point */
+static uint64_t trace_clock0;
+static uint64_t trace_ns0;
+
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int trace_thread_init(const char *name, unsigned int size)
+{
+	struct trace_ring *r;
+	unsigned int n = 64;
+
+	while (n < size)
+		n <<= 1;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return -ENOMEM;
+
+	r->rec = calloc(n, sizeof(*r->rec));
+	if (r->rec == NULL) {
+		free(r);
+		return -ENOMEM;
+	}
+
+	r->tid = syscall(SYS_gettid);
+	strncpy(r->name, name, sizeof(r->name) - 1);
+	r->mask = n - 1;
+	atomic_init(&r->head, 0);
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_nr_rings >= TRACE_MAX_THREADS) {
+		pthread_mutex_unlock(&trace_lock);
+		free(r->rec);
+		free(r);
+		return -ENOSPC;
+	}
+	if (trace_nr_rings == 0) {
+		trace_clock0 = trace_clock();
+		trace_ns0 = monotonic_ns();
+	}
+	trace_rings[trace_nr_rings++] = r;
+	pthread_mutex_unlock(&trace_lock);
+
+	trace_local = r;
+	return 0;
+}
+
+/*
+ * Write all rings, oldest record first. Records written by other threads
+ * while dumping may be torn, the ring of the calling thread is exact.
+ */
+int trace_dump(const char *filename)
+{
+	struct trace_file_header header;
+	FILE *f;
+	unsigned int i;
+	int err = 0;
+
+	f = fopen(filename, "wb");
+	if (f == NULL)
+		return -errno;
+
+	pthread_mutex_lock(&trace_lock);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.nr_rings = trace_nr_rings;
+	header.clock0 = trace_clock0;
+	header.ns0 = trace_ns0;
+
+	/* second calibration point */
+#if defined(__x86_64__) || defined(__i386__)
+	{
+		uint64_t clock1 = trace_clock();
+		uint64_t ns1 = monotonic_ns();
+
+		header.ns_per_tick = clock1 > trace_clock0 ?
+			(double) (ns1 - trace_ns0) / (clock1 - trace_clock0) : 1.0;
+	}
+#else
+	header.clock0 = 0;
+	header.ns0 = 0;
+	header.ns_per_tick = 1.0;
+#endif
+
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (i = 0; i < trace_nr_rings; i++) {
+		struct trace_ring *r = trace_rings[i];
+		uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+		uint64_t size = (uint64_t) r->mask + 1;
+		uint64_t count = head < size ? head : size;
+		struct trace_file_ring fr;
+		uint64_t j;
+
+		memset(&fr, 0, sizeof(fr));
+		fr.tid = r->tid;
+		memcpy(fr.name, r->name, sizeof(fr.name));
+		fr.count = count;
+		fwrite(&fr, sizeof(fr), 1, f);
+
+		for (j = head - count; j < head; j++)
+			fwrite(&r->rec[j & r->mask], sizeof(r->rec[0]), 1, f);
+	}
+
+	pthread_mutex_unlock(&trace_lock);
+
+	if (fclose(f) != 0)
+		err = -errno;
+
+	return err;
+}
@@ -0,0 +1,118 @@
+/*
+ * Hot path tracing
+ *
+ * Every thread that calls trace_thread_init() gets its own fixed size
+ * ring of binary records. Recording is a timestamp and two stores into
+ * thread local memory: no locks, no syscalls, no atomics read-modify-
+ * write. Old records are overwritten.
+ *
+ * trace_dump() writes all rings to a file, trace2json converts that
+ * file to chrome trace json (chrome://tracing, ui.perfetto.dev).
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/* maximum number of traced threads */
+#define TRACE_MAX_THREADS 64
+
+/* file format */
+#define TRACE_MAGIC 0x52544c41 /* "ALTR" */
+#define TRACE_VERSION 1
+
+enum trace_event {
+	TRACE_WAKEUP,
+	TRACE_FILL_BEGIN,
+	TRACE_FILL_END,
+	TRACE_STORE_BEGIN,
+	TRACE_STORE_END,
+	TRACE_WRITEI_ENTER,
+	TRACE_WRITEI_EXIT,
+	TRACE_READI_ENTER,
+	TRACE_READI_EXIT,
+	TRACE_AVAIL,
+	TRACE_DELAY,
+	TRACE_XRUN,
+	/* a parallel job ended past its deadline */
+	TRACE_LATE,
+	TRACE_NR_EVENTS,
+};
+
+struct trace_record {
+	uint64_t time;
+	uint32_t event;
+	int32_t value;
+};
+
+struct trace_ring {
+	uint32_t tid;
+	char name[16];
+	uint32_t mask;
+	/* only written by the owner, read when dumping */
+	atomic_uint_fast64_t head;
+	struct trace_record *rec;
+};
+
+/* header of a trace file, followed per ring by trace_file_ring + records */
+struct trace_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_rings;
+	uint32_t pad;
+	/* time = (clock - clock0) * ns_per_tick + ns0 */
+	uint64_t clock0;
+	uint64_t ns0;
+	double ns_per_tick;
+};
+
+struct trace_file_ring {
+	uint32_t tid;
+	char name[16];
+	uint32_t count;
+};
+
+extern __thread struct trace_ring *trace_local;
+
+/* setup - not realtime safe */
+int trace_thread_init(const char *name, unsigned int size);
+int trace_dump(const char *filename);
+
+static inline uint64_t trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* record an event - a no-op when the thread has no ring */
+static inline void trace(enum trace_event event, int32_t value)
+{
+	struct trace_ring *r = trace_local;
+	uint64_t head;
+	struct trace_record *rec;
+
+	if (r == NULL)
+		return;
+
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	rec = &r->rec[head & r->mask];
+	rec->time = trace_clock();
+	rec->event = event;
+	rec->value = value;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Convert a trace_dump() file to chrome trace json
+ *
+ * build: gcc -O2 trace2json.c -o trace2json
+ *
+ * usage: trace2json trace.bin > trace.json
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+/* how every event shows up in the trace */
+static const struct {
+	const char *name;
+	char phase;
+} events[TRACE_NR_EVENTS] = {
+	[TRACE_WAKEUP]       = { "wakeup", 'i' },
+	[TRACE_FILL_BEGIN]   = { "fill",   'B' },
+	[TRACE_FILL_END]     = { "fill",   'E' },
+	[TRACE_STORE_BEGIN]  = { "store",  'B' },
+	[TRACE_STORE_END]    = { "store",  'E' },
+	[TRACE_WRITEI_ENTER] = { "writei", 'B' },
+	[TRACE_WRITEI_EXIT]  = { "writei", 'E' },
+	[TRACE_READI_ENTER]  = { "readi",  'B' },
+	[TRACE_READI_EXIT]   = { "readi",  'E' },
+	[TRACE_AVAIL]        = { "avail",  'C' },
+	[TRACE_DELAY]        = { "delay",  'C' },
+	[TRACE_XRUN]         = { "xrun",   'i' },
+	[TRACE_LATE]         = { "late",   'i' },
+};
+
+int main(int argc, char *argv[])
+{
+	struct trace_file_header header;
+	struct trace_file_ring ring;
+	struct trace_record rec;
+	const char *sep = "";
+	unsigned int i, j;
+	FILE *f;
+
+	if (argc != 2) {
+		printf("Usage: %s trace.bin\n", argv[0]);
+		return -1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if (f == NULL) {
+		printf("Could not open: %s\n", argv[1]);
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    header.magic != TRACE_MAGIC || header.version != TRACE_VERSION) {
+		printf("%s is not a trace file\n", argv[1]);
+		return -1;
+	}
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	for (i = 0; i < header.nr_rings; i++) {
+		if (fread(&ring, sizeof(ring), 1, f) != 1) {
+			fprintf(stderr, "truncated trace\n");
+			break;
+		}
+		ring.name[sizeof(ring.name) - 1] = '\0';
+
+		/* thread name */
+		printf("%s\n{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,"
+		       "\"args\":{\"name\":\"%s\"}}", sep, ring.tid, ring.name);
+		sep = ",";
+
+		for (j = 0; j < ring.count; j++) {
+			double us;
+
+			if (fread(&rec, sizeof(rec), 1, f) != 1) {
+				fprintf(stderr, "truncated trace\n");
+				break;
+			}
+
+			if (rec.event >= TRACE_NR_EVENTS)
+				continue;
+
+			us = ((double) (int64_t) (rec.time - header.clock0) * header.ns_per_tick +
+			      header.ns0) / 1000.0;
+
+			printf(",\n{\"ph\":\"%c\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,\"ts\":%.3f",
+			       events[rec.event].phase, events[rec.event].name, ring.tid, us);
+
+			switch (events[rec.event].phase) {
+			case 'C':
+				printf(",\"args\":{\"%s\":%d}}", events[rec.event].name, rec.value);
+				break;
+			case 'i':
+				printf(",\"s\":\"%c\",\"args\":{\"value\":%d}}",
+				       rec.event == TRACE_XRUN ? 'g' : 't', rec.value);
+				break;
+			default:
+				printf(",\"args\":{\"value\":%d}}", rec.value);
+				break;
+			}
+		}
+	}
+
+	printf("\n]}\n");
+	fclose(f);
+
+	return 0;
+}
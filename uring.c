@@ -0,0 +1,439 @@
+/*
+ * Streaming file i/o through io_uring
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+#include "bufpool.h"
+
+enum {
+	SLOT_IDLE,
+	SLOT_BUSY,
+	SLOT_DONE,
+};
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                                 unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* the kernel reads the tail and writes the completions */
+static inline unsigned int load_acquire(unsigned int *p)
+{
+	return atomic_load_explicit((_Atomic unsigned int *) p, memory_order_acquire);
+}
+
+static inline void store_release(unsigned int *p, unsigned int v)
+{
+	atomic_store_explicit((_Atomic unsigned int *) p, v, memory_order_release);
+}
+
+static int map_rings(struct uring *u, struct io_uring_params *p)
+{
+	u->sq_map_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	u->cq_map_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	/* one mapping for both on 5.4 and later */
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_map_size > u->sq_map_size)
+			u->sq_map_size = u->cq_map_size;
+		u->cq_map_size = 0;
+	}
+
+	u->sq_map = mmap(NULL, u->sq_map_size, PROT_READ | PROT_WRITE,
+	                 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_map == MAP_FAILED)
+		return -errno;
+
+	u->cq_map = u->sq_map;
+	if (u->cq_map_size) {
+		u->cq_map = mmap(NULL, u->cq_map_size, PROT_READ | PROT_WRITE,
+		                 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_map == MAP_FAILED)
+			return -errno;
+	}
+
+	u->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+	               MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		return -errno;
+
+	u->sq_tail = (unsigned int *) ((char *) u->sq_map + p->sq_off.tail);
+	u->sq_mask = (unsigned int *) ((char *) u->sq_map + p->sq_off.ring_mask);
+	u->sq_array = (unsigned int *) ((char *) u->sq_map + p->sq_off.array);
+	u->cq_head = (unsigned int *) ((char *) u->cq_map + p->cq_off.head);
+	u->cq_tail = (unsigned int *) ((char *) u->cq_map + p->cq_off.tail);
+	u->cq_mask = (unsigned int *) ((char *) u->cq_map + p->cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *) ((char *) u->cq_map + p->cq_off.cqes);
+
+	return 0;
+}
+
+static void unmap_rings(struct uring *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_map_size && u->cq_map && u->cq_map != MAP_FAILED)
+		munmap(u->cq_map, u->cq_map_size);
+	if (u->sq_map && u->sq_map != MAP_FAILED)
+		munmap(u->sq_map, u->sq_map_size);
+}
+
+/* slot 'i' at the current offset - goes out with the next submit */
+static void queue(struct uring *u, unsigned int i)
+{
+	struct uring_slot *s = &u->slot[i];
+	unsigned int tail = *u->sq_tail;
+	unsigned int idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (u->fixed_buffers)
+		sqe->opcode = u->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+	else
+		sqe->opcode = u->write ? IORING_OP_WRITE : IORING_OP_READ;
+	if (u->fixed_file) {
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->fd = 0;
+	} else
+		sqe->fd = u->fd;
+	sqe->addr = (uintptr_t) s->data;
+	sqe->len = s->len;
+	sqe->off = u->offset;
+	sqe->buf_index = i;
+	sqe->user_data = i;
+
+	u->sq_array[idx] = idx;
+	store_release(u->sq_tail, tail + 1);
+
+	u->offset += s->len;
+	s->state = SLOT_BUSY;
+	u->pending++;
+}
+
+/* hand the queued requests to the kernel, waiting for 'wait' completions */
+static int submit(struct uring *u, unsigned int wait)
+{
+	int ret;
+
+	if (u->pending == 0 && wait == 0)
+		return 0;
+
+	do {
+		ret = sys_io_uring_enter(u->ring_fd, u->pending, wait,
+		                         wait ? IORING_ENTER_GETEVENTS : 0);
+	} while (ret < 0 && errno == EINTR);
+	u->enters++;
+
+	if (ret < 0)
+		return -errno;
+
+	u->ios += ret;
+	u->pending -= ret;
+
+	return 0;
+}
+
+/* completions, straight from the ring */
+static void reap(struct uring *u)
+{
+	unsigned int head = *u->cq_head;
+	unsigned int tail = load_acquire(u->cq_tail);
+
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct uring_slot *s = &u->slot[cqe->user_data];
+
+		s->res = cqe->res;
+		s->state = SLOT_DONE;
+		if (cqe->res > 0)
+			u->bytes += cqe->res;
+		head++;
+	}
+
+	store_release(u->cq_head, head);
+}
+
+static unsigned int in_flight(struct uring *u)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < u->nr_slots; i++)
+		if (u->slot[i].state == SLOT_BUSY)
+			n++;
+
+	return n;
+}
+
+int uring_open(struct uring *u, int fd, int write, off_t offset,
+               size_t slot_size, unsigned int nr_slots)
+{
+	struct io_uring_params p;
+	struct iovec *iov;
+	unsigned int i;
+	int err;
+
+	memset(u, 0, sizeof(*u));
+	u->fd = fd;
+	u->write = write;
+	u->offset = offset;
+	u->slot_size = slot_size;
+	u->nr_slots = nr_slots;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = sys_io_uring_setup(nr_slots, &p);
+	if (u->ring_fd < 0)
+		return -errno;
+
+	err = map_rings(u, &p);
+	if (err < 0)
+		goto fail;
+
+	u->slot = calloc(nr_slots, sizeof(*u->slot));
+	iov = calloc(nr_slots, sizeof(*iov));
+	if (u->slot == NULL || iov == NULL) {
+		free(iov);
+		err = -ENOMEM;
+		goto fail;
+	}
+
+	for (i = 0; i < nr_slots; i++) {
+		u->slot[i].data = bufpool_alloc(slot_size);
+		if (u->slot[i].data == NULL) {
+			free(iov);
+			err = -ENOMEM;
+			goto fail;
+		}
+		iov[i].iov_base = u->slot[i].data;
+		iov[i].iov_len = slot_size;
+	}
+
+	/* not fatal: plain requests map the buffers and look up the file every time */
+	u->fixed_buffers = sys_io_uring_register(u->ring_fd, IORING_REGISTER_BUFFERS,
+	                                         iov, nr_slots) == 0;
+	u->fixed_file = sys_io_uring_register(u->ring_fd, IORING_REGISTER_FILES,
+	                                      &fd, 1) == 0;
+	free(iov);
+
+	if (write)
+		return 0;
+
+	/* read ahead: every slot, the first ones in before playback starts */
+	for (i = 0; i < nr_slots; i++) {
+		u->slot[i].len = slot_size;
+		queue(u, i);
+	}
+
+	err = submit(u, nr_slots);
+	if (err < 0)
+		goto fail;
+	reap(u);
+
+	return 0;
+
+fail:
+	uring_close(u);
+	return err;
+}
+
+int uring_close(struct uring *u)
+{
+	struct uring_slot *s;
+	unsigned int i;
+	int err = u->error;
+
+	/* the rest of the last slot, then everything in flight */
+	if (u->slot && u->write) {
+		s = &u->slot[u->head];
+		if (s->state != SLOT_BUSY && s->len) {
+			s->state = SLOT_IDLE;
+			queue(u, u->head);
+		}
+
+		while (in_flight(u)) {
+			if (submit(u, 1) < 0)
+				break;
+			reap(u);
+		}
+
+		for (i = 0; i < u->nr_slots; i++) {
+			s = &u->slot[i];
+			if (err == 0 && s->state == SLOT_DONE && s->res < 0)
+				err = s->res;
+			else if (err == 0 && s->state == SLOT_DONE && (size_t) s->res != s->len)
+				err = -EIO;
+		}
+	} else if (u->slot) {
+		/* reads in flight still write into the slots */
+		while (in_flight(u)) {
+			if (submit(u, 1) < 0)
+				break;
+			reap(u);
+		}
+	}
+
+	unmap_rings(u);
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+	u->ring_fd = -1;
+
+	if (u->slot) {
+		for (i = 0; i < u->nr_slots; i++)
+			bufpool_free(u->slot[i].data);
+		free(u->slot);
+		u->slot = NULL;
+	}
+
+	return err;
+}
+
+ssize_t uring_read(struct uring *u, void *buf, size_t size)
+{
+	struct uring_slot *s;
+	size_t avail = 0, copied = 0, n;
+	unsigned int i;
+	int end = 0;
+
+	reap(u);
+
+	/* all or nothing: what is in from the head on */
+	for (i = 0; i < u->nr_slots && avail < size; i++) {
+		s = &u->slot[(u->head + i) % u->nr_slots];
+		if (s->state != SLOT_DONE)
+			break;
+		if (s->res < 0)
+			return s->res;
+
+		avail += s->res - (i ? 0 : u->head_pos);
+		/* a short read is the end of the file */
+		if ((size_t) s->res < s->len) {
+			end = 1;
+			break;
+		}
+	}
+
+	if (avail < size && !end) {
+		u->stalls++;
+		submit(u, 0);
+		return -EAGAIN;
+	}
+
+	while (copied < size) {
+		s = &u->slot[u->head];
+		n = s->res - u->head_pos;
+		if (n > size - copied)
+			n = size - copied;
+		if (n == 0)
+			break;
+
+		memcpy((char *) buf + copied, (char *) s->data + u->head_pos, n);
+		copied += n;
+		u->head_pos += n;
+
+		/* used up: read further ahead into it, unless it was the end */
+		if (u->head_pos == (size_t) s->res && (size_t) s->res == s->len) {
+			queue(u, u->head);
+			u->head = (u->head + 1) % u->nr_slots;
+			u->head_pos = 0;
+		}
+	}
+
+	/* half of the slots per syscall */
+	if (u->pending * 2 >= u->nr_slots)
+		submit(u, 0);
+
+	return copied;
+}
+
+int uring_write(struct uring *u, const void *buf, size_t size)
+{
+	struct uring_slot *s;
+	size_t room = 0, n;
+	unsigned int i;
+	int err;
+
+	if (u->error)
+		return u->error;
+
+	reap(u);
+
+	/* completed slots are free again, unless the write failed */
+	for (i = 0; i < u->nr_slots; i++) {
+		s = &u->slot[i];
+		if (s->state != SLOT_DONE)
+			continue;
+		if (s->res < 0 || (size_t) s->res != s->len) {
+			u->error = s->res < 0 ? s->res : -EIO;
+			return u->error;
+		}
+		s->state = SLOT_IDLE;
+		s->len = 0;
+	}
+
+	/* all or nothing: room in the free slots from the head on */
+	for (i = 0; i < u->nr_slots && room < size; i++) {
+		s = &u->slot[(u->head + i) % u->nr_slots];
+		if (s->state != SLOT_IDLE)
+			break;
+		room += u->slot_size - s->len;
+	}
+
+	if (room < size) {
+		u->stalls++;
+		return -EAGAIN;
+	}
+
+	while (size) {
+		s = &u->slot[u->head];
+		n = u->slot_size - s->len;
+		if (n > size)
+			n = size;
+
+		memcpy((char *) s->data + s->len, buf, n);
+		s->len += n;
+		buf = (const char *) buf + n;
+		size -= n;
+
+		/* full: off it goes */
+		if (s->len == u->slot_size) {
+			queue(u, u->head);
+			u->head = (u->head + 1) % u->nr_slots;
+		}
+	}
+
+	/* the data is taken: a busy ring submits it with the next write */
+	err = submit(u, 0);
+	return err == -EAGAIN || err == -EBUSY ? 0 : err;
+}
+
+void uring_print_stats(struct uring *u)
+{
+	printf("uring: %lu syscalls, %lu requests, %llu KB, %lu stalls, fixed%s%s\n",
+	       u->enters, u->ios, u->bytes >> 10, u->stalls,
+	       u->fixed_buffers ? " buffers" : "", u->fixed_file ? " file" : "");
+}
@@ -0,0 +1,97 @@
+/*
+ * Streaming file i/o through io_uring
+ *
+ * A file is read ahead, or written behind, in slots of 'slot_size' bytes:
+ * the slots are registered as fixed buffers and the file as a fixed file,
+ * so the kernel does not map them again for every request. Reading keeps
+ * every slot in flight and hands out data from the oldest; writing fills
+ * a slot with periods and sends it off when it is full.
+ *
+ * Completions are reaped from the shared ring without a syscall and
+ * requests are submitted in batches, so a stream takes a syscall per
+ * few slots instead of one per period. Nothing blocks after the setup:
+ * data that is not read yet, or a write with every slot still in
+ * flight, is -EAGAIN and the caller decides (silence, drop).
+ *
+ * No liburing: the raw syscalls and the ring layout of linux/io_uring.h.
+ * uring_open() fails when the kernel has no io_uring (or it is disabled),
+ * the caller then uses read() and write() as before.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* defaults for a stream: 1.5 s of 44.1 kHz stereo in flight */
+#define URING_SLOT_SIZE 65536
+#define URING_NR_SLOTS 4
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+struct uring_slot {
+	void *data;
+	/* bytes requested or filled */
+	size_t len;
+	/* idle, in flight, completed with 'res' */
+	int state;
+	int res;
+};
+
+struct uring {
+	int ring_fd;
+	int fd;
+	int write;
+
+	/* the rings, shared with the kernel */
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* queued, not submitted yet */
+	unsigned int pending;
+	int fixed_buffers;
+	int fixed_file;
+
+	struct uring_slot *slot;
+	unsigned int nr_slots;
+	size_t slot_size;
+	/* read: slot handed out next, write: slot being filled */
+	unsigned int head;
+	size_t head_pos;
+	/* file offset of the next request */
+	off_t offset;
+	int error;
+
+	/* statistics */
+	unsigned long enters;
+	unsigned long ios;
+	unsigned long long bytes;
+	unsigned long stalls;
+};
+
+/* i/o on 'fd' from 'offset' on - a read waits for the first slots */
+int uring_open(struct uring *u, int fd, int write, off_t offset,
+               size_t slot_size, unsigned int nr_slots);
+/* a write waits for the slots in flight - returns the first error */
+int uring_close(struct uring *u);
+
+/* all 'size' bytes, less at the end of the file, or -EAGAIN */
+ssize_t uring_read(struct uring *u, void *buf, size_t size);
+/* all 'size' bytes or -EAGAIN, earlier write errors are returned here */
+int uring_write(struct uring *u, const void *buf, size_t size);
+
+void uring_print_stats(struct uring *u);
+
+#endif
@@ -0,0 +1,464 @@
+/*
+ * Wave file parsing and analysis
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "wav.h"
+
+/* 4 channels, one per lane - double for the K-weighting poles near 1 */
+typedef double wav_v4 __attribute__((vector_size(32)));
+typedef int64_t wav_m4 __attribute__((vector_size(32)));
+
+/* frames converted and filtered at once */
+#define WAV_CHUNK_FRAMES 1024
+
+static unsigned int le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+	       ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	put16(p, v & 0xffff);
+	put16(p + 2, v >> 16);
+}
+
+static int wav_error(struct wav_info *info, const char *error)
+{
+	info->error = error;
+	return -EINVAL;
+}
+
+static int parse_fmt(const unsigned char *p, uint32_t len,
+                     struct wav_info *info)
+{
+	unsigned int byte_rate;
+
+	if (len < 16)
+		return wav_error(info, "fmt chunk too small");
+
+	info->format = le16(p);
+	info->channels = le16(p + 2);
+	info->rate = le32(p + 4);
+	byte_rate = le32(p + 8);
+	info->block_align = le16(p + 12);
+	info->bits = le16(p + 14);
+
+	/* sub format: first 2 bytes of the guid are the format tag */
+	if (info->format == WAV_FORMAT_EXTENSIBLE) {
+		if (len < 40 || le16(p + 16) < 22)
+			return wav_error(info, "extensible fmt chunk too small");
+		info->format = le16(p + 24);
+	}
+
+	if (info->format != WAV_FORMAT_PCM && info->format != WAV_FORMAT_FLOAT)
+		return wav_error(info, "unsupported format");
+	if (info->channels == 0)
+		return wav_error(info, "no channels");
+	if (info->rate == 0)
+		return wav_error(info, "sample rate 0");
+
+	if (info->format == WAV_FORMAT_PCM &&
+	    info->bits != 8 && info->bits != 16 &&
+	    info->bits != 24 && info->bits != 32)
+		return wav_error(info, "unsupported pcm sample size");
+	if (info->format == WAV_FORMAT_FLOAT &&
+	    info->bits != 32 && info->bits != 64)
+		return wav_error(info, "unsupported float sample size");
+
+	if (info->block_align != info->channels * (info->bits / 8))
+		return wav_error(info, "block align does not match the sample size");
+	if (byte_rate != info->rate * info->block_align)
+		return wav_error(info, "byte rate does not match the sample rate");
+
+	return 0;
+}
+
+int wav_parse(const void *data, size_t size, struct wav_info *info)
+{
+	const unsigned char *p = data;
+	uint64_t pos, end;
+	int have_fmt = 0, have_data = 0;
+	int err;
+
+	memset(info, 0, sizeof(*info));
+
+	if (size < 12 || memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4))
+		return wav_error(info, "not a riff wave file");
+
+	/* riff size counts from byte 8 */
+	end = 8 + (uint64_t) le32(p + 4);
+	if (end > size) {
+		info->truncated = 1;
+		end = size;
+	}
+
+	for (pos = 12; pos + 8 <= end; ) {
+		const unsigned char *chunk = p + pos;
+		uint32_t len = le32(chunk + 4);
+
+		if (!memcmp(chunk, "fmt ", 4)) {
+			if (have_fmt)
+				return wav_error(info, "more than one fmt chunk");
+			if (pos + 8 + len > end)
+				return wav_error(info, "fmt chunk truncated");
+
+			err = parse_fmt(chunk + 8, len, info);
+			if (err < 0)
+				return err;
+			have_fmt = 1;
+
+		} else if (!memcmp(chunk, "data", 4)) {
+			if (!have_fmt)
+				return wav_error(info, "data chunk before fmt chunk");
+			if (have_data)
+				return wav_error(info, "more than one data chunk");
+
+			info->data_offset = pos + 8;
+			info->data_size = len;
+			if (info->data_offset + len > end) {
+				info->truncated = 1;
+				info->data_size = end - info->data_offset;
+			}
+			info->frames = info->data_size / info->block_align;
+			have_data = 1;
+		}
+
+		/* chunks are padded to an even size */
+		pos += 8 + (uint64_t) len + (len & 1);
+	}
+
+	if (!have_fmt)
+		return wav_error(info, "no fmt chunk");
+	if (!have_data)
+		return wav_error(info, "no data chunk");
+
+	return 0;
+}
+
+void wav_header(unsigned char *p, unsigned int rate, unsigned int channels,
+                uint64_t frames)
+{
+	uint64_t data_size = frames * channels * 2;
+
+	/* sizes that do not fit are clamped, readers handle that */
+	if (data_size > 0xffffffffu - 36)
+		data_size = 0xffffffffu - 36;
+
+	memcpy(p, "RIFF", 4);
+	put32(p + 4, 36 + data_size);
+	memcpy(p + 8, "WAVE", 4);
+	memcpy(p + 12, "fmt ", 4);
+	put32(p + 16, 16);
+	put16(p + 20, WAV_FORMAT_PCM);
+	put16(p + 22, channels);
+	put32(p + 24, rate);
+	put32(p + 28, rate * channels * 2);
+	put16(p + 32, channels * 2);
+	put16(p + 34, 16);
+	memcpy(p + 36, "data", 4);
+	put32(p + 40, data_size);
+}
+
+/*
+ * analysis
+ */
+
+/* normalized biquad coefficients (a0 = 1) */
+struct wav_biquad {
+	double b0, b1, b2;
+	double a1, a2;
+};
+
+/*
+ * K-weighting as two biquads: the BS.1770 coefficients are given for
+ * 48 kHz only, these are derived from the analog prototype so every
+ * rate gets the same response.
+ */
+static void k_weighting(unsigned int rate, struct wav_biquad *shelf,
+                        struct wav_biquad *highpass)
+{
+	double k, q, vh, vb, a0;
+
+	/* high shelf: +4 dB above ~1.7 kHz */
+	k = tan(M_PI * 1681.974450955533 / rate);
+	q = 0.7071752369554196;
+	vh = pow(10.0, 3.999843853973347 / 20.0);
+	vb = pow(vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+	shelf->b0 = (vh + vb * k / q + k * k) / a0;
+	shelf->b1 = 2.0 * (k * k - vh) / a0;
+	shelf->b2 = (vh - vb * k / q + k * k) / a0;
+	shelf->a1 = 2.0 * (k * k - 1.0) / a0;
+	shelf->a2 = (1.0 - k / q + k * k) / a0;
+
+	/* high pass at ~38 Hz */
+	k = tan(M_PI * 38.13547087602444 / rate);
+	q = 0.5003270373238773;
+	a0 = 1.0 + k / q + k * k;
+	highpass->b0 = 1.0;
+	highpass->b1 = -2.0;
+	highpass->b2 = 1.0;
+	highpass->a1 = 2.0 * (k * k - 1.0) / a0;
+	highpass->a2 = (1.0 - k / q + k * k) / a0;
+}
+
+static void biquad_process(wav_v4 *v, unsigned int frames,
+                           const struct wav_biquad *b, wav_v4 *z)
+{
+	wav_v4 z1 = z[0], z2 = z[1];
+	unsigned int i;
+
+	for (i = 0; i < frames; i++) {
+		wav_v4 x = v[i];
+		wav_v4 y = x * b->b0 + z1;
+
+		z1 = x * b->b1 - y * b->a1 + z2;
+		z2 = x * b->b2 - y * b->a2;
+		v[i] = y;
+	}
+
+	z[0] = z1;
+	z[1] = z2;
+}
+
+/* running maximum of |v| per lane */
+static void peak_update(const wav_v4 *v, unsigned int frames, wav_v4 *max)
+{
+	const wav_m4 abs_mask = (wav_m4) { 0 } + INT64_MAX;
+	wav_v4 peak = *max;
+	unsigned int i;
+
+	for (i = 0; i < frames; i++) {
+		wav_v4 a = (wav_v4) ((wav_m4) v[i] & abs_mask);
+		wav_m4 m = a > peak;
+
+		peak = (wav_v4) (((wav_m4) a & m) | ((wav_m4) peak & ~m));
+	}
+
+	*max = peak;
+}
+
+/* deinterleave channels first..first+3 of 'frames' frames into v */
+static void load_group(const unsigned char *src, const struct wav_info *info,
+                       unsigned int first, wav_v4 *v, unsigned int frames)
+{
+	unsigned int n = info->channels - first < 4 ? info->channels - first : 4;
+	unsigned int bytes = info->bits / 8;
+	unsigned int i, c;
+
+	src += first * bytes;
+
+	/* the common case */
+	if (info->format == WAV_FORMAT_PCM && bytes == 2) {
+		for (i = 0; i < frames; i++, src += info->block_align) {
+			wav_v4 x = { 0 };
+
+			for (c = 0; c < n; c++)
+				x[c] = (int16_t) le16(src + c * 2) * (1.0 / 32768);
+			v[i] = x;
+		}
+		return;
+	}
+
+	for (i = 0; i < frames; i++, src += info->block_align) {
+		wav_v4 x = { 0 };
+
+		for (c = 0; c < n; c++) {
+			const unsigned char *s = src + c * bytes;
+
+			if (info->format == WAV_FORMAT_FLOAT) {
+				if (bytes == 4) {
+					float f;
+
+					memcpy(&f, s, 4);
+					x[c] = f;
+				} else {
+					double d;
+
+					memcpy(&d, s, 8);
+					x[c] = d;
+				}
+				continue;
+			}
+
+			switch (bytes) {
+			case 1:
+				x[c] = (s[0] - 128) * (1.0 / 128);
+				break;
+			case 3:
+				x[c] = (int32_t) (((uint32_t) s[0] << 8) | ((uint32_t) s[1] << 16) |
+				                  ((uint32_t) s[2] << 24)) * (1.0 / 2147483648.0);
+				break;
+			default:
+				x[c] = (int32_t) le32(s) * (1.0 / 2147483648.0);
+				break;
+			}
+		}
+
+		v[i] = x;
+	}
+}
+
+/* BS.1770 channel weight: no LFE, surrounds +1.5 dB (5.1 order) */
+static double channel_weight(unsigned int channels, unsigned int c)
+{
+	if (channels < 6)
+		return 1.0;
+	if (c == 3)
+		return 0.0;
+	if (c >= 4)
+		return 1.41;
+	return 1.0;
+}
+
+/* integrated loudness from the weighted mean square of every 100 ms */
+static double gated_loudness(const double *sub, uint64_t nr_sub)
+{
+	double sum = 0, threshold;
+	uint64_t i, n = 0;
+
+	if (nr_sub < 4)
+		return -HUGE_VAL;
+
+	/* 400 ms blocks, 75% overlap - absolute gate at -70 LUFS */
+	threshold = pow(10.0, (-70.0 + 0.691) / 10.0);
+	for (i = 0; i + 4 <= nr_sub; i++) {
+		double z = (sub[i] + sub[i + 1] + sub[i + 2] + sub[i + 3]) / 4;
+
+		if (z > threshold) {
+			sum += z;
+			n++;
+		}
+	}
+	if (n == 0)
+		return -HUGE_VAL;
+
+	/* relative gate 10 LU below the absolute gated loudness */
+	threshold = sum / n * pow(10.0, -10.0 / 10.0);
+	sum = 0;
+	n = 0;
+	for (i = 0; i + 4 <= nr_sub; i++) {
+		double z = (sub[i] + sub[i + 1] + sub[i + 2] + sub[i + 3]) / 4;
+
+		if (z > threshold && z > pow(10.0, (-70.0 + 0.691) / 10.0)) {
+			sum += z;
+			n++;
+		}
+	}
+	if (n == 0)
+		return -HUGE_VAL;
+
+	return -0.691 + 10.0 * log10(sum / n);
+}
+
+int wav_analyze(const void *data, const struct wav_info *info,
+                struct wav_stats *stats)
+{
+	const unsigned char *p = (const unsigned char *) data + info->data_offset;
+	unsigned int groups = (info->channels + 3) / 4;
+	unsigned int sub_len = (info->rate + 5) / 10;
+	uint64_t nr_sub = info->frames / sub_len;
+	struct wav_biquad shelf, highpass;
+	wav_v4 *work, *state, *power, peak = { 0 };
+	double *sub, weight[4];
+	uint64_t frame = 0, s;
+	unsigned int g, c, i;
+
+	if (sub_len == 0)
+		return -EINVAL;
+
+	work = malloc(WAV_CHUNK_FRAMES * sizeof(*work));
+	state = calloc(groups * 4, sizeof(*state));
+	power = calloc(groups, sizeof(*power));
+	sub = calloc(nr_sub + 1, sizeof(*sub));
+	if (work == NULL || state == NULL || power == NULL || sub == NULL) {
+		free(work);
+		free(state);
+		free(power);
+		free(sub);
+		return -ENOMEM;
+	}
+
+	k_weighting(info->rate, &shelf, &highpass);
+
+	/* every full 100 ms sub block, chunk by chunk */
+	for (s = 0; s < nr_sub; s++) {
+		unsigned int left = sub_len;
+
+		while (left > 0) {
+			unsigned int n = left < WAV_CHUNK_FRAMES ? left : WAV_CHUNK_FRAMES;
+
+			for (g = 0; g < groups; g++) {
+				wav_v4 *z = state + g * 4;
+				wav_v4 acc = power[g];
+
+				load_group(p + frame * info->block_align, info, g * 4, work, n);
+				peak_update(work, n, &peak);
+
+				biquad_process(work, n, &shelf, z);
+				biquad_process(work, n, &highpass, z + 2);
+
+				for (i = 0; i < n; i++)
+					acc += work[i] * work[i];
+				power[g] = acc;
+			}
+
+			frame += n;
+			left -= n;
+		}
+
+		/* weighted sum of the channel mean squares */
+		for (g = 0; g < groups; g++) {
+			for (c = 0; c < 4; c++)
+				weight[c] = g * 4 + c < info->channels ?
+				            channel_weight(info->channels, g * 4 + c) : 0;
+			for (c = 0; c < 4; c++)
+				sub[s] += weight[c] * power[g][c] / sub_len;
+			power[g] = (wav_v4) { 0 };
+		}
+	}
+
+	/* the tail shorter than a sub block still counts for the peak */
+	while (frame < info->frames) {
+		unsigned int n = info->frames - frame < WAV_CHUNK_FRAMES ?
+		                 info->frames - frame : WAV_CHUNK_FRAMES;
+
+		for (g = 0; g < groups; g++) {
+			load_group(p + frame * info->block_align, info, g * 4, work, n);
+			peak_update(work, n, &peak);
+		}
+		frame += n;
+	}
+
+	stats->peak = 0;
+	for (c = 0; c < 4; c++)
+		if (peak[c] > stats->peak)
+			stats->peak = peak[c];
+	stats->peak = stats->peak > 0 ? 20.0 * log10(stats->peak) : -HUGE_VAL;
+	stats->loudness = gated_loudness(sub, nr_sub);
+
+	free(work);
+	free(state);
+	free(power);
+	free(sub);
+
+	return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * Wave file parsing and analysis
+ *
+ * wav_parse() walks the RIFF chunks of a file in memory - typically
+ * mmap()ed, so only the pages holding chunk headers are touched - and
+ * validates the structure and the fmt chunk.
+ *
+ * wav_header() builds the canonical 44 byte header for writers.
+ *
+ * wav_analyze() reads all samples once and measures the sample peak and
+ * the integrated loudness (ITU-R BS.1770: K-weighting, 400 ms blocks,
+ * absolute and relative gate). Channels are processed in groups of 4,
+ * one per vector lane.
+ */
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* fmt chunk format tags */
+#define WAV_FORMAT_PCM        0x0001
+#define WAV_FORMAT_FLOAT      0x0003
+#define WAV_FORMAT_EXTENSIBLE 0xfffe
+
+struct wav_info {
+	/* PCM or FLOAT - EXTENSIBLE is resolved to its sub format */
+	unsigned int format;
+	unsigned int channels;
+	unsigned int rate;
+	unsigned int bits;
+	/* bytes per frame */
+	unsigned int block_align;
+	/* samples, relative to the start of the file */
+	uint64_t data_offset;
+	uint64_t data_size;
+	uint64_t frames;
+	/* the file ends before the data chunk does */
+	int truncated;
+	/* why wav_parse() failed */
+	const char *error;
+};
+
+struct wav_stats {
+	/* sample peak in dBFS */
+	double peak;
+	/* integrated loudness in LUFS - -HUGE_VAL when everything is gated */
+	double loudness;
+};
+
+/* 0 or -EINVAL with info->error set */
+int wav_parse(const void *data, size_t size, struct wav_info *info);
+
+/* size of the header wav_header() builds */
+#define WAV_HEADER_SIZE 44
+
+/* 16 bit pcm header for 'frames' frames */
+void wav_header(unsigned char *p, unsigned int rate, unsigned int channels,
+                uint64_t frames);
+
+/* 'data' is the whole file as passed to wav_parse() */
+int wav_analyze(const void *data, const struct wav_info *info,
+                struct wav_stats *stats);
+
+#endif
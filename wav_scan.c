@@ -0,0 +1,450 @@
+/*
+ * Scan directory trees for wave files and write a metadata index
+ *
+ * A pool of worker threads shares one queue of directories and files:
+ * directories are read with their d_type so no file is stat()ed twice,
+ * files are mmap()ed and only their chunk headers are touched unless
+ * -a asks for peak and loudness. Every worker keeps its own results,
+ * they are merged and sorted once at the end.
+ *
+ * build: gcc -O2 wav_scan.c wav.c wavindex.c -o wav_scan -lm -lpthread
+ *
+ * usage: wav_scan [-j threads] [-a] [-v] [-o index] dir...
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wav.h"
+#include "wavindex.h"
+
+/* maximum number of worker threads */
+#define MAX_WORKERS 64
+
+
+/* number of worker threads - 0 = one per cpu */
+unsigned int nr_workers = 0;
+/* measure peak and loudness - reads every sample */
+int analyze = 0;
+/* print every file */
+int verbose = 0;
+/* index file */
+const char *index_file = "wav.idx";
+
+
+/* work queue: directories and files still to scan */
+struct item {
+	char *path;
+	int is_dir;
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct item *queue = NULL;
+static size_t queue_len = 0;
+static size_t queue_cap = 0;
+/* items being worked on - the scan is done when 0 with an empty queue */
+static unsigned int queue_busy = 0;
+
+struct result {
+	char *path;
+	struct wav_index_entry entry;
+};
+
+struct worker {
+	pthread_t thread;
+
+	/* results, only touched by this worker until it is joined */
+	struct result *results;
+	size_t nr_results;
+	size_t cap_results;
+
+	/* statistics */
+	unsigned long invalid;
+	unsigned long long bytes;
+};
+
+static struct worker workers[MAX_WORKERS];
+
+
+/* caller holds queue_lock */
+static int queue_add(char *path, int is_dir)
+{
+	if (queue_len == queue_cap) {
+		size_t cap = queue_cap ? 2 * queue_cap : 1024;
+		struct item *q = realloc(queue, cap * sizeof(*q));
+
+		if (q == NULL)
+			return -ENOMEM;
+		queue = q;
+		queue_cap = cap;
+	}
+
+	queue[queue_len].path = path;
+	queue[queue_len].is_dir = is_dir;
+	queue_len++;
+
+	return 0;
+}
+
+/* 0 when everything is scanned */
+static int queue_get(struct item *item)
+{
+	pthread_mutex_lock(&queue_lock);
+
+	while (queue_len == 0 && queue_busy > 0)
+		pthread_cond_wait(&queue_cond, &queue_lock);
+
+	if (queue_len == 0) {
+		pthread_mutex_unlock(&queue_lock);
+		return 0;
+	}
+
+	/* last in, first out: depth first keeps the queue short */
+	*item = queue[--queue_len];
+	queue_busy++;
+
+	pthread_mutex_unlock(&queue_lock);
+	return 1;
+}
+
+static void queue_done(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	queue_busy--;
+	if (queue_busy == 0 && queue_len == 0)
+		pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+}
+
+static int is_wav(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && !strcasecmp(name + len - 4, ".wav");
+}
+
+static char *join(const char *dir, const char *name)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		return NULL;
+
+	return path;
+}
+
+/* queue all subdirectories and wave files of 'path' in one go */
+static void scan_dir(const char *path)
+{
+	struct item *found = NULL;
+	size_t nr_found = 0, cap_found = 0, i;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		int is_dir;
+
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		/* symbolic links are not followed */
+		if (de->d_type == DT_DIR)
+			is_dir = 1;
+		else if (de->d_type == DT_REG)
+			is_dir = 0;
+		else if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+
+			if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+				continue;
+			if (S_ISDIR(st.st_mode))
+				is_dir = 1;
+			else if (S_ISREG(st.st_mode))
+				is_dir = 0;
+			else
+				continue;
+		} else
+			continue;
+
+		if (!is_dir && !is_wav(de->d_name))
+			continue;
+
+		if (nr_found == cap_found) {
+			size_t cap = cap_found ? 2 * cap_found : 64;
+			struct item *f = realloc(found, cap * sizeof(*f));
+
+			if (f == NULL)
+				break;
+			found = f;
+			cap_found = cap;
+		}
+
+		found[nr_found].path = join(path, de->d_name);
+		if (found[nr_found].path == NULL)
+			break;
+		found[nr_found].is_dir = is_dir;
+		nr_found++;
+	}
+
+	closedir(dir);
+
+	pthread_mutex_lock(&queue_lock);
+	for (i = 0; i < nr_found; i++) {
+		if (queue_add(found[i].path, found[i].is_dir) < 0) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (nr_found > 0)
+		pthread_cond_broadcast(&queue_cond);
+	pthread_mutex_unlock(&queue_lock);
+
+	free(found);
+}
+
+static void scan_file(struct worker *w, char *path)
+{
+	struct wav_index_entry *e;
+	struct wav_info info;
+	struct wav_stats stats;
+	struct stat st;
+	const char *error = NULL;
+	void *map;
+	int fd;
+
+	if (w->nr_results == w->cap_results) {
+		size_t cap = w->cap_results ? 2 * w->cap_results : 1024;
+		struct result *r = realloc(w->results, cap * sizeof(*r));
+
+		if (r == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		w->results = r;
+		w->cap_results = cap;
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		free(path);
+		return;
+	}
+
+	e = &w->results[w->nr_results].entry;
+	memset(e, 0, sizeof(*e));
+	e->file_size = st.st_size;
+	e->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	w->results[w->nr_results].path = path;
+	w->nr_results++;
+
+	if (st.st_size == 0) {
+		close(fd);
+		error = "empty file";
+		goto out;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		error = strerror(errno);
+		goto out;
+	}
+
+	if (wav_parse(map, st.st_size, &info) < 0) {
+		error = info.error;
+		munmap(map, st.st_size);
+		goto out;
+	}
+
+	e->data_offset = info.data_offset;
+	e->frames = info.frames;
+	e->rate = info.rate;
+	e->channels = info.channels;
+	e->bits = info.bits;
+	e->format = info.format;
+	e->flags = WAV_INDEX_VALID;
+	if (info.truncated)
+		e->flags |= WAV_INDEX_TRUNCATED;
+
+	if (analyze) {
+		madvise(map, st.st_size, MADV_SEQUENTIAL);
+		if (wav_analyze(map, &info, &stats) == 0) {
+			e->peak = stats.peak;
+			e->loudness = stats.loudness;
+			e->flags |= WAV_INDEX_ANALYZED;
+			w->bytes += info.data_size;
+		}
+	}
+
+	munmap(map, st.st_size);
+
+out:
+	if (error) {
+		w->invalid++;
+		if (verbose)
+			printf("%s: %s\n", path, error);
+	} else if (verbose) {
+		printf("%s: %u ch, %u Hz, %u bit%s, %.3f s",
+		       path, e->channels, e->rate, e->bits,
+		       e->format == WAV_FORMAT_FLOAT ? " float" : "",
+		       (double) e->frames / e->rate);
+		if (e->flags & WAV_INDEX_ANALYZED)
+			printf(", peak %.1f dBFS, %.1f LUFS", e->peak, e->loudness);
+		printf("%s\n", e->flags & WAV_INDEX_TRUNCATED ? " (truncated)" : "");
+	}
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct item item;
+
+	while (queue_get(&item)) {
+		if (item.is_dir) {
+			scan_dir(item.path);
+			free(item.path);
+		} else
+			scan_file(w, item.path);
+
+		queue_done();
+	}
+
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	struct wav_index_entry *entries;
+	char **names;
+	unsigned long invalid = 0;
+	unsigned long long bytes = 0;
+	size_t total = 0, n;
+	unsigned int i;
+	double start, elapsed;
+	int opt, err;
+
+	/* command line options */
+	while ((opt = getopt(argc, argv, "j:avo:")) != -1) {
+		switch (opt) {
+		case 'j':
+			nr_workers = atoi(optarg);
+			break;
+		case 'a':
+			analyze = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'o':
+			index_file = optarg;
+			break;
+		default:
+			printf("Usage: %s [-j threads] [-a] [-v] [-o index] dir...\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		printf("Usage: %s [-j threads] [-a] [-v] [-o index] dir...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (nr_workers == 0)
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers < 1)
+		nr_workers = 1;
+	if (nr_workers > MAX_WORKERS)
+		nr_workers = MAX_WORKERS;
+
+	/* absolute paths: the players look files up by their real path */
+	for (i = optind; i < (unsigned int) argc; i++) {
+		char *root = realpath(argv[i], NULL);
+
+		if (root == NULL) {
+			printf("%s: %s\n", argv[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		queue_add(root, 1);
+	}
+
+	start = now();
+
+	for (i = 0; i < nr_workers; i++)
+		pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		total += workers[i].nr_results;
+		invalid += workers[i].invalid;
+		bytes += workers[i].bytes;
+	}
+
+	elapsed = now() - start;
+
+	/* merge */
+	entries = malloc((total + 1) * sizeof(*entries));
+	names = malloc((total + 1) * sizeof(*names));
+	if (entries == NULL || names == NULL) {
+		printf("No enough memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0, n = 0; i < nr_workers; i++) {
+		size_t j;
+
+		for (j = 0; j < workers[i].nr_results; j++, n++) {
+			entries[n] = workers[i].results[j].entry;
+			names[n] = workers[i].results[j].path;
+		}
+		free(workers[i].results);
+	}
+
+	err = wav_index_write(index_file, entries, names, total);
+	if (err < 0) {
+		printf("Writing %s failed: %s\n", index_file, strerror(-err));
+		exit(EXIT_FAILURE);
+	}
+
+	printf("%zu files, %lu invalid, %u threads, %.2f s, %.0f files/s",
+	       total, invalid, nr_workers, elapsed, total / (elapsed > 0 ? elapsed : 1e-9));
+	if (analyze)
+		printf(", %.1f MB/s analyzed", bytes / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+	printf("\n");
+
+	for (n = 0; n < total; n++)
+		free(names[n]);
+	free(names);
+	free(entries);
+	free(queue);
+
+	return 0;
+}
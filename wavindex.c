@@ -0,0 +1,169 @@
+/*
+ * On-disk index of wave file metadata
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wavindex.h"
+
+int wav_index_open(struct wav_index *idx, const char *filename)
+{
+	const struct wav_index_header *header;
+	struct stat st;
+	size_t names_offset;
+	int fd, err;
+
+	memset(idx, 0, sizeof(*idx));
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if ((size_t) st.st_size < sizeof(*header)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	idx->size = st.st_size;
+	idx->map = mmap(NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (idx->map == MAP_FAILED) {
+		idx->map = NULL;
+		return -errno;
+	}
+
+	header = idx->map;
+	names_offset = sizeof(*header) +
+	               (size_t) header->nr_entries * sizeof(struct wav_index_entry);
+
+	if (header->magic != WAV_INDEX_MAGIC || header->version != WAV_INDEX_VERSION ||
+	    names_offset + header->names_size != idx->size ||
+	    header->names_size == 0 || ((char *) idx->map)[idx->size - 1] != '\0')
+		goto invalid;
+
+	idx->nr_entries = header->nr_entries;
+	idx->entries = (const struct wav_index_entry *) (header + 1);
+	idx->names = (const char *) idx->map + names_offset;
+	idx->names_size = header->names_size;
+
+	return 0;
+
+invalid:
+	wav_index_close(idx);
+	return -EINVAL;
+}
+
+void wav_index_close(struct wav_index *idx)
+{
+	if (idx->map)
+		munmap(idx->map, idx->size);
+	memset(idx, 0, sizeof(*idx));
+}
+
+const struct wav_index_entry *wav_index_find(const struct wav_index *idx,
+                                             const char *path)
+{
+	uint32_t lo = 0, hi = idx->nr_entries;
+
+	while (lo < hi) {
+		uint32_t mid = lo + (hi - lo) / 2;
+		int cmp;
+
+		/* names are checked here, not when opening: that reads every entry */
+		if (idx->entries[mid].name >= idx->names_size)
+			return NULL;
+
+		cmp = strcmp(path, wav_index_name(idx, &idx->entries[mid]));
+
+		if (cmp == 0)
+			return &idx->entries[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
+static int compare_names(const void *a, const void *b, void *arg)
+{
+	char **names = arg;
+
+	return strcmp(names[*(const unsigned int *) a],
+	              names[*(const unsigned int *) b]);
+}
+
+int wav_index_write(const char *filename, struct wav_index_entry *entries,
+                    char **names, unsigned int nr_entries)
+{
+	struct wav_index_header header;
+	unsigned int *order;
+	uint64_t names_size = 0;
+	unsigned int i;
+	FILE *f;
+	int err = 0;
+
+	order = malloc((nr_entries + 1) * sizeof(*order));
+	if (order == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_entries; i++)
+		order[i] = i;
+	qsort_r(order, nr_entries, sizeof(*order), compare_names, names);
+
+	for (i = 0; i < nr_entries; i++) {
+		entries[order[i]].name = names_size;
+		names_size += strlen(names[order[i]]) + 1;
+	}
+	if (names_size == 0)
+		names_size = 1;
+	if (names_size > UINT32_MAX) {
+		free(order);
+		return -EFBIG;
+	}
+
+	f = fopen(filename, "wb");
+	if (f == NULL) {
+		free(order);
+		return -errno;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.magic = WAV_INDEX_MAGIC;
+	header.version = WAV_INDEX_VERSION;
+	header.nr_entries = nr_entries;
+	header.names_size = names_size;
+	fwrite(&header, sizeof(header), 1, f);
+
+	for (i = 0; i < nr_entries; i++)
+		fwrite(&entries[order[i]], sizeof(*entries), 1, f);
+
+	/* an empty index still has a (empty) string table */
+	if (nr_entries == 0)
+		fputc('\0', f);
+	for (i = 0; i < nr_entries; i++)
+		fwrite(names[order[i]], strlen(names[order[i]]) + 1, 1, f);
+
+	if (ferror(f))
+		err = -EIO;
+	if (fclose(f) != 0 && err == 0)
+		err = -errno;
+
+	free(order);
+	return err;
+}
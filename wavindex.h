@@ -0,0 +1,78 @@
+/*
+ * On-disk index of wave file metadata
+ *
+ * Written by wav_scan, loaded by the players with one mmap() instead of
+ * opening and parsing every file. Entries are sorted by absolute path,
+ * lookups are a binary search.
+ *
+ * layout: wav_index_header, nr_entries * wav_index_entry, the paths as
+ * NUL terminated strings. All fields are little endian.
+ */
+
+#ifndef WAVINDEX_H
+#define WAVINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WAV_INDEX_MAGIC 0x58495741 /* "AWIX" */
+#define WAV_INDEX_VERSION 1
+
+/* entry flags */
+#define WAV_INDEX_VALID     0x0001 /* parsed, the format fields are set */
+#define WAV_INDEX_TRUNCATED 0x0002 /* data chunk runs past the end of the file */
+#define WAV_INDEX_ANALYZED  0x0004 /* peak and loudness are set */
+
+struct wav_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_entries;
+	uint32_t names_size;
+};
+
+struct wav_index_entry {
+	/* to detect stale entries */
+	uint64_t file_size;
+	int64_t mtime_ns;
+	/* see struct wav_info */
+	uint64_t data_offset;
+	uint64_t frames;
+	uint32_t rate;
+	uint16_t channels;
+	uint16_t bits;
+	uint16_t format;
+	uint16_t flags;
+	/* dBFS and LUFS */
+	float peak;
+	float loudness;
+	/* offset of the path in the string table */
+	uint32_t name;
+};
+
+struct wav_index {
+	void *map;
+	size_t size;
+	uint32_t nr_entries;
+	const struct wav_index_entry *entries;
+	const char *names;
+	uint32_t names_size;
+};
+
+int wav_index_open(struct wav_index *idx, const char *filename);
+void wav_index_close(struct wav_index *idx);
+
+/* NULL when not in the index */
+const struct wav_index_entry *wav_index_find(const struct wav_index *idx,
+                                             const char *path);
+
+static inline const char *wav_index_name(const struct wav_index *idx,
+                                         const struct wav_index_entry *e)
+{
+	return idx->names + e->name;
+}
+
+/* written sorted by name - the name fields of 'entries' are filled in */
+int wav_index_write(const char *filename, struct wav_index_entry *entries,
+                    char **names, unsigned int nr_entries);
+
+#endif
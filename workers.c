@@ -0,0 +1,271 @@
+/*
+ * Fork-join worker pool for the audio thread
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "workers.h"
+
+/* spin this long without a job before sleeping */
+#define WORKERS_SPIN_TIME 0.05
+/* spins between clock reads */
+#define WORKERS_SPIN_CHECK 1024
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ volatile("yield");
+#endif
+}
+
+/* claim chunks of job 'gen' until there are none left - returns the items done */
+static unsigned long work(struct workers *w, unsigned int gen)
+{
+	unsigned long long cur = atomic_load_explicit(&w->next, memory_order_relaxed);
+	unsigned long items = 0;
+
+	while (1) {
+		workers_fn fn = atomic_load_explicit(&w->fn, memory_order_relaxed);
+		void *ctx = atomic_load_explicit(&w->ctx, memory_order_relaxed);
+		unsigned int nr_items = atomic_load_explicit(&w->nr_items, memory_order_relaxed);
+		unsigned int chunk = atomic_load_explicit(&w->chunk, memory_order_relaxed);
+		unsigned int first, last;
+
+		/* job fields of a newer job come with its tag in 'next' */
+		atomic_thread_fence(memory_order_acquire);
+
+		first = (unsigned int) cur;
+		if ((unsigned int) (cur >> 32) != gen || first >= nr_items)
+			break;
+
+		last = first + chunk < nr_items ? first + chunk : nr_items;
+		if (!atomic_compare_exchange_weak_explicit(&w->next, &cur,
+		                                           cur - first + last,
+		                                           memory_order_acq_rel,
+		                                           memory_order_relaxed))
+			continue;
+
+		fn(ctx, first, last);
+		items += last - first;
+
+		atomic_fetch_add_explicit(&w->done, last - first, memory_order_release);
+		cur = atomic_load_explicit(&w->next, memory_order_relaxed);
+	}
+
+	return items;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *me = arg;
+	struct workers *w = me->pool;
+	unsigned int seen = atomic_load(&w->gen);
+	unsigned long spins = 0;
+	double idle_since = now();
+
+	while (atomic_load_explicit(&w->running, memory_order_relaxed)) {
+		unsigned int gen = atomic_load_explicit(&w->gen, memory_order_acquire);
+
+		if (gen != seen) {
+			seen = gen;
+			me->items += work(w, gen);
+			idle_since = now();
+			continue;
+		}
+
+		if (++spins % WORKERS_SPIN_CHECK || now() - idle_since < WORKERS_SPIN_TIME) {
+			cpu_relax();
+			continue;
+		}
+
+		/* idle: sleep until the next job posts */
+		atomic_store(&me->sleeping, 1);
+		if (atomic_load(&w->gen) == seen && atomic_load(&w->running))
+			sem_wait(&me->wake);
+		atomic_store(&me->sleeping, 0);
+		idle_since = now();
+	}
+
+	return NULL;
+}
+
+int workers_start(struct workers *w, unsigned int nr_workers, int first_cpu)
+{
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int i;
+	int err;
+
+	memset(w, 0, sizeof(*w));
+	if (nr_workers > WORKERS_MAX)
+		return -EINVAL;
+
+	/* spinning on a shared cpu only takes time from the caller */
+	if (nr_cpus > 0 && nr_workers > (unsigned int) nr_cpus - 1) {
+		printf("Only %ld cpus, using %ld workers\n", nr_cpus, nr_cpus - 1);
+		nr_workers = nr_cpus - 1;
+	}
+
+	atomic_init(&w->running, 1);
+	atomic_init(&w->gen, 0);
+	atomic_init(&w->next, 0);
+	atomic_init(&w->fn, NULL);
+	atomic_init(&w->ctx, NULL);
+	atomic_init(&w->nr_items, 0);
+	atomic_init(&w->chunk, 1);
+	atomic_init(&w->done, 0);
+
+	if (posix_memalign((void **) &w->worker, 64, (nr_workers ? nr_workers : 1) *
+	                   sizeof(struct worker)))
+		return -ENOMEM;
+	memset(w->worker, 0, nr_workers * sizeof(struct worker));
+
+	for (i = 0; i < nr_workers; i++) {
+		struct worker *me = &w->worker[i];
+
+		me->pool = w;
+		me->cpu = first_cpu < 0 ? -1 : (int) ((first_cpu + i) % nr_cpus);
+		atomic_init(&me->sleeping, 0);
+		sem_init(&me->wake, 0, 0);
+
+		err = pthread_create(&me->thread, NULL, worker_thread, me);
+		if (err) {
+			sem_destroy(&me->wake);
+			workers_stop(w);
+			return -err;
+		}
+		w->nr_workers++;
+
+		/* not fatal, it just scales worse */
+		if (me->cpu >= 0) {
+			cpu_set_t set;
+
+			CPU_ZERO(&set);
+			CPU_SET(me->cpu, &set);
+			err = pthread_setaffinity_np(me->thread, sizeof(set), &set);
+			if (err)
+				printf("Worker %u: could not pin to cpu %d: %s\n",
+				       i, me->cpu, strerror(err));
+		}
+	}
+
+	return 0;
+}
+
+void workers_stop(struct workers *w)
+{
+	unsigned int i;
+
+	workers_sync(w);
+	atomic_store(&w->running, 0);
+
+	for (i = 0; i < w->nr_workers; i++) {
+		sem_post(&w->worker[i].wake);
+		pthread_join(w->worker[i].thread, NULL);
+		sem_destroy(&w->worker[i].wake);
+	}
+
+	free(w->worker);
+	w->worker = NULL;
+	w->nr_workers = 0;
+}
+
+void workers_sync(struct workers *w)
+{
+	unsigned int nr_items = atomic_load_explicit(&w->nr_items, memory_order_relaxed);
+
+	if (!w->pending)
+		return;
+
+	while (atomic_load_explicit(&w->done, memory_order_acquire) < nr_items)
+		cpu_relax();
+	w->pending = 0;
+}
+
+int workers_run(struct workers *w, unsigned int nr_items, unsigned int chunk,
+                workers_fn fn, void *ctx, double budget)
+{
+	double start = now(), t;
+	unsigned long spins = 0;
+	unsigned int gen, i;
+
+	/* the previous job must be off its data and the counters */
+	workers_sync(w);
+
+	/* old claims fail from here on, then the new job is published */
+	gen = atomic_load_explicit(&w->gen, memory_order_relaxed) + 1;
+	atomic_store_explicit(&w->next, (unsigned long long) gen << 32, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	atomic_store_explicit(&w->fn, fn, memory_order_relaxed);
+	atomic_store_explicit(&w->ctx, ctx, memory_order_relaxed);
+	atomic_store_explicit(&w->nr_items, nr_items, memory_order_relaxed);
+	atomic_store_explicit(&w->chunk, chunk ? chunk : 1, memory_order_relaxed);
+	atomic_store_explicit(&w->done, 0, memory_order_relaxed);
+	atomic_store_explicit(&w->gen, gen, memory_order_seq_cst);
+
+	/* the sleepers need a post, the spinners see the generation */
+	for (i = 0; i < w->nr_workers; i++)
+		if (atomic_load(&w->worker[i].sleeping))
+			sem_post(&w->worker[i].wake);
+
+	/* everything not claimed yet is done here */
+	w->items += work(w, gen);
+
+	/* join: only chunks in flight are left, until the deadline */
+	while (atomic_load_explicit(&w->done, memory_order_acquire) < nr_items) {
+		if (++spins % WORKERS_SPIN_CHECK == 0 && now() - start > budget) {
+			w->pending = 1;
+			break;
+		}
+		cpu_relax();
+	}
+
+	t = now() - start;
+	w->jobs++;
+	w->time += t;
+	if (t > w->max_time)
+		w->max_time = t;
+
+	if (w->pending || t > budget) {
+		w->late++;
+		return -ETIME;
+	}
+
+	return 0;
+}
+
+void workers_print_stats(struct workers *w)
+{
+	unsigned long total = w->items;
+	unsigned int i;
+
+	for (i = 0; i < w->nr_workers; i++)
+		total += w->worker[i].items;
+
+	printf("workers: %u + caller, %lu jobs, avg %.1f us, max %.1f us, %lu late\n",
+	       w->nr_workers, w->jobs, w->jobs ? w->time * 1e6 / w->jobs : 0.0,
+	       w->max_time * 1e6, w->late);
+	if (total == 0)
+		return;
+
+	printf("workers: share caller %.0f%%", 100.0 * w->items / total);
+	for (i = 0; i < w->nr_workers; i++)
+		printf(", cpu %d %.0f%%", w->worker[i].cpu, 100.0 * w->worker[i].items / total);
+	printf("\n");
+}
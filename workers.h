@@ -0,0 +1,90 @@
+/*
+ * Fork-join worker pool for the audio thread
+ *
+ * A job is a range of items - channel groups of a period - handed out
+ * in chunks through one atomic counter. The workers are pinned to their
+ * own cpu and spin on the job generation, so a job starts without a
+ * wakeup; after a while without jobs they fall back to a semaphore.
+ *
+ * The audio thread takes chunks too and then waits for the chunks in
+ * flight. A worker that is preempted holds at most one chunk, everything
+ * it did not claim yet is done by the others. The wait has a deadline:
+ * the period the job works on must be back before the device needs it.
+ * At the deadline the job is handed back as it is - the chunks still in
+ * flight finish in the background - and counted as late. The next job,
+ * or workers_sync(), waits for them.
+ *
+ * Claims are tagged with the job generation: a worker still busy with
+ * an old job can not claim a chunk of the next one.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#define WORKERS_MAX 64
+
+/* items [first, last) of the job */
+typedef void (*workers_fn)(void *ctx, unsigned int first, unsigned int last);
+
+struct workers;
+
+struct worker {
+	struct workers *pool;
+	pthread_t thread;
+	int cpu;
+
+	atomic_int sleeping;
+	sem_t wake;
+
+	/* items done */
+	unsigned long items;
+} __attribute__((aligned(64)));
+
+struct workers {
+	unsigned int nr_workers;
+	struct worker *worker;
+	atomic_int running;
+
+	/* the job - published by the generation */
+	_Atomic(workers_fn) fn;
+	_Atomic(void *) ctx;
+	atomic_uint nr_items;
+	atomic_uint chunk;
+	/* a late job still has chunks in flight */
+	int pending;
+
+	/* job generation, generation << 32 | next item, items done: own cache lines */
+	_Alignas(64) atomic_uint gen;
+	_Alignas(64) atomic_ullong next;
+	_Alignas(64) atomic_uint done;
+
+	/* audio thread statistics */
+	_Alignas(64) unsigned long jobs;
+	unsigned long late;
+	unsigned long items;
+	double time;
+	double max_time;
+};
+
+/* 'nr_workers' threads besides the caller, pinned from 'first_cpu' on - -1 = not pinned */
+int workers_start(struct workers *w, unsigned int nr_workers, int first_cpu);
+void workers_stop(struct workers *w);
+
+/*
+ * Run fn over 'nr_items' in chunks of 'chunk' and wait until all are
+ * done, for at most 'budget' seconds. -ETIME when the budget ran out:
+ * the chunks in flight still run, until workers_sync().
+ */
+int workers_run(struct workers *w, unsigned int nr_items, unsigned int chunk,
+                workers_fn fn, void *ctx, double budget);
+
+/* wait for the chunks a late job left in flight - before reusing its data */
+void workers_sync(struct workers *w);
+
+void workers_print_stats(struct workers *w);
+
+#endif